@@ -9,6 +9,10 @@ from yaml.dumper import BaseDumper
 # On each generated file mac address is computed and serial number.
 #
 # Example: venv/bin/python3 gen-eeprom-yaml.py -n 100 -f ../kstr-sama5d27-rev3.0.yaml
+#
+# devclient --gen-eeprom builds the binary images directly from the same
+# template, without the intermediate YAML files:
+#   devclient --gen-eeprom ../kstr-sama5d27-rev3.0.yaml --gen-count 100 --gen-output images/
 
 
 import argparse
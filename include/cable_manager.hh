@@ -0,0 +1,157 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_CABLE_MANAGER_HH
+#define DEVCLIENT_CABLE_MANAGER_HH
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <giomm.h>
+#include <device.hh>
+#include <profile.hh>
+#include <profile_watcher.hh>
+#include <uart.hh>
+#include <jtag.hh>
+#include <gpio.hh>
+
+#define CABLE_REAP_INTERVAL	100	/* ms between checks for stopped workers */
+
+/*
+ * One cable bound to its profile. While the cable is connected its
+ * UART, JTAG and GPIO services live on a worker thread with a main
+ * context of its own, so a cable that hangs in USB I/O or keeps
+ * crashing OpenOCD does not hold up the others.
+ *
+ * A reloaded profile is applied on that thread as well, restarting
+ * only the services whose settings changed. An unplugged cable is
+ * released without waiting for the worker, which may be stuck in USB
+ * I/O; it is joined by reap() once it has finished.
+ */
+class Cable
+{
+public:
+	enum State
+	{
+		ABSENT,
+		STARTING,
+		RUNNING,
+		FAILED,
+		STOPPING
+	};
+
+	Cable(const std::string &profile_path);
+	virtual ~Cable();
+
+	void attach(const Device &device);
+	void detach();
+	void release();
+	bool reap();
+	void reload(const ProfileConfig &profile);
+	State get_state() const;
+	JtagServer::State get_jtag_state() const;
+	std::string get_error() const;
+	const std::string &get_serial() const { return (m_serial); }
+	const std::string &get_profile_path() const { return (m_path); }
+	Device get_device() const;
+	std::shared_ptr<Gpio> get_gpio() const;
+	static const char *state_name(State state);
+
+protected:
+	void worker();
+	void quit();
+	void joined();
+	bool try_start(const std::function<void()> &start);
+	void start_services();
+	void start_uart();
+	void start_jtag();
+	void stop_services();
+	void stop_jtag();
+	void apply_profile(const ProfileConfig &profile);
+	void set_state(State state, const std::string &error = "");
+
+	ProfileConfig m_profile;
+	std::string m_path;
+	std::string m_serial;
+	Device m_device;
+	Glib::RefPtr<Glib::MainContext> m_context;
+	Glib::RefPtr<Glib::MainLoop> m_loop;
+	std::thread m_thread;
+	std::atomic<bool> m_done;
+	std::optional<Device> m_pending_device;
+	std::unique_ptr<ProfileConfig> m_pending_profile;
+	mutable std::mutex m_lock;
+	State m_state;
+	JtagServer::State m_jtag_state;
+	std::string m_error;
+	std::unique_ptr<Uart> m_uart;
+	std::unique_ptr<JtagServer> m_jtag;
+	std::shared_ptr<Gpio> m_gpio;
+};
+
+/*
+ * Serves every cable that has a profile from one process. Cables start
+ * when they are plugged in and stop when they are removed. Profile
+ * files are watched; an edited one is validated and handed to its
+ * cable, a broken edit is reported and the running setup kept.
+ */
+class CableManager
+{
+public:
+	CableManager(const std::vector<std::string> &profiles);
+	virtual ~CableManager();
+
+	void start();
+	void stop();
+	Cable *find(const std::string &serial) const;
+	std::vector<Cable *> get_cables() const;
+	void print_status() const;
+
+protected:
+	void add_profile(const std::string &path);
+	void on_device_event(const DeviceEvent &event);
+	void process_events();
+	void profile_changed(const std::string &path);
+	bool reap();
+
+	std::map<std::string, std::unique_ptr<Cable>> m_cables;
+	Glib::Dispatcher m_events_ready;
+	std::mutex m_events_lock;
+	std::vector<DeviceEvent> m_events;
+	unsigned int m_subscription;
+	std::unique_ptr<ProfileWatcher> m_watcher;
+	sigc::connection m_reaper;
+};
+
+#endif /* DEVCLIENT_CABLE_MANAGER_HH */
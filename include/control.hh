@@ -0,0 +1,103 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_CONTROL_HH
+#define DEVCLIENT_CONTROL_HH
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <giomm.h>
+#include <yaml-cpp/yaml.h>
+#include <session.hh>
+
+#define CONTROL_SOCKET_NAME	"devclient.sock"
+
+class Cable;
+class CableManager;
+
+/*
+ * JSON-RPC 2.0 over a Unix socket, one request per line, in front of a
+ * Session that keeps the cable's channels open between requests.
+ * Requests are parsed with yaml-cpp, which reads JSON as well.
+ *
+ * In front of a CableManager the socket serves all cables instead:
+ * cable.list and cable.status report them, and the GPIO, EEPROM and
+ * TLV methods take the cable's serial. The UART and JTAG channels
+ * belong to the cable's services there, so their methods are absent.
+ */
+class ControlServer
+{
+public:
+	ControlServer(std::shared_ptr<Session> session, const std::string &path);
+	ControlServer(CableManager *manager, const std::string &path);
+	virtual ~ControlServer();
+
+	void start();
+	void stop();
+	std::string handle(const std::string &request);
+
+	static std::string default_path();
+
+protected:
+	bool client_worker(const Glib::RefPtr<Gio::SocketConnection> &conn,
+	    const Glib::RefPtr<Glib::Object> &source);
+	std::string dispatch(const std::string &method, const YAML::Node &params);
+	std::string dispatch_cable(const std::string &method,
+	    const YAML::Node &params);
+	std::string dispatch_session(Session &session, const std::string &method,
+	    const YAML::Node &params);
+	Cable *find_cable(const YAML::Node &params);
+
+	std::shared_ptr<Session> m_session;
+	CableManager *m_manager;
+	std::string m_path;
+	std::mutex m_lock;
+	Glib::RefPtr<Gio::ThreadedSocketService> m_service;
+	bool m_running;
+};
+
+class ControlClient
+{
+public:
+	ControlClient(const std::string &path);
+	virtual ~ControlClient();
+
+	std::string call(const std::string &method,
+	    const std::string &params = "{}");
+
+protected:
+	Glib::RefPtr<Gio::SocketConnection> m_conn;
+	Glib::RefPtr<Gio::DataInputStream> m_input;
+	unsigned int m_next_id;
+};
+
+std::string json_quote(const std::string &value);
+std::string json_emit(const YAML::Node &node);
+
+#endif /* DEVCLIENT_CONTROL_HH */
@@ -31,9 +31,13 @@
 
 #include <optional>
 #include <vector>
+#include <functional>
 #include <stdint.h>
 #include <string>
 
+#define DEVICE_CACHE_TTL	1	/* seconds, only without hotplug support */
+#define DEVICE_RESCAN_INTERVAL	2	/* seconds, only without hotplug support */
+
 struct Device
 {
 	uint16_t vid;
@@ -42,11 +46,38 @@ struct Device
 	std::string description;
 };
 
+struct DeviceEvent
+{
+	Device device;
+	bool arrived;	/* false when the cable was unplugged */
+};
+
+typedef std::function<void(const DeviceEvent &)> DeviceEventHandler;
+
+/*
+ * Keeps the list of connected cables cached. libusb hotplug callbacks
+ * trigger a rescan when a cable comes or goes; without hotplug support
+ * the list is rescanned once it gets stale, and periodically while
+ * someone is subscribed. Handlers run on whichever thread found the
+ * change: the monitor thread, or a caller of enumerate(), rescan() or
+ * find_by_serial(). Calls are serialized and a handler may subscribe
+ * or unsubscribe from within.
+ */
 class DeviceEnumerator
 {
 public:
 	static std::vector<Device> enumerate();
+	static std::vector<Device> rescan();
 	static std::optional<Device> find_by_serial(const std::string &serial);
+	static unsigned int subscribe(const DeviceEventHandler &handler);
+	static void unsubscribe(unsigned int id);
+	static bool has_hotplug();
+
+protected:
+	static std::vector<Device> scan();
+	static std::vector<Device> update(const std::vector<Device> &devices);
+	static void start_monitor();
+	static void monitor();
 };
 
 
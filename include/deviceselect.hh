@@ -37,6 +37,7 @@ class DeviceSelectDialog: public Gtk::Dialog
 {
 public:
 	DeviceSelectDialog();
+	virtual ~DeviceSelectDialog();
 	std::optional<Device> get_selected_device();
 
 protected:
@@ -53,11 +54,14 @@ protected:
 	};
 
 	void ok_clicked();
+	void refresh();
 
 	Glib::RefPtr<Gtk::ListStore> m_store;
 	Gtk::TreeView m_treeview;
 	Gtk::Button m_ok;
 	ModelColumns m_columns;
+	Glib::Dispatcher m_devices_changed;
+	unsigned int m_subscription;
 };
 
 #endif //DEVCLIENT_DEVICESELECT_HH
@@ -29,34 +29,117 @@
 #ifndef DEVCLIENT_DTB_HH
 #define DEVCLIENT_DTB_HH
 
-#include <vector>
+#include <cstdint>
+#include <optional>
 #include <string>
-#include <condition_variable>
+#include <vector>
+
+#define FDT_MAGIC		0xd00dfeed
+#define FDT_VERSION		17
+#define FDT_LAST_COMP_VERSION	16
+#define FDT_HEADER_SIZE		40
+
+#define FDT_BEGIN_NODE		0x1
+#define FDT_END_NODE		0x2
+#define FDT_PROP		0x3
+#define FDT_NOP			0x4
+#define FDT_END			0x9
 
+struct DTBProperty
+{
+	std::string name;
+	std::vector<uint8_t> value;
+};
+
+struct DTBNode
+{
+	std::string name;
+	std::vector<std::string> labels;
+	std::vector<DTBProperty> properties;
+	std::vector<DTBNode> children;
+
+	DTBNode *find_child(const std::string &name);
+	DTBProperty *find_property(const std::string &name);
+	const DTBProperty *find_property(const std::string &name) const;
+	void set_property(const std::string &name,
+	    const std::vector<uint8_t> &value);
+	bool remove_property(const std::string &name);
+	bool remove_child(const std::string &name);
+};
+
+struct DTBReserve
+{
+	uint64_t address;
+	uint64_t size;
+};
+
+/*
+ * Device tree held in memory. It is built from DTS source or from a
+ * flattened (FDT) blob and written back out in either form without
+ * running dtc. Malformed input throws std::runtime_error; DTS errors
+ * carry the line and column.
+ */
 class DTB
 {
 public:
-	using SlotDone = sigc::slot<void, bool, int, std::string>;
+	DTB();
 
-	DTB(std::shared_ptr<std::string> &dts, std::shared_ptr<std::vector<uint8_t>> &dtb);
-	virtual ~DTB();
-	void compile(const SlotDone &done);
-	void decompile(const SlotDone &done);
+	static DTB from_dts(const std::string &source);
+	static DTB from_blob(const uint8_t *data, size_t size);
+	static DTB from_blob(const std::vector<uint8_t> &blob);
+
+	std::vector<uint8_t> to_blob() const;
+	std::string to_dts() const;
+
+	static std::vector<uint8_t> compile(const std::string &source);
+	static std::string decompile(const std::vector<uint8_t> &blob);
+	static std::vector<uint8_t> parse_value(const std::string &text);
+
+	DTBNode &root() { return (m_root); }
+	const DTBNode &root() const { return (m_root); }
+	DTBNode *find_node(const std::string &path);
+
+	std::vector<DTBReserve> reserved;
+	uint32_t boot_cpuid_phys;
+
+protected:
+	DTBNode m_root;
+};
+
+/*
+ * Flattened tree edited in place, for stamping per-board values into a
+ * template without a DTS round trip. A property rewrite splices the
+ * structure block, growing or shrinking it as the value requires, and
+ * new names are appended to the strings block. The blob is laid out
+ * the way DTB::to_blob() writes it, so the strings block is always
+ * last and only the header sizes and the strings offset move.
+ */
+class FDTBlob
+{
+public:
+	FDTBlob(const uint8_t *data, size_t size);
+	FDTBlob(const std::vector<uint8_t> &blob);
+
+	std::optional<std::vector<uint8_t>> get_property(const std::string &path,
+	    const std::string &name) const;
+	void set_property(const std::string &path, const std::string &name,
+	    const std::vector<uint8_t> &value);
+	void set_string(const std::string &path, const std::string &name,
+	    const std::string &value);
+
+	const std::vector<uint8_t> &data() const { return (m_data); }
 
 protected:
-	void run_dtc(bool compile, const SlotDone &done);
-	void output_ready(Glib::RefPtr<Gio::AsyncResult> &result);
-	void error_ready(Glib::RefPtr<Gio::AsyncResult> &result);
-	void child_exited(Glib::Pid pid, int code);
-
-	Glib::RefPtr<Gio::UnixOutputStream> m_in;
-	Glib::RefPtr<Gio::UnixInputStream> m_out;
-	Glib::RefPtr<Gio::UnixInputStream> m_err;
-	std::shared_ptr<std::vector<uint8_t>> m_dtb;
-	std::shared_ptr<std::string> m_dts;
-	std::string m_errors;
-	SlotDone m_done;
-	bool m_compile;
+	uint32_t header(size_t offset) const;
+	void set_header(size_t offset, uint32_t value);
+	size_t find_node(const std::string &path) const;
+	size_t find_property(size_t node, const std::string &name,
+	    size_t &end) const;
+	uint32_t add_string(const std::string &name);
+	void splice(size_t offset, size_t remove,
+	    const std::vector<uint8_t> &insert);
+
+	std::vector<uint8_t> m_data;
 };
 
 #endif //DEVCLIENT_DTB_HH
@@ -34,6 +34,10 @@
 #include <string>
 #include <map>
 
+#define EEPROM_FDT_MAGIC	0xd00dfeed
+#define EEPROM_FDT_HEADER_SIZE	40
+#define EEPROM_FDT_MAX_SIZE	4096
+
 struct EepromAddress {
 	uint8_t read;
 	uint8_t write;
@@ -52,6 +56,14 @@ public:
 	    const std::vector<uint8_t> &data) = 0;
 	virtual void erase() = 0;
 	virtual void set_address(std::string addr) = 0;
+
+	/*
+	 * Read only the bytes actually used by an ONIE TLV image or a
+	 * flattened device tree: the fixed header first, then the length
+	 * it declares. A malformed header throws before the payload read.
+	 */
+	void read_tlv(std::vector<uint8_t> &data);
+	void read_fdt(std::vector<uint8_t> &data);
 	static std::map<std::string, uint8_t> eeprom_addrs;
 
 protected:
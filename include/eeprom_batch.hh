@@ -0,0 +1,136 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_EEPROM_BATCH_HH
+#define DEVCLIENT_EEPROM_BATCH_HH
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <stdint.h>
+#include <onie_tlv.hh>
+#include <dtb.hh>
+
+#define EEPROM_BATCH_MAGIC	"TLVBATCH"
+#define EEPROM_BATCH_VERSION	1
+#define EEPROM_BATCH_SERIAL_LEN	32
+#define EEPROM_BATCH_MAC_MAX	0xffffffffffffULL
+
+/* Root properties stamped into device tree images, as EepromTab has them */
+#define EEPROM_BATCH_DTB_SERIAL	"serial"
+#define EEPROM_BATCH_DTB_MAC	"ethaddr-eth0"
+#define EEPROM_BATCH_DTB_MODEL	"model"
+
+/*
+ * Archive layout, all integers big endian like the TLV data itself:
+ * a header, `count` index entries, then the images back to back.
+ */
+struct __attribute__ ((__packed__)) eeprom_batch_header_raw {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	count;
+};
+
+struct __attribute__ ((__packed__)) eeprom_batch_entry_raw {
+	uint64_t	offset;		/* from the start of the archive */
+	uint32_t	length;
+	uint32_t	crc32;		/* TLV CRC, or crc32 of a whole DTB */
+	char		serial[EEPROM_BATCH_SERIAL_LEN];
+};
+
+struct EepromBatchConfig
+{
+	std::string template_file;
+	size_t count = 0;
+	std::optional<uint64_t> first_serial;	/* default: the template's */
+	std::optional<uint64_t> mac_base;	/* default: the template's */
+	std::optional<unsigned int> mac_stride;	/* default: number-mac */
+	std::string output;	/* a directory, or an archive file */
+	unsigned int jobs = 0;	/* 0 uses every core */
+	std::string ledger;	/* reserve serials and MACs here if set */
+	std::vector<std::string> dtb_set;	/* "path:name=value" */
+};
+
+struct EepromBatchImage
+{
+	std::string serial;
+	std::string mac;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t crc32;
+};
+
+/*
+ * Builds TLV images for a run of boards from one template, with the
+ * serial number counting up and the base MAC advancing by the number
+ * of MACs per board. The template is parsed once; every worker thread
+ * patches its own copy and serializes straight into memory.
+ *
+ * A .dtb or .dts template produces device tree images instead: the
+ * serial and ethaddr-eth0 root properties are patched into a copy of
+ * the flattened template for every board, along with any dtb_set
+ * properties, which are the same for all of them.
+ */
+class EepromBatch
+{
+public:
+	EepromBatch(const EepromBatchConfig &config);
+
+	void run();
+	const std::vector<EepromBatchImage> &get_images() const;
+
+	static std::string format_mac(uint64_t mac);
+	static uint64_t parse_mac(const std::string &text);
+
+protected:
+	void reserve();
+	void check_mac_range() const;
+	void load_tlv_template();
+	void load_dtb_template();
+	void generate(size_t first, size_t last, std::vector<uint8_t> &out);
+	void generate_dtb(size_t first, size_t last, std::vector<uint8_t> &out);
+	void store(EepromBatchImage &entry, const uint8_t *image,
+	    bool directory, std::vector<uint8_t> &out);
+	void write_directory();
+	void write_archive();
+	void write_manifest(const std::string &path);
+	bool is_directory_output() const;
+
+	EepromBatchConfig m_config;
+	OnieTLV m_template;
+	std::optional<FDTBlob> m_dtb_template;
+	std::string m_board;
+	uint64_t m_first_serial;
+	std::optional<uint64_t> m_mac_base;
+	unsigned int m_mac_stride;
+	std::vector<EepromBatchImage> m_images;
+	std::vector<std::vector<uint8_t>> m_chunks;
+	std::vector<size_t> m_chunk_first;
+};
+
+#endif /* DEVCLIENT_EEPROM_BATCH_HH */
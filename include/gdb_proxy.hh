@@ -0,0 +1,140 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_GDB_PROXY_HH
+#define DEVCLIENT_GDB_PROXY_HH
+
+#include <map>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+#include <condition_variable>
+#include <stdint.h>
+#include <giomm.h>
+
+/*
+ * GDB remote protocol proxy sitting between debugger clients and the
+ * OpenOCD gdb_port. While the target is halted, register reads and
+ * memory reads are answered from a cache, and memory reads are widened
+ * to whole GDB_PROXY_BLOCK aligned blocks so that neighbouring reads
+ * (stack walks, structure dumps) hit the cache. Anything that resumes
+ * the target or writes to it drops the cache.
+ *
+ * Reading device registers can have side effects, so memory is only
+ * widened and cached inside the given RAM ranges; any other read goes
+ * to OpenOCD exactly as the client sent it.
+ *
+ * All clients share a single upstream connection; requests are
+ * serialized, so while one client has the target running the others
+ * wait for it to stop.
+ */
+/* Start and size of each target RAM region */
+typedef std::vector<std::pair<uint64_t, uint64_t>> GdbProxyRanges;
+
+class GdbProxy
+{
+public:
+	GdbProxy(Glib::RefPtr<Gio::InetAddress> address, uint16_t port,
+	    const std::string &upstream_host, uint16_t upstream_port,
+	    const GdbProxyRanges &ram = {});
+	virtual ~GdbProxy();
+
+	void start();
+	void stop();
+
+protected:
+	enum Event
+	{
+		PACKET,
+		INTERRUPT,
+		CLOSED
+	};
+
+	struct Client
+	{
+		int fd;
+		bool noack;
+		std::string thread;
+		std::string buffer;
+	};
+
+	bool client_worker(const Glib::RefPtr<Gio::SocketConnection> &conn,
+	    const Glib::RefPtr<Glib::Object> &source);
+	bool handle(Client &client, const std::string &packet,
+	    std::string &reply);
+	bool transact(Client *client, const std::string &packet,
+	    std::string &reply);
+	bool read_memory(Client &client, const std::string &packet,
+	    std::string &reply);
+	bool in_ram(uint64_t start, uint64_t end) const;
+	bool wait_upstream(Client *client);
+	void select_thread(Client &client);
+	bool connect_upstream();
+	void disconnect_upstream();
+	void invalidate();
+	size_t client_count();
+
+	static bool parse_event(std::string &buffer, Event &event,
+	    std::string &payload);
+	static Event read_event(int fd, std::string &buffer,
+	    std::string &payload);
+	static bool fill(int fd, std::string &buffer);
+	static bool write_all(int fd, const std::string &data);
+	static bool send_packet(int fd, const std::string &payload);
+
+	Glib::RefPtr<Gio::ThreadedSocketService> m_service;
+	Glib::RefPtr<Gio::InetAddress> m_address;
+	uint16_t m_port;
+	std::string m_upstream_host;
+	uint16_t m_upstream_port;
+	GdbProxyRanges m_ram;
+
+	/* Connected clients, guarded by m_clients_lock */
+	std::mutex m_clients_lock;
+	std::condition_variable m_idle;
+	std::set<int> m_clients;
+	bool m_running;
+
+	/* Upstream connection and caches, guarded by m_lock */
+	std::mutex m_lock;
+	std::atomic<int> m_upstream_fd;
+	Glib::RefPtr<Gio::SocketConnection> m_upstream;
+	std::string m_upstream_buffer;
+	std::string m_upstream_thread;
+	bool m_upstream_noack;
+	std::map<std::string, std::string> m_registers;
+	std::map<uint64_t, std::string> m_memory;
+	bool m_halted;
+	uint64_t m_hits;
+	uint64_t m_misses;
+};
+
+#endif /* DEVCLIENT_GDB_PROXY_HH */
@@ -29,10 +29,18 @@
 #ifndef DEVCLIENT_GPIO_HH
 #define DEVCLIENT_GPIO_HH
 
+#include <map>
+#include <mutex>
 #include <ftdi.hpp>
 #include <device.hh>
+#include <gpio_sequence.hh>
 #include <gtkmm.h>
 
+/*
+ * Channel D in bitbang mode. Output levels and directions are cached,
+ * so updates never read the pins back first. Calls are serialized, so a
+ * GpioMonitor thread may sample the pins while the GUI drives them.
+ */
 class Gpio
 {
 public:
@@ -40,13 +48,26 @@ public:
 	virtual ~Gpio();
 
 	uint8_t get_direction();
+	uint8_t get_output();
 	uint8_t get();
 	void set(uint8_t mask);
+	void update(uint8_t mask, uint8_t value);
+	void update(const std::map<int, bool> &pins);
 	void configure(uint8_t direction_mask);
+	void set_direction(uint8_t mask, uint8_t outputs);
+
+	void start_sampling(unsigned int rate);
+	size_t sample(uint8_t *buf, size_t count);
+	void stop_sampling();
+	void play(const GpioSequence &sequence);
 
 protected:
 	Ftdi::Context m_context;
+	std::mutex m_lock;
 	uint8_t m_bitmode;
+	uint8_t m_output;
+	unsigned int m_sample_rate;
+	bool m_sampling;
 };
 
 #endif /* DEVCLIENT_GPIO_HH */
@@ -0,0 +1,87 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_GPIO_MONITOR_HH
+#define DEVCLIENT_GPIO_MONITOR_HH
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <glibmm.h>
+#include <gpio.hh>
+
+#define GPIO_MONITOR_RATE	10000
+#define GPIO_MONITOR_MIN_CHUNK	64
+#define GPIO_MONITOR_MAX_CHUNK	4096
+
+struct GpioEvent
+{
+	gint64 timestamp;	/* g_get_monotonic_time() of the sample, in us */
+	uint8_t value;		/* pin levels after the edge */
+	uint8_t changed;	/* pins that toggled */
+};
+
+typedef std::function<void(const GpioEvent &)> GpioEventHandler;
+
+/*
+ * Samples channel D in synchronous bitbang mode and reports edges. The
+ * sampling thread only runs while there is at least one subscriber;
+ * handlers are called on that thread.
+ */
+class GpioMonitor
+{
+public:
+	GpioMonitor(std::shared_ptr<Gpio> gpio,
+	    unsigned int rate = GPIO_MONITOR_RATE);
+	virtual ~GpioMonitor();
+
+	unsigned int subscribe(const GpioEventHandler &handler);
+	void unsubscribe(unsigned int id);
+	void set_rate(unsigned int rate);
+	unsigned int get_rate() const;
+
+protected:
+	void start();
+	void stop();
+	void worker();
+	void publish(const GpioEvent &event);
+
+	std::shared_ptr<Gpio> m_gpio;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	std::atomic<unsigned int> m_rate;
+	std::mutex m_thread_lock;
+	std::mutex m_lock;
+	std::map<unsigned int, GpioEventHandler> m_handlers;
+	unsigned int m_next_id;
+};
+
+#endif /* DEVCLIENT_GPIO_MONITOR_HH */
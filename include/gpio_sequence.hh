@@ -0,0 +1,70 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_GPIO_SEQUENCE_HH
+#define DEVCLIENT_GPIO_SEQUENCE_HH
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#define GPIO_SEQUENCE_MIN_RATE	1000
+#define GPIO_SEQUENCE_MAX_RATE	1000000
+#define GPIO_SEQUENCE_MAX_SIZE	(4 * 1024 * 1024)
+
+struct GpioStep
+{
+	uint8_t mask;		/* pins driven by this step */
+	uint8_t value;		/* their levels */
+	uint32_t hold_us;	/* time before the next step */
+};
+
+/*
+ * A list of pin states with durations, compiled into one bitbang
+ * buffer, so every step is paced by the same chip clock. See
+ * Gpio::play() for how far the absolute timing can be trusted.
+ */
+class GpioSequence
+{
+public:
+	GpioSequence(const std::string &name = "");
+
+	void add_step(uint8_t mask, uint8_t value, uint32_t hold_us);
+	const std::string &get_name() const;
+	const std::vector<GpioStep> &get_steps() const;
+	uint8_t get_outputs() const;
+	uint64_t get_duration() const;
+	unsigned int get_rate() const;
+	std::vector<uint8_t> compile(uint8_t initial) const;
+
+protected:
+	std::string m_name;
+	std::vector<GpioStep> m_steps;
+};
+
+#endif /* DEVCLIENT_GPIO_SEQUENCE_HH */
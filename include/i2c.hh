@@ -40,6 +40,9 @@
 #define WP		(1u << 4)
 #define OUT_PINS	(SCL | SDA_OUT | WP)
 
+#define I2C_READ_CHUNK		256	/* bytes clocked in per USB transfer */
+#define I2C_READ_RETRIES	100
+
 class I2C
 {
 public:
@@ -52,7 +55,8 @@ public:
 	void write(const std::vector<uint8_t> &data);
 
 protected:
-	uint8_t read_byte(bool ack);
+	void queue_read_byte(std::vector<uint8_t> &cmd, bool ack);
+	void read_exact(uint8_t *buf, size_t nbytes);
 	void write_byte(uint8_t byte);
 
 	Ftdi::Context m_context;
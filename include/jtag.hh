@@ -29,40 +29,129 @@
 #ifndef DEVCLIENT_JTAG_HH
 #define DEVCLIENT_JTAG_HH
 
+#include <list>
+#include <map>
+#include <memory>
 #include <giomm.h>
 #include <device.hh>
+#include <openocd_rpc.hh>
+#include <gdb_proxy.hh>
 
-class JtagServer
+struct JtagServerConfig
+{
+	Glib::RefPtr<Gio::InetAddress> address;
+	uint16_t gdb_port;
+	uint16_t ocd_port;
+	std::string board_script;
+	uint32_t adapter_speed = 1000;
+	uint16_t rpc_port = OPENOCD_RPC_PORT;
+	bool gdb_proxy = false;
+	GdbProxyRanges gdb_proxy_ram;
+
+	std::string local_host() const;
+	bool operator==(const JtagServerConfig &other) const;
+	bool operator!=(const JtagServerConfig &other) const
+	{
+		return (!(*this == other));
+	}
+};
+
+/*
+ * Timers and child watches are attached to the thread-default main
+ * context of the thread that created the server.
+ */
+class JtagServer: public sigc::trackable
 {
 public:
+	enum State
+	{
+		STOPPED,
+		STARTING,
+		RUNNING,
+		STOPPING,
+		BACKOFF
+	};
+
+	JtagServer(const Device &device, const JtagServerConfig &config);
 	JtagServer(const Device &device, Glib::RefPtr<Gio::InetAddress>,
 	    uint16_t gdb_port, uint16_t ocd_port,
 	    const std::string &board_script);
 	virtual ~JtagServer();
 	void start();
 	void stop();
+	State get_state() const { return (m_state); }
+	const Device &get_device() const { return (m_device); }
+	const JtagServerConfig &get_config() const { return (m_config); }
+	void set_auto_restart(bool enable) { m_auto_restart = enable; }
+	void set_stop_timeout(unsigned int msec) { m_stop_timeout = msec; }
 	static void bypass(const Device &device);
 	static void reset(const Device &device);
+	static const char *state_name(State state);
 
 	sigc::signal<void, const std::string &> on_output_produced;
 	sigc::signal<void> on_server_start;
 	sigc::signal<void> on_server_exit;
+	sigc::signal<void, State> on_state_changed;
 
 protected:
+	void spawn();
+	void set_state(State state);
 	void prepare_child();
 	void child_exited(Glib::Pid pid, int code);
 	void output_ready(Glib::RefPtr<Gio::AsyncResult> &result,
 	    Glib::RefPtr<Gio::UnixInputStream> stream);
+	bool stop_timeout_expired();
+	bool restart_timeout_expired();
+	void cancel_timers();
 
-	const Device &m_device;
-	Glib::RefPtr<Gio::InetAddress> m_address;
-	uint16_t m_ocd_port;
-	uint16_t m_gdb_port;
-	std::string m_board_script;
+	Device m_device;
+	JtagServerConfig m_config;
+	Glib::RefPtr<Glib::MainContext> m_context;
 	Glib::Pid m_pid;
 	Glib::RefPtr<Gio::UnixInputStream> m_out;
 	Glib::RefPtr<Gio::UnixInputStream> m_err;
+	Glib::RefPtr<Gio::Cancellable> m_cancel;
+	sigc::connection m_child_watch;
+	sigc::connection m_stop_timer;
+	sigc::connection m_restart_timer;
+	std::unique_ptr<GdbProxy> m_gdb_proxy;
+	uint16_t m_gdb_upstream_port;
+	std::string m_pending_output;
+	gint64 m_started_at;
+	unsigned int m_backoff;
+	unsigned int m_stop_timeout;
+	bool m_auto_restart;
+	bool m_stopping;
 	bool m_running;
+	State m_state;
+};
+
+/*
+ * Keeps one OpenOCD instance per cable alive between debug sessions, so
+ * that starting a session with an unchanged configuration reuses the
+ * already initialized server instead of spawning a new one.
+ */
+class JtagSupervisor
+{
+public:
+	static JtagSupervisor *instance();
+
+	JtagSupervisor(JtagSupervisor const &) = delete;
+	void operator=(JtagSupervisor const &) = delete;
+
+	std::shared_ptr<JtagServer> acquire(const Device &device,
+	    const JtagServerConfig &config);
+	void release(const Device &device, bool standby);
+	void discard(const Device &device);
+	void shutdown();
+
+private:
+	JtagSupervisor() = default;
+
+	static JtagSupervisor *m_instance;
+
+	std::map<std::string, std::shared_ptr<JtagServer>> m_servers;
+	std::list<std::shared_ptr<JtagServer>> m_retired;
 };
 
 #endif /* DEVCLIENT_JTAG_HH */
@@ -0,0 +1,105 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_JTAG_BATCH_HH
+#define DEVCLIENT_JTAG_BATCH_HH
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <giomm.h>
+#include <device.hh>
+#include <jtag.hh>
+#include <mapped_file.hh>
+
+/*
+ * Programs the same image into several boards at once, one OpenOCD per
+ * cable on automatically assigned local ports. Every board is driven
+ * by its own worker thread. Differential flashing slices one shared
+ * mapping of the image; a plain flash has each OpenOCD read the file
+ * itself, as flash write_image only takes a file. Progress and the
+ * final report are printed to stdout.
+ */
+class JtagBatch: public sigc::trackable
+{
+public:
+	JtagBatch(const std::vector<Device> &devices,
+	    const JtagServerConfig &config, const OpenOcdRpcJob &job);
+	virtual ~JtagBatch();
+
+	void start();
+
+	/* Emitted once every board has finished, true if all succeeded */
+	sigc::signal<void, bool> on_finished;
+
+protected:
+	enum Status
+	{
+		WAITING,
+		FLASHING,
+		DONE,
+		FAILED
+	};
+
+	struct Board
+	{
+		Device device;
+		std::shared_ptr<JtagServer> server;
+		std::thread worker;
+		Status status;
+		size_t done;
+		size_t total;
+		gint64 started;
+		gint64 finished;
+		std::string message;
+	};
+
+	void prepare(Board &board);
+	void server_state(Board *board, JtagServer::State state);
+	void worker(Board *board);
+	void worker_done();
+	void fail(Board &board, const std::string &message);
+	void check_finished();
+	bool print_progress();
+	void print_report();
+
+	std::vector<std::unique_ptr<Board>> m_boards;
+	std::shared_ptr<MappedFile> m_image;
+	std::set<uint16_t> m_ports;	/* handed out to any board so far */
+	JtagServerConfig m_config;
+	OpenOcdRpcJob m_job;
+	std::mutex m_lock;
+	Glib::Dispatcher m_worker_done;
+	sigc::connection m_timer;
+	gint64 m_started;
+	bool m_reported;
+};
+
+#endif /* DEVCLIENT_JTAG_BATCH_HH */
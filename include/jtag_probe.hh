@@ -0,0 +1,116 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_JTAG_PROBE_HH
+#define DEVCLIENT_JTAG_PROBE_HH
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <ftdi.hpp>
+#include <stdint.h>
+#include <device.hh>
+
+#define JTAG_SPEED_AUTO		0
+#define JTAG_SPEED_DEFAULT	1000
+#define JTAG_SPEED_MAX		30000
+#define JTAG_SPEED_MIN		100
+
+struct JtagTap
+{
+	uint32_t idcode;	/* 0 when the TAP has no IDCODE register */
+	unsigned int irlen;	/* 0 when it could not be determined */
+};
+
+/* Receives the progress lines of detect_script(), one at a time */
+typedef std::function<void(const std::string &)> JtagProbeReport;
+
+/*
+ * Minimal JTAG engine driving channel B in MPSSE mode, the same pins
+ * OpenOCD uses (TCK, TDI, TDO, TMS on ADBUS0..3). Scans are queued and
+ * sent to the chip in as few USB transfers as possible.
+ */
+class JtagProbe
+{
+public:
+	JtagProbe(const Device &device);
+	virtual ~JtagProbe();
+
+	uint32_t set_frequency(uint32_t khz);
+	void reset();
+	std::vector<uint32_t> read_idcodes();
+	std::vector<JtagTap> scan_chain();
+	bool check_bypass(size_t ndevices, unsigned int rounds);
+	uint32_t tune(uint32_t max_khz, unsigned int margin);
+
+	static std::string match_script(const std::vector<JtagTap> &chain,
+	    const std::string &script_dir);
+	static std::string detect_script(const Device &device,
+	    const std::string &script_dir,
+	    const JtagProbeReport &report = nullptr);
+
+protected:
+	void queue_tms(uint8_t tms, unsigned int count);
+	size_t queue_scan(const std::vector<uint8_t> &tdi, size_t nbits,
+	    bool ir);
+	std::vector<std::vector<uint8_t>> execute();
+	void flush();
+	std::vector<uint32_t> parse_idcodes(const std::vector<uint8_t> &dr,
+	    size_t nbits);
+	std::vector<unsigned int> parse_irlens(const std::vector<uint8_t> &ir,
+	    size_t ndevices);
+	bool stable(const std::vector<uint32_t> &reference, size_t rounds);
+
+	struct Capture
+	{
+		size_t nbits;
+	};
+
+	Ftdi::Context m_context;
+	std::vector<uint8_t> m_cmd;
+	std::vector<uint8_t> m_rx;
+	std::vector<Capture> m_captures;
+	size_t m_pending;
+};
+
+/*
+ * Adapter speeds found by JtagProbe::tune(), remembered per board
+ * profile and cable serial number.
+ */
+class JtagSpeedCache
+{
+public:
+	static uint32_t lookup(const std::string &profile,
+	    const std::string &serial);
+	static void store(const std::string &profile,
+	    const std::string &serial, uint32_t khz);
+	static uint32_t resolve(const Device &device,
+	    const std::string &profile, bool force = false);
+};
+
+#endif /* DEVCLIENT_JTAG_PROBE_HH */
@@ -0,0 +1,132 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_LEDGER_HH
+#define DEVCLIENT_LEDGER_HH
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <optional>
+#include <stdint.h>
+#include <stddef.h>
+#include <onie_tlv.hh>
+
+#define LEDGER_MAGIC		"DEVLEDGR"
+#define LEDGER_VERSION		1
+#define LEDGER_GROW_RECORDS	4096
+#define LEDGER_CABLE_LEN	32
+#define LEDGER_BOARD_LEN	56
+
+/*
+ * On-disk layout, little endian: the header, then one record per board
+ * in allocation order. Serials and MAC blocks only ever grow, so the
+ * records are sorted by both and lookups are binary searches.
+ */
+struct __attribute__ ((__packed__)) ledger_header_raw {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	record_size;
+	uint64_t	count;		/* committed records */
+	uint64_t	next_serial;
+	uint64_t	next_mac;
+	uint32_t	crc32;		/* of the fields above */
+	uint8_t		reserved[20];
+};
+
+struct __attribute__ ((__packed__)) ledger_record_raw {
+	uint64_t	serial;
+	uint64_t	mac;
+	uint32_t	mac_count;
+	uint32_t	reserved;
+	int64_t		timestamp;
+	char		cable[LEDGER_CABLE_LEN];
+	char		board[LEDGER_BOARD_LEN];
+	uint32_t	crc32;		/* of the fields above */
+	uint32_t	pad;
+};
+
+struct LedgerEntry
+{
+	uint64_t serial;
+	uint64_t mac;
+	unsigned int mac_count;
+	int64_t timestamp;
+	std::string cable;
+	std::string board;
+};
+
+/*
+ * Persistent record of serial numbers and MAC blocks handed out to
+ * boards, shared by every station that opens the same file. Writers
+ * hold an exclusive open file description lock, which also works on
+ * NFS. Records are synced to disk before the header counts them, and
+ * opening the ledger adopts any valid record past the count, so a
+ * crash never hands the same numbers out twice.
+ */
+class Ledger
+{
+public:
+	Ledger(const std::string &path);
+	virtual ~Ledger();
+
+	Ledger(Ledger const &) = delete;
+	void operator=(Ledger const &) = delete;
+
+	/* The floors come from the template; the ledger never goes back */
+	std::vector<LedgerEntry> reserve(size_t boards, unsigned int mac_count,
+	    uint64_t serial_floor, uint64_t mac_floor,
+	    const std::string &cable, const std::string &board);
+	LedgerEntry assign(OnieTLV &tlv, const std::string &cable);
+	std::optional<LedgerEntry> find_serial(uint64_t serial);
+	std::optional<LedgerEntry> find_mac(uint64_t mac);
+	size_t size();
+
+protected:
+	void lock(bool exclusive);
+	void unlock();
+	void remap();
+	void grow(size_t records);
+	void recover();
+	void sync(const void *addr, size_t length);
+	ledger_header_raw *header() const;
+	ledger_record_raw *record(size_t index) const;
+	size_t capacity() const;
+	LedgerEntry decode(const ledger_record_raw *raw) const;
+
+	static uint32_t header_crc(const ledger_header_raw *raw);
+	static uint32_t record_crc(const ledger_record_raw *raw);
+
+	std::string m_path;
+	std::mutex m_lock;
+	int m_fd;
+	uint8_t *m_data;
+	size_t m_size;
+};
+
+#endif /* DEVCLIENT_LEDGER_HH */
@@ -0,0 +1,176 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_LOGIC_CAPTURE_HH
+#define DEVCLIENT_LOGIC_CAPTURE_HH
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <gpio.hh>
+
+#define LOGIC_CHANNELS		8
+#define LOGIC_DEFAULT_RATE	1000000
+#define LOGIC_DEFAULT_PRE	10000
+#define LOGIC_DEFAULT_POST	100000
+#define LOGIC_RING_SIZE		(4 * 1024 * 1024)
+#define LOGIC_CHUNK_SIZE	(64 * 1024)
+#define LOGIC_TIMEOUT		10
+
+/*
+ * Single producer, single consumer byte ring. The USB reader pushes
+ * samples and the trigger logic pops them without taking any lock.
+ */
+class SampleRing
+{
+public:
+	explicit SampleRing(size_t capacity);
+
+	size_t push(const uint8_t *buf, size_t count);
+	size_t pop(uint8_t *buf, size_t count);
+
+protected:
+	std::vector<uint8_t> m_buffer;
+	size_t m_mask;
+	alignas(64) std::atomic<size_t> m_head;
+	alignas(64) std::atomic<size_t> m_tail;
+};
+
+struct LogicTrigger
+{
+	enum Type
+	{
+		IMMEDIATE,
+		RISING,
+		FALLING,
+		EDGE,
+		PATTERN
+	};
+
+	Type type = IMMEDIATE;
+	uint8_t mask = 0;
+	uint8_t value = 0;
+
+	bool matches(uint8_t prev, uint8_t cur) const;
+	std::string describe() const;
+
+	/* "now", "rising:N", "falling:N", "edge:N" or "pattern:1x0x" */
+	static LogicTrigger parse(const std::string &spec);
+};
+
+struct LogicRun
+{
+	uint8_t value;
+	uint32_t length;
+};
+
+/*
+ * Time lost before a sample while the host was not clocking the chip.
+ * The length is measured on the host, so it is only an estimate.
+ */
+struct LogicGap
+{
+	uint64_t sample;
+	uint64_t ns;
+};
+
+/*
+ * A capture kept run-length encoded, so seconds of idle lines between
+ * a few edges take a handful of bytes.
+ */
+class LogicTrace
+{
+public:
+	LogicTrace(unsigned int rate);
+
+	void append(uint8_t value);
+	void mark_trigger();
+	void add_gap(uint64_t sample, uint64_t ns);
+	size_t size() const;
+	size_t get_trigger() const;
+	const std::vector<LogicRun> &get_runs() const;
+	const std::vector<LogicGap> &get_gaps() const;
+
+	void save(const std::string &path,
+	    const std::vector<std::string> &names) const;
+	void write_vcd(const std::string &path,
+	    const std::vector<std::string> &names) const;
+	void write_sigrok(const std::string &path,
+	    const std::vector<std::string> &names) const;
+
+protected:
+	std::string channel_name(const std::vector<std::string> &names,
+	    int channel) const;
+
+	unsigned int m_rate;
+	size_t m_samples;
+	size_t m_trigger;
+	std::vector<LogicRun> m_runs;
+	std::vector<LogicGap> m_gaps;
+};
+
+struct LogicCaptureConfig
+{
+	unsigned int rate = LOGIC_DEFAULT_RATE;
+	size_t pre = LOGIC_DEFAULT_PRE;
+	size_t post = LOGIC_DEFAULT_POST;
+	unsigned int timeout = LOGIC_TIMEOUT;	/* seconds to wait for the trigger */
+	LogicTrigger trigger;
+};
+
+/*
+ * Streams channel D samples from a reader thread into a SampleRing
+ * while the calling thread looks for the trigger and keeps the pre- and
+ * post-trigger windows.
+ */
+class LogicCapture
+{
+public:
+	LogicCapture(std::shared_ptr<Gpio> gpio, const LogicCaptureConfig &config);
+
+	LogicTrace run();
+	void cancel();
+	size_t get_overruns() const;
+
+protected:
+	void reader();
+
+	std::shared_ptr<Gpio> m_gpio;
+	LogicCaptureConfig m_config;
+	SampleRing m_ring;
+	std::atomic<bool> m_running;
+	std::atomic<bool> m_cancelled;
+	std::atomic<bool> m_failed;
+	std::atomic<size_t> m_overruns;
+	std::vector<LogicGap> m_gaps;	/* by stream position, read after join */
+	std::string m_error;
+};
+
+#endif /* DEVCLIENT_LOGIC_CAPTURE_HH */
@@ -29,17 +29,22 @@
 #ifndef DEVCLIENT_MAINWINDOW_HH
 #define DEVCLIENT_MAINWINDOW_HH
 
+#include <mutex>
+#include <thread>
 #include <gtkmm.h>
 #include <formrow.hh>
 #include <uart.hh>
 #include <jtag.hh>
 #include <gpio.hh>
+#include <gpio_monitor.hh>
 #include <i2c.hh>
 #include <dtb.hh>
 //#include <profile.hh>
 #include <onie_tlv.hh>
 #include <profile.hh>
 
+#define GPIO_LOG_LINES		1000
+
 class MainWindow;
 
 
@@ -106,11 +111,15 @@ class JtagTab: public Gtk::Box
 {
 public:
 	JtagTab(MainWindow *parent, const Device &dev);
+	virtual ~JtagTab();
 
 	void set_address(std::string addr);
 	void set_ocd_port(std::string port);
 	void set_gdb_port(std::string port);
 	void set_script(std::string script);
+	void set_speed(std::string speed);
+	void set_rpc_port(uint16_t port);
+	void set_gdb_proxy(bool enable, const GdbProxyRanges &ram);
 	
 	
 protected:
@@ -118,10 +127,21 @@ protected:
 	void stop_clicked();
 	void reset_clicked();
 	void bypass_clicked();
+	void tune_clicked();
+	void detect_clicked();
+	void load_clicked();
+	void flash_clicked();
+	void flash_diff_clicked();
+	void dump_clicked();
+	uint32_t adapter_speed(bool force);
+	std::string detect_script();
+	void run_job(OpenOcdRpcJob::Kind kind, const std::string &path);
+	void rpc_worker(OpenOcdRpcJob job, JtagServerConfig config);
+	void on_rpc_progress();
+	void on_rpc_finished();
 	
 	void on_output_ready(const std::string &output);
-	void on_server_start();
-	void on_server_exit();
+	void on_server_state(JtagServer::State state);
 	void on_address_changed();
 	void on_ocd_port_changed();
 	void on_gdb_port_changed();
@@ -130,7 +150,14 @@ protected:
 	FormRow<Gtk::Entry> m_gdb_port_row;
 	FormRow<Gtk::Entry> m_ocd_port_row;
 	FormRow<Gtk::FileChooserButton> m_board_row;
+	FormRow<Gtk::Entry> m_speed_row;
 	FormRow<Gtk::Entry> m_status_row;
+	FormRow<Gtk::CheckButton> m_standby_row;
+	FormRow<Gtk::CheckButton> m_proxy_row;
+	FormRow<Gtk::FileChooserButton> m_image_row;
+	FormRow<Gtk::Entry> m_image_addr_row;
+	FormRow<Gtk::Entry> m_dump_size_row;
+	Gtk::ProgressBar m_progress;
 	Glib::RefPtr<Gtk::TextBuffer> m_textbuffer;
 	Gtk::ScrolledWindow m_scroll;
 	Gtk::TextView m_textview;
@@ -139,12 +166,33 @@ protected:
 	Gtk::Button m_stop;
 	Gtk::Button m_reset;
 	Gtk::Button m_bypass;
+	Gtk::Button m_tune;
+	Gtk::Button m_detect;
+	Gtk::ButtonBox m_image_buttons;
+	Gtk::Button m_load;
+	Gtk::Button m_flash;
+	Gtk::Button m_flash_diff;
+	Gtk::Button m_dump;
 	
 	sigc::connection m_addr_changed_conn;
 	sigc::connection m_ocd_port_changed_conn;
 	sigc::connection m_gdb_port_changed_conn;
+	sigc::connection m_output_conn;
+	sigc::connection m_state_conn;
 	
 	std::shared_ptr<JtagServer> m_server;
+	uint16_t m_rpc_port;
+	GdbProxyRanges m_gdb_proxy_ram;
+
+	/* Image transfers run on m_rpc_thread, guarded by m_rpc_lock */
+	std::thread m_rpc_thread;
+	std::mutex m_rpc_lock;
+	Glib::Dispatcher m_rpc_progress;
+	Glib::Dispatcher m_rpc_finished;
+	size_t m_rpc_done;
+	size_t m_rpc_total;
+	std::string m_rpc_error;
+	std::string m_rpc_summary;
 	
 	MainWindow *m_parent;
 	
@@ -159,8 +207,6 @@ public:
 protected:
 	void read_clicked();
 	void write_clicked();
-	void compile_done(bool ok, int size, const std::string &errors);
-	void decompile_done(bool ok, int size, const std::string &errors);
 
 	Glib::RefPtr<Gtk::TextBuffer> m_textbuffer;
 	Gtk::ScrolledWindow m_scroll;
@@ -169,9 +215,6 @@ protected:
 	Gtk::Button m_read;
 	Gtk::Button m_write;
 	Gtk::Button m_save;
-	std::shared_ptr<DTB> m_dtb;
-	std::shared_ptr<std::string> m_textual;
-	std::shared_ptr<std::vector<uint8_t>> m_blob;
 	MainWindow *m_parent;
 	const Device &m_device;
 };
@@ -214,6 +257,7 @@ protected:
 	void clear_clicked();
 	void add_tlv_row(tlv_code_t id, std::string name, std::string value);
 	void update_tlv_row(tlv_code_t id, std::string value);
+	void update_vendor_rows();
 
 };
 
@@ -225,16 +269,35 @@ public:
 	std::shared_ptr<Gpio> m_gpio;
 
 	void set_gpio_name(int no, const std::string &name);
+	void set_sequences(const std::vector<std::string> &names);
 	
 protected:
 	void state_changed(bool state, uint8_t mask);
 	void direction_changed(bool state, uint8_t mask);
+	void rate_changed();
+	void play_clicked();
+	void on_map() override;
+	void on_unmap() override;
+	void on_gpio_event(const GpioEvent &event);
+	void on_events_ready();
 
 	MainWindow *m_parent;
 	const Device &m_device;
 	FormRowGpio m_gpio_row[4];
-	sigc::connection m_timer;
-	bool timer();
+	FormRow<Gtk::Entry> m_rate_row;
+	FormRow<Gtk::ComboBoxText> m_sequence_row;
+	Gtk::ButtonBox m_buttons;
+	Gtk::Button m_play;
+	Gtk::ScrolledWindow m_scroll;
+	Gtk::TextView m_textview;
+	Glib::RefPtr<Gtk::TextBuffer> m_textbuffer;
+	std::unique_ptr<GpioMonitor> m_monitor;
+	unsigned int m_subscription;
+	Glib::Dispatcher m_events_ready;
+	std::mutex m_events_lock;
+	std::vector<GpioEvent> m_events;
+	gint64 m_first_event;
+	bool m_updating;
 };
 
 class MainWindow: public Gtk::Window
@@ -248,6 +311,7 @@ public:
 	ProfileConfig *m_pc;
 	
 	void set_gpio_name(int no, std::string name);
+	void set_gpio_sequences(const std::vector<std::string> &names);
 	void set_uart_addr(std::string addr);
 	void set_uart_port(std::string port);
 	void set_uart_baud(std::string baud);
@@ -255,6 +319,9 @@ public:
 	void set_jtag_gdb_port(std::string port);
 	void set_jtag_ocd_port(std::string port);
 	void set_jtag_script(std::string script);
+	void set_jtag_speed(std::string speed);
+	void set_jtag_rpc_port(uint16_t port);
+	void set_jtag_gdb_proxy(bool enable, const GdbProxyRanges &ram);
 	
 protected:
 	Gtk::Notebook m_notebook;
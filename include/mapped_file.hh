@@ -0,0 +1,62 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_MAPPED_FILE_HH
+#define DEVCLIENT_MAPPED_FILE_HH
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Read-only memory mapping of a whole file. Copies are not allowed;
+ * share it through a pointer when several users need the same file.
+ */
+class MappedFile
+{
+public:
+	MappedFile(const std::string &path);
+	virtual ~MappedFile();
+
+	MappedFile(MappedFile const &) = delete;
+	void operator=(MappedFile const &) = delete;
+
+	const uint8_t *data() const { return (m_data); }
+	size_t size() const { return (m_size); }
+	const std::string &path() const { return (m_path); }
+
+	void write_slice(const std::string &path, size_t offset,
+	    size_t length) const;
+
+protected:
+	std::string m_path;
+	const uint8_t *m_data;
+	size_t m_size;
+};
+
+#endif /* DEVCLIENT_MAPPED_FILE_HH */
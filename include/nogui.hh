@@ -37,15 +37,28 @@ public:
 	bool gui;
 
 	JtagCmdLine(void);
-	JtagCmdLine(const Device &device, Glib::RefPtr<Gio::InetAddress> address, uint16_t gdb_port,  uint16_t ocd_port, const std::string &board_script);
+	JtagCmdLine(const Device &device, Glib::RefPtr<Gio::InetAddress> address, uint16_t gdb_port,  uint16_t ocd_port, const std::string &board_script, uint32_t adapter_speed);
+	JtagCmdLine(const Device &device, const JtagServerConfig &config);
 	JtagCmdLine(const Device &device);
+	virtual ~JtagCmdLine();
 	std::shared_ptr<JtagServer> m_server;
 	void bypass(const Device &device);
+	void add_job(const OpenOcdRpcJob &job);
 	void on_output_ready(const std::string &output);
+	void on_server_state(JtagServer::State state);
 	void on_server_start();
 	void on_server_exit();
 
 private:
+	void rpc_worker();
+	void rpc_done();
+
+	std::vector<OpenOcdRpcJob> m_jobs;
+	std::thread m_rpc_thread;
+	Glib::Dispatcher m_rpc_finished;
+	bool m_rpc_started = false;
+	bool m_rpc_failed = false;
+
 	const Device &m_device;
 	Glib::RefPtr<Gio::InetAddress> m_address;
 	uint16_t m_ocd_port;
@@ -29,9 +29,13 @@
 #define DEVCLIENT_ONIE_TLV_H
 
 #include <stdint.h>
+#include <array>
 #include <string>
 #include <vector>
 #include <map>
+#include <optional>
+#include <string_view>
+#include <iterator>
 
 /*
  * Here comes structure of the ONIE TLV EEPROM format
@@ -52,18 +56,23 @@ struct __attribute__ ((__packed__)) tlv_record_raw {
 	uint8_t      value[0];
 };
 
-struct TLVRecord {
-	uint8_t type;
-	std::string data;
-	size_t data_length;
-};
-
 #define TLV_EEPROM_ID_STRING    "TlvInfo"
 #define TLV_EEPROM_VERSION      0x1
 #define TLV_EEPROM_MAX_SIZE     2048
 #define TLV_EEPROM_LEN_MAX      (TLV_EEPROM_MAX_SIZE - sizeof(struct tlv_header_raw))
 #define TLV_EEPROM_LEN_CRC      (sizeof (tlv_record_raw) + 4)
 #define TLV_EEPROM_VALUE_MAX_SIZE   255
+#define TLV_CODE_COUNT          256
+
+/*
+ * One slot per type code. The length field of a record is a single
+ * byte, so every value fits inline and no record ever allocates.
+ */
+struct TLVRecord {
+	bool present;
+	uint8_t data_length;
+	uint8_t data[TLV_EEPROM_VALUE_MAX_SIZE];
+};
 
 /*
  * TLV types
@@ -91,6 +100,119 @@ typedef enum TLVCode {
 	TLV_CODE_RESERVED_1 = 0xFF,         /* None */
 } tlv_code_t;
 
+/*
+ * How a field's value is stored; see codec_ops in onie_tlv.cc for the
+ * encoder and decoder of each one.
+ */
+typedef enum TLVCodec {
+	TLV_CODEC_TEXT,         /* up to length bytes of text */
+	TLV_CODEC_FIXED_TEXT,   /* text padded with zeros to length bytes */
+	TLV_CODEC_DATE,         /* MM/DD/YYYY hh:mm:ss */
+	TLV_CODEC_UINT8,
+	TLV_CODEC_UINT16,       /* big endian */
+	TLV_CODEC_MAC,          /* six bytes, written as xx:xx:xx:xx:xx:xx */
+	TLV_CODEC_HEX,          /* raw bytes, written as hex digits */
+	TLV_CODEC_COUNT
+} tlv_codec_t;
+
+/* Codec names used in YAML, indexed by tlv_codec_t */
+inline constexpr const char *tlv_codec_names[] = {
+	"text", "fixed-text", "date", "uint8", "uint16", "mac", "hex",
+};
+
+static_assert(std::size(tlv_codec_names) == TLV_CODEC_COUNT, "every codec needs a name");
+
+struct TLVField {
+	tlv_code_t code;
+	const char *yaml_name;
+	const char *label;
+	tlv_codec_t codec;
+	uint8_t length;             /* fixed size, or the maximum for text */
+	const char *placeholder;    /* value offered for a new board */
+};
+
+/*
+ * The one place that knows the ONIE fields. Parsing, formatting,
+ * validation, YAML names and the GUI rows are all driven from here;
+ * vendor extension sub-fields are described with the same struct.
+ */
+inline constexpr TLVField onie_tlv_schema[] = {
+	{ TLV_CODE_PRODUCT_NAME, "product-name", "Product name", TLV_CODEC_TEXT, 255, "set-me-sample-name" },
+	{ TLV_CODE_PART_NUMBER, "part-number", "Part number", TLV_CODEC_TEXT, 255, "" },
+	{ TLV_CODE_SERIAL_NUMBER, "serial-number", "Serial number", TLV_CODEC_TEXT, 255, "000000" },
+	{ TLV_CODE_MAC_BASE, "mac-address", "MAC", TLV_CODEC_MAC, 6, "70:B3:D5:B9:D0:00" },
+	{ TLV_CODE_MANUF_DATE, "manufacture-date", "Manufacture date", TLV_CODEC_DATE, 19, "01/01/2021 12:00:01" },
+	{ TLV_CODE_DEV_VERSION, "device-version", "Device version", TLV_CODEC_UINT8, 1, "1" },
+	{ TLV_CODE_LABEL_REVISION, "label-revision", "Label revision", TLV_CODEC_TEXT, 255, "" },
+	{ TLV_CODE_PLATFORM_NAME, "platform-name", "Platform name", TLV_CODEC_TEXT, 255, "" },
+	{ TLV_CODE_ONIE_VERSION, "onie-version", "ONIE version", TLV_CODEC_TEXT, 255, "1" },
+	{ TLV_CODE_NUM_MACs, "number-mac", "Number MACs", TLV_CODEC_UINT16, 2, "1" },
+	{ TLV_CODE_MANUF_NAME, "manufacturer", "Manufacturer", TLV_CODEC_TEXT, 255, "Conclusive Engineering" },
+	{ TLV_CODE_COUNTRY_CODE, "country-code", "Country code", TLV_CODEC_FIXED_TEXT, 2, "PL" },
+	{ TLV_CODE_VENDOR_NAME, "vendor-name", "Vendor", TLV_CODEC_TEXT, 255, "" },
+	{ TLV_CODE_DIAG_VERSION, "diag-version", "Diag Version", TLV_CODEC_TEXT, 255, "" },
+	{ TLV_CODE_SERVICE_TAG, "service-tag", "Service tag", TLV_CODEC_TEXT, 255, "" },
+	/* Written as IANA:payload, see OnieTLV::add_vendor_extension() */
+	{ TLV_CODE_VENDOR_EXT, "vendor-extension", "Vendor extension", TLV_CODEC_HEX, 251, "" },
+};
+
+constexpr std::array<int8_t, TLV_CODE_COUNT> make_tlv_schema_index()
+{
+	std::array<int8_t, TLV_CODE_COUNT> index{};
+
+	for (auto &i : index)
+		i = -1;
+	for (size_t i = 0; i < std::size(onie_tlv_schema); i++)
+		index[onie_tlv_schema[i].code] = i;
+	return index;
+}
+
+inline constexpr std::array<int8_t, TLV_CODE_COUNT> onie_tlv_schema_index = make_tlv_schema_index();
+
+constexpr const TLVField *tlv_field(uint8_t code)
+{
+	return onie_tlv_schema_index[code] < 0 ? nullptr : &onie_tlv_schema[onie_tlv_schema_index[code]];
+}
+
+constexpr const TLVField *tlv_field_by_name(std::string_view name)
+{
+	for (const auto &field : onie_tlv_schema) {
+		if (name == field.yaml_name)
+			return &field;
+	}
+	return nullptr;
+}
+
+static_assert(tlv_field(TLV_CODE_MAC_BASE)->length == 6, "schema index is broken");
+static_assert(tlv_field(TLV_CODE_CRC_32) == nullptr, "CRC is not a user field");
+
+#define TLV_VENDOR_IANA_SIZE    4
+#define TLV_VENDOR_DATA_MAX     (TLV_EEPROM_VALUE_MAX_SIZE - TLV_VENDOR_IANA_SIZE)
+
+/*
+ * Layout of the payload behind one IANA enterprise number: fields one
+ * after another, each taking exactly `length` bytes. A length of 0 is
+ * allowed on the last field only and takes the rest of the payload.
+ */
+struct TLVVendorField {
+	std::string name;
+	tlv_codec_t codec;
+	uint8_t length;
+};
+
+struct TLVVendorSchema {
+	uint32_t iana;
+	std::string name;
+	std::vector<TLVVendorField> fields;
+};
+
+/* One 0xFD record; ONIE allows any number of them */
+struct TLVVendorExt {
+	uint32_t iana;
+	uint8_t data_length;
+	uint8_t data[TLV_VENDOR_DATA_MAX];
+};
+
 class OnieTLVException : public std::exception {
 	std::string error_msg;
 public:
@@ -108,30 +230,82 @@ public:
 };
 
 
+struct TLVRecordView {
+	uint8_t type;
+	std::string_view value;	/* points into the parsed buffer */
+};
+
+/*
+ * Read-only view of a TLV image in memory. The constructor checks the
+ * header, every record length and the CRC in one pass over the bytes
+ * and never reads outside [data, data + size). Records are handed out
+ * as views into the buffer, so the buffer must outlive the view.
+ */
+class OnieTLVView {
+public:
+	class iterator {
+	public:
+		iterator(const uint8_t *pos): m_pos(pos) {}
+		TLVRecordView operator*() const;
+		iterator &operator++();
+		bool operator!=(const iterator &other) const { return m_pos != other.m_pos; }
+	private:
+		const uint8_t *m_pos;
+	};
+
+	OnieTLVView(const uint8_t *data, size_t size);
+
+	bool is_valid() const { return error == nullptr; }
+	const char *get_error() const { return error; }
+	size_t get_size() const { return size; }
+	uint32_t get_crc() const { return crc; }
+	std::optional<std::string_view> find(uint8_t type) const;
+	iterator begin() const;
+	iterator end() const;
+
+private:
+	const uint8_t *data;
+	size_t size;		/* header, records and CRC record */
+	size_t records_end;	/* offset of the CRC record */
+	uint32_t crc;
+	const char *error;	/* static string, nullptr when valid */
+	uint16_t offsets[TLV_CODE_COUNT];	/* last record of each type, 0 if none */
+};
+
 class OnieTLV {
 public:
 	OnieTLV();
 	~OnieTLV();
 
 	std::optional<std::string> get_tlv_record(const tlv_code_t tlv_id);
+	bool has_tlv_record(const tlv_code_t tlv_id);
 	void save_user_tlv(tlv_code_t tlv_id, const std::string& value) noexcept(false);
 	bool generate_eeprom_file(uint8_t eeprom[2048]);
-	bool load_from_eeprom(const uint8_t *eeprom);
+	bool load_from_eeprom(const uint8_t *eeprom, size_t size);
+	bool load_from_eeprom(const OnieTLVView &view);
 	void load_from_yaml(const std::string& filename);
 	size_t get_usage();
 	std::string get_eeprom_address_from_yaml();
+	std::string get_board_name_from_yaml();
+
+	/*
+	 * Vendor extensions in text form are "IANA:payload". The payload is
+	 * "name=value;name=value" when a schema is registered for the IANA
+	 * number, hex digits otherwise.
+	 */
+	void add_vendor_extension(uint32_t iana, const uint8_t *data, size_t length);
+	void add_vendor_extension(const std::string& text);
+	const std::vector<TLVVendorExt>& get_vendor_extensions() const;
+	void clear_vendor_extensions();
+	static std::string format_vendor_extension(const TLVVendorExt& ext);
+
+	static void register_vendor_schema(const TLVVendorSchema& schema);
+	static std::optional<TLVVendorSchema> find_vendor_schema(uint32_t iana);
+	static void load_vendor_schemas(const std::string& filename);
 
-	static constexpr tlv_code_t ALL_TLV_ID[] = {
-			TLV_CODE_PRODUCT_NAME, TLV_CODE_PART_NUMBER, TLV_CODE_SERIAL_NUMBER,
-			TLV_CODE_MAC_BASE, TLV_CODE_MANUF_DATE, TLV_CODE_DEV_VERSION,
-			TLV_CODE_LABEL_REVISION, TLV_CODE_PLATFORM_NAME,
-			TLV_CODE_ONIE_VERSION, TLV_CODE_NUM_MACs, TLV_CODE_MANUF_NAME,
-			TLV_CODE_COUNTRY_CODE, TLV_CODE_VENDOR_NAME, TLV_CODE_DIAG_VERSION,
-			TLV_CODE_SERVICE_TAG, TLV_CODE_VENDOR_EXT
-	};
 private:
-	std::vector<TLVRecord> tlv_records;
-	std::map<std::string, tlv_code_t> yaml_map;
+	std::array<TLVRecord, TLV_CODE_COUNT> tlv_records;
+	std::vector<TLVVendorExt> vendor_exts;
 	uint32_t eeprom_tlv_crc32_generated;
 	uint16_t usage;
 	std::string board_name;
@@ -139,13 +313,8 @@ private:
 	std::string eeprom_address;
 
 	TLVRecord * find_record_or_nullptr(tlv_code_t tlv_id);
-	void update_records(TLVRecord& rec);
-	bool is_eeprom_valid(uint32_t crc32);
-	int parse_number(const std::string& text_number, int min, int max) noexcept(false);
-	void parse_mac_address(const std::string& mac_text, uint8_t *mac_address) noexcept(false);
-	bool validate_mac_address(const std::string&  mac_address) noexcept(false);
-	void validate_date(const std::string& date_value) noexcept(false);
-	void validate_text(const std::string& text, size_t len) noexcept(false);
+	void update_records(uint8_t type, const void *data, size_t length);
+	void clear_records();
 };
 
 #endif //DEVCLIENT_ONIE_TLV_H
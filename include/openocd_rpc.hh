@@ -0,0 +1,125 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_OPENOCD_RPC_HH
+#define DEVCLIENT_OPENOCD_RPC_HH
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include <giomm.h>
+
+#define OPENOCD_RPC_PORT	6666
+
+class MappedFile;
+
+struct FlashSector
+{
+	uint32_t address;
+	uint32_t size;
+};
+
+struct FlashDiffResult
+{
+	size_t skipped;		/* sectors already matching the image */
+	size_t written;		/* sectors erased and programmed */
+	size_t bytes;		/* bytes programmed */
+};
+
+/*
+ * Client for the OpenOCD TCL RPC port. All calls block, so bulk
+ * operations are meant to be run from a worker thread.
+ */
+class OpenOcdRpc
+{
+public:
+	/* Called with bytes done and total after every completed chunk */
+	using Progress = std::function<void(size_t, size_t)>;
+
+	OpenOcdRpc(const std::string &host, uint16_t port);
+	virtual ~OpenOcdRpc();
+
+	std::string command(const std::string &cmd);
+	void halt();
+	void load_image(const std::string &path, uint32_t address,
+	    const Progress &progress = nullptr);
+	void flash_image(const std::string &path, uint32_t address,
+	    bool verify, const Progress &progress = nullptr);
+	void dump_image(const std::string &path, uint32_t address,
+	    uint32_t size, const Progress &progress = nullptr);
+	std::vector<FlashSector> flash_sectors(uint32_t address);
+	FlashDiffResult flash_image_diff(const MappedFile &image,
+	    uint32_t address, const Progress &progress = nullptr);
+	double get_throughput() const { return (m_throughput); }
+
+	static std::string format_rate(double bytes_per_sec);
+
+protected:
+	void send(const std::string &cmd);
+	std::string receive();
+	void pipeline(const std::vector<std::string> &cmds,
+	    const std::function<void(size_t, const std::string &)> &reply,
+	    bool raw = false);
+	void pipeline(size_t count,
+	    const std::function<std::string(size_t)> &cmd,
+	    const std::function<void(size_t, const std::string &)> &reply,
+	    bool raw = false);
+	void finish(size_t bytes, gint64 started);
+
+	Glib::RefPtr<Gio::SocketConnection> m_conn;
+	std::string m_pending;
+	double m_throughput;
+};
+
+/*
+ * One bulk transfer requested from the command line or the JTAG tab.
+ * Specs are FILE@ADDRESS, with :SIZE appended for dumps.
+ */
+struct OpenOcdRpcJob
+{
+	enum Kind
+	{
+		LOAD,
+		FLASH,
+		FLASH_DIFF,
+		DUMP
+	};
+
+	Kind kind;
+	std::string path;
+	uint32_t address;
+	uint32_t size;
+
+	static OpenOcdRpcJob parse(Kind kind, const std::string &spec);
+	std::string run(OpenOcdRpc &rpc,
+	    const OpenOcdRpc::Progress &progress) const;
+	std::string describe() const;
+};
+
+#endif /* DEVCLIENT_OPENOCD_RPC_HH */
@@ -30,31 +30,96 @@
 #define DEVCLIENT_PROFILE_HH
 
 #include "uart.hh"
+#include "gpio_sequence.hh"
 #include <bits/stdint-uintn.h>
 #include <cstdint>
 #include <exception>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 #include <yaml-cpp/node/node.h>
 #include <yaml-cpp/yaml.h>
 
 class ProfileConfigException : public std::exception {
   std::string error_msg;
+  std::vector<std::string> errors;
 
 public:
   ProfileConfigException(const std::string &msg) : std::exception() {
     error_msg = msg;
+    errors.push_back(msg);
+  }
+
+  ProfileConfigException(const std::vector<std::string> &errs) : std::exception() {
+    for (const auto &err: errs)
+      error_msg += (error_msg.empty() ? "" : "\n") + err;
+    errors = errs;
   }
 
   const char *what() const throw() { return "ProfileValueException"; }
 
   std::string get_info() const { return error_msg; }
+  const std::vector<std::string> &get_errors() const { return errors; }
+};
+
+/*
+ * Settings of one profile file, converted and checked once when it is
+ * loaded. The sections compare equal when a service built from them
+ * would not change, which is what a reload goes by.
+ */
+struct ProfileUart {
+  std::string listen_address;
+  std::uint32_t listen_port = 0;
+  std::uint32_t baudrate = 0;
+
+  bool operator==(const ProfileUart &other) const;
+  bool operator!=(const ProfileUart &other) const { return !(*this == other); }
+};
+
+struct ProfileJtag {
+  bool pass_trough = false;
+  std::string listen_address;
+  std::uint32_t gdb_port = 0;
+  std::uint32_t telnet_port = 0;
+  std::uint16_t rpc_port = 0;
+  std::string script_file;
+  std::uint32_t adapter_speed = 0;
+  bool gdb_proxy = false;
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> gdb_proxy_ram;
+
+  bool operator==(const ProfileJtag &other) const;
+  bool operator!=(const ProfileJtag &other) const { return !(*this == other); }
+};
+
+struct ProfileGpio {
+  std::vector<std::string> names;
+  std::vector<GpioSequence> sequences;
+
+  bool operator==(const ProfileGpio &other) const;
+  bool operator!=(const ProfileGpio &other) const { return !(*this == other); }
 };
 
+struct Profile {
+  std::string name;
+  std::string devcable_serial;
+  ProfileUart uart;
+  ProfileJtag jtag;
+  ProfileGpio gpio;
+  std::optional<std::string> eeprom_file;
+};
+
+/*
+ * Loads a profile file. Every problem in it is collected and reported
+ * by a single ProfileConfigException from the constructor, so a bad
+ * profile is refused before any service starts.
+ */
 class ProfileConfig {
 
 public:
   ProfileConfig(const std::string &file_name);
+  const Profile &get_profile() const;
+  std::string get_profile_name();
   std::string get_devcable_serial();
   std::uint32_t get_uart_baudrate();
   std::string get_uart_listen_address();
@@ -63,17 +128,25 @@ public:
   std::uint32_t get_jtag_telnet_port();
   std::string get_jtag_listen_address();
   std::string get_jtag_script_file();
+  std::uint32_t get_jtag_adapter_speed();
+  std::uint16_t get_jtag_rpc_port();
+  bool get_jtag_gdb_proxy();
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> get_jtag_gdb_proxy_ram();
   bool get_jtag_passtrough();
   std::string get_gpio_name(int gpio);
+  std::vector<std::string> get_gpio_sequence_names();
+  GpioSequence get_gpio_sequence(const std::string &name);
   std::string get_eeprom_file();
 
 private:
-   YAML::Node uart;
-   YAML::Node jtag;
-   YAML::Node gpio;
-   YAML::Node eeprom;
-   std::string devcable_serial;
-   std::vector<std::string> gpio_names;
+   void parse_uart(const YAML::Node &node, std::vector<std::string> &errors);
+   void parse_jtag(const YAML::Node &node, std::vector<std::string> &errors);
+   void parse_gpio(const YAML::Node &names, const YAML::Node &sequences,
+       std::vector<std::string> &errors);
+   void parse_gpio_sequence(const std::string &name, const YAML::Node &steps,
+       std::vector<std::string> &errors);
+
+   Profile profile;
 };
 
 #endif /* DEVCLIENT_PROFILE_HH */
@@ -0,0 +1,70 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_PROFILE_WATCHER_HH
+#define DEVCLIENT_PROFILE_WATCHER_HH
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <glibmm.h>
+
+#define PROFILE_WATCHER_SETTLE_MS	200
+
+/*
+ * Reports profile files that were written, through inotify on their
+ * directories so that editors saving by renaming a new file over the
+ * old one are noticed as well. Bursts of events for one file are
+ * folded into a single report once it has been quiet for a while.
+ * Runs on the main context of the thread that created it.
+ */
+class ProfileWatcher
+{
+public:
+	using SlotChanged = std::function<void(const std::string &path)>;
+
+	ProfileWatcher(const SlotChanged &changed);
+	virtual ~ProfileWatcher();
+
+	void add(const std::string &path);
+
+protected:
+	bool readable(Glib::IOCondition condition);
+	bool settled();
+
+	int m_fd;
+	std::map<int, std::string> m_dirs;
+	std::set<std::string> m_files;
+	std::set<std::string> m_pending;
+	sigc::connection m_io;
+	sigc::connection m_timer;
+	SlotChanged m_changed;
+};
+
+#endif /* DEVCLIENT_PROFILE_WATCHER_HH */
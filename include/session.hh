@@ -0,0 +1,104 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_SESSION_HH
+#define DEVCLIENT_SESSION_HH
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ftdi.hpp>
+#include <device.hh>
+#include <gpio.hh>
+#include <i2c.hh>
+#include <onie_tlv.hh>
+#include <gpio_sequence.hh>
+#include <ledger.hh>
+
+#define SESSION_I2C_CLOCK	300000
+#define SESSION_EEPROM_ADDRESS	"0x50"
+#define SESSION_UART_BAUDRATE	115200
+#define SESSION_EXPECT_TIMEOUT	5000
+
+/*
+ * One cable with its channels opened on first use and kept open, so a
+ * long series of operations pays for USB setup only once. Not thread
+ * safe, callers serialize access.
+ */
+class Session
+{
+public:
+	Session(const Device &device);
+	Session(const Device &device, std::shared_ptr<Gpio> gpio);
+	virtual ~Session();
+
+	const Device &get_device() const { return (m_device); }
+	void set_ledger(std::shared_ptr<Ledger> ledger) { m_ledger = ledger; }
+
+	uint8_t gpio_get();
+	uint8_t gpio_get_output();
+	uint8_t gpio_get_direction();
+	void gpio_set(uint8_t mask, uint8_t value);
+	void gpio_direction(uint8_t mask, uint8_t outputs);
+	void gpio_pulse(uint8_t mask, uint8_t value, uint32_t width_us);
+	void gpio_play(const GpioSequence &sequence);
+
+	std::vector<uint8_t> eeprom_read(const std::string &address,
+	    uint16_t offset, size_t length);
+	void eeprom_write(const std::string &address, uint16_t offset,
+	    const std::vector<uint8_t> &data);
+	std::map<tlv_code_t, std::vector<std::string>> tlv_read(
+	    const std::string &address);
+	void tlv_write(const std::string &yaml_file, bool verify = false);
+	void tlv_write(const std::string &address,
+	    const std::map<tlv_code_t, std::vector<std::string>> &fields);
+
+	void reset();
+	void bypass();
+
+	void uart_open(unsigned int baudrate);
+	void uart_send(const std::string &data);
+	std::string uart_expect(const std::string &pattern,
+	    unsigned int timeout_ms);
+
+protected:
+	Gpio &gpio();
+	I2C &i2c();
+	Ftdi::Context &uart();
+	void check_eeprom_address(const std::string &address);
+
+	Device m_device;
+	std::shared_ptr<Gpio> m_gpio;
+	std::unique_ptr<I2C> m_i2c;
+	std::unique_ptr<Ftdi::Context> m_uart;
+	std::string m_uart_pending;
+	std::shared_ptr<Ledger> m_ledger;
+};
+
+#endif /* DEVCLIENT_SESSION_HH */
@@ -0,0 +1,70 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef DEVCLIENT_SESSION_SCRIPT_HH
+#define DEVCLIENT_SESSION_SCRIPT_HH
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+#include <session.hh>
+
+struct SessionScriptStep
+{
+	std::string description;
+	bool keep_going;	/* a failure does not abort the script */
+	std::function<void(Session &)> action;
+};
+
+/*
+ * A YAML list of operations run one after another on a single Session,
+ * so the channels opened by the first step serve all later ones.
+ * Steps are checked when the file is loaded, before the cable is
+ * touched.
+ */
+class SessionScript
+{
+public:
+	SessionScript(const std::string &file);
+
+	const std::string &get_serial() const;
+	const std::vector<SessionScriptStep> &get_steps() const;
+	bool run(Session &session) const;
+
+protected:
+	SessionScriptStep parse_step(const YAML::Node &node);
+	std::string resolve(const std::string &path) const;
+
+	std::string m_file;
+	std::string m_serial;
+	std::string m_profile;
+	std::vector<SessionScriptStep> m_steps;
+};
+
+#endif /* DEVCLIENT_SESSION_SCRIPT_HH */
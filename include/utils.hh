@@ -110,5 +110,6 @@ void hex_dump(
 }
 
 std::string executable_dir();
+uint16_t free_tcp_port(const std::string &host);
 
 #endif //DEVCLIENT_UTILS_HH
@@ -1,5 +1,6 @@
 #include <application.hh>
 #include <mainwindow.hh>
+#include <jtag.hh>
 
 Devclient::Application *Devclient::Application::m_instance = nullptr;
 
@@ -23,7 +24,11 @@ Devclient::Application::~Application()
 
 int Devclient::Application::run()
 {
-	return m_app->run(*m_window);
+	int ret;
+
+	ret = m_app->run(*m_window);
+	JtagSupervisor::instance()->shutdown();
+	return ret;
 }
 
 void Devclient::Application::close()
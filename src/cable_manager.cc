@@ -0,0 +1,662 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <algorithm>
+#include <fmt/format.h>
+#include <cable_manager.hh>
+#include <jtag_probe.hh>
+#include <filesystem.hh>
+#include <utils.hh>
+#include <log.hh>
+
+Cable::Cable(const std::string &profile_path):
+    m_profile(profile_path),
+    m_path(profile_path),
+    m_done(false),
+    m_state(ABSENT),
+    m_jtag_state(JtagServer::STOPPED)
+{
+	m_serial = m_profile.get_devcable_serial();
+}
+
+Cable::~Cable()
+{
+	detach();
+}
+
+const char *
+Cable::state_name(State state)
+{
+	switch (state) {
+	case ABSENT:
+		return ("Absent");
+	case STARTING:
+		return ("Starting");
+	case RUNNING:
+		return ("Running");
+	case FAILED:
+		return ("Failed");
+	case STOPPING:
+		return ("Stopping");
+	}
+
+	return ("Unknown");
+}
+
+/*
+ * A cable plugged back in before its previous worker was reaped is
+ * started once reap() has joined that worker.
+ */
+void
+Cable::attach(const Device &device)
+{
+	if (m_thread.joinable()) {
+		if (get_state() == STOPPING)
+			m_pending_device = device;
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		m_device = device;
+	}
+
+	m_context = Glib::MainContext::create();
+	m_loop = Glib::MainLoop::create(m_context);
+	m_done = false;
+	set_state(STARTING);
+	m_thread = std::thread(&Cable::worker, this);
+}
+
+/*
+ * The quit request is queued on the cable's own context, so it takes
+ * effect even if the loop has not started running yet.
+ */
+void
+Cable::quit()
+{
+	m_context->invoke([this]() {
+		m_loop->quit();
+		return (false);
+	});
+}
+
+/* Blocks until the worker is gone, for shutdown */
+void
+Cable::detach()
+{
+	m_pending_device.reset();
+	if (!m_thread.joinable())
+		return;
+
+	quit();
+	m_thread.join();
+	joined();
+}
+
+/* Asks the worker to stop without waiting for it, see reap() */
+void
+Cable::release()
+{
+	m_pending_device.reset();
+	if (!m_thread.joinable() || get_state() == STOPPING)
+		return;
+
+	set_state(STOPPING);
+	quit();
+}
+
+/*
+ * Joins a released worker that has finished, then applies what arrived
+ * while it was stopping. Returns false while it is still winding down.
+ */
+bool
+Cable::reap()
+{
+	std::optional<Device> device;
+
+	if (!m_thread.joinable() || get_state() != STOPPING)
+		return (true);
+
+	if (!m_done)
+		return (false);
+
+	m_thread.join();
+	joined();
+
+	device.swap(m_pending_device);
+	if (device.has_value())
+		attach(device.value());
+
+	return (true);
+}
+
+void
+Cable::joined()
+{
+	m_loop.reset();
+	m_context.reset();
+	set_state(ABSENT);
+
+	if (m_pending_profile) {
+		m_profile = *m_pending_profile;
+		m_pending_profile.reset();
+		Logger::info("{}: profile {} reloaded", m_serial, m_path);
+	}
+}
+
+Cable::State
+Cable::get_state() const
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	return (m_state);
+}
+
+JtagServer::State
+Cable::get_jtag_state() const
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	return (m_jtag_state);
+}
+
+std::string
+Cable::get_error() const
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	return (m_error);
+}
+
+Device
+Cable::get_device() const
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	return (m_device);
+}
+
+std::shared_ptr<Gpio>
+Cable::get_gpio() const
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	return (m_gpio);
+}
+
+/* A released cable stays STOPPING until reap(), whatever its worker says */
+void
+Cable::set_state(State state, const std::string &error)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	if (m_state == STOPPING && state != ABSENT)
+		return;
+
+	m_state = state;
+	m_error = error;
+}
+
+/*
+ * The profile is handed over to the worker, which swaps it in between
+ * events. A new cable serial means a different cable, which is left
+ * for a restart to pick up.
+ */
+void
+Cable::reload(const ProfileConfig &profile)
+{
+	const std::string &serial = profile.get_profile().devcable_serial;
+	std::shared_ptr<ProfileConfig> next;
+
+	if (serial != m_serial) {
+		Logger::warning("{}: {} now names cable {}, restart to apply",
+		    m_serial, m_path, serial);
+		return;
+	}
+
+	if (!m_thread.joinable()) {
+		m_profile = profile;
+		Logger::info("{}: profile {} reloaded", m_serial, m_path);
+		return;
+	}
+
+	/* The stopping worker may still read m_profile */
+	if (get_state() == STOPPING) {
+		m_pending_profile.reset(new ProfileConfig(profile));
+		return;
+	}
+
+	next = std::make_shared<ProfileConfig>(profile);
+	m_context->invoke([this, next]() {
+		apply_profile(*next);
+		return (false);
+	});
+}
+
+/* Runs on the worker; a failed start leaves the cable in FAILED */
+bool
+Cable::try_start(const std::function<void()> &start)
+{
+	try {
+		start();
+		set_state(RUNNING);
+		return (true);
+	} catch (const ProfileConfigException &err) {
+		Logger::error("{}: {}", m_serial, err.get_info());
+		set_state(FAILED, err.get_info());
+	} catch (const std::exception &err) {
+		Logger::error("{}: {}", m_serial, err.what());
+		set_state(FAILED, err.what());
+	} catch (const Glib::Error &err) {
+		Logger::error("{}: {}", m_serial, err.what());
+		set_state(FAILED, err.what());
+	}
+
+	return (false);
+}
+
+void
+Cable::worker()
+{
+	m_context->push_thread_default();
+
+	if (try_start([this]() { start_services(); }))
+		Logger::info("{}: serving with profile {}", m_serial, m_path);
+
+	/* A failed cable idles here until it is unplugged or fixed */
+	m_loop->run();
+	stop_services();
+	m_context->pop_thread_default();
+	m_done = true;
+}
+
+/*
+ * Only the services whose section changed are restarted, so an edit
+ * to the JTAG settings does not drop the UART console. GPIO names and
+ * sequences are looked up from the profile when used.
+ */
+void
+Cable::apply_profile(const ProfileConfig &profile)
+{
+	const Profile &prev = m_profile.get_profile();
+	const Profile &next = profile.get_profile();
+	bool uart = prev.uart != next.uart;
+	bool jtag = prev.jtag != next.jtag;
+	bool gpio = prev.gpio != next.gpio;
+
+	if (get_state() == FAILED) {
+		m_profile = profile;
+		stop_services();
+		if (try_start([this]() { start_services(); }))
+			Logger::info("{}: serving with reloaded profile {}",
+			    m_serial, m_path);
+		return;
+	}
+
+	if (!uart && !jtag && !gpio) {
+		Logger::debug("{}: {} has no changes", m_serial, m_path);
+		return;
+	}
+
+	if (uart)
+		m_uart.reset();
+
+	if (jtag)
+		stop_jtag();
+
+	m_profile = profile;
+
+	if ((uart || jtag) && try_start([this, uart, jtag]() {
+		if (uart)
+			start_uart();
+		if (jtag)
+			start_jtag();
+	}))
+		Logger::info("{}: restarted{}{}", m_serial,
+		    uart ? " UART" : "", jtag ? " JTAG" : "");
+
+	if (gpio)
+		Logger::info("{}: GPIO names and sequences updated", m_serial);
+}
+
+void
+Cable::start_services()
+{
+	std::shared_ptr<Gpio> gpio;
+
+	start_uart();
+
+	gpio = std::make_shared<Gpio>(m_device);
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		m_gpio = gpio;
+	}
+
+	start_jtag();
+}
+
+void
+Cable::start_uart()
+{
+	m_uart.reset(new Uart(m_device, Gio::InetSocketAddress::create(
+	    Gio::InetAddress::create(m_profile.get_uart_listen_address()),
+	    m_profile.get_uart_port()), m_profile.get_uart_baudrate()));
+	m_uart->start();
+}
+
+void
+Cable::start_jtag()
+{
+	JtagServerConfig config;
+
+	if (m_profile.get_jtag_passtrough()) {
+		Logger::info("{}: JTAG pass-through, not starting OpenOCD",
+		    m_serial);
+		return;
+	}
+
+	config.address = Gio::InetAddress::create(
+	    m_profile.get_jtag_listen_address());
+	config.gdb_port = m_profile.get_jtag_gdb_port();
+	config.ocd_port = m_profile.get_jtag_telnet_port();
+	config.board_script = m_profile.get_jtag_script_file();
+	config.adapter_speed = m_profile.get_jtag_adapter_speed();
+	config.rpc_port = m_profile.get_jtag_rpc_port();
+	config.gdb_proxy = m_profile.get_jtag_gdb_proxy();
+	config.gdb_proxy_ram = m_profile.get_jtag_gdb_proxy_ram();
+
+	if (config.board_script.empty() || config.board_script == "auto")
+		config.board_script = JtagProbe::detect_script(m_device,
+		    fmt::format("{}/scripts", executable_dir()));
+
+	if (config.adapter_speed == JTAG_SPEED_AUTO)
+		config.adapter_speed = JtagSpeedCache::resolve(m_device,
+		    m_profile.get_profile_name());
+
+	m_jtag.reset(new JtagServer(m_device, config));
+	m_jtag->on_state_changed.connect([this](JtagServer::State state) {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		m_jtag_state = state;
+	});
+	m_jtag->set_auto_restart(true);
+	m_jtag->start();
+}
+
+/* Runs on the worker, the services' sources belong to its context */
+void
+Cable::stop_services()
+{
+	stop_jtag();
+	m_uart.reset();
+
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	m_gpio.reset();
+}
+
+void
+Cable::stop_jtag()
+{
+	m_jtag.reset();
+
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	m_jtag_state = JtagServer::STOPPED;
+}
+
+CableManager::CableManager(const std::vector<std::string> &profiles):
+    m_subscription(0)
+{
+	std::error_code err;
+
+	for (const auto &path: profiles) {
+		if (!filesystem::is_directory(path, err)) {
+			add_profile(path);
+			continue;
+		}
+
+		for (const auto &entry: filesystem::directory_iterator(path, err)) {
+			if (entry.path().extension() == ".yml" ||
+			    entry.path().extension() == ".yaml")
+				add_profile(entry.path().string());
+		}
+	}
+
+	if (m_cables.empty())
+		throw std::runtime_error("No cable profiles to serve");
+
+	m_watcher.reset(new ProfileWatcher([this](const std::string &path) {
+		profile_changed(path);
+	}));
+
+	for (const auto &i: m_cables)
+		m_watcher->add(i.second->get_profile_path());
+
+	m_events_ready.connect(sigc::mem_fun(*this,
+	    &CableManager::process_events));
+}
+
+CableManager::~CableManager()
+{
+	stop();
+}
+
+void
+CableManager::add_profile(const std::string &path)
+{
+	std::unique_ptr<Cable> cable;
+
+	try {
+		cable.reset(new Cable(path));
+	} catch (const ProfileConfigException &err) {
+		throw std::runtime_error(fmt::format("{}: {}", path,
+		    err.get_info()));
+	}
+
+	if (m_cables.count(cable->get_serial())) {
+		throw std::runtime_error(fmt::format(
+		    "{}: cable {} already has profile {}", path,
+		    cable->get_serial(),
+		    m_cables[cable->get_serial()]->get_profile_path()));
+	}
+
+	m_cables[cable->get_serial()] = std::move(cable);
+}
+
+void
+CableManager::start()
+{
+	m_subscription = DeviceEnumerator::subscribe(
+	    [this](const DeviceEvent &event) {
+		on_device_event(event);
+	});
+
+	for (const auto &device: DeviceEnumerator::enumerate()) {
+		if (Cable *cable = find(device.serial))
+			cable->attach(device);
+	}
+
+	for (const auto &i: m_cables) {
+		if (i.second->get_state() == Cable::ABSENT)
+			Logger::info("{}: waiting for the cable", i.first);
+	}
+}
+
+void
+CableManager::stop()
+{
+	if (m_subscription != 0) {
+		DeviceEnumerator::unsubscribe(m_subscription);
+		m_subscription = 0;
+	}
+
+	m_reaper.disconnect();
+
+	for (const auto &i: m_cables)
+		i.second->detach();
+}
+
+Cable *
+CableManager::find(const std::string &serial) const
+{
+	auto it = m_cables.find(serial);
+
+	return (it == m_cables.end() ? nullptr : it->second.get());
+}
+
+std::vector<Cable *>
+CableManager::get_cables() const
+{
+	std::vector<Cable *> result;
+
+	for (const auto &i: m_cables)
+		result.push_back(i.second.get());
+
+	return (result);
+}
+
+void
+CableManager::print_status() const
+{
+	fmt::print("{:<14} {:<10} {:<11} {}\n", "Serial", "State", "JTAG",
+	    "Profile");
+
+	for (const auto &i: m_cables) {
+		const Cable *cable = i.second.get();
+
+		fmt::print("{:<14} {:<10} {:<11} {}\n", cable->get_serial(),
+		    Cable::state_name(cable->get_state()),
+		    JtagServer::state_name(cable->get_jtag_state()),
+		    cable->get_state() == Cable::FAILED
+		    ? cable->get_error() : cable->get_profile_path());
+	}
+
+	fflush(stdout);
+}
+
+/* Called on the enumerator thread */
+void
+CableManager::on_device_event(const DeviceEvent &event)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_events_lock);
+
+		m_events.push_back(event);
+	}
+
+	m_events_ready.emit();
+}
+
+void
+CableManager::process_events()
+{
+	std::vector<DeviceEvent> events;
+	bool released = false;
+
+	{
+		std::lock_guard<std::mutex> guard(m_events_lock);
+
+		events.swap(m_events);
+	}
+
+	for (const auto &event: events) {
+		Cable *cable = find(event.device.serial);
+
+		if (cable == nullptr) {
+			Logger::debug("Ignoring cable {} without a profile",
+			    event.device.serial);
+			continue;
+		}
+
+		if (event.arrived) {
+			Logger::info("{}: connected, starting services",
+			    event.device.serial);
+			cable->attach(event.device);
+		} else {
+			Logger::info("{}: removed, stopping services",
+			    event.device.serial);
+			cable->release();
+			released = true;
+		}
+	}
+
+	if (released && !m_reaper.connected()) {
+		m_reaper = Glib::signal_timeout().connect(sigc::mem_fun(*this,
+		    &CableManager::reap), CABLE_REAP_INTERVAL);
+	}
+}
+
+/*
+ * Released cables are joined here rather than in process_events(), so
+ * a worker stuck in USB I/O does not hold up hotplug handling and
+ * profile reloads for the other cables.
+ */
+bool
+CableManager::reap()
+{
+	bool busy = false;
+
+	for (const auto &i: m_cables) {
+		if (!i.second->reap())
+			busy = true;
+	}
+
+	return (busy);
+}
+
+/*
+ * A profile that no longer validates is reported in full and the
+ * cable keeps running with the one it has.
+ */
+void
+CableManager::profile_changed(const std::string &path)
+{
+	std::error_code err;
+
+	for (const auto &i: m_cables) {
+		Cable *cable = i.second.get();
+
+		if (!filesystem::equivalent(cable->get_profile_path(), path, err))
+			continue;
+
+		try {
+			cable->reload(ProfileConfig(path));
+		} catch (const ProfileConfigException &e) {
+			Logger::error("{}: {} is invalid, keeping the running "
+			    "profile", i.first, path);
+			for (const auto &msg: e.get_errors())
+				Logger::error("{}: {}", i.first, msg);
+		}
+
+		return;
+	}
+}
@@ -0,0 +1,677 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <map>
+#include <set>
+#include <regex>
+#include <climits>
+#include <cstdint>
+#include <optional>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fmt/format.h>
+#include <control.hh>
+#include <cable_manager.hh>
+#include <log.hh>
+
+#define JSONRPC_PARSE_ERROR	-32700
+#define JSONRPC_INVALID_REQUEST	-32600
+#define JSONRPC_NO_METHOD	-32601
+#define JSONRPC_INVALID_PARAMS	-32602
+#define JSONRPC_FAILED		-32000
+
+class ControlError: public std::runtime_error
+{
+public:
+	ControlError(int code, const std::string &msg):
+	    std::runtime_error(msg),
+	    m_code(code)
+	{
+	}
+
+	int get_code() const { return (m_code); }
+
+protected:
+	int m_code;
+};
+
+std::string
+json_quote(const std::string &value)
+{
+	std::string result = "\"";
+
+	for (unsigned char c: value) {
+		switch (c) {
+		case '"':
+			result += "\\\"";
+			break;
+		case '\\':
+			result += "\\\\";
+			break;
+		case '\n':
+			result += "\\n";
+			break;
+		case '\r':
+			result += "\\r";
+			break;
+		case '\t':
+			result += "\\t";
+			break;
+		default:
+			if (c < 0x20)
+				result += fmt::format("\\u{:04x}", c);
+			else
+				result += c;
+		}
+	}
+
+	return (result + "\"");
+}
+
+/*
+ * Quoted scalars carry the "!" tag after parsing, so strings that look
+ * like numbers keep their quotes.
+ */
+std::string
+json_emit(const YAML::Node &node)
+{
+	static const std::regex number("-?(0|[1-9][0-9]*)(\\.[0-9]+)?([eE][-+]?[0-9]+)?");
+	std::string result;
+	bool first = true;
+
+	switch (node.Type()) {
+	case YAML::NodeType::Undefined:
+	case YAML::NodeType::Null:
+		return ("null");
+	case YAML::NodeType::Scalar:
+		if (node.Tag() != "!" && (std::regex_match(node.Scalar(), number) ||
+		    node.Scalar() == "true" || node.Scalar() == "false"))
+			return (node.Scalar());
+
+		return (json_quote(node.Scalar()));
+	case YAML::NodeType::Sequence:
+		for (const auto &i: node) {
+			result += first ? "" : ", ";
+			result += json_emit(i);
+			first = false;
+		}
+
+		return ("[" + result + "]");
+	case YAML::NodeType::Map:
+		for (const auto &i: node) {
+			result += first ? "" : ", ";
+			result += json_quote(i.first.Scalar()) + ": " +
+			    json_emit(i.second);
+			first = false;
+		}
+
+		return ("{" + result + "}");
+	}
+
+	return ("null");
+}
+
+/* max is the largest value the parameter's target type can hold */
+static unsigned long
+param_uint(const YAML::Node &params, const std::string &key,
+    unsigned long max, std::optional<unsigned long> def = std::nullopt)
+{
+	unsigned long value;
+
+	if (!params[key]) {
+		if (def.has_value())
+			return (def.value());
+
+		throw ControlError(JSONRPC_INVALID_PARAMS,
+		    fmt::format("Missing parameter '{}'", key));
+	}
+
+	try {
+		value = std::stoul(params[key].Scalar(), nullptr, 0);
+	} catch (const std::logic_error &) {
+		throw ControlError(JSONRPC_INVALID_PARAMS,
+		    fmt::format("Parameter '{}' must be a number", key));
+	}
+
+	if (value > max)
+		throw ControlError(JSONRPC_INVALID_PARAMS,
+		    fmt::format("Parameter '{}' must be at most {:#x}", key, max));
+
+	return (value);
+}
+
+static std::string
+param_string(const YAML::Node &params, const std::string &key,
+    std::optional<std::string> def = std::nullopt)
+{
+	if (!params[key] || !params[key].IsScalar()) {
+		if (def.has_value())
+			return (def.value());
+
+		throw ControlError(JSONRPC_INVALID_PARAMS,
+		    fmt::format("Missing parameter '{}'", key));
+	}
+
+	return (params[key].Scalar());
+}
+
+static std::string
+to_hex(const std::vector<uint8_t> &data)
+{
+	std::string result;
+
+	for (uint8_t byte: data)
+		result += fmt::format("{:02x}", byte);
+
+	return (result);
+}
+
+static std::vector<uint8_t>
+from_hex(const std::string &hex)
+{
+	std::vector<uint8_t> result;
+
+	if (hex.size() % 2 != 0)
+		throw ControlError(JSONRPC_INVALID_PARAMS, "Odd length hex data");
+
+	for (size_t i = 0; i < hex.size(); i += 2) {
+		try {
+			result.push_back(std::stoul(hex.substr(i, 2), nullptr, 16));
+		} catch (const std::logic_error &) {
+			throw ControlError(JSONRPC_INVALID_PARAMS,
+			    "Invalid hex data");
+		}
+	}
+
+	return (result);
+}
+
+/*
+ * Removes a socket left behind by a run that did not clean up. Only a
+ * socket nobody accepts connections on counts as stale; a live one or
+ * any other kind of file is left alone and reported.
+ */
+static void
+remove_stale_socket(const std::string &path)
+{
+	struct sockaddr_un addr = {};
+	struct stat st;
+	int saved;
+	int fd;
+	int ret;
+
+	if (lstat(path.c_str(), &st) != 0)
+		return;
+
+	if (!S_ISSOCK(st.st_mode))
+		throw std::runtime_error(fmt::format(
+		    "{} exists and is not a socket", path));
+
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error(fmt::format("{} is too long", path));
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size());
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw std::runtime_error(fmt::format("Cannot check {}: {}", path,
+		    strerror(errno)));
+
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	saved = errno;
+	close(fd);
+
+	if (ret == 0)
+		throw std::runtime_error(fmt::format(
+		    "{} is in use by another instance", path));
+
+	if (saved != ECONNREFUSED)
+		throw std::runtime_error(fmt::format("Cannot check {}: {}", path,
+		    strerror(saved)));
+
+	unlink(path.c_str());
+}
+
+ControlServer::ControlServer(std::shared_ptr<Session> session,
+    const std::string &path):
+    m_session(session),
+    m_manager(nullptr),
+    m_path(path),
+    m_running(false)
+{
+}
+
+ControlServer::ControlServer(CableManager *manager, const std::string &path):
+    m_manager(manager),
+    m_path(path),
+    m_running(false)
+{
+}
+
+ControlServer::~ControlServer()
+{
+	stop();
+}
+
+std::string
+ControlServer::default_path()
+{
+	return (fmt::format("{}/{}", Glib::get_user_runtime_dir(),
+	    CONTROL_SOCKET_NAME));
+}
+
+void
+ControlServer::start()
+{
+	Glib::RefPtr<Gio::SocketAddress> retaddr;
+
+	if (m_running)
+		return;
+
+	/* A socket left behind by a previous run would make bind fail */
+	remove_stale_socket(m_path);
+
+	try {
+		m_service = Gio::ThreadedSocketService::create(10);
+		m_service->add_address(Gio::UnixSocketAddress::create(m_path),
+		    Gio::SocketType::SOCKET_TYPE_STREAM,
+		    Gio::SocketProtocol::SOCKET_PROTOCOL_DEFAULT, retaddr);
+	} catch (const Glib::Error &err) {
+		throw std::runtime_error(fmt::format("Cannot listen on {}: {}",
+		    m_path, err.what()));
+	}
+
+	m_service->signal_run().connect(sigc::mem_fun(*this,
+	    &ControlServer::client_worker));
+	m_service->start();
+	m_running = true;
+
+	if (m_manager)
+		Logger::info("Control: serving all cables on {}", m_path);
+	else
+		Logger::info("Control: serving {} on {}",
+		    m_session->get_device().serial, m_path);
+}
+
+void
+ControlServer::stop()
+{
+	if (!m_running)
+		return;
+
+	m_running = false;
+	m_service->stop();
+	m_service->close();
+	unlink(m_path.c_str());
+}
+
+bool
+ControlServer::client_worker(const Glib::RefPtr<Gio::SocketConnection> &conn,
+    const Glib::RefPtr<Glib::Object> &source)
+{
+	Glib::RefPtr<Gio::DataInputStream> input =
+	    Gio::DataInputStream::create(conn->get_input_stream());
+	std::string line;
+	std::string response;
+	gsize written;
+
+	Logger::debug("Control: client connected");
+
+	try {
+		while (input->read_line(line)) {
+			if (line.empty())
+				continue;
+
+			response = handle(line) + "\n";
+			conn->get_output_stream()->write_all(response, written);
+		}
+	} catch (const Glib::Error &err) {
+		Logger::warning("Control: connection failed: {}", err.what());
+	}
+
+	Logger::debug("Control: client disconnected");
+	return (false);
+}
+
+std::string
+ControlServer::handle(const std::string &request)
+{
+	std::string id = "null";
+	YAML::Node node;
+
+	try {
+		try {
+			node = YAML::Load(request);
+		} catch (const YAML::Exception &err) {
+			throw ControlError(JSONRPC_PARSE_ERROR, err.what());
+		}
+
+		if (!node.IsMap() || !node["method"] || !node["method"].IsScalar())
+			throw ControlError(JSONRPC_INVALID_REQUEST,
+			    "Request must be an object with a method");
+
+		if (node["id"])
+			id = json_emit(node["id"]);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		std::string result = dispatch(node["method"].Scalar(),
+		    node["params"] ? node["params"] : YAML::Node(YAML::NodeType::Map));
+
+		return (fmt::format("{{\"jsonrpc\": \"2.0\", \"id\": {}, \"result\": {}}}",
+		    id, result));
+	} catch (const ControlError &err) {
+		return (fmt::format("{{\"jsonrpc\": \"2.0\", \"id\": {}, "
+		    "\"error\": {{\"code\": {}, \"message\": {}}}}}", id,
+		    err.get_code(), json_quote(err.what())));
+	} catch (const std::exception &err) {
+		return (fmt::format("{{\"jsonrpc\": \"2.0\", \"id\": {}, "
+		    "\"error\": {{\"code\": {}, \"message\": {}}}}}", id,
+		    JSONRPC_FAILED, json_quote(err.what())));
+	}
+}
+
+std::string
+ControlServer::dispatch(const std::string &method, const YAML::Node &params)
+{
+	if (m_manager)
+		return (dispatch_cable(method, params));
+
+	return (dispatch_session(*m_session, method, params));
+}
+
+static std::string
+cable_status(const Cable *cable)
+{
+	return (fmt::format("{{\"serial\": {}, \"state\": {}, \"jtag\": {}, "
+	    "\"profile\": {}, \"error\": {}}}", json_quote(cable->get_serial()),
+	    json_quote(Cable::state_name(cable->get_state())),
+	    json_quote(JtagServer::state_name(cable->get_jtag_state())),
+	    json_quote(cable->get_profile_path()),
+	    json_quote(cable->get_error())));
+}
+
+Cable *
+ControlServer::find_cable(const YAML::Node &params)
+{
+	std::string serial = param_string(params, "serial");
+	Cable *cable = m_manager->find(serial);
+
+	if (!cable)
+		throw ControlError(JSONRPC_INVALID_PARAMS,
+		    fmt::format("No profile for cable {}", serial));
+
+	return (cable);
+}
+
+/*
+ * The GPIO channel is shared with the cable's own services. EEPROM
+ * access opens the I2C channel for the one request, so nothing stays
+ * claimed once the cable is unplugged.
+ */
+std::string
+ControlServer::dispatch_cable(const std::string &method,
+    const YAML::Node &params)
+{
+	static const std::set<std::string> cable_methods = {
+		"gpio.get", "gpio.set", "gpio.direction", "gpio.pulse",
+		"eeprom.read", "eeprom.write", "tlv.read", "tlv.write"
+	};
+	std::shared_ptr<Gpio> gpio;
+	std::string result;
+	Cable *cable;
+
+	if (method == "cable.list") {
+		for (const Cable *i: m_manager->get_cables()) {
+			result += result.empty() ? "" : ", ";
+			result += cable_status(i);
+		}
+
+		return ("[" + result + "]");
+	}
+
+	if (method == "cable.status")
+		return (cable_status(find_cable(params)));
+
+	if (cable_methods.count(method) == 0)
+		throw ControlError(JSONRPC_NO_METHOD,
+		    fmt::format("Unknown method {}", method));
+
+	cable = find_cable(params);
+	gpio = cable->get_gpio();
+	if (cable->get_state() != Cable::RUNNING || !gpio)
+		throw ControlError(JSONRPC_FAILED, fmt::format("Cable {} is {}",
+		    cable->get_serial(), Cable::state_name(cable->get_state())));
+
+	Session session(cable->get_device(), gpio);
+
+	return (dispatch_session(session, method, params));
+}
+
+std::string
+ControlServer::dispatch_session(Session &session, const std::string &method,
+    const YAML::Node &params)
+{
+	if (method == "gpio.get") {
+		return (fmt::format("{{\"value\": {}, \"output\": {}, \"direction\": {}}}",
+		    session.gpio_get(), session.gpio_get_output(),
+		    session.gpio_get_direction()));
+	}
+
+	if (method == "gpio.set") {
+		session.gpio_set(param_uint(params, "mask", UINT8_MAX, 0xff),
+		    param_uint(params, "value", UINT8_MAX));
+		return ("true");
+	}
+
+	if (method == "gpio.direction") {
+		session.gpio_direction(
+		    param_uint(params, "mask", UINT8_MAX, 0xff),
+		    param_uint(params, "outputs", UINT8_MAX));
+		return ("true");
+	}
+
+	if (method == "gpio.pulse") {
+		session.gpio_pulse(param_uint(params, "mask", UINT8_MAX),
+		    param_uint(params, "value", UINT8_MAX),
+		    param_uint(params, "width_us", UINT32_MAX));
+		return ("true");
+	}
+
+	if (method == "eeprom.read") {
+		return (json_quote(to_hex(session.eeprom_read(
+		    param_string(params, "address", SESSION_EEPROM_ADDRESS),
+		    param_uint(params, "offset", UINT16_MAX, 0),
+		    param_uint(params, "length", UINT16_MAX + 1)))));
+	}
+
+	if (method == "eeprom.write") {
+		session.eeprom_write(
+		    param_string(params, "address", SESSION_EEPROM_ADDRESS),
+		    param_uint(params, "offset", UINT16_MAX, 0),
+		    from_hex(param_string(params, "data")));
+		return ("true");
+	}
+
+	/* Vendor extensions (0xfd) may repeat and come as an array */
+	if (method == "tlv.read") {
+		std::string result;
+
+		for (const auto &field: session.tlv_read(param_string(params,
+		    "address", SESSION_EEPROM_ADDRESS))) {
+			std::string values;
+
+			for (const auto &value: field.second) {
+				values += values.empty() ? "" : ", ";
+				values += json_quote(value);
+			}
+
+			if (field.first == TLV_CODE_VENDOR_EXT)
+				values = "[" + values + "]";
+
+			result += result.empty() ? "" : ", ";
+			result += fmt::format("\"{:#04x}\": {}", field.first,
+			    values);
+		}
+
+		return ("{" + result + "}");
+	}
+
+	if (method == "tlv.write") {
+		std::map<tlv_code_t, std::vector<std::string>> fields;
+
+		if (params["file"]) {
+			session.tlv_write(param_string(params, "file"));
+			return ("true");
+		}
+
+		if (!params["fields"] || !params["fields"].IsMap())
+			throw ControlError(JSONRPC_INVALID_PARAMS,
+			    "tlv.write needs 'file' or 'fields'");
+
+		for (const auto &field: params["fields"]) {
+			unsigned long code;
+
+			try {
+				code = std::stoul(field.first.Scalar(), nullptr, 0);
+			} catch (const std::logic_error &) {
+				code = UINT8_MAX + 1;
+			}
+
+			if (code > UINT8_MAX)
+				throw ControlError(JSONRPC_INVALID_PARAMS,
+				    fmt::format("Invalid TLV code {}",
+				    field.first.Scalar()));
+
+			if (field.second.IsSequence() &&
+			    code == TLV_CODE_VENDOR_EXT) {
+				for (const auto &value: field.second)
+					fields[(tlv_code_t)code].push_back(
+					    value.Scalar());
+			} else if (field.second.IsScalar()) {
+				fields[(tlv_code_t)code].push_back(
+				    field.second.Scalar());
+			} else {
+				throw ControlError(JSONRPC_INVALID_PARAMS,
+				    fmt::format("TLV {} must be a string",
+				    field.first.Scalar()));
+			}
+		}
+
+		session.tlv_write(param_string(params, "address",
+		    SESSION_EEPROM_ADDRESS), fields);
+		return ("true");
+	}
+
+	if (method == "reset") {
+		session.reset();
+		return ("true");
+	}
+
+	if (method == "bypass") {
+		session.bypass();
+		return ("true");
+	}
+
+	if (method == "uart.open") {
+		session.uart_open(param_uint(params, "baudrate",
+		    UINT_MAX, SESSION_UART_BAUDRATE));
+		return ("true");
+	}
+
+	if (method == "uart.send") {
+		session.uart_send(param_string(params, "data"));
+		return ("true");
+	}
+
+	if (method == "uart.expect") {
+		return (json_quote(session.uart_expect(
+		    param_string(params, "pattern"),
+		    param_uint(params, "timeout_ms", UINT_MAX,
+		    SESSION_EXPECT_TIMEOUT))));
+	}
+
+	throw ControlError(JSONRPC_NO_METHOD,
+	    fmt::format("Unknown method {}", method));
+}
+
+ControlClient::ControlClient(const std::string &path):
+    m_next_id(1)
+{
+	Glib::RefPtr<Gio::SocketClient> client = Gio::SocketClient::create();
+
+	try {
+		m_conn = client->connect(Gio::UnixSocketAddress::create(path));
+	} catch (const Glib::Error &err) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot connect to {}: {}", path, err.what()));
+	}
+
+	m_input = Gio::DataInputStream::create(m_conn->get_input_stream());
+}
+
+ControlClient::~ControlClient()
+{
+	try {
+		m_conn->close();
+	} catch (const Glib::Error &err) {
+	}
+}
+
+/* Returns the result as JSON text, throws with the error message */
+std::string
+ControlClient::call(const std::string &method, const std::string &params)
+{
+	std::string request = fmt::format(
+	    "{{\"jsonrpc\": \"2.0\", \"id\": {}, \"method\": {}, \"params\": {}}}\n",
+	    m_next_id++, json_quote(method), params);
+	std::string line;
+	YAML::Node reply;
+	gsize written;
+
+	try {
+		m_conn->get_output_stream()->write_all(request, written);
+		if (!m_input->read_line(line))
+			throw std::runtime_error("Connection closed by the server");
+
+		reply = YAML::Load(line);
+	} catch (const Glib::Error &err) {
+		throw std::runtime_error(err.what());
+	} catch (const YAML::Exception &err) {
+		throw std::runtime_error(fmt::format("Invalid reply: {}", err.what()));
+	}
+
+	if (reply["error"])
+		throw std::runtime_error(reply["error"]["message"].as<std::string>());
+
+	return (json_emit(reply["result"]));
+}
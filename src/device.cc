@@ -26,16 +26,50 @@
  *
  */
 
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <optional>
+#include <libusb.h>
 #include <ftdi.hpp>
 #include <device.hh>
+#include <log.hh>
 #include <fmt/format.h>
 
 #define USB_VID		0x0403
 #define USB_PID		0x6011
 
+static struct
+{
+	std::mutex lock;
+	std::vector<Device> devices;
+	std::chrono::steady_clock::time_point scanned;
+	bool valid = false;
+
+	std::mutex handlers_lock;
+	std::recursive_mutex dispatch_lock;
+	std::map<unsigned int, DeviceEventHandler> handlers;
+	unsigned int next_id = 1;
+
+	std::once_flag started;
+	std::atomic<bool> dirty{false};
+	libusb_context *usb = nullptr;
+	bool hotplug = false;
+} cache;
+
+static int
+hotplug_callback(libusb_context *ctx, libusb_device *dev,
+    libusb_hotplug_event event, void *arg)
+{
+	/* No descriptor reads are allowed here, monitor() rescans instead */
+	cache.dirty = true;
+	return (0);
+}
+
 std::vector<Device>
-DeviceEnumerator::enumerate()
+DeviceEnumerator::scan()
 {
 	Ftdi::Context ctx;
 	Ftdi::List *devices = Ftdi::List::find_all(ctx, USB_VID, USB_PID);
@@ -54,7 +88,165 @@ DeviceEnumerator::enumerate()
 	return (result);
 }
 
+/*
+ * Replaces the cached list and tells the subscribers which cables
+ * appeared and which are gone. Handlers are called without
+ * handlers_lock held, so they may subscribe and unsubscribe; the
+ * dispatch lock keeps unsubscribe() from returning while another
+ * thread is still calling the handler it removes.
+ */
+std::vector<Device>
+DeviceEnumerator::update(const std::vector<Device> &devices)
+{
+	std::lock_guard<std::recursive_mutex> dispatch(cache.dispatch_lock);
+	std::map<unsigned int, DeviceEventHandler> handlers;
+	std::vector<DeviceEvent> events;
+	auto contains = [](const std::vector<Device> &list, const Device &dev) {
+		for (const auto &i: list) {
+			if (i.serial == dev.serial)
+				return (true);
+		}
+
+		return (false);
+	};
+
+	{
+		std::lock_guard<std::mutex> guard(cache.lock);
+
+		for (const auto &i: devices) {
+			if (!contains(cache.devices, i))
+				events.push_back({i, true});
+		}
+
+		for (const auto &i: cache.devices) {
+			if (!contains(devices, i))
+				events.push_back({i, false});
+		}
+
+		cache.devices = devices;
+		cache.scanned = std::chrono::steady_clock::now();
+		cache.valid = true;
+	}
+
+	for (const auto &event: events) {
+		Logger::debug("Cable {} {}", event.device.serial,
+		    event.arrived ? "connected" : "disconnected");
+
+		{
+			std::lock_guard<std::mutex> guard(cache.handlers_lock);
+
+			handlers = cache.handlers;
+		}
+
+		for (const auto &handler: handlers) {
+			bool subscribed;
+
+			{
+				std::lock_guard<std::mutex> guard(
+				    cache.handlers_lock);
+
+				subscribed = cache.handlers.count(handler.first);
+			}
+
+			/* Dropped by an earlier handler of this event */
+			if (subscribed)
+				handler.second(event);
+		}
+	}
+
+	return (devices);
+}
+
+void
+DeviceEnumerator::start_monitor()
+{
+	int ret;
+
+	ret = libusb_init(&cache.usb);
+	if (ret != LIBUSB_SUCCESS) {
+		Logger::warning("Cannot initialize libusb: {}, hotplug disabled",
+		    libusb_error_name(ret));
+		cache.usb = nullptr;
+	} else if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		ret = libusb_hotplug_register_callback(cache.usb,
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+		    USB_VID, USB_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+		    hotplug_callback, nullptr, nullptr);
+		cache.hotplug = ret == LIBUSB_SUCCESS;
+	}
+
+	if (!cache.hotplug)
+		Logger::debug("USB hotplug not available, rescanning for cables");
+
+	/* Runs for the life of the process */
+	std::thread(&DeviceEnumerator::monitor).detach();
+}
+
+void
+DeviceEnumerator::monitor()
+{
+	struct timeval tv;
+	bool subscribed;
 
+	for (;;) {
+		if (cache.hotplug) {
+			tv = {1, 0};
+			libusb_handle_events_timeout_completed(cache.usb, &tv,
+			    nullptr);
+			if (!cache.dirty.exchange(false))
+				continue;
+		} else {
+			std::this_thread::sleep_for(
+			    std::chrono::seconds(DEVICE_RESCAN_INTERVAL));
+
+			{
+				std::lock_guard<std::mutex> guard(cache.handlers_lock);
+
+				subscribed = !cache.handlers.empty();
+			}
+
+			if (!subscribed)
+				continue;
+		}
+
+		update(scan());
+	}
+}
+
+bool
+DeviceEnumerator::has_hotplug()
+{
+	std::call_once(cache.started, start_monitor);
+	return (cache.hotplug);
+}
+
+std::vector<Device>
+DeviceEnumerator::enumerate()
+{
+	std::call_once(cache.started, start_monitor);
+
+	{
+		std::lock_guard<std::mutex> guard(cache.lock);
+
+		/* A pending hotplug event means the cache is already stale */
+		if (cache.valid && (cache.hotplug ? !cache.dirty.exchange(false) :
+		    std::chrono::steady_clock::now() - cache.scanned <
+		    std::chrono::seconds(DEVICE_CACHE_TTL)))
+			return (cache.devices);
+	}
+
+	return (update(scan()));
+}
+
+std::vector<Device>
+DeviceEnumerator::rescan()
+{
+	std::call_once(cache.started, start_monitor);
+	return (update(scan()));
+}
+
+/* A cable missing from the cache may have just been plugged in */
 std::optional<Device>
 DeviceEnumerator::find_by_serial(const std::string &serial)
 {
@@ -63,5 +255,31 @@ DeviceEnumerator::find_by_serial(const std::string &serial)
 			return (i);
 	}
 
+	for (const auto &i: rescan()) {
+		if (i.serial == serial)
+			return (i);
+	}
+
 	return (std::nullopt);
 }
+
+unsigned int
+DeviceEnumerator::subscribe(const DeviceEventHandler &handler)
+{
+	std::call_once(cache.started, start_monitor);
+	std::lock_guard<std::mutex> guard(cache.handlers_lock);
+	unsigned int id = cache.next_id++;
+
+	cache.handlers[id] = handler;
+	return (id);
+}
+
+/* Waits for a handler call in progress on another thread */
+void
+DeviceEnumerator::unsubscribe(unsigned int id)
+{
+	std::lock_guard<std::recursive_mutex> dispatch(cache.dispatch_lock);
+	std::lock_guard<std::mutex> guard(cache.handlers_lock);
+
+	cache.handlers.erase(id);
+}
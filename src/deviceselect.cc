@@ -45,15 +45,14 @@ DeviceSelectDialog::DeviceSelectDialog():
 	m_treeview.append_column("PID", m_columns.m_pid);
 	m_treeview.append_column("Description", m_columns.m_description);
 	m_treeview.append_column("Serial", m_columns.m_serial);
+	refresh();
 
-	for (const auto &i: DeviceEnumerator::enumerate()) {
-		auto row = *(m_store->append());
-		row[m_columns.m_vid] = fmt::format("{:#04x}", i.vid);
-		row[m_columns.m_pid] = fmt::format("{:#04x}", i.pid);
-		row[m_columns.m_description] = i.description;
-		row[m_columns.m_serial] = i.serial;
-		row[m_columns.m_device] = i;
-	}
+	/* Cables plugged in while the dialog is open show up right away */
+	m_devices_changed.connect(sigc::mem_fun(*this,
+	    &DeviceSelectDialog::refresh));
+	m_subscription = DeviceEnumerator::subscribe([this](const DeviceEvent &) {
+		m_devices_changed.emit();
+	});
 
 	m_ok.signal_clicked().connect(sigc::mem_fun(*this,
 	    &DeviceSelectDialog::ok_clicked));
@@ -65,6 +64,30 @@ DeviceSelectDialog::DeviceSelectDialog():
 	show_all_children();
 }
 
+DeviceSelectDialog::~DeviceSelectDialog()
+{
+	DeviceEnumerator::unsubscribe(m_subscription);
+}
+
+void
+DeviceSelectDialog::refresh()
+{
+	std::optional<Device> selected = get_selected_device();
+
+	m_store->clear();
+	for (const auto &i: DeviceEnumerator::enumerate()) {
+		auto row = *(m_store->append());
+		row[m_columns.m_vid] = fmt::format("{:#04x}", i.vid);
+		row[m_columns.m_pid] = fmt::format("{:#04x}", i.pid);
+		row[m_columns.m_description] = i.description;
+		row[m_columns.m_serial] = i.serial;
+		row[m_columns.m_device] = i;
+
+		if (selected && selected->serial == i.serial)
+			m_treeview.get_selection()->select(row);
+	}
+}
+
 std::optional<Device>
 DeviceSelectDialog::get_selected_device()
 {
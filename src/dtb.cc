@@ -26,131 +26,1610 @@
  *
  */
 
-#include <vector>
-#include <string>
-#include <giomm.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <fmt/format.h>
 #include <log.hh>
-#include <utils.hh>
 #include <dtb.hh>
 
-#define BUFFER_SIZE	1024
+#define DTB_MAX_DEPTH	64
 
-DTB::DTB( std::shared_ptr<std::string> &dts,
-    std::shared_ptr<std::vector<uint8_t>> &dtb):
-    m_dtb(dtb),
-    m_dts(dts)
+/* Byte offsets of the header fields FDTBlob has to keep up to date */
+#define FDT_OFF_TOTALSIZE	4
+#define FDT_OFF_DT_STRUCT	8
+#define FDT_OFF_DT_STRINGS	12
+#define FDT_OFF_SIZE_STRINGS	32
+#define FDT_OFF_SIZE_STRUCT	36
+
+namespace {
+
+void
+put_be32(std::vector<uint8_t> &out, uint32_t value)
 {
+	out.push_back((value >> 24) & 0xff);
+	out.push_back((value >> 16) & 0xff);
+	out.push_back((value >> 8) & 0xff);
+	out.push_back(value & 0xff);
 }
 
-DTB::~DTB()
+void
+put_be(std::vector<uint8_t> &out, uint64_t value, unsigned int bits)
 {
+	for (int shift = bits - 8; shift >= 0; shift -= 8)
+		out.push_back((value >> shift) & 0xff);
 }
 
-void DTB::run_dtc(bool compile, const SlotDone &done)
+uint32_t
+get_be32(const uint8_t *p)
 {
-	int stdin_fd;
-	int stdout_fd;
-	int stderr_fd;
-	Glib::Pid pid;
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]);
+}
 
-	m_done = done;
-	m_compile = compile;
+uint64_t
+get_be64(const uint8_t *p)
+{
+	return ((uint64_t)get_be32(p) << 32 | get_be32(p + 4));
+}
 
-	std::string errors;
-	std::vector<std::string> argv {
-		"dtc",
-		"-I", compile ? "dts" : "dtb",
-		"-O", compile ? "dtb" : "dts"
+void
+align4(std::vector<uint8_t> &out)
+{
+	out.resize((out.size() + 3) & ~(size_t)3, 0);
+}
+
+bool
+is_name_char(char c)
+{
+	return (isalnum((unsigned char)c) || strchr(",._+*#?@-", c) != nullptr);
+}
+
+bool
+is_label_char(char c)
+{
+	return (isalnum((unsigned char)c) || c == '_');
+}
+
+std::string
+child_path(const std::string &parent, const std::string &name)
+{
+	return (parent == "/" ? "/" + name : parent + "/" + name);
+}
+
+/*
+ * Recursive descent parser for the DTS source format accepted by dtc:
+ * nodes and properties, labels and &label / &{/path} references,
+ * strings, <cells> with /bits/ and C integer expressions, [bytes],
+ * /memreserve/, /delete-node/ and /delete-property/. References are
+ * resolved once the whole source has been read, since labels may be
+ * used before they are defined.
+ */
+class DTSParser
+{
+public:
+	DTSParser(const std::string &source, DTB &dtb):
+	    m_src(source),
+	    m_pos(0),
+	    m_dtb(dtb)
+	{
+	}
+
+	void parse();
+
+private:
+	struct Fixup
+	{
+		std::string path;
+		std::string property;
+		size_t offset;
+		std::string target;
+		bool phandle;
+		size_t pos;
 	};
 
-	try {
-		Glib::spawn_async_with_pipes("/tmp", argv,
-		    Glib::SpawnFlags::SPAWN_DO_NOT_REAP_CHILD |
-		    Glib::SpawnFlags::SPAWN_SEARCH_PATH,
-		    Glib::SlotSpawnChildSetup(),
-		    &pid, &stdin_fd, &stdout_fd, &stderr_fd);
-	} catch (const Glib::Error &err) {
-		throw std::runtime_error(err.what());
+	[[noreturn]] void error(const std::string &msg, size_t pos);
+	[[noreturn]] void error(const std::string &msg) { error(msg, m_pos); }
+	void skip_ws();
+	bool eof() { return (m_pos >= m_src.size()); }
+	char peek() { skip_ws(); return (eof() ? '\0' : m_src[m_pos]); }
+	bool accept(const char *token);
+	void expect(char c);
+	std::string read_name();
+	std::vector<std::string> parse_labels();
+	void add_labels(DTBNode &node, const std::string &path,
+	    const std::vector<std::string> &labels);
+	std::string parse_ref();
+	std::string resolve_target(const std::string &target, size_t pos);
+	void parse_node_body(DTBNode &node, const std::string &path, int depth);
+	void parse_value(const std::string &path, const std::string &name,
+	    std::vector<uint8_t> &out);
+	void parse_string(std::vector<uint8_t> &out);
+	void parse_cells(const std::string &path, const std::string &name,
+	    unsigned int bits, std::vector<uint8_t> &out);
+	void parse_bytes(std::vector<uint8_t> &out);
+	uint8_t parse_escape();
+	uint64_t parse_literal();
+	uint64_t parse_primary();
+	uint64_t parse_unary();
+	uint64_t parse_binary(int level);
+	uint64_t parse_expr();
+	void drop_fixups(const std::string &path, const std::string &name);
+	uint32_t phandle_of(DTBNode &node);
+	void resolve_fixups();
+
+	const std::string &m_src;
+	size_t m_pos;
+	DTB &m_dtb;
+	std::map<std::string, std::string> m_labels;
+	std::vector<Fixup> m_fixups;
+	uint32_t m_next_phandle;
+};
+
+void
+DTSParser::error(const std::string &msg, size_t pos)
+{
+	size_t line = 1;
+	size_t col = 1;
+
+	for (size_t i = 0; i < pos && i < m_src.size(); i++) {
+		if (m_src[i] == '\n') {
+			line++;
+			col = 1;
+		} else
+			col++;
 	}
 
-	m_in = Gio::UnixOutputStream::create(stdin_fd, true);
-	m_out = Gio::UnixInputStream::create(stdout_fd, true);
-	m_err = Gio::UnixInputStream::create(stderr_fd, true);
+	throw std::runtime_error(fmt::format("line {}, column {}: {}",
+	    line, col, msg));
+}
 
-	m_out->read_bytes_async(BUFFER_SIZE,
-	    sigc::mem_fun(*this, &DTB::output_ready));
+void
+DTSParser::skip_ws()
+{
+	while (!eof()) {
+		if (isspace((unsigned char)m_src[m_pos])) {
+			m_pos++;
+		} else if (m_src.compare(m_pos, 2, "//") == 0) {
+			m_pos = m_src.find('\n', m_pos);
+			if (m_pos == std::string::npos)
+				m_pos = m_src.size();
+		} else if (m_src.compare(m_pos, 2, "/*") == 0) {
+			size_t end = m_src.find("*/", m_pos + 2);
 
-	m_err->read_bytes_async(BUFFER_SIZE,
-	    sigc::mem_fun(*this, &DTB::error_ready));
+			if (end == std::string::npos)
+				error("unterminated comment");
 
-	Glib::signal_child_watch().connect(
-	    sigc::mem_fun(*this, &DTB::child_exited),
-	    pid);
+			m_pos = end + 2;
+		} else if (m_src.compare(m_pos, 8, "#include") == 0) {
+			error("preprocessor directives are not supported");
+		} else
+			break;
+	}
+}
 
-	if (compile)
-		m_in->write(*m_dts);
-	else
-		m_in->write(m_dtb->data(), m_dtb->size());
+bool
+DTSParser::accept(const char *token)
+{
+	size_t len = strlen(token);
+
+	skip_ws();
+	if (m_src.compare(m_pos, len, token) != 0)
+		return (false);
+
+	m_pos += len;
+	return (true);
+}
+
+void
+DTSParser::expect(char c)
+{
+	if (peek() != c)
+		error(fmt::format("expected '{}'", c));
+
+	m_pos++;
+}
+
+std::string
+DTSParser::read_name()
+{
+	size_t start;
+
+	skip_ws();
+	start = m_pos;
+	while (!eof() && is_name_char(m_src[m_pos]))
+		m_pos++;
+
+	if (start == m_pos)
+		error("expected a node or property name");
+
+	return (m_src.substr(start, m_pos - start));
+}
+
+std::vector<std::string>
+DTSParser::parse_labels()
+{
+	std::vector<std::string> result;
+
+	for (;;) {
+		size_t save;
+		size_t start;
+
+		skip_ws();
+		save = m_pos;
+		start = m_pos;
+		if (eof() || !(isalpha((unsigned char)m_src[m_pos]) ||
+		    m_src[m_pos] == '_'))
+			break;
+
+		while (!eof() && is_label_char(m_src[m_pos]))
+			m_pos++;
+
+		if (eof() || m_src[m_pos] != ':') {
+			m_pos = save;
+			break;
+		}
 
-	m_in->flush();
-	m_in->close();
+		result.push_back(m_src.substr(start, m_pos - start));
+		m_pos++;
+	}
+
+	return (result);
 }
 
 void
-DTB::compile(const DTB::SlotDone &done)
+DTSParser::add_labels(DTBNode &node, const std::string &path,
+    const std::vector<std::string> &labels)
+{
+	for (const auto &label: labels) {
+		auto it = m_labels.find(label);
+
+		if (it != m_labels.end() && it->second != path)
+			error(fmt::format("duplicate label '{}'", label));
+
+		m_labels[label] = path;
+		if (std::find(node.labels.begin(), node.labels.end(), label) ==
+		    node.labels.end())
+			node.labels.push_back(label);
+	}
+}
+
+std::string
+DTSParser::parse_ref()
 {
-	run_dtc(true, done);
+	size_t start;
+	size_t end;
+
+	expect('&');
+	if (!eof() && m_src[m_pos] == '{') {
+		end = m_src.find('}', m_pos);
+		if (end == std::string::npos)
+			error("unterminated path reference");
+
+		start = m_pos + 1;
+		m_pos = end + 1;
+		if (m_src[start] != '/')
+			error("path references must be absolute", start);
+
+		return (m_src.substr(start, end - start));
+	}
+
+	start = m_pos;
+	while (!eof() && is_label_char(m_src[m_pos]))
+		m_pos++;
+
+	if (start == m_pos)
+		error("expected a label after '&'");
+
+	return (m_src.substr(start, m_pos - start));
+}
+
+std::string
+DTSParser::resolve_target(const std::string &target, size_t pos)
+{
+	if (target[0] == '/')
+		return (target);
+
+	auto it = m_labels.find(target);
+	if (it == m_labels.end())
+		error(fmt::format("reference to undefined label '{}'", target), pos);
+
+	return (it->second);
+}
+
+void
+DTSParser::parse()
+{
+	if (!accept("/dts-v1/"))
+		error("missing /dts-v1/ tag");
+
+	expect(';');
+
+	for (;;) {
+		std::vector<std::string> labels;
+		DTBNode *node;
+		std::string path;
+		size_t pos;
+
+		skip_ws();
+		if (eof())
+			break;
+
+		if (accept("/dts-v1/")) {
+			expect(';');
+			continue;
+		}
+
+		if (accept("/plugin/"))
+			error("device tree overlays are not supported");
+
+		if (accept("/memreserve/")) {
+			DTBReserve entry;
+
+			entry.address = parse_primary();
+			entry.size = parse_primary();
+			expect(';');
+			m_dtb.reserved.push_back(entry);
+			continue;
+		}
+
+		if (accept("/delete-node/")) {
+			pos = m_pos;
+			path = resolve_target(parse_ref(), pos);
+			expect(';');
+			if (path == "/")
+				error("cannot delete the root node", pos);
+
+			node = m_dtb.find_node(path.substr(0, path.rfind('/') + 1));
+			if (node != nullptr)
+				node->remove_child(path.substr(path.rfind('/') + 1));
+
+			continue;
+		}
+
+		labels = parse_labels();
+		pos = m_pos;
+		if (peek() == '/') {
+			m_pos++;
+			path = "/";
+		} else if (peek() == '&') {
+			path = resolve_target(parse_ref(), pos);
+		} else
+			error("expected a node definition");
+
+		node = m_dtb.find_node(path);
+		if (node == nullptr)
+			error(fmt::format("no node at '{}'", path), pos);
+
+		add_labels(*node, path, labels);
+		parse_node_body(*node, path, 0);
+	}
+
+	resolve_fixups();
 }
 
 void
-DTB::decompile(const DTB::SlotDone &done)
+DTSParser::parse_node_body(DTBNode &node, const std::string &path, int depth)
 {
-	run_dtc(false, done);
+	if (depth > DTB_MAX_DEPTH)
+		error("nodes nested too deeply");
+
+	expect('{');
+
+	for (;;) {
+		std::vector<std::string> labels;
+		std::vector<uint8_t> value;
+		std::string name;
+
+		if (peek() == '}') {
+			m_pos++;
+			expect(';');
+			return;
+		}
+
+		if (accept("/delete-property/")) {
+			name = read_name();
+			expect(';');
+			node.remove_property(name);
+			drop_fixups(path, name);
+			continue;
+		}
+
+		if (accept("/delete-node/")) {
+			name = read_name();
+			expect(';');
+			node.remove_child(name);
+			continue;
+		}
+
+		if (accept("/omit-if-no-ref/"))
+			error("/omit-if-no-ref/ is not supported");
+
+		labels = parse_labels();
+		name = read_name();
+
+		if (peek() == '{') {
+			DTBNode *child = node.find_child(name);
+
+			if (child == nullptr) {
+				node.children.emplace_back();
+				child = &node.children.back();
+				child->name = name;
+			}
+
+			add_labels(*child, child_path(path, name), labels);
+			parse_node_body(*child, child_path(path, name), depth + 1);
+			continue;
+		}
+
+		drop_fixups(path, name);
+		if (peek() == '=') {
+			m_pos++;
+			parse_value(path, name, value);
+		}
+
+		expect(';');
+		node.set_property(name, value);
+	}
 }
 
 void
-DTB::output_ready(Glib::RefPtr<Gio::AsyncResult> &result)
+DTSParser::parse_value(const std::string &path, const std::string &name,
+    std::vector<uint8_t> &out)
 {
-	Glib::RefPtr<Glib::Bytes> data;
-	const uint8_t *buffer;
-	size_t len;
+	for (;;) {
+		unsigned int bits = 32;
+		size_t pos;
 
-	data = m_out->read_bytes_finish(result);
-	buffer = static_cast<const uint8_t *>(data->get_data(len));
+		parse_labels();
+		pos = m_pos;
+		switch (peek()) {
+		case '"':
+			parse_string(out);
+			break;
 
-	if (len == 0)
-		return;
+		case '[':
+			parse_bytes(out);
+			break;
+
+		case '&':
+			m_fixups.push_back(Fixup{path, name, out.size(),
+			    parse_ref(), false, pos});
+			break;
+
+		case '/':
+			if (!accept("/bits/"))
+				error("expected a property value");
+
+			bits = parse_primary();
+			if (bits != 8 && bits != 16 && bits != 32 && bits != 64)
+				error("/bits/ must be 8, 16, 32 or 64", pos);
+			/* FALLTHROUGH */
+
+		case '<':
+			parse_cells(path, name, bits, out);
+			break;
+
+		default:
+			error("expected a property value");
+		}
+
+		parse_labels();
+		if (peek() != ',')
+			break;
+
+		m_pos++;
+	}
+}
+
+uint8_t
+DTSParser::parse_escape()
+{
+	char c;
+	unsigned int value = 0;
+	int i;
+
+	if (eof())
+		error("unterminated escape sequence");
+
+	c = m_src[m_pos++];
+	switch (c) {
+	case 'a': return ('\a');
+	case 'b': return ('\b');
+	case 'f': return ('\f');
+	case 'n': return ('\n');
+	case 'r': return ('\r');
+	case 't': return ('\t');
+	case 'v': return ('\v');
+	case 'x':
+		for (i = 0; i < 2 && !eof() &&
+		    isxdigit((unsigned char)m_src[m_pos]); i++) {
+			value = value * 16 + (isdigit((unsigned char)m_src[m_pos]) ?
+			    m_src[m_pos] - '0' :
+			    tolower((unsigned char)m_src[m_pos]) - 'a' + 10);
+			m_pos++;
+		}
+
+		if (i == 0)
+			error("\\x used with no following hex digits");
+
+		return (value);
+	default:
+		if (c < '0' || c > '7')
+			return (c);
+
+		value = c - '0';
+		for (i = 1; i < 3 && !eof() && m_src[m_pos] >= '0' &&
+		    m_src[m_pos] <= '7'; i++)
+			value = value * 8 + (m_src[m_pos++] - '0');
+
+		return (value & 0xff);
+	}
+}
+
+void
+DTSParser::parse_string(std::vector<uint8_t> &out)
+{
+	expect('"');
+
+	for (;;) {
+		if (eof())
+			error("unterminated string");
+
+		char c = m_src[m_pos++];
+		if (c == '"')
+			break;
+
+		out.push_back(c == '\\' ? parse_escape() : (uint8_t)c);
+	}
+
+	out.push_back('\0');
+}
+
+void
+DTSParser::parse_cells(const std::string &path, const std::string &name,
+    unsigned int bits, std::vector<uint8_t> &out)
+{
+	uint64_t mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+
+	expect('<');
+
+	for (;;) {
+		uint64_t value;
+		size_t pos;
+
+		parse_labels();
+		pos = m_pos;
+		if (peek() == '>') {
+			m_pos++;
+			break;
+		}
+
+		if (peek() == '&') {
+			if (bits != 32)
+				error("references are only allowed in 32-bit cells");
+
+			m_fixups.push_back(Fixup{path, name, out.size(),
+			    parse_ref(), true, pos});
+			put_be32(out, 0);
+			continue;
+		}
+
+		value = parse_primary();
+		if ((value & ~mask) != 0 && (value | mask) != ~0ull) {
+			Logger::warning("Cell value 0x{:x} truncated to {} bits",
+			    value, bits);
+		}
+
+		put_be(out, value & mask, bits);
+	}
+}
+
+void
+DTSParser::parse_bytes(std::vector<uint8_t> &out)
+{
+	expect('[');
+
+	for (;;) {
+		parse_labels();
+		if (peek() == ']') {
+			m_pos++;
+			break;
+		}
+
+		if (m_pos + 1 >= m_src.size() ||
+		    !isxdigit((unsigned char)m_src[m_pos]) ||
+		    !isxdigit((unsigned char)m_src[m_pos + 1]))
+			error("expected a hex byte");
+
+		out.push_back(std::stoul(m_src.substr(m_pos, 2), nullptr, 16));
+		m_pos += 2;
+	}
+}
+
+uint64_t
+DTSParser::parse_literal()
+{
+	const char *start = m_src.c_str() + m_pos;
+	unsigned long long value;
+	char *end;
+
+	errno = 0;
+	value = strtoull(start, &end, 0);
+	if (end == start)
+		error("expected a number");
+
+	if (errno == ERANGE)
+		error("integer literal out of range");
+
+	m_pos += end - start;
+	while (!eof() && strchr("uUlL", m_src[m_pos]) != nullptr)
+		m_pos++;
+
+	if (!eof() && is_label_char(m_src[m_pos]))
+		error("malformed integer literal");
+
+	return (value);
+}
+
+uint64_t
+DTSParser::parse_primary()
+{
+	uint64_t value;
+	char c = peek();
+
+	if (c == '(') {
+		m_pos++;
+		value = parse_expr();
+		expect(')');
+		return (value);
+	}
+
+	if (c == '\'') {
+		m_pos++;
+		if (eof())
+			error("unterminated character literal");
+
+		c = m_src[m_pos++];
+		value = c == '\\' ? parse_escape() : (uint8_t)c;
+		if (eof() || m_src[m_pos] != '\'')
+			error("unterminated character literal");
+
+		m_pos++;
+		return (value);
+	}
+
+	if (!isdigit((unsigned char)c))
+		error("expected a number");
+
+	return (parse_literal());
+}
+
+uint64_t
+DTSParser::parse_unary()
+{
+	switch (peek()) {
+	case '-':
+		m_pos++;
+		return (-parse_unary());
+	case '~':
+		m_pos++;
+		return (~parse_unary());
+	case '!':
+		m_pos++;
+		return (!parse_unary());
+	default:
+		return (parse_primary());
+	}
+}
+
+/*
+ * Binary operators by C precedence, loosest first. The operator at the
+ * cursor is always taken as the longest match so "<" never eats "<<".
+ */
+uint64_t
+DTSParser::parse_binary(int level)
+{
+	static const struct {
+		const char *op;
+		int level;
+	} ops[] = {
+	    { "||", 0 }, { "&&", 1 }, { "==", 5 }, { "!=", 5 },
+	    { "<=", 6 }, { ">=", 6 }, { "<<", 7 }, { ">>", 7 },
+	    { "|", 2 }, { "^", 3 }, { "&", 4 }, { "<", 6 }, { ">", 6 },
+	    { "+", 8 }, { "-", 8 }, { "*", 9 }, { "/", 9 }, { "%", 9 },
+	};
+	uint64_t lhs;
+	uint64_t rhs;
+
+	if (level > 9)
+		return (parse_unary());
+
+	lhs = parse_binary(level + 1);
+
+	for (;;) {
+		std::string op;
+		size_t pos;
+
+		skip_ws();
+		pos = m_pos;
+		for (const auto &i: ops) {
+			if (m_src.compare(m_pos, strlen(i.op), i.op) == 0) {
+				if (i.level == level)
+					op = i.op;
+				break;
+			}
+		}
+
+		if (op.empty())
+			return (lhs);
+
+		m_pos += op.size();
+		rhs = parse_binary(level + 1);
+
+		if ((op == "/" || op == "%") && rhs == 0)
+			error("division by zero", pos);
+
+		if (op == "||") lhs = lhs || rhs;
+		else if (op == "&&") lhs = lhs && rhs;
+		else if (op == "|") lhs |= rhs;
+		else if (op == "^") lhs ^= rhs;
+		else if (op == "&") lhs &= rhs;
+		else if (op == "==") lhs = lhs == rhs;
+		else if (op == "!=") lhs = lhs != rhs;
+		else if (op == "<") lhs = lhs < rhs;
+		else if (op == ">") lhs = lhs > rhs;
+		else if (op == "<=") lhs = lhs <= rhs;
+		else if (op == ">=") lhs = lhs >= rhs;
+		else if (op == "<<") lhs = rhs < 64 ? lhs << rhs : 0;
+		else if (op == ">>") lhs = rhs < 64 ? lhs >> rhs : 0;
+		else if (op == "+") lhs += rhs;
+		else if (op == "-") lhs -= rhs;
+		else if (op == "*") lhs *= rhs;
+		else if (op == "/") lhs /= rhs;
+		else lhs %= rhs;
+	}
+}
+
+uint64_t
+DTSParser::parse_expr()
+{
+	uint64_t cond = parse_binary(0);
+	uint64_t a;
+	uint64_t b;
+
+	if (peek() != '?')
+		return (cond);
+
+	m_pos++;
+	a = parse_expr();
+	expect(':');
+	b = parse_expr();
+	return (cond ? a : b);
+}
+
+void
+DTSParser::drop_fixups(const std::string &path, const std::string &name)
+{
+	m_fixups.erase(std::remove_if(m_fixups.begin(), m_fixups.end(),
+	    [&](const Fixup &f) {
+		return (f.path == path && f.property == name);
+	    }), m_fixups.end());
+}
+
+uint32_t
+DTSParser::phandle_of(DTBNode &node)
+{
+	std::vector<uint8_t> value;
+	const DTBProperty *prop;
+
+	prop = node.find_property("phandle");
+	if (prop == nullptr)
+		prop = node.find_property("linux,phandle");
+
+	if (prop != nullptr && prop->value.size() == 4)
+		return (get_be32(prop->value.data()));
+
+	put_be32(value, m_next_phandle);
+	node.set_property("phandle", value);
+	return (m_next_phandle++);
+}
+
+void
+DTSParser::resolve_fixups()
+{
+	std::vector<const DTBNode *> stack { &m_dtb.root() };
+	size_t delta = 0;
+
+	/* New phandles continue after any given explicitly in the source */
+	m_next_phandle = 1;
+	while (!stack.empty()) {
+		const DTBNode *node = stack.back();
+
+		stack.pop_back();
+		for (const auto &prop: node->properties) {
+			if ((prop.name == "phandle" || prop.name == "linux,phandle") &&
+			    prop.value.size() == 4) {
+				m_next_phandle = std::max(m_next_phandle,
+				    get_be32(prop.value.data()) + 1);
+			}
+		}
+
+		for (const auto &child: node->children)
+			stack.push_back(&child);
+	}
+
+	/* Path references grow the value, shifting later fixups in it */
+	for (size_t i = 0; i < m_fixups.size(); i++) {
+		const Fixup &f = m_fixups[i];
+		std::string path = resolve_target(f.target, f.pos);
+		std::vector<uint8_t> bytes;
+		DTBNode *target;
+		DTBNode *node;
+		DTBProperty *prop;
+
+		if (i == 0 || m_fixups[i - 1].path != f.path ||
+		    m_fixups[i - 1].property != f.property)
+			delta = 0;
+
+		node = m_dtb.find_node(f.path);
+		if (node == nullptr || node->find_property(f.property) == nullptr)
+			continue;
+
+		target = m_dtb.find_node(path);
+		if (target == nullptr)
+			error(fmt::format("reference to missing node '{}'", path),
+			    f.pos);
+
+		if (f.phandle)
+			put_be32(bytes, phandle_of(*target));
+		else
+			bytes.assign(path.begin(), path.end() + 1);
+
+		/* Looked up after phandle_of(), which may add a property */
+		node = m_dtb.find_node(f.path);
+		prop = node != nullptr ? node->find_property(f.property) : nullptr;
+		if (prop == nullptr)
+			continue;
+
+		if (f.phandle) {
+			std::copy(bytes.begin(), bytes.end(),
+			    prop->value.begin() + f.offset + delta);
+		} else {
+			prop->value.insert(prop->value.begin() + f.offset + delta,
+			    bytes.begin(), bytes.end());
+			delta += bytes.size();
+		}
+	}
+}
+
+class FDTReader
+{
+public:
+	FDTReader(const uint8_t *data, size_t size, DTB &dtb):
+	    m_data(data),
+	    m_size(size),
+	    m_dtb(dtb)
+	{
+	}
+
+	void read();
 
-	if (m_compile)
-		m_dtb->insert(m_dtb->end(), &buffer[0], &buffer[len]);
+private:
+	uint32_t token();
+	std::string read_name();
+	void read_node(DTBNode &node, int depth);
+
+	const uint8_t *m_data;
+	size_t m_size;
+	DTB &m_dtb;
+	size_t m_pos;
+	size_t m_struct_end;
+	size_t m_strings;
+	size_t m_strings_size;
+};
+
+void
+FDTReader::read()
+{
+	uint32_t totalsize;
+	uint32_t off_struct;
+	uint32_t off_rsvmap;
+	uint32_t version;
+	uint32_t size_struct;
+	size_t pos;
+
+	if (m_size < FDT_HEADER_SIZE)
+		throw std::runtime_error("Device tree blob is truncated");
+
+	if (get_be32(m_data) != FDT_MAGIC)
+		throw std::runtime_error("Bad device tree magic");
+
+	totalsize = get_be32(m_data + 4);
+	off_struct = get_be32(m_data + 8);
+	m_strings = get_be32(m_data + 12);
+	off_rsvmap = get_be32(m_data + 16);
+	version = get_be32(m_data + 20);
+	m_dtb.boot_cpuid_phys = get_be32(m_data + 28);
+	m_strings_size = get_be32(m_data + 32);
+	size_struct = get_be32(m_data + 36);
+
+	if (totalsize < FDT_HEADER_SIZE || totalsize > m_size) {
+		throw std::runtime_error(fmt::format(
+		    "Device tree size {} does not fit in {} bytes",
+		    totalsize, m_size));
+	}
+
+	if (version < 16 || get_be32(m_data + 24) > FDT_VERSION) {
+		throw std::runtime_error(fmt::format(
+		    "Unsupported device tree version {}", version));
+	}
+
+	/* Version 16 headers end before size_dt_struct */
+	if (version < 17)
+		size_struct = totalsize - std::min(off_struct, totalsize);
+
+	if (off_struct % 4 != 0 || off_struct > totalsize ||
+	    size_struct > totalsize - off_struct ||
+	    m_strings > totalsize || m_strings_size > totalsize - m_strings ||
+	    off_rsvmap % 8 != 0 || off_rsvmap > totalsize)
+		throw std::runtime_error("Device tree header offsets out of range");
+
+	for (pos = off_rsvmap;; pos += 16) {
+		DTBReserve entry;
+
+		if (totalsize - pos < 16)
+			throw std::runtime_error("Unterminated memory reserve map");
+
+		entry.address = get_be64(m_data + pos);
+		entry.size = get_be64(m_data + pos + 8);
+		if (entry.address == 0 && entry.size == 0)
+			break;
+
+		m_dtb.reserved.push_back(entry);
+	}
+
+	m_pos = off_struct;
+	m_struct_end = off_struct + size_struct;
+
+	if (token() != FDT_BEGIN_NODE)
+		throw std::runtime_error("Device tree has no root node");
+
+	read_name();
+	read_node(m_dtb.root(), 0);
+
+	if (token() != FDT_END)
+		throw std::runtime_error("Missing FDT_END token");
+}
+
+uint32_t
+FDTReader::token()
+{
+	uint32_t tag;
+
+	do {
+		if (m_struct_end - m_pos < 4)
+			throw std::runtime_error("Device tree structure is truncated");
+
+		tag = get_be32(m_data + m_pos);
+		m_pos += 4;
+	} while (tag == FDT_NOP);
+
+	return (tag);
+}
+
+std::string
+FDTReader::read_name()
+{
+	const uint8_t *start = m_data + m_pos;
+	const void *nul = memchr(start, '\0', m_struct_end - m_pos);
+	std::string name;
+
+	if (nul == nullptr)
+		throw std::runtime_error("Unterminated node name");
+
+	name.assign(reinterpret_cast<const char *>(start),
+	    static_cast<const uint8_t *>(nul) - start);
+	m_pos = (m_pos + name.size() + 1 + 3) & ~(size_t)3;
+	if (m_pos > m_struct_end)
+		throw std::runtime_error("Device tree structure is truncated");
+
+	return (name);
+}
+
+void
+FDTReader::read_node(DTBNode &node, int depth)
+{
+	if (depth > DTB_MAX_DEPTH)
+		throw std::runtime_error("Device tree nodes nested too deeply");
+
+	for (;;) {
+		uint32_t len;
+		uint32_t nameoff;
+		const void *nul;
+		DTBProperty prop;
+
+		switch (token()) {
+		case FDT_PROP:
+			if (m_struct_end - m_pos < 8)
+				throw std::runtime_error("Truncated property");
+
+			len = get_be32(m_data + m_pos);
+			nameoff = get_be32(m_data + m_pos + 4);
+			m_pos += 8;
+
+			if (len > m_struct_end - m_pos)
+				throw std::runtime_error("Property value out of range");
+
+			if (nameoff >= m_strings_size)
+				throw std::runtime_error("Property name out of range");
+
+			nul = memchr(m_data + m_strings + nameoff, '\0',
+			    m_strings_size - nameoff);
+			if (nul == nullptr)
+				throw std::runtime_error("Unterminated property name");
+
+			prop.name = reinterpret_cast<const char *>(
+			    m_data + m_strings + nameoff);
+			prop.value.assign(m_data + m_pos, m_data + m_pos + len);
+			node.properties.push_back(std::move(prop));
+			m_pos = std::min(m_struct_end, (m_pos + len + 3) & ~(size_t)3);
+			break;
+
+		case FDT_BEGIN_NODE:
+			node.children.emplace_back();
+			node.children.back().name = read_name();
+			read_node(node.children.back(), depth + 1);
+			break;
+
+		case FDT_END_NODE:
+			return;
+
+		default:
+			throw std::runtime_error(fmt::format(
+			    "Unexpected device tree token 0x{:x}",
+			    get_be32(m_data + m_pos - 4)));
+		}
+	}
+}
+
+void
+write_fdt_node(const DTBNode &node, std::vector<uint8_t> &structure,
+    std::vector<uint8_t> &strings, std::map<std::string, uint32_t> &offsets)
+{
+	put_be32(structure, FDT_BEGIN_NODE);
+	structure.insert(structure.end(), node.name.begin(), node.name.end());
+	structure.push_back('\0');
+	align4(structure);
+
+	for (const auto &prop: node.properties) {
+		auto it = offsets.find(prop.name);
+
+		if (it == offsets.end()) {
+			it = offsets.emplace(prop.name, strings.size()).first;
+			strings.insert(strings.end(), prop.name.begin(),
+			    prop.name.end());
+			strings.push_back('\0');
+		}
+
+		put_be32(structure, FDT_PROP);
+		put_be32(structure, prop.value.size());
+		put_be32(structure, it->second);
+		structure.insert(structure.end(), prop.value.begin(),
+		    prop.value.end());
+		align4(structure);
+	}
+
+	for (const auto &child: node.children)
+		write_fdt_node(child, structure, strings, offsets);
+
+	put_be32(structure, FDT_END_NODE);
+}
+
+bool
+is_string_list(const std::vector<uint8_t> &value)
+{
+	if (value.empty() || value.front() == '\0' || value.back() != '\0')
+		return (false);
+
+	for (size_t i = 0; i < value.size(); i++) {
+		if (value[i] == '\0') {
+			if (i > 0 && value[i - 1] == '\0')
+				return (false);
+		} else if (!isprint(value[i]) && value[i] != '\t' &&
+		    value[i] != '\n' && value[i] != '\r')
+			return (false);
+	}
+
+	return (true);
+}
+
+std::string
+format_value(const std::vector<uint8_t> &value)
+{
+	std::string result;
+	size_t i;
+
+	if (is_string_list(value)) {
+		result = "\"";
+		for (i = 0; i < value.size() - 1; i++) {
+			switch (value[i]) {
+			case '\0': result += "\", \""; break;
+			case '"': result += "\\\""; break;
+			case '\\': result += "\\\\"; break;
+			case '\t': result += "\\t"; break;
+			case '\n': result += "\\n"; break;
+			case '\r': result += "\\r"; break;
+			default: result += value[i];
+			}
+		}
+
+		return (result + "\"");
+	}
+
+	if (value.size() % 4 == 0) {
+		result = "<";
+		for (i = 0; i < value.size(); i += 4) {
+			result += fmt::format("{}0x{:02x}", i == 0 ? "" : " ",
+			    get_be32(&value[i]));
+		}
+
+		return (result + ">");
+	}
+
+	result = "[";
+	for (i = 0; i < value.size(); i++)
+		result += fmt::format("{}{:02x}", i == 0 ? "" : " ", value[i]);
+
+	return (result + "]");
+}
+
+void
+write_dts_node(const DTBNode &node, int depth, std::string &out)
+{
+	std::string indent(depth, '\t');
+
+	out += indent;
+	for (const auto &label: node.labels)
+		out += label + ": ";
+
+	out += (depth == 0 ? "/" : node.name) + " {\n";
+
+	for (const auto &prop: node.properties) {
+		out += indent + "\t" + prop.name;
+		if (!prop.value.empty())
+			out += " = " + format_value(prop.value);
+
+		out += ";\n";
+	}
+
+	for (const auto &child: node.children) {
+		out += "\n";
+		write_dts_node(child, depth + 1, out);
+	}
+
+	out += indent + "};\n";
+}
+
+}
+
+DTBNode *
+DTBNode::find_child(const std::string &name)
+{
+	for (auto &child: children) {
+		if (child.name == name)
+			return (&child);
+	}
+
+	return (nullptr);
+}
+
+DTBProperty *
+DTBNode::find_property(const std::string &name)
+{
+	for (auto &prop: properties) {
+		if (prop.name == name)
+			return (&prop);
+	}
+
+	return (nullptr);
+}
+
+const DTBProperty *
+DTBNode::find_property(const std::string &name) const
+{
+	return (const_cast<DTBNode *>(this)->find_property(name));
+}
+
+void
+DTBNode::set_property(const std::string &name,
+    const std::vector<uint8_t> &value)
+{
+	DTBProperty *prop = find_property(name);
+
+	if (prop != nullptr)
+		prop->value = value;
 	else
-		m_dts->insert(m_dts->end(), &buffer[0], &buffer[len]);
+		properties.push_back(DTBProperty{name, value});
+}
+
+bool
+DTBNode::remove_property(const std::string &name)
+{
+	auto it = std::find_if(properties.begin(), properties.end(),
+	    [&](const DTBProperty &prop) { return (prop.name == name); });
+
+	if (it == properties.end())
+		return (false);
+
+	properties.erase(it);
+	return (true);
+}
+
+bool
+DTBNode::remove_child(const std::string &name)
+{
+	auto it = std::find_if(children.begin(), children.end(),
+	    [&](const DTBNode &child) { return (child.name == name); });
+
+	if (it == children.end())
+		return (false);
+
+	children.erase(it);
+	return (true);
+}
+
+DTB::DTB():
+    boot_cpuid_phys(0)
+{
+}
+
+DTB
+DTB::from_dts(const std::string &source)
+{
+	DTB result;
+
+	DTSParser(source, result).parse();
+	return (result);
+}
+
+DTB
+DTB::from_blob(const uint8_t *data, size_t size)
+{
+	DTB result;
+
+	FDTReader(data, size, result).read();
+	return (result);
+}
+
+DTB
+DTB::from_blob(const std::vector<uint8_t> &blob)
+{
+	return (from_blob(blob.data(), blob.size()));
+}
+
+std::vector<uint8_t>
+DTB::to_blob() const
+{
+	std::map<std::string, uint32_t> offsets;
+	std::vector<uint8_t> structure;
+	std::vector<uint8_t> strings;
+	std::vector<uint8_t> result;
+	size_t off_struct;
+
+	write_fdt_node(m_root, structure, strings, offsets);
+	put_be32(structure, FDT_END);
+
+	off_struct = FDT_HEADER_SIZE + (reserved.size() + 1) * 16;
+	result.reserve(off_struct + structure.size() + strings.size());
+
+	put_be32(result, FDT_MAGIC);
+	put_be32(result, off_struct + structure.size() + strings.size());
+	put_be32(result, off_struct);
+	put_be32(result, off_struct + structure.size());
+	put_be32(result, FDT_HEADER_SIZE);
+	put_be32(result, FDT_VERSION);
+	put_be32(result, FDT_LAST_COMP_VERSION);
+	put_be32(result, boot_cpuid_phys);
+	put_be32(result, strings.size());
+	put_be32(result, structure.size());
+
+	for (const auto &entry: reserved) {
+		put_be(result, entry.address, 64);
+		put_be(result, entry.size, 64);
+	}
+
+	put_be(result, 0, 64);
+	put_be(result, 0, 64);
+
+	result.insert(result.end(), structure.begin(), structure.end());
+	result.insert(result.end(), strings.begin(), strings.end());
+	return (result);
+}
+
+std::string
+DTB::to_dts() const
+{
+	std::string result = "/dts-v1/;\n\n";
+
+	for (const auto &entry: reserved) {
+		result += fmt::format("/memreserve/\t0x{:016x} 0x{:016x};\n",
+		    entry.address, entry.size);
+	}
+
+	if (!reserved.empty())
+		result += "\n";
 
-	m_out->read_bytes_async(BUFFER_SIZE,
-	    sigc::mem_fun(*this, &DTB::output_ready));
+	write_dts_node(m_root, 0, result);
+	return (result);
+}
+
+std::vector<uint8_t>
+DTB::compile(const std::string &source)
+{
+	return (from_dts(source).to_blob());
+}
+
+std::string
+DTB::decompile(const std::vector<uint8_t> &blob)
+{
+	return (from_blob(blob).to_dts());
+}
+
+/* A property value in DTS syntax, as on the right hand side of '=' */
+std::vector<uint8_t>
+DTB::parse_value(const std::string &text)
+{
+	if (text.empty())
+		return {};
+
+	try {
+		DTB tree = from_dts("/dts-v1/;\n/ {\n\tvalue = " + text + ";\n};\n");
+
+		return (tree.root().find_property("value")->value);
+	} catch (const std::runtime_error &err) {
+		throw std::runtime_error(fmt::format(
+		    "Invalid property value {}: {}", text, err.what()));
+	}
+}
+
+DTBNode *
+DTB::find_node(const std::string &path)
+{
+	DTBNode *node = &m_root;
+	size_t pos = 1;
+	size_t end;
+
+	if (path.empty() || path[0] != '/')
+		return (nullptr);
+
+	while (node != nullptr && pos < path.size()) {
+		end = path.find('/', pos);
+		if (end == std::string::npos)
+			end = path.size();
+
+		if (end > pos)
+			node = node->find_child(path.substr(pos, end - pos));
+
+		pos = end + 1;
+	}
+
+	return (node);
+}
+
+FDTBlob::FDTBlob(const uint8_t *data, size_t size):
+    m_data(DTB::from_blob(data, size).to_blob())
+{
+}
+
+FDTBlob::FDTBlob(const std::vector<uint8_t> &blob):
+    FDTBlob(blob.data(), blob.size())
+{
+}
+
+uint32_t
+FDTBlob::header(size_t offset) const
+{
+	return (get_be32(&m_data[offset]));
 }
 
 void
-DTB::error_ready(Glib::RefPtr<Gio::AsyncResult> &result)
+FDTBlob::set_header(size_t offset, uint32_t value)
+{
+	m_data[offset] = (value >> 24) & 0xff;
+	m_data[offset + 1] = (value >> 16) & 0xff;
+	m_data[offset + 2] = (value >> 8) & 0xff;
+	m_data[offset + 3] = value & 0xff;
+}
+
+/* Offset of the first token inside the node, after its name */
+size_t
+FDTBlob::find_node(const std::string &path) const
+{
+	std::vector<std::string> components;
+	size_t pos = header(FDT_OFF_DT_STRUCT);
+	size_t matched = 0;
+	size_t start = 1;
+	size_t end;
+	int level = -1;
+
+	if (path.empty() || path[0] != '/')
+		throw std::runtime_error(fmt::format(
+		    "Node path {} is not absolute", path));
+
+	while (start < path.size()) {
+		end = path.find('/', start);
+		if (end == std::string::npos)
+			end = path.size();
+
+		if (end > start)
+			components.push_back(path.substr(start, end - start));
+
+		start = end + 1;
+	}
+
+	for (;;) {
+		const char *name;
+
+		switch (get_be32(&m_data[pos])) {
+		case FDT_BEGIN_NODE:
+			name = reinterpret_cast<const char *>(&m_data[pos + 4]);
+			pos = (pos + 4 + strlen(name) + 1 + 3) & ~(size_t)3;
+			level++;
+
+			if (level > 0 && matched == (size_t)level - 1 &&
+			    matched < components.size() &&
+			    components[matched] == name)
+				matched++;
+
+			if (matched == components.size() &&
+			    (size_t)level == matched)
+				return (pos);
+
+			break;
+
+		case FDT_END_NODE:
+			if (level > 0 && matched == (size_t)level)
+				matched--;
+
+			level--;
+			pos += 4;
+			break;
+
+		case FDT_PROP:
+			pos += 12 + ((get_be32(&m_data[pos + 4]) + 3) & ~3u);
+			break;
+
+		case FDT_NOP:
+			pos += 4;
+			break;
+
+		default:
+			throw std::runtime_error(fmt::format(
+			    "No node {} in device tree", path));
+		}
+	}
+}
+
+/*
+ * Offset of the property's FDT_PROP token, or npos with `end` set to
+ * where a new property of the node goes (properties precede subnodes).
+ */
+size_t
+FDTBlob::find_property(size_t node, const std::string &name, size_t &end) const
 {
-	Glib::RefPtr<Glib::Bytes> data;
-	const uint8_t *buffer;
-	size_t len;
+	size_t strings = header(FDT_OFF_DT_STRINGS);
+	size_t pos = node;
 
-	data = m_err->read_bytes_finish(result);
-	buffer = static_cast<const uint8_t *>(data->get_data(len));
+	for (;;) {
+		switch (get_be32(&m_data[pos])) {
+		case FDT_PROP:
+			if (name == reinterpret_cast<const char *>(
+			    &m_data[strings + get_be32(&m_data[pos + 8])]))
+				return (pos);
 
-	if (len == 0)
+			pos += 12 + ((get_be32(&m_data[pos + 4]) + 3) & ~3u);
+			break;
+
+		case FDT_NOP:
+			pos += 4;
+			break;
+
+		default:
+			end = pos;
+			return (std::string::npos);
+		}
+	}
+}
+
+std::optional<std::vector<uint8_t>>
+FDTBlob::get_property(const std::string &path, const std::string &name) const
+{
+	size_t end;
+	size_t pos = find_property(find_node(path), name, end);
+	uint32_t len;
+
+	if (pos == std::string::npos)
+		return (std::nullopt);
+
+	len = get_be32(&m_data[pos + 4]);
+	return (std::vector<uint8_t>(&m_data[pos + 12], &m_data[pos + 12] + len));
+}
+
+/* Reuses any string the name is a suffix of, as dtc does */
+uint32_t
+FDTBlob::add_string(const std::string &name)
+{
+	size_t strings = header(FDT_OFF_DT_STRINGS);
+	size_t size = header(FDT_OFF_SIZE_STRINGS);
+	auto first = m_data.begin() + strings;
+	auto last = first + size;
+	auto it = std::search(first, last, name.c_str(),
+	    name.c_str() + name.size() + 1);
+
+	if (it != last)
+		return (it - first);
+
+	m_data.insert(last, name.c_str(), name.c_str() + name.size() + 1);
+	set_header(FDT_OFF_SIZE_STRINGS, size + name.size() + 1);
+	set_header(FDT_OFF_TOTALSIZE, m_data.size());
+	return (size);
+}
+
+void
+FDTBlob::splice(size_t offset, size_t remove,
+    const std::vector<uint8_t> &insert)
+{
+	uint32_t delta = insert.size() - remove;
+
+	if (insert.size() == remove) {
+		std::copy(insert.begin(), insert.end(), m_data.begin() + offset);
 		return;
+	}
+
+	m_data.erase(m_data.begin() + offset, m_data.begin() + offset + remove);
+	m_data.insert(m_data.begin() + offset, insert.begin(), insert.end());
+
+	/* Unsigned wrap-around makes a shrinking delta subtract */
+	set_header(FDT_OFF_SIZE_STRUCT, header(FDT_OFF_SIZE_STRUCT) + delta);
+	set_header(FDT_OFF_DT_STRINGS, header(FDT_OFF_DT_STRINGS) + delta);
+	set_header(FDT_OFF_TOTALSIZE, m_data.size());
+}
+
+void
+FDTBlob::set_property(const std::string &path, const std::string &name,
+    const std::vector<uint8_t> &value)
+{
+	std::vector<uint8_t> token;
+	size_t node = find_node(path);
+	size_t end;
+	size_t pos = find_property(node, name, end);
+	uint32_t nameoff;
 
-	m_errors.insert(m_errors.end(), &buffer[0], &buffer[len]);
-	m_err->read_bytes_async(BUFFER_SIZE,
-	    sigc::mem_fun(*this, &DTB::error_ready));
+	/* The strings block follows the structure, so node offsets hold */
+	nameoff = pos != std::string::npos ? get_be32(&m_data[pos + 8]) :
+	    add_string(name);
+
+	put_be32(token, FDT_PROP);
+	put_be32(token, value.size());
+	put_be32(token, nameoff);
+	token.insert(token.end(), value.begin(), value.end());
+	align4(token);
+
+	if (pos != std::string::npos)
+		splice(pos, 12 + ((get_be32(&m_data[pos + 4]) + 3) & ~3u), token);
+	else
+		splice(end, 0, token);
 }
 
 void
-DTB::child_exited(Glib::Pid pid, int code)
+FDTBlob::set_string(const std::string &path, const std::string &name,
+    const std::string &value)
 {
-	Logger::debug("Child exited, status: {}", code);
-	m_done(code == 0, m_compile ? m_dtb->size() : m_dts->size(), m_errors);
+	set_property(path, name, std::vector<uint8_t>(value.c_str(),
+	    value.c_str() + value.size() + 1));
 }
@@ -1,11 +1,73 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <eeprom.hh>
 #include <eeprom/24c.hh>
 #include <log.hh>
+#include <onie_tlv.hh>
 
 #define RD_BIT 0x01
 /* First = eeprom address without R/W = 8th bit, Second = eeprom address extended to 8 bits */
 std::map<std::string, uint8_t> Eeprom::eeprom_addrs = { {"0x50", 0xa0}, {"0x56", 0xac} };
 
+static uint32_t be32(const std::vector<uint8_t> &data, size_t offset)
+{
+    return ((uint32_t)data[offset] << 24 | (uint32_t)data[offset + 1] << 16 |
+        (uint32_t)data[offset + 2] << 8 | data[offset + 3]);
+}
+
+void Eeprom::read_tlv(std::vector<uint8_t> &data)
+{
+    const size_t hdrlen = sizeof(tlv_header_raw);
+    size_t total;
+
+    data.clear();
+    read(0, hdrlen, data);
+    if (data.size() != hdrlen)
+        throw std::runtime_error("Short read of the TLV header");
+
+    if (memcmp(data.data(), TLV_EEPROM_ID_STRING,
+        sizeof(TLV_EEPROM_ID_STRING)) != 0)
+        throw std::runtime_error("No ONIE TLV signature in EEPROM");
+
+    if (data[8] != TLV_EEPROM_VERSION)
+        throw std::runtime_error(fmt::format(
+            "Unsupported TLV version {}", data[8]));
+
+    total = (size_t)data[9] << 8 | data[10];
+    if (total < TLV_EEPROM_LEN_CRC || total > TLV_EEPROM_LEN_MAX)
+        throw std::runtime_error(fmt::format(
+            "Invalid TLV total length {}", total));
+
+    Logger::debug("Reading {} bytes of TLV data", total);
+    read(hdrlen, total, data);
+    if (data.size() != hdrlen + total)
+        throw std::runtime_error("Short read of the TLV data");
+}
+
+void Eeprom::read_fdt(std::vector<uint8_t> &data)
+{
+    size_t total;
+
+    data.clear();
+    read(0, EEPROM_FDT_HEADER_SIZE, data);
+    if (data.size() != EEPROM_FDT_HEADER_SIZE)
+        throw std::runtime_error("Short read of the FDT header");
+
+    if (be32(data, 0) != EEPROM_FDT_MAGIC)
+        throw std::runtime_error("No device tree blob in EEPROM");
+
+    total = be32(data, 4);
+    if (total < EEPROM_FDT_HEADER_SIZE || total > EEPROM_FDT_MAX_SIZE)
+        throw std::runtime_error(fmt::format(
+            "Invalid device tree size {}", total));
+
+    Logger::debug("Reading {} bytes of device tree", total);
+    read(EEPROM_FDT_HEADER_SIZE, total - EEPROM_FDT_HEADER_SIZE, data);
+    if (data.size() != total)
+        throw std::runtime_error("Short read of the device tree");
+}
+
 void Eeprom24c::read(uint16_t offset, size_t length, std::vector<uint8_t> &data)
 {
     if (!address.valid) {
@@ -45,7 +107,8 @@ void Eeprom24c::write(uint16_t offset, const std::vector<uint8_t> &data)
             static_cast<unsigned char>(offset & 0xff)
         });
 
-        slice = std::vector<uint8_t>(data.begin() + i, data.begin() + i + 32);
+        slice = std::vector<uint8_t>(data.begin() + i,
+            data.begin() + std::min(i + 32, data.size()));
         m_i2c.write(slice);
         m_i2c.stop();
         offset += 32;
@@ -0,0 +1,501 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <thread>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <cstring>
+#include <endian.h>
+#include <netinet/in.h>
+#include <fmt/format.h>
+#include <zlib.h>
+#include <eeprom_batch.hh>
+#include <eeprom.hh>
+#include <filesystem.hh>
+#include <ledger.hh>
+#include <log.hh>
+
+EepromBatch::EepromBatch(const EepromBatchConfig &config):
+    m_config(config)
+{
+	std::string ext = filesystem::path(config.template_file).extension().string();
+
+	if (ext == ".dtb" || ext == ".dts")
+		load_dtb_template();
+	else
+		load_tlv_template();
+
+	if (config.count == 0)
+		throw std::runtime_error("Number of images must be at least 1");
+
+	check_mac_range();
+}
+
+/* The last board's block has to end within the 48 bit address space */
+void
+EepromBatch::check_mac_range() const
+{
+	uint64_t base = m_mac_base.value_or(0);
+
+	if (!m_mac_base.has_value())
+		return;
+
+	if (m_mac_stride == 0)
+		throw std::runtime_error("MAC stride must be at least 1");
+
+	if (base > EEPROM_BATCH_MAC_MAX || m_config.count >
+	    (EEPROM_BATCH_MAC_MAX - base + 1) / m_mac_stride)
+		throw std::runtime_error(fmt::format(
+		    "{} boards with {} MACs each from {} run out of addresses",
+		    m_config.count, m_mac_stride, format_mac(base)));
+}
+
+void
+EepromBatch::load_tlv_template()
+{
+	const EepromBatchConfig &config = m_config;
+
+	if (!config.dtb_set.empty())
+		throw std::runtime_error(
+		    "Device tree properties need a .dtb or .dts template");
+
+	try {
+		m_template.load_from_yaml(config.template_file);
+		m_board = m_template.get_board_name_from_yaml();
+
+		if (config.first_serial.has_value())
+			m_first_serial = config.first_serial.value();
+		else if (m_template.has_tlv_record(TLV_CODE_SERIAL_NUMBER))
+			m_first_serial = std::stoull(m_template.get_tlv_record(
+			    TLV_CODE_SERIAL_NUMBER).value(), nullptr, 0);
+		else
+			throw std::runtime_error(fmt::format(
+			    "{} has no serial-number, give the first one",
+			    config.template_file));
+
+		if (config.mac_base.has_value())
+			m_mac_base = config.mac_base;
+		else if (m_template.has_tlv_record(TLV_CODE_MAC_BASE))
+			m_mac_base = parse_mac(m_template.get_tlv_record(
+			    TLV_CODE_MAC_BASE).value());
+
+		if (config.mac_stride.has_value())
+			m_mac_stride = config.mac_stride.value();
+		else if (m_template.has_tlv_record(TLV_CODE_NUM_MACs))
+			m_mac_stride = std::stoul(m_template.get_tlv_record(
+			    TLV_CODE_NUM_MACs).value());
+		else
+			m_mac_stride = 1;
+	} catch (const OnieTLVException &err) {
+		throw std::runtime_error(fmt::format("{}: {}",
+		    config.template_file, err.get_info()));
+	} catch (const std::logic_error &err) {
+		throw std::runtime_error(fmt::format(
+		    "{}: serial-number is not a number", config.template_file));
+	}
+}
+
+/* String properties of the template's root node, if NUL terminated */
+static std::optional<std::string>
+root_string(const FDTBlob &blob, const char *name)
+{
+	std::optional<std::vector<uint8_t>> value = blob.get_property("/", name);
+
+	if (!value.has_value() || value->empty() || value->back() != '\0')
+		return (std::nullopt);
+
+	return (std::string((const char *)value->data()));
+}
+
+void
+EepromBatch::load_dtb_template()
+{
+	const EepromBatchConfig &config = m_config;
+	std::ifstream f(config.template_file, std::ios::binary);
+	std::vector<uint8_t> blob((std::istreambuf_iterator<char>(f)),
+	    std::istreambuf_iterator<char>());
+	std::optional<std::vector<uint8_t>> mac;
+	std::optional<std::string> serial;
+	size_t pos;
+
+	if (!f.is_open())
+		throw std::runtime_error(fmt::format("Cannot read {}",
+		    config.template_file));
+
+	try {
+		if (filesystem::path(config.template_file).extension() == ".dts")
+			blob = DTB::compile(std::string(blob.begin(), blob.end()));
+
+		m_dtb_template.emplace(blob);
+
+		for (const auto &i: config.dtb_set) {
+			size_t colon = i.find(':');
+			size_t equals = i.find('=', colon);
+
+			if (colon == std::string::npos || equals == std::string::npos)
+				throw std::runtime_error(fmt::format(
+				    "Expected path:name=value, got {}", i));
+
+			m_dtb_template->set_property(i.substr(0, colon),
+			    i.substr(colon + 1, equals - colon - 1),
+			    DTB::parse_value(i.substr(equals + 1)));
+		}
+	} catch (const std::runtime_error &err) {
+		throw std::runtime_error(fmt::format("{}: {}",
+		    config.template_file, err.what()));
+	}
+
+	m_board = root_string(*m_dtb_template, EEPROM_BATCH_DTB_MODEL).value_or("");
+
+	serial = root_string(*m_dtb_template, EEPROM_BATCH_DTB_SERIAL);
+	if (config.first_serial.has_value())
+		m_first_serial = config.first_serial.value();
+	else {
+		try {
+			m_first_serial = std::stoull(serial.value(), &pos, 0);
+			if (pos != serial->size())
+				throw std::invalid_argument(serial.value());
+		} catch (const std::logic_error &err) {
+			throw std::runtime_error(fmt::format(
+			    "{} has no numeric {} property, give the first one",
+			    config.template_file, EEPROM_BATCH_DTB_SERIAL));
+		}
+	}
+
+	/* An all-zero address is the placeholder of the default template */
+	mac = m_dtb_template->get_property("/", EEPROM_BATCH_DTB_MAC);
+	if (config.mac_base.has_value())
+		m_mac_base = config.mac_base;
+	else if (mac.has_value() && mac->size() == 6 &&
+	    std::any_of(mac->begin(), mac->end(), [](uint8_t b) { return (b); })) {
+		m_mac_base = 0;
+		for (uint8_t byte: mac.value())
+			m_mac_base = (m_mac_base.value() << 8) | byte;
+	}
+
+	m_mac_stride = config.mac_stride.value_or(1);
+}
+
+const std::vector<EepromBatchImage> &
+EepromBatch::get_images() const
+{
+	return (m_images);
+}
+
+std::string
+EepromBatch::format_mac(uint64_t mac)
+{
+	return (fmt::format("{:02X}:{:02X}:{:02X}:{:02X}:{:02X}:{:02X}",
+	    (mac >> 40) & 0xff, (mac >> 32) & 0xff, (mac >> 24) & 0xff,
+	    (mac >> 16) & 0xff, (mac >> 8) & 0xff, mac & 0xff));
+}
+
+uint64_t
+EepromBatch::parse_mac(const std::string &text)
+{
+	unsigned int bytes[6];
+	uint64_t result = 0;
+
+	if (std::sscanf(text.c_str(), "%02x:%02x:%02x:%02x:%02x:%02x",
+	    &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4],
+	    &bytes[5]) != 6)
+		throw std::runtime_error(fmt::format("Invalid MAC address {}",
+		    text));
+
+	for (unsigned int byte: bytes)
+		result = (result << 8) | byte;
+
+	return (result);
+}
+
+/*
+ * The template values only act as a floor once a ledger is in use, so
+ * the MAC range is checked again from where the ledger started it.
+ */
+void
+EepromBatch::reserve()
+{
+	Ledger ledger(m_config.ledger);
+	unsigned int mac_count = m_mac_base.has_value() ? m_mac_stride : 0;
+	LedgerEntry first = ledger.reserve(m_config.count, mac_count,
+	    m_first_serial, m_mac_base.value_or(0), m_config.output,
+	    m_board).front();
+
+	m_first_serial = first.serial;
+	if (m_mac_base.has_value())
+		m_mac_base = first.mac;
+
+	check_mac_range();
+}
+
+bool
+EepromBatch::is_directory_output() const
+{
+	return (m_config.output.back() == '/' ||
+	    filesystem::is_directory(m_config.output));
+}
+
+/*
+ * Images [first, last) go into one buffer, offsets relative to its
+ * start. In directory mode the worker also writes its own files.
+ */
+void
+EepromBatch::generate(size_t first, size_t last, std::vector<uint8_t> &out)
+{
+	OnieTLV tlv(m_template);
+	uint8_t image[TLV_EEPROM_MAX_SIZE];
+	bool directory = is_directory_output();
+	uint32_t crc;
+
+	if (m_dtb_template.has_value()) {
+		generate_dtb(first, last, out);
+		return;
+	}
+
+	out.reserve((last - first) * (m_template.get_usage() + 64));
+
+	for (size_t i = first; i < last; i++) {
+		EepromBatchImage &entry = m_images[i];
+
+		entry.serial = fmt::format("0x{:08x}", m_first_serial + i);
+		tlv.save_user_tlv(TLV_CODE_SERIAL_NUMBER, entry.serial);
+
+		if (m_mac_base.has_value()) {
+			entry.mac = format_mac(m_mac_base.value() + i * m_mac_stride);
+			tlv.save_user_tlv(TLV_CODE_MAC_BASE, entry.mac);
+		}
+
+		if (!tlv.generate_eeprom_file(image))
+			throw std::runtime_error(fmt::format(
+			    "Image {} does not fit in the EEPROM", entry.serial));
+
+		memcpy(&crc, image + tlv.get_usage() - sizeof(crc), sizeof(crc));
+		entry.crc32 = ntohl(crc);
+		entry.length = tlv.get_usage();
+		store(entry, image, directory, out);
+	}
+}
+
+void
+EepromBatch::generate_dtb(size_t first, size_t last, std::vector<uint8_t> &out)
+{
+	FDTBlob blob(m_dtb_template.value());
+	bool directory = is_directory_output();
+	std::vector<uint8_t> mac(6);
+	uint64_t addr;
+
+	out.reserve((last - first) * (blob.data().size() + 16));
+
+	for (size_t i = first; i < last; i++) {
+		EepromBatchImage &entry = m_images[i];
+
+		entry.serial = fmt::format("0x{:08x}", m_first_serial + i);
+		blob.set_string("/", EEPROM_BATCH_DTB_SERIAL, entry.serial);
+
+		if (m_mac_base.has_value()) {
+			addr = m_mac_base.value() + i * m_mac_stride;
+			entry.mac = format_mac(addr);
+			for (size_t j = 0; j < mac.size(); j++)
+				mac[j] = (addr >> (40 - 8 * j)) & 0xff;
+
+			blob.set_property("/", EEPROM_BATCH_DTB_MAC, mac);
+		}
+
+		if (blob.data().size() > EEPROM_FDT_MAX_SIZE)
+			throw std::runtime_error(fmt::format(
+			    "Device tree image is {} bytes, the EEPROM holds {}",
+			    blob.data().size(), EEPROM_FDT_MAX_SIZE));
+
+		entry.length = blob.data().size();
+		entry.crc32 = crc32(0, blob.data().data(), entry.length);
+		store(entry, blob.data().data(), directory, out);
+	}
+}
+
+void
+EepromBatch::store(EepromBatchImage &entry, const uint8_t *image,
+    bool directory, std::vector<uint8_t> &out)
+{
+	entry.offset = out.size();
+
+	if (directory) {
+		std::string path = (filesystem::path(m_config.output) /
+		    (entry.serial + ".bin")).string();
+		std::ofstream f(path, std::ios::binary | std::ios::trunc);
+
+		f.write((const char *)image, entry.length);
+		if (!f)
+			throw std::runtime_error(fmt::format(
+			    "Cannot write {}", path));
+	} else
+		out.insert(out.end(), image, image + entry.length);
+}
+
+void
+EepromBatch::run()
+{
+	unsigned int jobs = m_config.jobs ? m_config.jobs :
+	    std::thread::hardware_concurrency();
+	std::vector<std::exception_ptr> errors;
+	std::vector<std::thread> workers;
+	size_t per_job;
+
+	jobs = std::max(1U, (unsigned int)std::min<size_t>(jobs, m_config.count));
+	per_job = (m_config.count + jobs - 1) / jobs;
+
+	if (m_config.output.empty())
+		throw std::runtime_error("No output given");
+
+	if (m_config.output.back() == '/')
+		filesystem::create_directories(m_config.output);
+
+	if (!m_config.ledger.empty())
+		reserve();
+
+	m_images.assign(m_config.count, EepromBatchImage());
+	m_chunks.assign(jobs, std::vector<uint8_t>());
+	m_chunk_first.assign(jobs, 0);
+	errors.assign(jobs, nullptr);
+
+	for (unsigned int t = 0; t < jobs; t++) {
+		size_t first = std::min(t * per_job, m_config.count);
+		size_t last = std::min(first + per_job, m_config.count);
+
+		m_chunk_first[t] = first;
+		workers.emplace_back([this, t, first, last, &errors]() {
+			try {
+				generate(first, last, m_chunks[t]);
+			} catch (...) {
+				errors[t] = std::current_exception();
+			}
+		});
+	}
+
+	for (auto &worker: workers)
+		worker.join();
+
+	for (auto &error: errors) {
+		if (!error)
+			continue;
+
+		try {
+			std::rethrow_exception(error);
+		} catch (const OnieTLVException &err) {
+			throw std::runtime_error(err.get_info());
+		}
+	}
+
+	if (is_directory_output())
+		write_directory();
+	else
+		write_archive();
+}
+
+void
+EepromBatch::write_directory()
+{
+	write_manifest((filesystem::path(m_config.output) /
+	    "manifest.csv").string());
+}
+
+void
+EepromBatch::write_archive()
+{
+	struct eeprom_batch_header_raw header;
+	std::vector<eeprom_batch_entry_raw> index(m_images.size());
+	std::ofstream f(m_config.output, std::ios::binary | std::ios::trunc);
+	uint64_t base = sizeof(header) + index.size() * sizeof(index[0]);
+
+	if (!f)
+		throw std::runtime_error(fmt::format("Cannot create {}",
+		    m_config.output));
+
+	memcpy(header.magic, EEPROM_BATCH_MAGIC, sizeof(header.magic));
+	header.version = htonl(EEPROM_BATCH_VERSION);
+	header.count = htonl(m_images.size());
+
+	/* Chunk offsets become archive offsets once the chunks are laid out */
+	for (size_t t = 0; t < m_chunks.size(); t++) {
+		size_t last = t + 1 < m_chunks.size() ? m_chunk_first[t + 1] :
+		    m_images.size();
+
+		for (size_t i = m_chunk_first[t]; i < last; i++) {
+			m_images[i].offset += base;
+			index[i].offset = htobe64(m_images[i].offset);
+			index[i].length = htonl(m_images[i].length);
+			index[i].crc32 = htonl(m_images[i].crc32);
+			memset(index[i].serial, 0, sizeof(index[i].serial));
+			strncpy(index[i].serial, m_images[i].serial.c_str(),
+			    sizeof(index[i].serial) - 1);
+		}
+
+		base += m_chunks[t].size();
+	}
+
+	f.write((const char *)&header, sizeof(header));
+	f.write((const char *)index.data(), index.size() * sizeof(index[0]));
+	for (const auto &chunk: m_chunks)
+		f.write((const char *)chunk.data(), chunk.size());
+
+	if (!f)
+		throw std::runtime_error(fmt::format("Cannot write {}",
+		    m_config.output));
+
+	write_manifest(m_config.output + ".csv");
+}
+
+void
+EepromBatch::write_manifest(const std::string &path)
+{
+	std::ofstream f(path, std::ios::trunc);
+	bool directory = is_directory_output();
+	fmt::memory_buffer buf;
+
+	fmt::format_to(buf, "index,serial,mac,{},length,crc32\n",
+	    directory ? "file" : "offset");
+
+	for (size_t i = 0; i < m_images.size(); i++) {
+		const EepromBatchImage &entry = m_images[i];
+
+		if (directory)
+			fmt::format_to(buf, "{},{},{},{}.bin,{},{:08x}\n", i,
+			    entry.serial, entry.mac, entry.serial, entry.length,
+			    entry.crc32);
+		else
+			fmt::format_to(buf, "{},{},{},{},{},{:08x}\n", i,
+			    entry.serial, entry.mac, entry.offset, entry.length,
+			    entry.crc32);
+	}
+
+	f.write(buf.data(), buf.size());
+	if (!f)
+		throw std::runtime_error(fmt::format("Cannot write {}", path));
+}
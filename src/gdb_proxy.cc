@@ -0,0 +1,698 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <cstdio>
+#include <algorithm>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <gdb_proxy.hh>
+
+#define GDB_PROXY_BLOCK	64
+#define MAX_READ	2048
+#define RECV_SIZE	4096
+
+static uint8_t
+checksum(const std::string &payload)
+{
+	uint8_t sum = 0;
+
+	for (char c: payload)
+		sum += (uint8_t)c;
+
+	return (sum);
+}
+
+static bool
+wait_fd(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret < 0 && errno == EINTR);
+
+	return (ret > 0 && !(pfd.revents & POLLNVAL));
+}
+
+/* Expands run-length encoding, then converts hex to raw bytes */
+static bool
+decode_hex(const std::string &data, std::string &bytes)
+{
+	std::string hex;
+	size_t i;
+
+	for (i = 0; i < data.size(); i++) {
+		if (data[i] == '*' && !hex.empty() && i + 1 < data.size()) {
+			hex.append(data[i + 1] - 29, hex.back());
+			i++;
+		} else
+			hex += data[i];
+	}
+
+	if (hex.size() % 2 || hex.empty() || hex[0] == 'E')
+		return (false);
+
+	bytes.clear();
+	for (i = 0; i < hex.size(); i += 2) {
+		if (!isxdigit(hex[i]) || !isxdigit(hex[i + 1]))
+			return (false);
+
+		bytes += (char)std::stoi(hex.substr(i, 2), nullptr, 16);
+	}
+
+	return (true);
+}
+
+static std::string
+encode_hex(const std::string &bytes)
+{
+	std::string hex;
+
+	for (char c: bytes)
+		hex += fmt::format("{:02x}", (uint8_t)c);
+
+	return (hex);
+}
+
+static bool
+is_resume(const std::string &packet)
+{
+	switch (packet[0]) {
+	case 'c':
+	case 'C':
+	case 's':
+	case 'S':
+		return (true);
+	default:
+		return (packet.rfind("vCont;", 0) == 0);
+	}
+}
+
+GdbProxy::GdbProxy(Glib::RefPtr<Gio::InetAddress> address, uint16_t port,
+    const std::string &upstream_host, uint16_t upstream_port,
+    const GdbProxyRanges &ram):
+    m_address(address),
+    m_port(port),
+    m_upstream_host(upstream_host),
+    m_upstream_port(upstream_port),
+    m_ram(ram),
+    m_running(false),
+    m_upstream_fd(-1),
+    m_upstream_noack(false),
+    m_halted(false),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+GdbProxy::~GdbProxy()
+{
+	stop();
+}
+
+void
+GdbProxy::start()
+{
+	Glib::RefPtr<Gio::SocketAddress> retaddr;
+
+	if (m_running)
+		return;
+
+	m_service = Gio::ThreadedSocketService::create(10);
+	m_service->add_address(Gio::InetSocketAddress::create(m_address, m_port),
+	    Gio::SocketType::SOCKET_TYPE_STREAM,
+	    Gio::SocketProtocol::SOCKET_PROTOCOL_TCP, retaddr);
+	m_service->signal_run().connect(sigc::mem_fun(*this,
+	    &GdbProxy::client_worker));
+	m_service->start();
+	m_running = true;
+
+	Logger::info("GDB proxy: listening on {}:{}, upstream {}:{}",
+	    m_address->to_string(), m_port, m_upstream_host, m_upstream_port);
+}
+
+void
+GdbProxy::stop()
+{
+	std::unique_lock<std::mutex> clients(m_clients_lock);
+	int upstream = m_upstream_fd;
+
+	if (!m_running)
+		return;
+
+	m_running = false;
+	m_service->stop();
+	m_service->close();
+
+	/* Wake up workers blocked on either side of the proxy */
+	for (int fd: m_clients)
+		shutdown(fd, SHUT_RDWR);
+
+	if (upstream >= 0)
+		shutdown(upstream, SHUT_RDWR);
+
+	m_idle.wait(clients, [this]() { return (m_clients.empty()); });
+	clients.unlock();
+
+	std::lock_guard<std::mutex> guard(m_lock);
+	disconnect_upstream();
+	Logger::info("GDB proxy: stopped, {} cache hits, {} misses",
+	    m_hits, m_misses);
+}
+
+bool
+GdbProxy::parse_event(std::string &buffer, Event &event, std::string &payload)
+{
+	size_t end;
+
+	while (!buffer.empty()) {
+		if (buffer[0] == '\x03') {
+			buffer.erase(0, 1);
+			event = INTERRUPT;
+			return (true);
+		}
+
+		/* Acks, retransmit requests and line noise */
+		if (buffer[0] != '$') {
+			buffer.erase(0, 1);
+			continue;
+		}
+
+		end = buffer.find('#');
+		if (end == std::string::npos || end + 2 >= buffer.size())
+			return (false);
+
+		payload = buffer.substr(1, end - 1);
+		buffer.erase(0, end + 3);
+		event = PACKET;
+		return (true);
+	}
+
+	return (false);
+}
+
+bool
+GdbProxy::fill(int fd, std::string &buffer)
+{
+	char data[RECV_SIZE];
+	ssize_t ret;
+
+	for (;;) {
+		ret = recv(fd, data, sizeof(data), 0);
+		if (ret > 0) {
+			buffer.append(data, ret);
+			return (true);
+		}
+
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			if (!wait_fd(fd, POLLIN))
+				return (false);
+			continue;
+		}
+
+		return (false);
+	}
+}
+
+GdbProxy::Event
+GdbProxy::read_event(int fd, std::string &buffer, std::string &payload)
+{
+	Event event;
+
+	while (!parse_event(buffer, event, payload)) {
+		if (!fill(fd, buffer))
+			return (CLOSED);
+	}
+
+	return (event);
+}
+
+bool
+GdbProxy::write_all(int fd, const std::string &data)
+{
+	size_t offset = 0;
+	ssize_t ret;
+
+	while (offset < data.size()) {
+		ret = send(fd, data.data() + offset, data.size() - offset,
+		    MSG_NOSIGNAL);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			if (!wait_fd(fd, POLLOUT))
+				return (false);
+			continue;
+		}
+
+		if (ret < 0)
+			return (false);
+
+		offset += ret;
+	}
+
+	return (true);
+}
+
+bool
+GdbProxy::send_packet(int fd, const std::string &payload)
+{
+	return (write_all(fd, fmt::format("${}#{:02x}", payload,
+	    checksum(payload))));
+}
+
+size_t
+GdbProxy::client_count()
+{
+	std::lock_guard<std::mutex> guard(m_clients_lock);
+
+	return (m_clients.size());
+}
+
+bool
+GdbProxy::client_worker(const Glib::RefPtr<Gio::SocketConnection> &conn,
+    const Glib::RefPtr<Glib::Object> &source)
+{
+	Client client { conn->get_socket()->get_fd(), false, "", "" };
+	std::string remote = conn->get_remote_address()->to_string();
+	std::string packet;
+	std::string reply;
+	Event event;
+	bool keep;
+	bool last;
+
+	{
+		std::lock_guard<std::mutex> guard(m_clients_lock);
+
+		if (!m_running)
+			return (false);
+
+		m_clients.insert(client.fd);
+	}
+
+	Logger::info("GDB proxy: accepted connection from {}", remote);
+
+	for (;;) {
+		event = read_event(client.fd, client.buffer, packet);
+		if (event == CLOSED)
+			break;
+
+		/* Interrupts only matter while this client's resume waits */
+		if (event == INTERRUPT)
+			continue;
+
+		if (!client.noack && !write_all(client.fd, "+"))
+			break;
+
+		keep = handle(client, packet, reply);
+		if ((keep || !reply.empty()) && !send_packet(client.fd, reply))
+			break;
+
+		if (!keep)
+			break;
+	}
+
+	Logger::info("GDB proxy: connection from {} ended", remote);
+
+	{
+		std::lock_guard<std::mutex> guard(m_clients_lock);
+		m_clients.erase(client.fd);
+		last = m_clients.empty();
+	}
+
+	/* OpenOCD treats a dropped connection like a detach */
+	if (last) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		disconnect_upstream();
+	}
+
+	m_idle.notify_all();
+	return (false);
+}
+
+bool
+GdbProxy::handle(Client &client, const std::string &packet, std::string &reply)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::string key;
+
+	reply.clear();
+
+	/* Acks are pointless over TCP, both sides are negotiated separately */
+	if (packet == "QStartNoAckMode") {
+		reply = "OK";
+		client.noack = true;
+		return (true);
+	}
+
+	switch (packet[0]) {
+	case 'k':
+		/* Killing the shared session would pull it from other clients */
+		return (false);
+
+	case 'D':
+		if (client_count() > 1)
+			reply = "OK";
+		else
+			transact(&client, packet, reply);
+
+		return (false);
+
+	case 'H':
+		transact(&client, packet, reply);
+		if (packet[1] == 'g' && reply == "OK") {
+			client.thread = packet.substr(2);
+			m_upstream_thread = client.thread;
+		}
+
+		return (true);
+
+	case 'g':
+	case 'p':
+		select_thread(client);
+		key = client.thread + ":" + packet;
+
+		if (m_halted && m_registers.count(key)) {
+			reply = m_registers[key];
+			m_hits++;
+			return (true);
+		}
+
+		m_misses++;
+		if (transact(&client, packet, reply) && m_halted &&
+		    !reply.empty() && reply[0] != 'E')
+			m_registers[key] = reply;
+
+		return (true);
+
+	case 'm':
+		if (m_halted && read_memory(client, packet, reply))
+			return (true);
+
+		transact(&client, packet, reply);
+		return (true);
+
+	case 'M':
+	case 'X':
+	case 'G':
+	case 'P':
+	case 'Z':
+	case 'z':
+		if (packet[0] == 'G' || packet[0] == 'P')
+			select_thread(client);
+
+		invalidate();
+		transact(&client, packet, reply);
+		return (true);
+
+	case '?':
+		transact(&client, packet, reply);
+		m_halted = !reply.empty() && (reply[0] == 'S' || reply[0] == 'T');
+		return (true);
+
+	default:
+		/* Monitor commands may do anything to the target */
+		if (is_resume(packet) || packet.rfind("qRcmd,", 0) == 0) {
+			invalidate();
+			m_halted = false;
+		}
+
+		if (is_resume(packet))
+			select_thread(client);
+
+		transact(&client, packet, reply);
+
+		if (is_resume(packet))
+			m_halted = !reply.empty() &&
+			    (reply[0] == 'S' || reply[0] == 'T');
+
+		return (true);
+	}
+}
+
+/* GDB expects g/p/G/P and resumes to apply to its own Hg selection */
+void
+GdbProxy::select_thread(Client &client)
+{
+	std::string reply;
+
+	if (client.thread == m_upstream_thread)
+		return;
+
+	if (transact(nullptr, "Hg" + (client.thread.empty() ? "0" :
+	    client.thread), reply) && reply == "OK")
+		m_upstream_thread = client.thread;
+}
+
+bool
+GdbProxy::wait_upstream(Client *client)
+{
+	struct pollfd pfd[2] = {
+		{ m_upstream_fd, POLLIN, 0 },
+		{ client ? client->fd : -1, POLLIN, 0 }
+	};
+	size_t pos;
+	int ret;
+
+	for (;;) {
+		ret = poll(pfd, 2, -1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return (false);
+
+		/* Forward ^C so that the client can stop a running target */
+		if (pfd[1].revents) {
+			if (!fill(client->fd, client->buffer))
+				pfd[1].fd = -1;
+
+			while ((pos = client->buffer.find('\x03')) != std::string::npos) {
+				client->buffer.erase(pos, 1);
+				if (!write_all(m_upstream_fd, "\x03"))
+					return (false);
+			}
+		}
+
+		if (pfd[0].revents)
+			return (fill(m_upstream_fd, m_upstream_buffer));
+	}
+}
+
+/*
+ * Sends a packet upstream and waits for the reply. Console output
+ * packets produced while the target runs or a monitor command executes
+ * are forwarded to the client as they arrive.
+ */
+bool
+GdbProxy::transact(Client *client, const std::string &packet,
+    std::string &reply)
+{
+	bool output = is_resume(packet) || packet.rfind("qRcmd,", 0) == 0;
+	std::string payload;
+	Event event;
+
+	if (!m_upstream && !connect_upstream()) {
+		reply = "E01";
+		return (false);
+	}
+
+	if (!send_packet(m_upstream_fd, packet))
+		goto fail;
+
+	for (;;) {
+		while (!parse_event(m_upstream_buffer, event, payload)) {
+			if (!wait_upstream(is_resume(packet) ? client : nullptr))
+				goto fail;
+		}
+
+		if (event != PACKET)
+			continue;
+
+		if (!m_upstream_noack && !write_all(m_upstream_fd, "+"))
+			goto fail;
+
+		if (output && payload[0] == 'O' && payload != "OK") {
+			if (client)
+				send_packet(client->fd, payload);
+			continue;
+		}
+
+		reply = payload;
+		return (true);
+	}
+
+fail:
+	Logger::warning("GDB proxy: lost connection to OpenOCD");
+	disconnect_upstream();
+	reply = "E01";
+	return (false);
+}
+
+/* Whether [start, end) lies within a single RAM range */
+bool
+GdbProxy::in_ram(uint64_t start, uint64_t end) const
+{
+	for (const auto &range: m_ram) {
+		if (start >= range.first && end >= start &&
+		    end - range.first <= range.second)
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Serves "m addr,len" from GDB_PROXY_BLOCK aligned blocks, fetching the
+ * missing ones with as few upstream reads as possible. Returns false
+ * when the request should go upstream unchanged: when the widened
+ * blocks reach outside RAM, or part of them is not readable.
+ */
+bool
+GdbProxy::read_memory(Client &client, const std::string &packet,
+    std::string &reply)
+{
+	unsigned long long addr;
+	unsigned long long len;
+	std::string data;
+	std::string bytes;
+	std::string out;
+	uint64_t first;
+	uint64_t last;
+	uint64_t start;
+	uint64_t block;
+	uint64_t offset;
+	uint64_t count;
+	uint64_t a;
+	size_t i;
+
+	if (sscanf(packet.c_str(), "m%llx,%llx", &addr, &len) != 2 ||
+	    len == 0 || len > MAX_READ || addr + len < addr)
+		return (false);
+
+	first = addr / GDB_PROXY_BLOCK * GDB_PROXY_BLOCK;
+	last = (addr + len - 1) / GDB_PROXY_BLOCK * GDB_PROXY_BLOCK;
+
+	if (last + GDB_PROXY_BLOCK < last ||
+	    !in_ram(first, last + GDB_PROXY_BLOCK))
+		return (false);
+
+	for (block = first; block <= last;) {
+		if (m_memory.count(block)) {
+			m_hits++;
+			block += GDB_PROXY_BLOCK;
+			continue;
+		}
+
+		/* Coalesce a run of missing blocks into a single read */
+		start = block;
+		while (block <= last && !m_memory.count(block) &&
+		    block - start < MAX_READ)
+			block += GDB_PROXY_BLOCK;
+
+		m_misses++;
+		if (!transact(&client, fmt::format("m{:x},{:x}", start,
+		    block - start), data))
+			return (false);
+
+		if (!decode_hex(data, bytes) || bytes.size() != block - start)
+			return (false);
+
+		for (i = 0; i < bytes.size(); i += GDB_PROXY_BLOCK)
+			m_memory[start + i] = bytes.substr(i, GDB_PROXY_BLOCK);
+	}
+
+	for (a = addr; a < addr + len; a += count) {
+		block = a / GDB_PROXY_BLOCK * GDB_PROXY_BLOCK;
+		offset = a - block;
+		count = std::min<uint64_t>(GDB_PROXY_BLOCK - offset,
+		    addr + len - a);
+		out += m_memory[block].substr(offset, count);
+	}
+
+	reply = encode_hex(out);
+	return (true);
+}
+
+bool
+GdbProxy::connect_upstream()
+{
+	Glib::RefPtr<Gio::SocketClient> socket_client = Gio::SocketClient::create();
+	std::string payload;
+
+	try {
+		m_upstream = socket_client->connect_to_host(m_upstream_host,
+		    m_upstream_port);
+	} catch (const Glib::Error &err) {
+		Logger::warning("GDB proxy: cannot connect to OpenOCD: {}",
+		    err.what());
+		return (false);
+	}
+
+	m_upstream_fd = m_upstream->get_socket()->get_fd();
+	m_upstream_buffer.clear();
+	m_upstream_thread.clear();
+	m_upstream_noack = false;
+	m_halted = false;
+	invalidate();
+
+	if (!send_packet(m_upstream_fd, "QStartNoAckMode") ||
+	    read_event(m_upstream_fd, m_upstream_buffer, payload) != PACKET ||
+	    !write_all(m_upstream_fd, "+")) {
+		disconnect_upstream();
+		return (false);
+	}
+
+	m_upstream_noack = payload == "OK";
+	return (true);
+}
+
+void
+GdbProxy::disconnect_upstream()
+{
+	if (!m_upstream)
+		return;
+
+	try {
+		m_upstream->close();
+	} catch (const Glib::Error &err) {
+	}
+
+	m_upstream.reset();
+	m_upstream_fd = -1;
+	m_halted = false;
+	invalidate();
+}
+
+void
+GdbProxy::invalidate()
+{
+	m_registers.clear();
+	m_memory.clear();
+}
@@ -26,13 +26,25 @@
  *
  */
 
+#include <chrono>
+#include <thread>
+#include <map>
+#include <vector>
 #include <fmt/format.h>
 #include <ftdi.hpp>
 #include <device.hh>
 #include <gpio.hh>
 #include <gtkmm.h>
 
-Gpio::Gpio(const Device &device)
+#define SAMPLE_RETRIES	100
+#define SAMPLE_CHUNK	512
+#define SAMPLE_INFLIGHT	1536	/* below the 2 KiB RX FIFO of the chip */
+
+Gpio::Gpio(const Device &device):
+    m_bitmode(0),
+    m_output(0),
+    m_sample_rate(0),
+    m_sampling(false)
 {
 	m_context.set_interface(INTERFACE_D);
 
@@ -43,6 +55,10 @@ Gpio::Gpio(const Device &device)
 		    m_context.error_string()));
 	}
 
+	/* The only reset; later direction changes keep the other pins */
+	if (m_context.set_bitmode(0xff, BITMODE_RESET) != 0)
+		throw std::runtime_error("Failed to reset bitmode");
+
 	configure(0u);
 }
 
@@ -54,32 +70,209 @@ Gpio::~Gpio()
 uint8_t
 Gpio::get_direction()
 {
+	std::lock_guard<std::mutex> guard(m_lock);
+
 	return (m_bitmode);
 }
 
 uint8_t
 Gpio::get()
 {
+	std::lock_guard<std::mutex> guard(m_lock);
 	uint8_t rd;
 
 	m_context.read_pins(&rd);
 	return (rd);
 }
 
+uint8_t
+Gpio::get_output()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	return (m_output);
+}
+
 void
 Gpio::set(uint8_t mask)
 {
-	m_context.write(&mask, 1);
+	update(0xff, mask);
+}
+
+/*
+ * Output levels are kept in a shadow register, so changing some pins
+ * is a single write with no read back over USB. While sampling, every
+ * byte written is paired with a sample read back, so the new value is
+ * only remembered and goes out with the next batch.
+ */
+void
+Gpio::update(uint8_t mask, uint8_t value)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	m_output = (m_output & ~mask) | (value & mask);
+	if (!m_sampling && m_context.write(&m_output, 1) != 1)
+		throw std::runtime_error("Failed to write GPIO outputs");
+}
+
+/* Batched form of update(): all listed pins change in one write */
+void
+Gpio::update(const std::map<int, bool> &pins)
+{
+	uint8_t mask = 0;
+	uint8_t value = 0;
+
+	for (const auto &pin: pins) {
+		mask |= 1 << pin.first;
+		if (pin.second)
+			value |= 1 << pin.first;
+	}
+
+	update(mask, value);
 }
 
 void
 Gpio::configure(uint8_t direction_mask)
 {
-	if (m_context.set_bitmode(0xff, BITMODE_RESET) != 0)
-		throw std::runtime_error("Failed to reset bitmode");
+	set_direction(0xff, direction_mask);
+}
+
+/*
+ * Changing the bitmode mask alone switches directions; pins that become
+ * outputs start at their shadow level instead of glitching through a
+ * reset.
+ */
+void
+Gpio::set_direction(uint8_t mask, uint8_t outputs)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	uint8_t direction = (m_bitmode & ~mask) | (outputs & mask);
+
+	if (m_context.set_bitmode(direction,
+	    m_sampling ? BITMODE_SYNCBB : BITMODE_BITBANG) != 0)
+		throw std::runtime_error("Failed to set bitmode");
+
+	m_bitmode = direction;
+	if (!m_sampling)
+		m_context.write(&m_output, 1);
+}
+
+/*
+ * Switches to synchronous bitbang mode, where the chip samples the pins
+ * once for every byte clocked out, at roughly rate samples per second.
+ */
+void
+Gpio::start_sampling(unsigned int rate)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	if (m_context.set_bitmode(m_bitmode, BITMODE_SYNCBB) != 0)
+		throw std::runtime_error("Failed to set synchronous bitbang mode");
+
+	if (m_context.set_baud_rate(rate) != 0)
+		throw std::runtime_error("Failed to set the sampling rate");
+
+	m_context.flush();
+	m_sample_rate = rate;
+	m_sampling = true;
+}
+
+/*
+ * The chip stops taking clock bytes once its RX FIFO is full, so writes
+ * are interleaved with reads and never run more than SAMPLE_INFLIGHT
+ * samples ahead. The pins are only sampled while bytes arrive, so the
+ * samples of one call are contiguous but there is a gap before the next.
+ */
+size_t
+Gpio::sample(uint8_t *buf, size_t count)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::vector<uint8_t> out(std::min<size_t>(count, SAMPLE_CHUNK), m_output);
+	unsigned int retries = 0;
+	size_t sent = 0;
+	size_t got = 0;
+	size_t n;
+	int ret;
+
+	while (got < count) {
+		while (sent < count) {
+			n = std::min<size_t>(count - sent, SAMPLE_CHUNK);
+			if (sent - got + n > SAMPLE_INFLIGHT)
+				break;
+
+			if (m_context.write(out.data(), n) != (int)n)
+				throw std::runtime_error(
+				    "Failed to clock out GPIO samples");
+
+			sent += n;
+		}
+
+		ret = m_context.read(buf + got, sent - got);
+		if (ret < 0)
+			throw std::runtime_error("Failed to read GPIO samples");
+
+		if (ret == 0) {
+			if (++retries > SAMPLE_RETRIES)
+				break;
+
+			continue;
+		}
+
+		retries = 0;
+		got += ret;
+	}
 
-	if (m_context.set_bitmode(direction_mask, BITMODE_BITBANG) != 0)
+	return (got);
+}
+
+void
+Gpio::stop_sampling()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	m_sampling = false;
+	m_context.set_bitmode(m_bitmode, BITMODE_BITBANG);
+	m_context.write(&m_output, 1);
+}
+
+/*
+ * Clocks the whole sequence out in asynchronous bitbang mode with a
+ * single write, so the host cannot stretch individual steps. The rate
+ * goes to set_baud_rate() as is: libftdi scales it for bitbang mode
+ * and the chip derives its bitbang clock from it in its own way, which
+ * has not been calibrated here. Steps keep their ratios to each other,
+ * but the sequence as a whole may run faster or slower by a constant
+ * factor. A running monitor loses the samples taken meanwhile.
+ */
+void
+Gpio::play(const GpioSequence &sequence)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::vector<uint8_t> buf = sequence.compile(m_output);
+	uint8_t direction = m_bitmode | sequence.get_outputs();
+
+	if (buf.empty())
+		return;
+
+	if (m_context.set_bitmode(direction, BITMODE_BITBANG) != 0)
 		throw std::runtime_error("Failed to set bitmode");
 
-	m_bitmode = direction_mask;
+	m_bitmode = direction;
+	if (m_context.set_baud_rate(sequence.get_rate()) != 0)
+		throw std::runtime_error("Failed to set the sequence clock");
+
+	if (m_context.write(buf.data(), buf.size()) != (int)buf.size())
+		throw std::runtime_error(fmt::format(
+		    "Failed to write GPIO sequence {}", sequence.get_name()));
+
+	m_output = buf.back();
+
+	if (m_sampling) {
+		/* Switching modes would cut off the bytes still queued */
+		std::this_thread::sleep_for(std::chrono::microseconds(
+		    sequence.get_duration()));
+		m_context.set_bitmode(m_bitmode, BITMODE_SYNCBB);
+		m_context.set_baud_rate(m_sample_rate);
+		m_context.flush();
+	}
 }
@@ -0,0 +1,187 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <vector>
+#include <algorithm>
+#include <gpio_monitor.hh>
+#include <log.hh>
+
+GpioMonitor::GpioMonitor(std::shared_ptr<Gpio> gpio, unsigned int rate):
+    m_gpio(gpio),
+    m_running(false),
+    m_rate(rate),
+    m_next_id(1)
+{
+}
+
+GpioMonitor::~GpioMonitor()
+{
+	std::lock_guard<std::mutex> thread_guard(m_thread_lock);
+
+	stop();
+}
+
+unsigned int
+GpioMonitor::subscribe(const GpioEventHandler &handler)
+{
+	std::lock_guard<std::mutex> thread_guard(m_thread_lock);
+	unsigned int id;
+	bool first;
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		id = m_next_id++;
+		m_handlers[id] = handler;
+		first = m_handlers.size() == 1;
+	}
+
+	if (first)
+		start();
+
+	return (id);
+}
+
+/*
+ * The worker takes m_lock to publish events, so it is never held while
+ * joining; m_thread_lock keeps start and stop in order instead.
+ */
+void
+GpioMonitor::unsubscribe(unsigned int id)
+{
+	std::lock_guard<std::mutex> thread_guard(m_thread_lock);
+	bool idle;
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		m_handlers.erase(id);
+		idle = m_handlers.empty();
+	}
+
+	if (idle)
+		stop();
+}
+
+void
+GpioMonitor::set_rate(unsigned int rate)
+{
+	std::lock_guard<std::mutex> thread_guard(m_thread_lock);
+
+	m_rate = rate;
+	if (m_thread.joinable()) {
+		stop();
+		start();
+	}
+}
+
+unsigned int
+GpioMonitor::get_rate() const
+{
+	return (m_rate);
+}
+
+void
+GpioMonitor::start()
+{
+	if (m_thread.joinable()) {
+		if (m_running)
+			return;
+
+		/* The previous worker gave up after an error */
+		m_thread.join();
+	}
+
+	m_running = true;
+	m_thread = std::thread(&GpioMonitor::worker, this);
+}
+
+void
+GpioMonitor::stop()
+{
+	m_running = false;
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void
+GpioMonitor::publish(const GpioEvent &event)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	for (auto &handler: m_handlers)
+		handler.second(event);
+}
+
+/*
+ * Each chunk covers about 10 ms of pin activity. The Gpio lock is
+ * released between chunks, so the GUI can still drive outputs and
+ * change directions while the monitor is running.
+ */
+void
+GpioMonitor::worker()
+{
+	unsigned int rate = m_rate;
+	size_t chunk = std::clamp<size_t>(rate / 100, GPIO_MONITOR_MIN_CHUNK,
+	    GPIO_MONITOR_MAX_CHUNK);
+	std::vector<uint8_t> buf(chunk);
+	GpioEvent event;
+	uint8_t last;
+	gint64 start;
+	size_t got;
+
+	try {
+		m_gpio->start_sampling(rate);
+		last = m_gpio->get();
+		event = {g_get_monotonic_time(), last, 0xff};
+		publish(event);
+
+		while (m_running) {
+			start = g_get_monotonic_time();
+			got = m_gpio->sample(buf.data(), buf.size());
+
+			for (size_t i = 0; i < got; i++) {
+				if (buf[i] == last)
+					continue;
+
+				event.timestamp = start + (gint64)i * 1000000 / rate;
+				event.value = buf[i];
+				event.changed = buf[i] ^ last;
+				last = buf[i];
+				publish(event);
+			}
+		}
+
+		m_gpio->stop_sampling();
+	} catch (const std::runtime_error &err) {
+		Logger::error("GPIO monitor stopped: {}", err.what());
+		m_running = false;
+		/* Leave bitbang mode, or later output updates are only cached */
+		m_gpio->stop_sampling();
+	}
+}
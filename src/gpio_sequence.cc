@@ -0,0 +1,122 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <numeric>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <gpio_sequence.hh>
+
+GpioSequence::GpioSequence(const std::string &name):
+    m_name(name)
+{
+}
+
+void
+GpioSequence::add_step(uint8_t mask, uint8_t value, uint32_t hold_us)
+{
+	m_steps.push_back({mask, (uint8_t)(value & mask), hold_us});
+}
+
+const std::string &
+GpioSequence::get_name() const
+{
+	return (m_name);
+}
+
+const std::vector<GpioStep> &
+GpioSequence::get_steps() const
+{
+	return (m_steps);
+}
+
+uint8_t
+GpioSequence::get_outputs() const
+{
+	uint8_t outputs = 0;
+
+	for (const auto &step: m_steps)
+		outputs |= step.mask;
+
+	return (outputs);
+}
+
+uint64_t
+GpioSequence::get_duration() const
+{
+	uint64_t duration = 0;
+
+	for (const auto &step: m_steps)
+		duration += step.hold_us;
+
+	return (duration);
+}
+
+/*
+ * The slowest rate that still places every step on a tick boundary:
+ * one tick is the greatest common divisor of the hold times.
+ */
+unsigned int
+GpioSequence::get_rate() const
+{
+	uint32_t tick = 0;
+
+	for (const auto &step: m_steps)
+		tick = std::gcd(tick, step.hold_us);
+
+	if (tick == 0)
+		return (GPIO_SEQUENCE_MAX_RATE);
+
+	return (std::max<unsigned int>(1000000 / tick, GPIO_SEQUENCE_MIN_RATE));
+}
+
+std::vector<uint8_t>
+GpioSequence::compile(uint8_t initial) const
+{
+	std::vector<uint8_t> buf;
+	uint64_t rate = get_rate();
+	uint64_t total = 0;
+	uint8_t state = initial;
+
+	for (const auto &step: m_steps)
+		total += std::max<uint64_t>(1, (step.hold_us * rate + 500000) / 1000000);
+
+	if (total > GPIO_SEQUENCE_MAX_SIZE) {
+		throw std::runtime_error(fmt::format(
+		    "GPIO sequence {} needs {} samples at {} Hz, at most {} fit in one transfer",
+		    m_name, total, rate, GPIO_SEQUENCE_MAX_SIZE));
+	}
+
+	buf.reserve(total);
+	for (const auto &step: m_steps) {
+		state = (state & ~step.mask) | step.value;
+		buf.insert(buf.end(), std::max<uint64_t>(1,
+		    (step.hold_us * rate + 500000) / 1000000), state);
+	}
+
+	return (buf);
+}
@@ -26,6 +26,7 @@
  *
  */
 
+#include <algorithm>
 #include <ftdi.hpp>
 #include <log.hh>
 #include <device.hh>
@@ -94,8 +95,26 @@ I2C::read(size_t nbytes, std::vector<uint8_t> &result)
 	 */
 	m_context.read(&rd, 1);
 
-	for (i = 0; i < nbytes; i++)
-		result.push_back(read_byte(i != nbytes - 1));
+	/*
+	 * Queue the clocking for a whole chunk and collect the bytes with
+	 * a single transfer instead of a USB round trip per byte. Chunks
+	 * are kept below the chip's receive buffer so it never stalls
+	 * while we are still writing commands.
+	 */
+	for (i = 0; i < nbytes; i += I2C_READ_CHUNK) {
+		std::vector<uint8_t> cmd;
+		uint8_t buf[I2C_READ_CHUNK];
+		size_t n = std::min(nbytes - i, (size_t)I2C_READ_CHUNK);
+		size_t j;
+
+		for (j = 0; j < n; j++)
+			queue_read_byte(cmd, i + j != nbytes - 1);
+
+		cmd.push_back(SEND_IMMEDIATE);
+		m_context.write(cmd.data(), cmd.size());
+		read_exact(buf, n);
+		result.insert(result.end(), buf, buf + n);
+	}
 }
 
 void
@@ -156,23 +175,40 @@ I2C::stop()
 	m_context.write(cmd2, sizeof(cmd2));
 }
 
-uint8_t
-I2C::read_byte(bool ack)
+void
+I2C::queue_read_byte(std::vector<uint8_t> &cmd, bool ack)
 {
-	uint8_t rd;
 	uint8_t ackbyte = static_cast<uint8_t>(ack ? 0 : 0xff);
-	const uint8_t cmd[] = {
+	const uint8_t seq[] = {
 	    SET_BITS_LOW, 0, SCL | WP,
 	    MPSSE_DO_READ | MPSSE_READ_NEG, 0, 0,
 	    SET_BITS_LOW, 0, OUT_PINS,
 	    MPSSE_DO_WRITE | MPSSE_WRITE_NEG | MPSSE_BITMODE, 0, ackbyte,
 	    SET_BITS_LOW, 0, OUT_PINS,
-	    SEND_IMMEDIATE
 	};
 
-	m_context.write(cmd, sizeof(cmd));
-	m_context.read(&rd, 1);
-	return (rd);
+	cmd.insert(cmd.end(), seq, seq + sizeof(seq));
+}
+
+void
+I2C::read_exact(uint8_t *buf, size_t nbytes)
+{
+	size_t pos = 0;
+	int retries = 0;
+	int ret;
+
+	while (pos < nbytes) {
+		ret = m_context.read(buf + pos, nbytes - pos);
+		if (ret < 0) {
+			throw std::runtime_error(fmt::format(
+			    "I2C read failed: {}", m_context.error_string()));
+		}
+
+		if (ret == 0 && ++retries > I2C_READ_RETRIES)
+			throw std::runtime_error("I2C read timed out");
+
+		pos += ret;
+	}
 }
 
 void
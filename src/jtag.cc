@@ -27,6 +27,7 @@
  */
 
 #include <vector>
+#include <algorithm>
 #include <giomm.h>
 #include <gtkmm.h>
 #include <ftdi.hpp>
@@ -34,44 +35,175 @@
 #include <jtag.hh>
 #include <utils.hh>
 #include <filesystem.hh>
+#include <sys/wait.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
 #endif
 
 #define RESET_MASK	0x20
 #define BUFFER_SIZE	1024
+#define STOP_TIMEOUT	3000
+#define BACKOFF_MIN	500
+#define BACKOFF_MAX	30000
+#define STABLE_RUNTIME	(10 * G_USEC_PER_SEC)
+
+JtagSupervisor *JtagSupervisor::m_instance = nullptr;
+
+bool
+JtagServerConfig::operator==(const JtagServerConfig &other) const
+{
+	return (address->to_string() == other.address->to_string() &&
+	    gdb_port == other.gdb_port &&
+	    ocd_port == other.ocd_port &&
+	    board_script == other.board_script &&
+	    adapter_speed == other.adapter_speed &&
+	    rpc_port == other.rpc_port &&
+	    gdb_proxy == other.gdb_proxy &&
+	    gdb_proxy_ram == other.gdb_proxy_ram);
+}
+
+/* Where local clients (RPC, GDB proxy) should connect to reach OpenOCD */
+std::string
+JtagServerConfig::local_host() const
+{
+	if (address->get_is_any())
+		return (address->get_family() == Gio::SOCKET_FAMILY_IPV6
+		    ? "::1" : "127.0.0.1");
+
+	return (address->to_string());
+}
+
+JtagServer::JtagServer(const Device &device, const JtagServerConfig &config):
+    m_device(device),
+    m_config(config),
+    m_context(Glib::MainContext::get_thread_default()),
+    m_gdb_upstream_port(0),
+    m_started_at(0),
+    m_backoff(BACKOFF_MIN),
+    m_stop_timeout(STOP_TIMEOUT),
+    m_auto_restart(false),
+    m_stopping(false),
+    m_running(false),
+    m_state(STOPPED)
+{
+}
 
 JtagServer::JtagServer(const Device &device,
     Glib::RefPtr<Gio::InetAddress> address, uint16_t gdb_port,
     uint16_t ocd_port, const std::string &board_script):
-    m_device(device),
-    m_address(address),
-    m_ocd_port(ocd_port),
-    m_gdb_port(gdb_port),
-    m_board_script(board_script),
-    m_running(false)
+    JtagServer(device, { address, gdb_port, ocd_port, board_script })
 {
 }
 
 JtagServer::~JtagServer()
 {
-	stop();
+	unsigned int waited;
+
+	/*
+	 * Nothing may call back into this object once it is gone, so the
+	 * teardown here is synchronous: ask OpenOCD to quit, give it
+	 * m_stop_timeout to do so and kill it otherwise.
+	 */
+	cancel_timers();
+	m_child_watch.disconnect();
+
+	if (m_cancel)
+		m_cancel->cancel();
+
+	if (!m_running)
+		return;
+
+	kill(m_pid, SIGTERM);
+
+	for (waited = 0; waited < m_stop_timeout; waited += 10) {
+		if (waitpid(m_pid, nullptr, WNOHANG) != 0) {
+			Glib::spawn_close_pid(m_pid);
+			return;
+		}
+
+		usleep(10 * 1000);
+	}
+
+	Logger::warning("OpenOCD (pid {}) did not exit in {} ms, killing it",
+	    m_pid, m_stop_timeout);
+	kill(m_pid, SIGKILL);
+	waitpid(m_pid, nullptr, 0);
+	Glib::spawn_close_pid(m_pid);
+}
+
+const char *
+JtagServer::state_name(State state)
+{
+	switch (state) {
+	case STOPPED:
+		return ("Stopped");
+	case STARTING:
+		return ("Starting");
+	case RUNNING:
+		return ("Running");
+	case STOPPING:
+		return ("Stopping");
+	case BACKOFF:
+		return ("Restarting");
+	}
+
+	return ("Unknown");
 }
 
 void
 JtagServer::start()
+{
+	m_restart_timer.disconnect();
+
+	if (m_running)
+		return;
+
+	m_backoff = BACKOFF_MIN;
+
+	try {
+		spawn();
+	} catch (const Glib::Error &err) {
+		Logger::error("Failed to start OpenOCD for {}: {}",
+		    m_device.serial, err.what());
+
+		/* Servers owned by a CableManager worker have no GUI */
+		if (m_context == Glib::MainContext::get_default())
+			show_centered_dialog(
+			    "Failed to start JTAG server.", err.what());
+		return;
+	}
+}
+
+void
+JtagServer::spawn()
 {
 	int stdout_fd;
 	int stderr_fd;
+	uint16_t gdb_port = m_config.gdb_port;
+
+	/* With the proxy in front, OpenOCD serves GDB on a private port */
+	if (m_config.gdb_proxy) {
+		if (!m_gdb_proxy) {
+			m_gdb_upstream_port = free_tcp_port(
+			    m_config.local_host());
+			m_gdb_proxy.reset(new GdbProxy(m_config.address,
+			    m_config.gdb_port, m_config.local_host(),
+			    m_gdb_upstream_port, m_config.gdb_proxy_ram));
+			m_gdb_proxy->start();
+		}
+
+		gdb_port = m_gdb_upstream_port;
+	}
+
 	std::vector<std::string> argv {
 		executable_dir() + "/tools/bin/openocd",
-		"-c", fmt::format("bindto {}", m_address->to_string()),
-		"-c", fmt::format("gdb_port {}", m_gdb_port),
-		"-c", fmt::format("telnet_port {}", m_ocd_port),
-		"-c", "tcl_port disabled",
+		"-c", fmt::format("bindto {}", m_config.address->to_string()),
+		"-c", fmt::format("gdb_port {}", gdb_port),
+		"-c", fmt::format("telnet_port {}", m_config.ocd_port),
+		"-c", fmt::format("tcl_port {}", m_config.rpc_port),
 		"-c", "adapter driver ftdi",
 		"-c", "transport select jtag",
-		"-c", "adapter speed 1000",
+		"-c", fmt::format("adapter speed {}", m_config.adapter_speed),
 		"-c", "ftdi_channel 1",
 		"-c", "ftdi_layout_init 0x0030 0x000b",
 		"-c", "ftdi_layout_signal nTRST -noe 0x10 -ndata 0x10",
@@ -79,57 +211,115 @@ JtagServer::start()
 		"-c", fmt::format("ftdi_serial \"{}\"", m_device.serial),
 		"-c", fmt::format("ftdi_vid_pid {:#04x} {:#04x}",
 		    m_device.vid, m_device.pid),
-		"-f", m_board_script
+		"-f", m_config.board_script
 	};
 
-	if (m_running)
-		return;
+	Glib::spawn_async_with_pipes("/tmp", argv,
+	    Glib::SpawnFlags::SPAWN_DO_NOT_REAP_CHILD,
+	    sigc::mem_fun(*this, &JtagServer::prepare_child), &m_pid,
+	    nullptr, &stdout_fd, &stderr_fd);
 
-	try {
-		Glib::spawn_async_with_pipes("/tmp", argv,
-		    Glib::SpawnFlags::SPAWN_DO_NOT_REAP_CHILD,
-		    sigc::mem_fun(*this, &JtagServer::prepare_child), &m_pid,
-		    nullptr, &stdout_fd, &stderr_fd);
-	} catch (const Glib::Error &err) {
-		show_centered_dialog(
-		    "Failed to start JTAG server.", err.what());
-		return;
-	}
-
-	Glib::signal_child_watch().connect(
+	m_child_watch = m_context->signal_child_watch().connect(
 	    sigc::mem_fun(*this, &JtagServer::child_exited),
 	    m_pid);
 
+	m_cancel = Gio::Cancellable::create();
 	m_out = Gio::UnixInputStream::create(stdout_fd, true);
 	m_err = Gio::UnixInputStream::create(stderr_fd, true);
 
 	m_out->read_bytes_async(BUFFER_SIZE, sigc::bind(sigc::mem_fun(
-	    *this, &JtagServer::output_ready), m_out));
+	    *this, &JtagServer::output_ready), m_out), m_cancel);
 
 	m_err->read_bytes_async(BUFFER_SIZE, sigc::bind(sigc::mem_fun(
-	    *this, &JtagServer::output_ready), m_err));
+	    *this, &JtagServer::output_ready), m_err), m_cancel);
 
 	setpgid(m_pid, getpid());
 
+	m_pending_output.clear();
+	m_started_at = g_get_monotonic_time();
 	m_running = true;
+	m_stopping = false;
 
+	set_state(STARTING);
 	on_server_start.emit();
 }
 
 void
 JtagServer::stop()
 {
-	if (!m_running)
+	m_restart_timer.disconnect();
+
+	if (!m_running) {
+		set_state(STOPPED);
+		return;
+	}
+
+	if (m_stopping)
 		return;
 
+	/*
+	 * Shutdown completes asynchronously in child_exited(); if OpenOCD
+	 * ignores SIGTERM it gets SIGKILL after m_stop_timeout.
+	 */
+	m_stopping = true;
+	set_state(STOPPING);
 	kill(m_pid, SIGTERM);
 
-	/* Crappy, there should be a better way to do this */
-	while (m_running)
-		Gtk::Main::iteration();
+	m_stop_timer = m_context->signal_timeout().connect(
+	    sigc::mem_fun(*this, &JtagServer::stop_timeout_expired),
+	    m_stop_timeout);
 }
 
+bool
+JtagServer::stop_timeout_expired()
+{
+	if (m_running) {
+		Logger::warning("OpenOCD (pid {}) did not exit in {} ms, "
+		    "killing it", m_pid, m_stop_timeout);
+		kill(m_pid, SIGKILL);
+	}
+
+	return (false);
+}
+
+bool
+JtagServer::restart_timeout_expired()
+{
+	Logger::info("Restarting OpenOCD for {}", m_device.serial);
+
+	try {
+		spawn();
+	} catch (const Glib::Error &err) {
+		Logger::error("Failed to restart OpenOCD: {}", err.what());
+		set_state(STOPPED);
+	}
+
+	return (false);
+}
 
+void
+JtagServer::cancel_timers()
+{
+	m_stop_timer.disconnect();
+	m_restart_timer.disconnect();
+}
+
+void
+JtagServer::set_state(State state)
+{
+	if (m_state == state)
+		return;
+
+	m_state = state;
+
+	/* The proxy outlives restarts, but not the server itself */
+	if (state == STOPPED)
+		m_gdb_proxy.reset();
+
+	on_state_changed.emit(state);
+}
+
+/* Both throw std::runtime_error when the channel cannot be driven */
 void
 JtagServer::bypass(const Device &device)
 {
@@ -139,28 +329,19 @@ JtagServer::bypass(const Device &device)
 
 	if (context.open(device.vid, device.pid, device.description,
 	    device.serial) != 0) {
-		show_centered_dialog("Failed to open device.");
-		return;
+		throw std::runtime_error("Failed to open device.");
 	}
 
-	if (context.reset() != 0) {
-		show_centered_dialog("Failed to reset channel");
-		return;
-	}
+	if (context.reset() != 0)
+		throw std::runtime_error("Failed to reset channel");
 
-	if (context.set_bitmode(0xff, BITMODE_RESET) != 0) {
-		show_centered_dialog("Failed to set BITMODE_RESET");
-		return;
-	}
+	if (context.set_bitmode(0xff, BITMODE_RESET) != 0)
+		throw std::runtime_error("Failed to set BITMODE_RESET");
 
 	if (context.set_bitmode(0, BITMODE_BITBANG) != 0)
-	{
-		show_centered_dialog("Failed to set BITMODE_BITBANG");
-		return;
-	}
+		throw std::runtime_error("Failed to set BITMODE_BITBANG");
 
 	Logger::info("Bypass mode enabled.");
-	show_centered_dialog("Bypass mode enabled.");
 
 	context.close();
 }
@@ -175,49 +356,34 @@ JtagServer::reset(const Device &device)
 
 	if (context.open(device.vid, device.pid, device.description,
 	    device.serial) != 0) {
-		show_centered_dialog("Failed to open device");
-		return;
+		throw std::runtime_error("Failed to open device");
 	}
 
-	if (context.reset() != 0) {
-		show_centered_dialog("Failed to reset channel");
-		return;
-	}
+	if (context.reset() != 0)
+		throw std::runtime_error("Failed to reset channel");
 
-	if (context.set_bitmode(0x0, BITMODE_RESET) != 0) {
-		show_centered_dialog("Failed to set bitmode");
-		return;
-	}
+	if (context.set_bitmode(0x0, BITMODE_RESET) != 0)
+		throw std::runtime_error("Failed to set bitmode");
 
-	if (context.set_bitmode(0x20, BITMODE_BITBANG) != 0) {
-		show_centered_dialog("Failed to set bitmode");
-		return;
-	}
+	if (context.set_bitmode(0x20, BITMODE_BITBANG) != 0)
+		throw std::runtime_error("Failed to set bitmode");
 
 	data = RESET_MASK;
-	if (context.write(&data, sizeof(data)) != sizeof(data)) {
-		show_centered_dialog("Failed to write reset mask");
-		return;
-	}
+	if (context.write(&data, sizeof(data)) != sizeof(data))
+		throw std::runtime_error("Failed to write reset mask");
 
 	data = 0x00;
-	if (context.write(&data, sizeof(data)) != sizeof(data)) {
-		show_centered_dialog("Failed to write reset mask");
-		return;
-	}
+	if (context.write(&data, sizeof(data)) != sizeof(data))
+		throw std::runtime_error("Failed to write reset mask");
 
 	usleep(1000 * 100);
 
 	data = RESET_MASK;
-	if (context.write(&data, sizeof(data)) != sizeof(data)) {
-		show_centered_dialog("Failed to write reset mask");
-		return;
-	}
+	if (context.write(&data, sizeof(data)) != sizeof(data))
+		throw std::runtime_error("Failed to write reset mask");
 
-	if (context.set_bitmode(0, BITMODE_BITBANG) != 0) {
-		show_centered_dialog("Failed to set bitmode");
-		return;
-	}
+	if (context.set_bitmode(0, BITMODE_BITBANG) != 0)
+		throw std::runtime_error("Failed to set bitmode");
 
 	Logger::info("Reset done");
 	context.close();
@@ -238,8 +404,14 @@ JtagServer::output_ready(Glib::RefPtr<Gio::AsyncResult> &result,
 	Glib::RefPtr<Glib::Bytes> buffer;
 	const char *ptr;
 	size_t nread;
+	size_t eol;
+
+	try {
+		buffer = stream->read_bytes_finish(result);
+	} catch (const Glib::Error &err) {
+		return;
+	}
 
-	buffer = stream->read_bytes_finish(result);
 	if (buffer.get() == nullptr)
 		return;
 
@@ -247,15 +419,153 @@ JtagServer::output_ready(Glib::RefPtr<Gio::AsyncResult> &result,
 	if (nread == 0)
 		return;
 
+	/* OpenOCD is ready to serve once it has opened the GDB port */
+	if (m_state == STARTING) {
+		m_pending_output.append(ptr, nread);
+		while ((eol = m_pending_output.find('\n')) != std::string::npos) {
+			if (m_pending_output.find("for gdb connections") < eol) {
+				set_state(RUNNING);
+				m_pending_output.clear();
+				break;
+			}
+
+			m_pending_output.erase(0, eol + 1);
+		}
+	}
+
 	on_output_produced.emit(std::string(ptr, nread));
 	stream->read_bytes_async(BUFFER_SIZE, sigc::bind(sigc::mem_fun(
-	    *this, &JtagServer::output_ready), stream));
+	    *this, &JtagServer::output_ready), stream), m_cancel);
 }
 
 void
 JtagServer::child_exited(Glib::Pid pid, int code)
 {
+	bool restart;
+
 	Logger::info("OpenOCD exited with code {} (pid {})", code, pid);
-	on_server_exit.emit();
+	Glib::spawn_close_pid(pid);
+
 	m_running = false;
+	m_stop_timer.disconnect();
+	restart = m_auto_restart && !m_stopping;
+	m_stopping = false;
+
+	if (restart) {
+		/* Exponential backoff, reset once a run proved stable */
+		if (g_get_monotonic_time() - m_started_at > STABLE_RUNTIME)
+			m_backoff = BACKOFF_MIN;
+
+		Logger::warning("OpenOCD exited unexpectedly, restarting "
+		    "in {} ms", m_backoff);
+		m_restart_timer = m_context->signal_timeout().connect(
+		    sigc::mem_fun(*this, &JtagServer::restart_timeout_expired),
+		    m_backoff);
+		m_backoff = std::min(m_backoff * 2, (unsigned int)BACKOFF_MAX);
+		set_state(BACKOFF);
+	} else
+		set_state(STOPPED);
+
+	on_server_exit.emit();
+}
+
+JtagSupervisor *
+JtagSupervisor::instance()
+{
+	if (m_instance == nullptr)
+		m_instance = new JtagSupervisor();
+
+	return (m_instance);
+}
+
+std::shared_ptr<JtagServer>
+JtagSupervisor::acquire(const Device &device, const JtagServerConfig &config)
+{
+	std::shared_ptr<JtagServer> previous;
+	std::shared_ptr<JtagServer> server;
+	auto it = m_servers.find(device.serial);
+
+	if (it != m_servers.end()) {
+		previous = it->second;
+		if (previous->get_config() == config &&
+		    previous->get_state() != JtagServer::STOPPING) {
+			Logger::info("JTAG: reusing OpenOCD instance for {}",
+			    device.serial);
+			previous->set_auto_restart(true);
+			previous->start();
+			return (previous);
+		}
+	}
+
+	server = std::make_shared<JtagServer>(device, config);
+	server->set_auto_restart(true);
+	m_servers[device.serial] = server;
+
+	if (!previous || previous->get_state() == JtagServer::STOPPED) {
+		server->start();
+		return (server);
+	}
+
+	/*
+	 * The cable is still held by the previous instance; start the new
+	 * one as soon as the old one has let go of it.
+	 */
+	m_retired.push_back(previous);
+	previous->on_state_changed.connect(
+	    [this, old = previous.get(), next = std::weak_ptr<JtagServer>(server)]
+	    (JtagServer::State state) {
+		if (state != JtagServer::STOPPED)
+			return;
+
+		Glib::signal_idle().connect_once([this, old, next]() {
+			if (auto server = next.lock())
+				server->start();
+
+			m_retired.remove_if([old](const auto &i) {
+				return (i.get() == old);
+			});
+		});
+	});
+
+	previous->set_auto_restart(false);
+	previous->stop();
+	return (server);
+}
+
+void
+JtagSupervisor::release(const Device &device, bool standby)
+{
+	auto it = m_servers.find(device.serial);
+
+	if (it == m_servers.end())
+		return;
+
+	if (standby) {
+		Logger::info("JTAG: keeping OpenOCD for {} in standby",
+		    device.serial);
+		return;
+	}
+
+	if (it->second->get_state() == JtagServer::STOPPED) {
+		m_servers.erase(it);
+		return;
+	}
+
+	it->second->set_auto_restart(false);
+	it->second->stop();
+}
+
+void
+JtagSupervisor::discard(const Device &device)
+{
+	/* Frees the cable right away, e.g. before resetting channel B */
+	m_servers.erase(device.serial);
+}
+
+void
+JtagSupervisor::shutdown()
+{
+	/* Destruction tears every instance down synchronously */
+	m_retired.clear();
+	m_servers.clear();
 }
@@ -0,0 +1,345 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <fmt/format.h>
+#include <log.hh>
+#include <utils.hh>
+#include <jtag_batch.hh>
+#include <jtag_probe.hh>
+#include <filesystem.hh>
+
+#define BATCH_PORT_TRIES	100
+
+static const char *
+status_name(int status)
+{
+	static const char *names[] = { "waiting", "flashing", "done", "FAILED" };
+
+	return (names[status]);
+}
+
+JtagBatch::JtagBatch(const std::vector<Device> &devices,
+    const JtagServerConfig &config, const OpenOcdRpcJob &job):
+    m_image(std::make_shared<MappedFile>(job.path)),
+    m_config(config),
+    m_job(job),
+    m_started(0),
+    m_reported(false)
+{
+	for (const auto &device: devices) {
+		std::unique_ptr<Board> board(new Board());
+
+		board->device = device;
+		board->status = WAITING;
+		board->done = 0;
+		board->total = m_image->size();
+		board->started = 0;
+		board->finished = 0;
+		m_boards.push_back(std::move(board));
+	}
+
+	m_worker_done.connect(sigc::mem_fun(*this, &JtagBatch::worker_done));
+}
+
+JtagBatch::~JtagBatch()
+{
+	m_timer.disconnect();
+
+	/* Killing OpenOCD unblocks workers still waiting on it */
+	for (auto &board: m_boards) {
+		board->server.reset();
+		if (board->worker.joinable())
+			board->worker.join();
+	}
+}
+
+void
+JtagBatch::start()
+{
+	m_started = g_get_monotonic_time();
+
+	fmt::print("Flashing {} ({} bytes) at {:#010x} into {} boards\n",
+	    m_job.path, m_image->size(), m_job.address, m_boards.size());
+
+	for (auto &board: m_boards)
+		prepare(*board);
+
+	m_timer = Glib::signal_timeout().connect(sigc::mem_fun(*this,
+	    &JtagBatch::print_progress), 1000);
+	check_finished();
+}
+
+void
+JtagBatch::prepare(Board &board)
+{
+	JtagServerConfig config = m_config;
+	std::vector<uint16_t> ports;
+	Board *ptr = &board;
+	unsigned int tries = 0;
+	uint16_t port;
+
+	try {
+		if (!config.address)
+			config.address = Gio::InetAddress::create("127.0.0.1");
+
+		if (config.board_script.empty() || config.board_script == "auto") {
+			config.board_script = JtagProbe::detect_script(
+			    board.device, executable_dir() + "/scripts");
+		}
+
+		if (config.adapter_speed == JTAG_SPEED_AUTO) {
+			config.adapter_speed = JtagSpeedCache::resolve(
+			    board.device, filesystem::path(
+			    config.board_script).stem().string());
+		}
+
+		/*
+		 * The probe socket is closed before OpenOCD binds, so the
+		 * kernel may hand a port out again to this or another board
+		 * of the batch. Every port is used once per batch.
+		 */
+		while (ports.size() < 3) {
+			if (++tries > BATCH_PORT_TRIES)
+				throw std::runtime_error("No free TCP ports left");
+
+			port = free_tcp_port(config.local_host());
+			if (m_ports.insert(port).second)
+				ports.push_back(port);
+		}
+
+		config.gdb_port = ports[0];
+		config.ocd_port = ports[1];
+		config.rpc_port = ports[2];
+		config.gdb_proxy = false;
+	} catch (const std::runtime_error &err) {
+		fail(board, err.what());
+		return;
+	} catch (const Glib::Error &err) {
+		fail(board, err.what());
+		return;
+	}
+
+	Logger::info("{}: OpenOCD on ports gdb {}, telnet {}, rpc {}",
+	    board.device.serial, config.gdb_port, config.ocd_port,
+	    config.rpc_port);
+
+	board.server = std::make_shared<JtagServer>(board.device, config);
+	board.server->on_state_changed.connect(
+	    [this, ptr](JtagServer::State state) {
+		server_state(ptr, state);
+	});
+	board.server->start();
+}
+
+void
+JtagBatch::server_state(Board *board, JtagServer::State state)
+{
+	Status status;
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		status = board->status;
+		if (state == JtagServer::RUNNING && status == WAITING) {
+			board->status = FLASHING;
+			board->started = g_get_monotonic_time();
+			board->worker = std::thread(&JtagBatch::worker, this,
+			    board);
+			return;
+		}
+	}
+
+	/* A worker that is still flashing notices on its own */
+	if (state == JtagServer::STOPPED && status == WAITING)
+		fail(*board, "OpenOCD exited before it was ready");
+
+	check_finished();
+}
+
+void
+JtagBatch::worker(Board *board)
+{
+	JtagServerConfig config = board->server->get_config();
+	FlashDiffResult diff;
+	std::string message;
+	bool ok = false;
+
+	auto progress = [this, board](size_t done, size_t total) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		board->done = done;
+		board->total = total;
+	};
+
+	try {
+		OpenOcdRpc rpc(config.local_host(), config.rpc_port);
+
+		rpc.halt();
+
+		/*
+		 * Differential writes slice the shared mapping directly. A
+		 * plain flash passes the path, OpenOCD reads the file itself.
+		 */
+		if (m_job.kind == OpenOcdRpcJob::FLASH_DIFF) {
+			diff = rpc.flash_image_diff(*m_image, m_job.address,
+			    progress);
+			message = fmt::format("{} sectors unchanged, {} written",
+			    diff.skipped, diff.written);
+		} else
+			message = m_job.run(rpc, progress);
+
+		ok = true;
+	} catch (const std::runtime_error &err) {
+		message = err.what();
+	}
+
+	std::lock_guard<std::mutex> guard(m_lock);
+	board->status = ok ? DONE : FAILED;
+	board->message = message;
+	board->finished = g_get_monotonic_time();
+	m_worker_done.emit();
+}
+
+void
+JtagBatch::worker_done()
+{
+	bool finished;
+
+	for (auto &board: m_boards) {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			finished = board->status >= DONE;
+		}
+
+		if (!finished || !board->worker.joinable())
+			continue;
+
+		board->worker.join();
+		board->server->stop();
+	}
+
+	check_finished();
+}
+
+void
+JtagBatch::fail(Board &board, const std::string &message)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		board.status = FAILED;
+		board.message = message;
+		board.finished = g_get_monotonic_time();
+	}
+
+	Logger::error("{}: {}", board.device.serial, message);
+	if (board.server)
+		board.server->stop();
+}
+
+void
+JtagBatch::check_finished()
+{
+	bool ok = true;
+
+	if (m_reported)
+		return;
+
+	for (auto &board: m_boards) {
+		/* Once joined, workers no longer touch the status */
+		if (board->worker.joinable() || board->status < DONE)
+			return;
+
+		if (board->server &&
+		    board->server->get_state() != JtagServer::STOPPED)
+			return;
+
+		ok = ok && board->status == DONE;
+	}
+
+	m_reported = true;
+	m_timer.disconnect();
+	print_report();
+	on_finished.emit(ok);
+}
+
+bool
+JtagBatch::print_progress()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	double secs = (g_get_monotonic_time() - m_started) / 1e6;
+	size_t finished = 0;
+	size_t failed = 0;
+	size_t done = 0;
+	size_t total = 0;
+
+	for (auto &board: m_boards) {
+		finished += board->status >= DONE;
+		failed += board->status == FAILED;
+		done += board->done;
+		total += board->total;
+	}
+
+	fmt::print("\r[{} of {} boards finished, {} failed] {:3d}%, {}    ",
+	    finished, m_boards.size(), failed,
+	    total ? done * 100 / total : 100,
+	    OpenOcdRpc::format_rate(secs > 0 ? done / secs : 0));
+	fflush(stdout);
+	return (true);
+}
+
+void
+JtagBatch::print_report()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	double wall = (g_get_monotonic_time() - m_started) / 1e6;
+	double secs;
+	size_t failed = 0;
+	size_t bytes = 0;
+
+	fmt::print("\n\n{:<16} {:<8} {:>8} {:>12}  {}\n", "Serial", "Status",
+	    "Time", "Throughput", "Result");
+
+	for (auto &board: m_boards) {
+		secs = board->started && board->finished > board->started
+		    ? (board->finished - board->started) / 1e6 : 0;
+
+		fmt::print("{:<16} {:<8} {:>7.1f}s {:>12}  {}\n",
+		    board->device.serial, status_name(board->status), secs,
+		    board->status == DONE && secs > 0
+		    ? OpenOcdRpc::format_rate(board->total / secs) : "-",
+		    board->message);
+
+		if (board->status == DONE)
+			bytes += board->total;
+		else
+			failed++;
+	}
+
+	fmt::print("\n{} boards, {} failed, {} bytes in {:.1f}s, aggregate {}\n",
+	    m_boards.size(), failed, bytes, wall,
+	    OpenOcdRpc::format_rate(wall > 0 ? bytes / wall : 0));
+}
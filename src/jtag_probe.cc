@@ -0,0 +1,659 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <random>
+#include <regex>
+#include <fstream>
+#include <stdexcept>
+#include <glibmm.h>
+#include <yaml-cpp/yaml.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <jtag_probe.hh>
+#include <filesystem.hh>
+
+#define TCK		(1u << 0)
+#define TDI		(1u << 1)
+#define TDO		(1u << 2)
+#define TMS		(1u << 3)
+#define OUT_PINS	(TCK | TDI | TMS)
+
+#define MPSSE_CLOCK_KHZ	30000
+#define READ_CHUNK	1024
+#define MAX_DEVICES	32
+#define MAX_IR_BITS	256
+#define PATTERN_BITS	128
+#define TUNE_ROUNDS	8
+#define TUNE_MARGIN	20
+
+/* Data goes out on the falling edge and is sampled on the rising one */
+#define SHIFT_BYTES	(MPSSE_DO_WRITE | MPSSE_DO_READ | MPSSE_LSB | MPSSE_WRITE_NEG)
+#define SHIFT_BITS	(SHIFT_BYTES | MPSSE_BITMODE)
+#define CLOCK_TMS	(MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG)
+#define CLOCK_TMS_READ	(CLOCK_TMS | MPSSE_DO_READ)
+
+static inline bool
+get_bit(const std::vector<uint8_t> &bits, size_t index)
+{
+	return (bits[index / 8] & (1u << (index % 8)));
+}
+
+JtagProbe::JtagProbe(const Device &device):
+    m_pending(0)
+{
+	const uint8_t sync[] = { 0xaa };
+	uint8_t rd[2];
+	const uint8_t cmd[] = {
+	    DIS_DIV_5,
+	    DIS_ADAPTIVE,
+	    DIS_3_PHASE,
+	    LOOPBACK_END,
+	    SET_BITS_LOW, TMS, OUT_PINS,
+	};
+	int retries;
+
+	m_context.set_interface(INTERFACE_B);
+
+	if (m_context.open(device.vid, device.pid, device.description,
+	    device.serial) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Failed to open device: {}",
+		    m_context.error_string()));
+	}
+
+	if (m_context.reset() != 0)
+		throw std::runtime_error("Failed to reset JTAG channel");
+
+	if (m_context.set_bitmode(0, BITMODE_RESET) != 0)
+		throw std::runtime_error("Failed to set bitmode");
+
+	if (m_context.set_bitmode(OUT_PINS, BITMODE_MPSSE) != 0)
+		throw std::runtime_error("Failed to set bitmode");
+
+	m_context.set_latency(1);
+	m_context.write(sync, sizeof(sync));
+
+	for (retries = 0;; retries++) {
+		if (retries == 10 ||
+		    m_context.read(rd, sizeof(rd)) != sizeof(rd))
+			throw std::runtime_error("Failed to synchronize");
+
+		if (rd[0] == 0xfa && rd[1] == 0xaa)
+			break;
+	}
+
+	m_context.write(cmd, sizeof(cmd));
+	set_frequency(JTAG_SPEED_DEFAULT);
+	flush();
+}
+
+JtagProbe::~JtagProbe()
+{
+	/* Hand the pins back in the state OpenOCD expects to find them */
+	m_context.set_bitmode(0, BITMODE_RESET);
+	m_context.close();
+}
+
+uint32_t
+JtagProbe::set_frequency(uint32_t khz)
+{
+	uint32_t divisor;
+
+	khz = std::max(1u, std::min(khz, (uint32_t)MPSSE_CLOCK_KHZ));
+	divisor = std::min((MPSSE_CLOCK_KHZ + khz - 1) / khz - 1, 0xffffu);
+
+	m_cmd.insert(m_cmd.end(), {
+	    TCK_DIVISOR,
+	    static_cast<uint8_t>(divisor & 0xff),
+	    static_cast<uint8_t>((divisor >> 8) & 0xff)
+	});
+
+	return (MPSSE_CLOCK_KHZ / (divisor + 1));
+}
+
+void
+JtagProbe::reset()
+{
+	/* Five TMS=1 clocks reach Test-Logic-Reset, one more to idle */
+	queue_tms(0x1f, 6);
+}
+
+void
+JtagProbe::queue_tms(uint8_t tms, unsigned int count)
+{
+	m_cmd.insert(m_cmd.end(), {
+	    CLOCK_TMS,
+	    static_cast<uint8_t>(count - 1),
+	    static_cast<uint8_t>(tms & 0x7f)
+	});
+}
+
+size_t
+JtagProbe::queue_scan(const std::vector<uint8_t> &tdi, size_t nbits, bool ir)
+{
+	size_t nbytes = (nbits - 1) / 8;
+	size_t nrem = (nbits - 1) % 8;
+	size_t chunk;
+	size_t i;
+	uint8_t last;
+
+	/* Run-Test/Idle to Shift-DR or Shift-IR */
+	if (ir)
+		queue_tms(0x03, 4);
+	else
+		queue_tms(0x01, 3);
+
+	/*
+	 * Keep the data the chip owes us below its buffer size, otherwise
+	 * it stops consuming commands until we read and we never do.
+	 */
+	for (i = 0; i < nbytes; i += chunk) {
+		chunk = std::min(nbytes - i, (size_t)READ_CHUNK);
+		if (m_pending + chunk > READ_CHUNK)
+			flush();
+
+		m_cmd.insert(m_cmd.end(), {
+		    SHIFT_BYTES,
+		    static_cast<uint8_t>((chunk - 1) & 0xff),
+		    static_cast<uint8_t>(((chunk - 1) >> 8) & 0xff)
+		});
+		m_cmd.insert(m_cmd.end(), &tdi[i], &tdi[i] + chunk);
+		m_pending += chunk;
+	}
+
+	if (m_pending + 2 > READ_CHUNK)
+		flush();
+
+	if (nrem > 0) {
+		m_cmd.insert(m_cmd.end(), {
+		    SHIFT_BITS,
+		    static_cast<uint8_t>(nrem - 1),
+		    tdi[nbytes]
+		});
+		m_pending++;
+	}
+
+	/* The last bit leaves Shift-xR, then go through Update to idle */
+	last = (tdi[nbytes] >> nrem) & 1;
+	m_cmd.insert(m_cmd.end(), {
+	    CLOCK_TMS_READ,
+	    0,
+	    static_cast<uint8_t>((last << 7) | 0x01)
+	});
+	m_pending++;
+	queue_tms(0x01, 2);
+
+	m_captures.push_back({ nbits });
+	return (m_captures.size() - 1);
+}
+
+void
+JtagProbe::flush()
+{
+	size_t offset = m_rx.size();
+	size_t done = 0;
+	int retries = 0;
+	int ret;
+
+	if (m_cmd.empty())
+		return;
+
+	m_cmd.push_back(SEND_IMMEDIATE);
+	if (m_context.write(m_cmd.data(), m_cmd.size()) != (int)m_cmd.size())
+		throw std::runtime_error("JTAG: failed to send MPSSE commands");
+
+	m_cmd.clear();
+	m_rx.resize(offset + m_pending);
+
+	while (done < m_pending) {
+		ret = m_context.read(&m_rx[offset + done], m_pending - done);
+		if (ret < 0)
+			throw std::runtime_error("JTAG: failed to read from MPSSE");
+
+		if (ret == 0 && ++retries > 100)
+			throw std::runtime_error("JTAG: MPSSE read timed out");
+
+		done += ret;
+	}
+
+	m_pending = 0;
+}
+
+std::vector<std::vector<uint8_t>>
+JtagProbe::execute()
+{
+	std::vector<std::vector<uint8_t>> result;
+	size_t pos = 0;
+	size_t nbytes;
+	size_t nrem;
+
+	flush();
+
+	for (const auto &i: m_captures) {
+		std::vector<uint8_t> bits((i.nbits + 7) / 8, 0);
+
+		nbytes = (i.nbits - 1) / 8;
+		nrem = (i.nbits - 1) % 8;
+
+		std::copy(&m_rx[pos], &m_rx[pos] + nbytes, bits.begin());
+		pos += nbytes;
+
+		/* Partial bytes are shifted in from the MSB side */
+		if (nrem > 0)
+			bits[nbytes] = m_rx[pos++] >> (8 - nrem);
+
+		bits[nbytes] |= (m_rx[pos++] >> 7) << nrem;
+		result.push_back(std::move(bits));
+	}
+
+	m_captures.clear();
+	m_rx.clear();
+	return (result);
+}
+
+std::vector<uint32_t>
+JtagProbe::read_idcodes()
+{
+	const size_t nbits = MAX_DEVICES * 32 + 32;
+	std::vector<uint8_t> tdi(nbits / 8, 0xff);
+
+	reset();
+	queue_scan(tdi, nbits, false);
+	return (parse_idcodes(execute()[0], nbits));
+}
+
+std::vector<uint32_t>
+JtagProbe::parse_idcodes(const std::vector<uint8_t> &dr, size_t nbits)
+{
+	std::vector<uint32_t> result;
+	uint32_t idcode;
+	size_t i;
+	size_t j;
+
+	/*
+	 * Test-Logic-Reset selects IDCODE, or BYPASS (a single 0 bit) on
+	 * TAPs without one; those are reported as 0. The ones shifted in
+	 * behind the chain mark its end.
+	 */
+	for (i = 0; i + 32 <= nbits && result.size() < MAX_DEVICES;) {
+		if (!get_bit(dr, i)) {
+			result.push_back(0);
+			i++;
+			continue;
+		}
+
+		for (idcode = 0, j = 0; j < 32; j++)
+			idcode |= (uint32_t)get_bit(dr, i + j) << j;
+
+		if (idcode == 0xffffffff)
+			break;
+
+		result.push_back(idcode);
+		i += 32;
+	}
+
+	/* TDO stuck low looks like an endless chain of BYPASS registers */
+	if (result.size() == MAX_DEVICES)
+		result.clear();
+
+	return (result);
+}
+
+std::vector<unsigned int>
+JtagProbe::parse_irlens(const std::vector<uint8_t> &ir, size_t ndevices)
+{
+	std::vector<unsigned int> result(ndevices, 0);
+	std::vector<size_t> starts;
+	size_t total;
+	size_t i;
+
+	/*
+	 * The scan shifted in MAX_IR_BITS ones, a single zero and ones
+	 * again, so that zero shows up exactly total IR length bits after
+	 * MAX_IR_BITS. Everything before that is the captured IR values.
+	 */
+	for (total = 0; total <= MAX_IR_BITS; total++) {
+		if (!get_bit(ir, MAX_IR_BITS + total))
+			break;
+	}
+
+	if (total == 0 || total > MAX_IR_BITS)
+		return (result);
+
+	if (ndevices == 1) {
+		result[0] = total;
+		return (result);
+	}
+
+	/*
+	 * IEEE 1149.1 makes every TAP capture binary 01 into the two
+	 * lowest IR bits. The split is only trusted when those markers
+	 * are unambiguous.
+	 */
+	for (i = 0; i + 1 < total; i++) {
+		if (get_bit(ir, i) && !get_bit(ir, i + 1))
+			starts.push_back(i);
+	}
+
+	if (starts.size() != ndevices || starts[0] != 0)
+		return (result);
+
+	starts.push_back(total);
+	for (i = 0; i < ndevices; i++)
+		result[i] = starts[i + 1] - starts[i];
+
+	return (result);
+}
+
+std::vector<JtagTap>
+JtagProbe::scan_chain()
+{
+	const size_t dr_bits = MAX_DEVICES * 32 + 32;
+	const size_t ir_bits = MAX_IR_BITS * 2 + 1;
+	std::vector<uint8_t> dr_tdi(dr_bits / 8, 0xff);
+	std::vector<uint8_t> ir_tdi((ir_bits + 7) / 8, 0xff);
+	std::vector<uint32_t> idcodes;
+	std::vector<unsigned int> irlens;
+	std::vector<JtagTap> result;
+	size_t i;
+
+	/* Both scans go out in a single batch, ending with IR all ones */
+	ir_tdi[MAX_IR_BITS / 8] &= ~(1u << (MAX_IR_BITS % 8));
+
+	reset();
+	queue_scan(dr_tdi, dr_bits, false);
+	queue_scan(ir_tdi, ir_bits, true);
+	auto out = execute();
+
+	idcodes = parse_idcodes(out[0], dr_bits);
+	irlens = parse_irlens(out[1], idcodes.size());
+
+	for (i = 0; i < idcodes.size(); i++)
+		result.push_back({ idcodes[i], irlens[i] });
+
+	return (result);
+}
+
+std::string
+JtagProbe::match_script(const std::vector<JtagTap> &chain,
+    const std::string &script_dir)
+{
+	const std::regex id_re("(TAPID|expected-id).*(0x[0-9a-fA-F]{8})");
+	std::string best;
+	size_t best_score = 0;
+	size_t score;
+	std::error_code err;
+
+	for (const auto &entry: filesystem::directory_iterator(script_dir, err)) {
+		std::vector<uint32_t> expected;
+		std::ifstream in;
+		std::string line;
+		std::smatch match;
+
+		if (entry.path().extension() != ".tcl")
+			continue;
+
+		in.open(entry.path());
+		while (std::getline(in, line)) {
+			if (std::regex_search(line, match, id_re))
+				expected.push_back(std::stoul(match[2], nullptr, 16));
+		}
+
+		/* The version nibble differs between silicon revisions */
+		score = 0;
+		for (const auto &tap: chain) {
+			for (uint32_t id: expected) {
+				if (((tap.idcode ^ id) & 0x0fffffff) == 0) {
+					score++;
+					break;
+				}
+			}
+		}
+
+		if (score > best_score) {
+			best_score = score;
+			best = entry.path().string();
+		}
+	}
+
+	return (best);
+}
+
+/* Progress goes to the log unless the caller takes the lines itself */
+std::string
+JtagProbe::detect_script(const Device &device, const std::string &script_dir,
+    const JtagProbeReport &report)
+{
+	std::vector<JtagTap> chain;
+	std::string script;
+	auto say = [&report](const std::string &line) {
+		if (report)
+			report(line);
+		else
+			Logger::info("JTAG: {}", line);
+	};
+
+	{
+		JtagProbe probe(device);
+		chain = probe.scan_chain();
+	}
+
+	if (chain.empty())
+		throw std::runtime_error("No devices found on the JTAG chain");
+
+	for (const auto &tap: chain) {
+		say(fmt::format("TAP idcode {:#010x}, IR length {}", tap.idcode,
+		    tap.irlen ? std::to_string(tap.irlen) : "unknown"));
+	}
+
+	script = match_script(chain, script_dir);
+	if (script.empty())
+		throw std::runtime_error(
+		    "No board script matches the devices on the JTAG chain");
+
+	say(fmt::format("Using board script {}", script));
+	return (script);
+}
+
+bool
+JtagProbe::check_bypass(size_t ndevices, unsigned int rounds)
+{
+	const size_t nbits = PATTERN_BITS + ndevices;
+	std::mt19937 rng(rounds);
+	std::vector<std::vector<uint8_t>> patterns;
+	std::vector<uint8_t> ones(MAX_IR_BITS / 8, 0xff);
+	unsigned int i;
+	size_t j;
+
+	/*
+	 * With every TAP in BYPASS the chain is a shift register ndevices
+	 * bits long, so the pattern must come back delayed by exactly that.
+	 */
+	for (i = 0; i < rounds; i++) {
+		std::vector<uint8_t> tdi((nbits + 7) / 8, 0);
+
+		for (j = 0; j < PATTERN_BITS / 8; j++)
+			tdi[j] = rng() & 0xff;
+
+		queue_scan(ones, MAX_IR_BITS, true);
+		queue_scan(tdi, nbits, false);
+		patterns.push_back(std::move(tdi));
+	}
+
+	auto out = execute();
+
+	for (i = 0; i < rounds; i++) {
+		const auto &dr = out[i * 2 + 1];
+
+		for (j = 0; j < ndevices; j++) {
+			if (get_bit(dr, j))
+				return (false);
+		}
+
+		for (j = 0; j < PATTERN_BITS; j++) {
+			if (get_bit(dr, ndevices + j) != get_bit(patterns[i], j))
+				return (false);
+		}
+	}
+
+	return (true);
+}
+
+bool
+JtagProbe::stable(const std::vector<uint32_t> &reference, size_t rounds)
+{
+	size_t i;
+
+	try {
+		for (i = 0; i < rounds; i++) {
+			if (read_idcodes() != reference)
+				return (false);
+		}
+
+		return (check_bypass(reference.size(), rounds));
+	} catch (const std::runtime_error &err) {
+		Logger::debug("JTAG: {}", err.what());
+		return (false);
+	}
+}
+
+uint32_t
+JtagProbe::tune(uint32_t max_khz, unsigned int margin)
+{
+	static const uint32_t steps[] = {
+		30000, 15000, 10000, 7500, 6000, 5000, 3750, 3000,
+		2000, 1500, 1000, 750, 500, 250
+	};
+	std::vector<uint32_t> reference;
+	uint32_t best;
+	uint32_t khz;
+
+	best = set_frequency(JTAG_SPEED_MIN);
+	reference = read_idcodes();
+	if (reference.empty())
+		throw std::runtime_error("No devices found on the JTAG chain");
+
+	if (!stable(reference, TUNE_ROUNDS)) {
+		throw std::runtime_error(fmt::format(
+		    "JTAG chain is not stable even at {} kHz", best));
+	}
+
+	for (uint32_t step: steps) {
+		if (step > max_khz)
+			continue;
+
+		if (step <= best)
+			break;
+
+		khz = set_frequency(step);
+		if (stable(reference, TUNE_ROUNDS)) {
+			best = khz;
+			break;
+		}
+
+		Logger::debug("JTAG: chain unstable at {} kHz", khz);
+	}
+
+	khz = set_frequency(std::max(best * (100 - margin) / 100,
+	    (uint32_t)JTAG_SPEED_MIN));
+
+	if (!stable(reference, TUNE_ROUNDS)) {
+		Logger::warning("JTAG: chain unstable at {} kHz after "
+		    "passing at {} kHz", khz, best);
+		khz = set_frequency(JTAG_SPEED_MIN);
+	}
+
+	Logger::info("JTAG: highest stable TCK is {} kHz, using {} kHz",
+	    best, khz);
+	return (khz);
+}
+
+static std::string
+speed_cache_path()
+{
+	return (Glib::get_user_config_dir() + "/devclient/jtag-speed.yaml");
+}
+
+uint32_t
+JtagSpeedCache::lookup(const std::string &profile, const std::string &serial)
+{
+	YAML::Node cache;
+
+	try {
+		cache = YAML::LoadFile(speed_cache_path());
+		if (cache[profile] && cache[profile][serial])
+			return (cache[profile][serial].as<uint32_t>());
+	} catch (const YAML::Exception &err) {
+		Logger::debug("JTAG speed cache not usable: {}", err.what());
+	}
+
+	return (JTAG_SPEED_AUTO);
+}
+
+void
+JtagSpeedCache::store(const std::string &profile, const std::string &serial,
+    uint32_t khz)
+{
+	filesystem::path path(speed_cache_path());
+	YAML::Node cache;
+	std::ofstream out;
+
+	try {
+		cache = YAML::LoadFile(path.string());
+	} catch (const YAML::Exception &err) {
+		cache = YAML::Node(YAML::NodeType::Map);
+	}
+
+	cache[profile][serial] = khz;
+
+	filesystem::create_directories(path.parent_path());
+	out.open(path, std::ios::out | std::ios::trunc);
+	out << cache << std::endl;
+}
+
+uint32_t
+JtagSpeedCache::resolve(const Device &device, const std::string &profile,
+    bool force)
+{
+	uint32_t khz;
+
+	if (!force) {
+		khz = lookup(profile, device.serial);
+		if (khz != JTAG_SPEED_AUTO) {
+			Logger::info("JTAG: using cached adapter speed {} kHz",
+			    khz);
+			return (khz);
+		}
+	}
+
+	JtagProbe probe(device);
+
+	khz = probe.tune(JTAG_SPEED_MAX, TUNE_MARGIN);
+	store(profile, device.serial, khz);
+	return (khz);
+}
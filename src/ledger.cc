@@ -0,0 +1,496 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <ctime>
+#include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fmt/format.h>
+#include <ledger.hh>
+#include <eeprom_batch.hh>
+#include <log.hh>
+
+#define LEDGER_HEADER_SIZE	sizeof(struct ledger_header_raw)
+#define LEDGER_RECORD_SIZE	sizeof(struct ledger_record_raw)
+
+static_assert(LEDGER_HEADER_SIZE == 64, "ledger header must stay 64 bytes");
+static_assert(LEDGER_RECORD_SIZE == 128, "ledger record must stay 128 bytes");
+
+Ledger::Ledger(const std::string &path):
+    m_path(path),
+    m_fd(-1),
+    m_data(nullptr),
+    m_size(0)
+{
+	m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (m_fd < 0) {
+		throw std::runtime_error(fmt::format("Cannot open {}: {}",
+		    path, strerror(errno)));
+	}
+
+	/* Whoever gets here first on a new file writes the header */
+	lock(true);
+	try {
+		remap();
+		if (m_size == 0) {
+			ledger_header_raw *hdr;
+
+			grow(LEDGER_GROW_RECORDS);
+			hdr = header();
+			memcpy(hdr->magic, LEDGER_MAGIC, sizeof(hdr->magic));
+			hdr->version = htole32(LEDGER_VERSION);
+			hdr->record_size = htole32(LEDGER_RECORD_SIZE);
+			hdr->crc32 = htole32(header_crc(hdr));
+			sync(hdr, LEDGER_HEADER_SIZE);
+		}
+
+		if (memcmp(header()->magic, LEDGER_MAGIC, sizeof(header()->magic)) != 0 ||
+		    le32toh(header()->record_size) != LEDGER_RECORD_SIZE)
+			throw std::runtime_error(fmt::format(
+			    "{} is not a ledger file", path));
+
+		recover();
+	} catch (...) {
+		unlock();
+		if (m_data)
+			munmap(m_data, m_size);
+		close(m_fd);
+		throw;
+	}
+	unlock();
+}
+
+Ledger::~Ledger()
+{
+	if (m_data)
+		munmap(m_data, m_size);
+
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+/* Open file description locks belong to the fd, not the process */
+void
+Ledger::lock(bool exclusive)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+	fl.l_whence = SEEK_SET;
+
+	while (fcntl(m_fd, F_OFD_SETLKW, &fl) != 0) {
+		if (errno != EINTR)
+			throw std::runtime_error(fmt::format("Cannot lock {}: {}",
+			    m_path, strerror(errno)));
+	}
+}
+
+void
+Ledger::unlock()
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fcntl(m_fd, F_OFD_SETLK, &fl);
+}
+
+/* Another station may have grown the file since we last looked */
+void
+Ledger::remap()
+{
+	struct stat st;
+	void *addr;
+
+	if (fstat(m_fd, &st) != 0)
+		throw std::runtime_error(fmt::format("Cannot stat {}: {}",
+		    m_path, strerror(errno)));
+
+	if ((size_t)st.st_size == m_size)
+		return;
+
+	if (m_data)
+		munmap(m_data, m_size);
+
+	m_data = nullptr;
+	m_size = st.st_size;
+
+	if (m_size == 0)
+		return;
+
+	addr = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    m_fd, 0);
+	if (addr == MAP_FAILED) {
+		m_size = 0;
+		throw std::runtime_error(fmt::format("Cannot map {}: {}",
+		    m_path, strerror(errno)));
+	}
+
+	m_data = (uint8_t *)addr;
+}
+
+void
+Ledger::grow(size_t records)
+{
+	size_t size = LEDGER_HEADER_SIZE + records * LEDGER_RECORD_SIZE;
+
+	if (size <= m_size)
+		return;
+
+	if (ftruncate(m_fd, size) != 0)
+		throw std::runtime_error(fmt::format("Cannot grow {}: {}",
+		    m_path, strerror(errno)));
+
+	remap();
+}
+
+void
+Ledger::sync(const void *addr, size_t length)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page - 1);
+
+	if (msync((void *)start, (uintptr_t)addr + length - start, MS_SYNC) != 0)
+		throw std::runtime_error(fmt::format("Cannot sync {}: {}",
+		    m_path, strerror(errno)));
+}
+
+ledger_header_raw *
+Ledger::header() const
+{
+	return ((ledger_header_raw *)m_data);
+}
+
+ledger_record_raw *
+Ledger::record(size_t index) const
+{
+	return ((ledger_record_raw *)(m_data + LEDGER_HEADER_SIZE) + index);
+}
+
+size_t
+Ledger::capacity() const
+{
+	return ((m_size - LEDGER_HEADER_SIZE) / LEDGER_RECORD_SIZE);
+}
+
+uint32_t
+Ledger::header_crc(const ledger_header_raw *raw)
+{
+	return (crc32(0, (const uint8_t *)raw,
+	    offsetof(ledger_header_raw, crc32)));
+}
+
+uint32_t
+Ledger::record_crc(const ledger_record_raw *raw)
+{
+	return (crc32(0, (const uint8_t *)raw,
+	    offsetof(ledger_record_raw, crc32)));
+}
+
+/*
+ * Called with the exclusive lock held. A torn header is rebuilt from
+ * the records; records synced after the header was last written are
+ * adopted. Zero filled space never carries a valid CRC.
+ */
+void
+Ledger::recover()
+{
+	ledger_header_raw *hdr = header();
+	uint64_t count = le64toh(hdr->count);
+	uint64_t next_serial = le64toh(hdr->next_serial);
+	uint64_t next_mac = le64toh(hdr->next_mac);
+	bool dirty = false;
+
+	if (le32toh(hdr->crc32) != header_crc(hdr)) {
+		Logger::warning("Ledger {}: header is damaged, rebuilding it",
+		    m_path);
+		count = next_serial = next_mac = 0;
+		dirty = true;
+	}
+
+	count = std::min<uint64_t>(count, capacity());
+
+	while (count < capacity()) {
+		const ledger_record_raw *raw = record(count);
+
+		if (le32toh(raw->crc32) != record_crc(raw) ||
+		    le64toh(raw->serial) < next_serial ||
+		    le64toh(raw->mac) < next_mac)
+			break;
+
+		next_serial = le64toh(raw->serial) + 1;
+		next_mac = le64toh(raw->mac) + le32toh(raw->mac_count);
+		count++;
+		dirty = true;
+	}
+
+	if (!dirty)
+		return;
+
+	Logger::info("Ledger {}: {} records, next serial {:#x}", m_path,
+	    count, next_serial);
+	hdr->count = htole64(count);
+	hdr->next_serial = htole64(next_serial);
+	hdr->next_mac = htole64(next_mac);
+	hdr->crc32 = htole32(header_crc(hdr));
+	sync(hdr, LEDGER_HEADER_SIZE);
+}
+
+LedgerEntry
+Ledger::decode(const ledger_record_raw *raw) const
+{
+	LedgerEntry entry;
+
+	entry.serial = le64toh(raw->serial);
+	entry.mac = le64toh(raw->mac);
+	entry.mac_count = le32toh(raw->mac_count);
+	entry.timestamp = le64toh(raw->timestamp);
+	entry.cable.assign(raw->cable, strnlen(raw->cable, sizeof(raw->cable)));
+	entry.board.assign(raw->board, strnlen(raw->board, sizeof(raw->board)));
+	return (entry);
+}
+
+std::vector<LedgerEntry>
+Ledger::reserve(size_t boards, unsigned int mac_count, uint64_t serial_floor,
+    uint64_t mac_floor, const std::string &cable, const std::string &board)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::vector<LedgerEntry> result;
+	ledger_header_raw *hdr;
+	uint64_t serial;
+	uint64_t mac;
+	uint64_t count;
+	int64_t now = time(nullptr);
+
+	lock(true);
+	try {
+		remap();
+		recover();
+
+		hdr = header();
+		count = le64toh(hdr->count);
+		serial = std::max(le64toh(hdr->next_serial), serial_floor);
+		mac = std::max(le64toh(hdr->next_mac), mac_floor);
+
+		if (mac_count > 0 && boards > 0 && (mac > EEPROM_BATCH_MAC_MAX ||
+		    boards > (EEPROM_BATCH_MAC_MAX - mac + 1) / mac_count))
+			throw std::runtime_error("Ledger ran out of MAC addresses");
+
+		if (count + boards > capacity()) {
+			grow(count + boards + LEDGER_GROW_RECORDS);
+			hdr = header();
+		}
+
+		/* Records first; the header only counts what is on disk */
+		for (size_t i = 0; i < boards; i++) {
+			ledger_record_raw *raw = record(count + i);
+
+			memset(raw, 0, LEDGER_RECORD_SIZE);
+			raw->serial = htole64(serial + i);
+			raw->mac = htole64(mac + i * mac_count);
+			raw->mac_count = htole32(mac_count);
+			raw->timestamp = htole64(now);
+			strncpy(raw->cable, cable.c_str(), sizeof(raw->cable) - 1);
+			strncpy(raw->board, board.c_str(), sizeof(raw->board) - 1);
+			raw->crc32 = htole32(record_crc(raw));
+			result.push_back(decode(raw));
+		}
+
+		if (boards > 0)
+			sync(record(count), boards * LEDGER_RECORD_SIZE);
+
+		hdr->count = htole64(count + boards);
+		hdr->next_serial = htole64(serial + boards);
+		hdr->next_mac = htole64(mac + boards * mac_count);
+		hdr->crc32 = htole32(header_crc(hdr));
+		sync(hdr, LEDGER_HEADER_SIZE);
+	} catch (...) {
+		unlock();
+		throw;
+	}
+	unlock();
+
+	Logger::info("Ledger {}: reserved {} serials from {:#x} for {}", m_path,
+	    boards, serial, cable);
+	return (result);
+}
+
+std::optional<LedgerEntry>
+Ledger::find_serial(uint64_t serial)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::optional<LedgerEntry> result;
+	size_t lo = 0;
+	size_t hi;
+
+	lock(false);
+	try {
+		remap();
+		hi = std::min<uint64_t>(le64toh(header()->count), capacity());
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			uint64_t value = le64toh(record(mid)->serial);
+
+			if (value == serial) {
+				result = decode(record(mid));
+				break;
+			}
+
+			if (value < serial)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	} catch (...) {
+		unlock();
+		throw;
+	}
+	unlock();
+
+	return (result);
+}
+
+/* Finds the board whose MAC block contains the address */
+std::optional<LedgerEntry>
+Ledger::find_mac(uint64_t mac)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::optional<LedgerEntry> result;
+	size_t lo = 0;
+	size_t hi;
+
+	lock(false);
+	try {
+		remap();
+		hi = std::min<uint64_t>(le64toh(header()->count), capacity());
+
+		/* First record starting past the address */
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (le64toh(record(mid)->mac) <= mac)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo > 0) {
+			const ledger_record_raw *raw = record(lo - 1);
+
+			if (mac < le64toh(raw->mac) + le32toh(raw->mac_count))
+				result = decode(raw);
+		}
+	} catch (...) {
+		unlock();
+		throw;
+	}
+	unlock();
+
+	return (result);
+}
+
+size_t
+Ledger::size()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	size_t result;
+
+	lock(false);
+	try {
+		remap();
+		result = le64toh(header()->count);
+	} catch (...) {
+		unlock();
+		throw;
+	}
+	unlock();
+
+	return (result);
+}
+
+/*
+ * Takes the next serial and MAC block for one board and stores them in
+ * the TLV data, using the values already there as the floor. Boards
+ * whose TLV data has no MAC address get a serial only; a MAC address
+ * with number-mac 0 still takes a block of one, since it is programmed.
+ */
+LedgerEntry
+Ledger::assign(OnieTLV &tlv, const std::string &cable)
+{
+	bool has_mac = tlv.has_tlv_record(TLV_CODE_MAC_BASE);
+	uint64_t serial_floor = 0;
+	uint64_t mac_floor = 0;
+	unsigned int mac_count = has_mac ? 1 : 0;
+	LedgerEntry entry;
+
+	try {
+		if (tlv.has_tlv_record(TLV_CODE_SERIAL_NUMBER))
+			serial_floor = std::stoull(tlv.get_tlv_record(
+			    TLV_CODE_SERIAL_NUMBER).value(), nullptr, 0);
+
+	} catch (const std::logic_error &) {
+		throw std::runtime_error("serial-number must be a number to use a ledger");
+	}
+
+	try {
+		if (has_mac && tlv.has_tlv_record(TLV_CODE_NUM_MACs))
+			mac_count = std::max(1ul, std::stoul(tlv.get_tlv_record(
+			    TLV_CODE_NUM_MACs).value()));
+	} catch (const std::logic_error &) {
+		throw std::runtime_error("number-mac must be a number to use a ledger");
+	}
+
+	if (has_mac)
+		mac_floor = EepromBatch::parse_mac(tlv.get_tlv_record(
+		    TLV_CODE_MAC_BASE).value());
+
+	entry = reserve(1, mac_count, serial_floor, mac_floor, cable,
+	    tlv.get_board_name_from_yaml()).front();
+
+	try {
+		tlv.save_user_tlv(TLV_CODE_SERIAL_NUMBER,
+		    fmt::format("0x{:08x}", entry.serial));
+		if (mac_count > 0)
+			tlv.save_user_tlv(TLV_CODE_MAC_BASE,
+			    EepromBatch::format_mac(entry.mac));
+	} catch (const OnieTLVException &err) {
+		throw std::runtime_error(err.get_info());
+	}
+
+	return (entry);
+}
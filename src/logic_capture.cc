@@ -0,0 +1,768 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <ctime>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <stdexcept>
+#include <zlib.h>
+#include <fmt/format.h>
+#include <logic_capture.hh>
+#include <log.hh>
+
+#define SIGROK_CHUNK_SIZE	(4 * 1024 * 1024)
+
+SampleRing::SampleRing(size_t capacity):
+    m_head(0),
+    m_tail(0)
+{
+	size_t size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	m_buffer.resize(size);
+	m_mask = size - 1;
+}
+
+size_t
+SampleRing::push(const uint8_t *buf, size_t count)
+{
+	size_t head = m_head.load(std::memory_order_relaxed);
+	size_t tail = m_tail.load(std::memory_order_acquire);
+	size_t n = std::min(count, m_buffer.size() - (head - tail));
+
+	for (size_t i = 0; i < n; i++)
+		m_buffer[(head + i) & m_mask] = buf[i];
+
+	m_head.store(head + n, std::memory_order_release);
+	return (n);
+}
+
+size_t
+SampleRing::pop(uint8_t *buf, size_t count)
+{
+	size_t tail = m_tail.load(std::memory_order_relaxed);
+	size_t head = m_head.load(std::memory_order_acquire);
+	size_t n = std::min(count, head - tail);
+
+	for (size_t i = 0; i < n; i++)
+		buf[i] = m_buffer[(tail + i) & m_mask];
+
+	m_tail.store(tail + n, std::memory_order_release);
+	return (n);
+}
+
+bool
+LogicTrigger::matches(uint8_t prev, uint8_t cur) const
+{
+	switch (type) {
+	case IMMEDIATE:
+		return (true);
+	case RISING:
+		return (~prev & cur & mask);
+	case FALLING:
+		return (prev & ~cur & mask);
+	case EDGE:
+		return ((prev ^ cur) & mask);
+	case PATTERN:
+		return ((cur & mask) == value);
+	}
+
+	return (false);
+}
+
+std::string
+LogicTrigger::describe() const
+{
+	std::string pattern;
+	int pin = 0;
+
+	while (mask >> pin > 1)
+		pin++;
+
+	switch (type) {
+	case IMMEDIATE:
+		return ("now");
+	case RISING:
+		return (fmt::format("rising:{}", pin));
+	case FALLING:
+		return (fmt::format("falling:{}", pin));
+	case EDGE:
+		return (fmt::format("edge:{}", pin));
+	case PATTERN:
+		for (int i = LOGIC_CHANNELS - 1; i >= 0; i--) {
+			if (!(mask & (1 << i)))
+				pattern += 'x';
+			else
+				pattern += value & (1 << i) ? '1' : '0';
+		}
+
+		return ("pattern:" + pattern);
+	}
+
+	return ("");
+}
+
+/*
+ * Patterns list one character per pin, the highest pin first, so
+ * "pattern:1x0" waits for GPIO2 high and GPIO0 low.
+ */
+LogicTrigger
+LogicTrigger::parse(const std::string &spec)
+{
+	LogicTrigger trigger;
+	std::string kind = spec.substr(0, spec.find(':'));
+	std::string arg;
+	unsigned long pin;
+
+	if (kind == "now" || kind.empty())
+		return (trigger);
+
+	if (spec.find(':') == std::string::npos)
+		throw std::runtime_error(fmt::format("Invalid trigger: {}", spec));
+
+	arg = spec.substr(spec.find(':') + 1);
+	if (kind == "pattern") {
+		if (arg.empty() || arg.size() > LOGIC_CHANNELS)
+			throw std::runtime_error(fmt::format(
+			    "Invalid trigger pattern: {}", arg));
+
+		trigger.type = PATTERN;
+		for (size_t i = 0; i < arg.size(); i++) {
+			uint8_t bit = 1 << (arg.size() - i - 1);
+
+			switch (arg[i]) {
+			case '1':
+				trigger.value |= bit;
+				/* FALLTHROUGH */
+			case '0':
+				trigger.mask |= bit;
+				break;
+			case 'x':
+			case 'X':
+				break;
+			default:
+				throw std::runtime_error(fmt::format(
+				    "Invalid trigger pattern: {}", arg));
+			}
+		}
+
+		return (trigger);
+	}
+
+	if (kind == "rising")
+		trigger.type = RISING;
+	else if (kind == "falling")
+		trigger.type = FALLING;
+	else if (kind == "edge")
+		trigger.type = EDGE;
+	else
+		throw std::runtime_error(fmt::format("Invalid trigger: {}", spec));
+
+	try {
+		pin = std::stoul(arg);
+	} catch (const std::logic_error &) {
+		pin = LOGIC_CHANNELS;
+	}
+
+	if (pin >= LOGIC_CHANNELS)
+		throw std::runtime_error(fmt::format("Invalid trigger pin: {}", arg));
+
+	trigger.mask = 1 << pin;
+	return (trigger);
+}
+
+LogicTrace::LogicTrace(unsigned int rate):
+    m_rate(rate),
+    m_samples(0),
+    m_trigger(0)
+{
+}
+
+void
+LogicTrace::append(uint8_t value)
+{
+	if (!m_runs.empty() && m_runs.back().value == value &&
+	    m_runs.back().length < UINT32_MAX)
+		m_runs.back().length++;
+	else
+		m_runs.push_back({value, 1});
+
+	m_samples++;
+}
+
+void
+LogicTrace::mark_trigger()
+{
+	m_trigger = m_samples;
+}
+
+/* Gaps are added in order, each before the given sample */
+void
+LogicTrace::add_gap(uint64_t sample, uint64_t ns)
+{
+	m_gaps.push_back({sample, ns});
+}
+
+size_t
+LogicTrace::size() const
+{
+	return (m_samples);
+}
+
+size_t
+LogicTrace::get_trigger() const
+{
+	return (m_trigger);
+}
+
+const std::vector<LogicRun> &
+LogicTrace::get_runs() const
+{
+	return (m_runs);
+}
+
+const std::vector<LogicGap> &
+LogicTrace::get_gaps() const
+{
+	return (m_gaps);
+}
+
+std::string
+LogicTrace::channel_name(const std::vector<std::string> &names,
+    int channel) const
+{
+	if ((size_t)channel < names.size() && !names[channel].empty())
+		return (names[channel]);
+
+	return (fmt::format("GPIO{}", channel));
+}
+
+void
+LogicTrace::save(const std::string &path,
+    const std::vector<std::string> &names) const
+{
+	std::string ext = path.substr(path.rfind('.') == std::string::npos
+	    ? path.size() : path.rfind('.'));
+
+	if (ext == ".vcd")
+		write_vcd(path, names);
+	else if (ext == ".sr")
+		write_sigrok(path, names);
+	else
+		throw std::runtime_error(fmt::format(
+		    "Unknown capture format for {}, use .vcd or .sr", path));
+}
+
+/*
+ * VCD only records value changes, so each run becomes one timestamp
+ * with the pins that toggled at its start. Across a gap all pins are
+ * unknown, and the timestamps after it are shifted by its length.
+ */
+void
+LogicTrace::write_vcd(const std::string &path,
+    const std::vector<std::string> &names) const
+{
+	std::ofstream out(path, std::ios::out | std::ios::trunc);
+	uint64_t sample = 0;
+	uint64_t offset = 0;
+	uint64_t pos;
+	uint64_t end;
+	size_t gap = 0;
+	bool all = true;
+	uint8_t prev = 0;
+	time_t now = time(nullptr);
+	char date[64];
+	auto stamp = [&](uint64_t at) {
+		return (at * 1000000000 / m_rate + offset);
+	};
+
+	if (!out)
+		throw std::runtime_error(fmt::format("Cannot create {}", path));
+
+	strftime(date, sizeof(date), "%c", localtime(&now));
+	out << fmt::format("$date {} $end\n", date);
+	out << "$version devclient $end\n";
+	out << fmt::format("$comment {} samples at {} Hz, trigger at sample {}, "
+	    "{} gaps $end\n", m_samples, m_rate, m_trigger, m_gaps.size());
+	out << "$timescale 1 ns $end\n";
+	out << "$scope module gpio $end\n";
+	for (int i = 0; i < LOGIC_CHANNELS; i++) {
+		out << fmt::format("$var wire 1 {} {} $end\n", (char)('!' + i),
+		    channel_name(names, i));
+	}
+	out << "$upscope $end\n";
+	out << "$enddefinitions $end\n";
+
+	for (const auto &run: m_runs) {
+		end = sample + run.length;
+		for (pos = sample; pos < end;) {
+			uint8_t changed;
+
+			if (gap < m_gaps.size() && m_gaps[gap].sample == pos) {
+				out << fmt::format("#{}\n", stamp(pos));
+				for (int i = 0; i < LOGIC_CHANNELS; i++)
+					out << fmt::format("x{}\n", (char)('!' + i));
+
+				offset += m_gaps[gap++].ns;
+				all = true;
+			}
+
+			changed = all ? 0xff : run.value ^ prev;
+			out << fmt::format("#{}\n", stamp(pos));
+			if (pos == 0)
+				out << "$dumpvars\n";
+
+			for (int i = 0; i < LOGIC_CHANNELS; i++) {
+				if (changed & (1 << i)) {
+					out << fmt::format("{}{}\n",
+					    run.value & (1 << i) ? '1' : '0',
+					    (char)('!' + i));
+				}
+			}
+
+			if (pos == 0)
+				out << "$end\n";
+
+			prev = run.value;
+			all = false;
+			pos = gap < m_gaps.size() && m_gaps[gap].sample < end
+			    ? m_gaps[gap].sample : end;
+		}
+
+		sample = end;
+	}
+
+	out << fmt::format("#{}\n", stamp(sample));
+	if (!out)
+		throw std::runtime_error(fmt::format("Failed to write {}", path));
+}
+
+static void
+put16(std::string &buf, uint16_t value)
+{
+	buf += (char)(value & 0xff);
+	buf += (char)(value >> 8);
+}
+
+static void
+put32(std::string &buf, uint32_t value)
+{
+	put16(buf, value & 0xffff);
+	put16(buf, value >> 16);
+}
+
+/*
+ * Just enough of a ZIP writer for sigrok session files: deflated
+ * entries, no extra fields, no ZIP64.
+ */
+class ZipWriter
+{
+public:
+	ZipWriter(const std::string &path):
+	    m_out(path, std::ios::out | std::ios::binary | std::ios::trunc),
+	    m_offset(0)
+	{
+		if (!m_out)
+			throw std::runtime_error(fmt::format("Cannot create {}", path));
+	}
+
+	void add(const std::string &name, const uint8_t *data, size_t size)
+	{
+		std::vector<uint8_t> packed(compressBound(size));
+		std::string header;
+		Entry entry;
+		z_stream zs = {};
+
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("Cannot initialize deflate");
+
+		zs.next_in = (Bytef *)data;
+		zs.avail_in = size;
+		zs.next_out = packed.data();
+		zs.avail_out = packed.size();
+		if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			deflateEnd(&zs);
+			throw std::runtime_error("Failed to compress capture");
+		}
+
+		entry.name = name;
+		entry.crc = crc32(0, data, size);
+		entry.packed = zs.total_out;
+		entry.size = size;
+		entry.offset = m_offset;
+		deflateEnd(&zs);
+
+		put32(header, 0x04034b50);
+		put_common(header, entry);
+		header += name;
+
+		m_out.write(header.data(), header.size());
+		m_out.write((const char *)packed.data(), entry.packed);
+		m_offset += header.size() + entry.packed;
+		m_entries.push_back(entry);
+	}
+
+	void add(const std::string &name, const std::string &data)
+	{
+		add(name, (const uint8_t *)data.data(), data.size());
+	}
+
+	void finish()
+	{
+		std::string dir;
+		std::string end;
+
+		for (const auto &entry: m_entries) {
+			put32(dir, 0x02014b50);
+			put16(dir, 20);		/* made by */
+			put_common(dir, entry);
+			put16(dir, 0);		/* comment length */
+			put16(dir, 0);		/* disk number */
+			put16(dir, 0);		/* internal attributes */
+			put32(dir, 0);		/* external attributes */
+			put32(dir, entry.offset);
+			dir += entry.name;
+		}
+
+		put32(end, 0x06054b50);
+		put16(end, 0);
+		put16(end, 0);
+		put16(end, m_entries.size());
+		put16(end, m_entries.size());
+		put32(end, dir.size());
+		put32(end, m_offset);
+		put16(end, 0);
+
+		m_out.write(dir.data(), dir.size());
+		m_out.write(end.data(), end.size());
+		m_out.close();
+		if (!m_out)
+			throw std::runtime_error("Failed to write capture archive");
+	}
+
+protected:
+	struct Entry
+	{
+		std::string name;
+		uint32_t crc;
+		uint32_t packed;
+		uint32_t size;
+		uint32_t offset;
+	};
+
+	/* The part shared by local and central directory headers */
+	static void put_common(std::string &buf, const Entry &entry)
+	{
+		put16(buf, 20);			/* version needed */
+		put16(buf, 0);			/* flags */
+		put16(buf, Z_DEFLATED);
+		put16(buf, 0);			/* time */
+		put16(buf, 0x21);		/* date, 1980-01-01 */
+		put32(buf, entry.crc);
+		put32(buf, entry.packed);
+		put32(buf, entry.size);
+		put16(buf, entry.name.size());
+		put16(buf, 0);			/* extra length */
+	}
+
+	std::ofstream m_out;
+	uint32_t m_offset;
+	std::vector<Entry> m_entries;
+};
+
+static std::string
+format_samplerate(unsigned int rate)
+{
+	if (rate % 1000000 == 0)
+		return (fmt::format("{} MHz", rate / 1000000));
+
+	if (rate % 1000 == 0)
+		return (fmt::format("{} kHz", rate / 1000));
+
+	return (fmt::format("{} Hz", rate));
+}
+
+/*
+ * Session format version 2, as written by sigrok-cli: a ZIP archive
+ * with the metadata and the raw samples split into logic-1-N chunks.
+ * The format has a fixed sample rate and no notion of missing data, so
+ * gaps are filled by holding the last value for their length.
+ */
+void
+LogicTrace::write_sigrok(const std::string &path,
+    const std::vector<std::string> &names) const
+{
+	ZipWriter zip(path);
+	std::vector<uint8_t> chunk;
+	std::string metadata;
+	uint64_t sample = 0;
+	uint64_t padded = 0;
+	size_t gap = 0;
+	int nchunk = 1;
+	auto emit = [&](uint8_t value, uint64_t count) {
+		while (count > 0) {
+			size_t n = std::min<uint64_t>(count,
+			    SIGROK_CHUNK_SIZE - chunk.size());
+
+			chunk.insert(chunk.end(), n, value);
+			count -= n;
+			if (chunk.size() == SIGROK_CHUNK_SIZE) {
+				zip.add(fmt::format("logic-1-{}", nchunk++),
+				    chunk.data(), chunk.size());
+				chunk.clear();
+			}
+		}
+	};
+
+	metadata += "[global]\n";
+	metadata += "sigrok version=0.5.1\n\n";
+	metadata += "[device 1]\n";
+	metadata += "capturefile=logic-1\n";
+	metadata += fmt::format("total probes={}\n", LOGIC_CHANNELS);
+	metadata += fmt::format("samplerate={}\n", format_samplerate(m_rate));
+	metadata += "total analog=0\n";
+	for (int i = 0; i < LOGIC_CHANNELS; i++)
+		metadata += fmt::format("probe{}={}\n", i + 1, channel_name(names, i));
+	metadata += "unitsize=1\n";
+
+	zip.add("version", "2");
+	zip.add("metadata", metadata);
+
+	chunk.reserve(SIGROK_CHUNK_SIZE);
+	for (size_t i = 0; i < m_runs.size(); i++) {
+		const LogicRun &run = m_runs[i];
+		uint64_t end = sample + run.length;
+
+		for (uint64_t pos = sample; pos < end;) {
+			uint64_t next;
+
+			if (gap < m_gaps.size() && m_gaps[gap].sample == pos) {
+				uint64_t fill = m_gaps[gap++].ns * m_rate / 1000000000;
+
+				emit(pos == sample && i > 0 ? m_runs[i - 1].value :
+				    run.value, fill);
+				padded += fill;
+			}
+
+			next = gap < m_gaps.size() && m_gaps[gap].sample < end
+			    ? m_gaps[gap].sample : end;
+			emit(run.value, next - pos);
+			pos = next;
+		}
+
+		sample = end;
+	}
+
+	if (!chunk.empty())
+		zip.add(fmt::format("logic-1-{}", nchunk), chunk.data(), chunk.size());
+
+	zip.finish();
+
+	if (padded > 0) {
+		Logger::warning("{}: {} gaps filled with {} held samples",
+		    path, m_gaps.size(), padded);
+	}
+}
+
+LogicCapture::LogicCapture(std::shared_ptr<Gpio> gpio,
+    const LogicCaptureConfig &config):
+    m_gpio(gpio),
+    m_config(config),
+    m_ring(LOGIC_RING_SIZE),
+    m_running(false),
+    m_cancelled(false),
+    m_failed(false),
+    m_overruns(0)
+{
+}
+
+void
+LogicCapture::cancel()
+{
+	m_cancelled = true;
+	m_running = false;
+}
+
+size_t
+LogicCapture::get_overruns() const
+{
+	return (m_overruns);
+}
+
+/*
+ * Every sample() call is one contiguous block. The time between the
+ * starts of two blocks beyond what the first one's samples account for
+ * was not sampled and is recorded as a gap before the second block,
+ * as are samples the ring had no room for.
+ */
+void
+LogicCapture::reader()
+{
+	std::vector<uint8_t> buf(LOGIC_CHUNK_SIZE);
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point prev_start;
+	uint64_t stream = 0;
+	uint64_t covered;
+	int64_t elapsed;
+	size_t prev = 0;
+	size_t got;
+	size_t pushed;
+
+	try {
+		m_gpio->start_sampling(m_config.rate);
+		while (m_running) {
+			start = std::chrono::steady_clock::now();
+			if (stream > 0) {
+				elapsed = std::chrono::duration_cast<
+				    std::chrono::nanoseconds>(start - prev_start).count();
+				covered = (uint64_t)prev * 1000000000 / m_config.rate;
+				if (elapsed > 0 && (uint64_t)elapsed > covered)
+					m_gaps.push_back({stream, elapsed - covered});
+			}
+
+			got = m_gpio->sample(buf.data(), buf.size());
+			pushed = m_ring.push(buf.data(), got);
+			if (pushed < got)
+				m_overruns += got - pushed;
+
+			stream += pushed;
+			prev = pushed;
+			prev_start = start;
+		}
+
+		m_gpio->stop_sampling();
+	} catch (const std::runtime_error &err) {
+		m_error = err.what();
+		m_failed = true;
+		m_gpio->stop_sampling();
+	}
+}
+
+/*
+ * Until the trigger fires, the last m_config.pre samples are kept in a
+ * circular history. The trigger sample and everything after it go
+ * straight into the trace until the post-trigger window is full.
+ */
+LogicTrace
+LogicCapture::run()
+{
+	std::vector<uint8_t> history(m_config.pre);
+	std::vector<uint8_t> buf(LOGIC_CHUNK_SIZE);
+	LogicTrace trace(m_config.rate);
+	auto deadline = std::chrono::steady_clock::now() +
+	    std::chrono::seconds(m_config.timeout);
+	size_t post_left = m_config.post + 1;
+	size_t hist_len = 0;
+	size_t hist_pos = 0;
+	bool triggered = false;
+	bool have_prev = false;
+	uint8_t prev = 0;
+	uint64_t consumed = 0;
+	uint64_t first = 0;
+	std::thread thread;
+	size_t n;
+
+	m_running = true;
+	thread = std::thread(&LogicCapture::reader, this);
+
+	while (post_left > 0) {
+		n = m_ring.pop(buf.data(), buf.size());
+		if (n == 0) {
+			if (m_failed || !m_running)
+				break;
+
+			if (!triggered && std::chrono::steady_clock::now() > deadline)
+				break;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		for (size_t i = 0; i < n && post_left > 0; i++) {
+			uint8_t value = buf[i];
+
+			if (triggered) {
+				trace.append(value);
+				post_left--;
+			} else if (m_config.trigger.matches(have_prev ? prev : value,
+			    value)) {
+				for (size_t j = 0; j < hist_len; j++) {
+					trace.append(history[(hist_pos + history.size() -
+					    hist_len + j) % history.size()]);
+				}
+
+				first = consumed - hist_len;
+				trace.mark_trigger();
+				trace.append(value);
+				post_left--;
+				triggered = true;
+			} else if (!history.empty()) {
+				history[hist_pos] = value;
+				hist_pos = (hist_pos + 1) % history.size();
+				hist_len = std::min(hist_len + 1, history.size());
+			}
+
+			prev = value;
+			have_prev = true;
+			consumed++;
+		}
+	}
+
+	m_running = false;
+	thread.join();
+
+	for (const auto &gap: m_gaps) {
+		if (gap.sample > first && gap.sample < first + trace.size())
+			trace.add_gap(gap.sample - first, gap.ns);
+	}
+
+	if (m_failed)
+		throw std::runtime_error(m_error);
+
+	if (!triggered) {
+		throw std::runtime_error(m_cancelled ? "Capture cancelled" :
+		    fmt::format("Trigger {} did not fire within {} s",
+		    m_config.trigger.describe(), m_config.timeout));
+	}
+
+	if (!trace.get_gaps().empty()) {
+		Logger::info("Capture has {} gaps where the host fell behind",
+		    trace.get_gaps().size());
+	}
+
+	if (m_overruns > 0) {
+		Logger::warning("{} samples were dropped, lower the sampling rate "
+		    "for a gapless capture", m_overruns.load());
+	}
+
+	return (trace);
+}
@@ -35,6 +35,7 @@
 #include <fmt/format.h>
 #include <gtkmm/application.h>
 #include <fstream>
+#include <sstream>
 #include <stdlib.h>
 
 #include <log.hh>
@@ -42,15 +43,65 @@
 #include <uart.hh>
 #include <i2c.hh>
 #include <eeprom/24c.hh>
+#include <dtb.hh>
 #include <gpio.hh>
 #include <utils.hh>
 #include <mainwindow.hh>
 #include <application.hh>
 #include <nogui.hh>
 #include <onie_tlv.hh>
+#include <jtag_probe.hh>
+#include <openocd_rpc.hh>
+#include <filesystem.hh>
+#include <jtag_batch.hh>
+#include <logic_capture.hh>
+#include <cable_manager.hh>
+#include <control.hh>
+#include <session_script.hh>
+#include <eeprom_batch.hh>
+#include <ledger.hh>
+#include <glib-unix.h>
 
 using namespace std;
 
+enum long_only_options {
+	OPT_JTAG_SPEED = 256,
+	OPT_RPC_PORT,
+	OPT_LOAD_IMAGE,
+	OPT_FLASH_IMAGE,
+	OPT_FLASH_DIFF,
+	OPT_DUMP_IMAGE,
+	OPT_GDB_PROXY,
+	OPT_FIXTURE_FLASH,
+	OPT_FIXTURE_DIFF,
+	OPT_CAPTURE,
+	OPT_CAPTURE_RATE,
+	OPT_CAPTURE_TRIGGER,
+	OPT_CAPTURE_WINDOW,
+	OPT_SEQUENCE,
+	OPT_DAEMON,
+	OPT_SERVE,
+	OPT_CALL,
+	OPT_CONTROL_SOCKET,
+	OPT_BATCH,
+	OPT_GEN_EEPROM,
+	OPT_GEN_COUNT,
+	OPT_GEN_SERIAL,
+	OPT_GEN_MAC,
+	OPT_GEN_MAC_STRIDE,
+	OPT_GEN_OUTPUT,
+	OPT_GEN_JOBS,
+	OPT_DTB_SET,
+	OPT_LEDGER,
+	OPT_LEDGER_FIND,
+	OPT_VENDOR_SCHEMA,
+};
+
+/* Live for the whole CLI main loop */
+static std::unique_ptr<JtagBatch> jtag_batch;
+static std::unique_ptr<CableManager> cable_manager;
+static std::unique_ptr<ControlServer> control_server;
+
 static const struct option long_options[] = {
 	{ "baudrate", required_argument, nullptr, 'b' },
 	{ "compile-dts", required_argument, nullptr, 'c' },
@@ -66,6 +117,36 @@ static const struct option long_options[] = {
 	{ "uart", required_argument, nullptr, 'u' },
 	{ "write-eeprom", no_argument, nullptr, 'w' },
 	{ "config", required_argument, nullptr, 'x' },
+	{ "jtag-speed", required_argument, nullptr, OPT_JTAG_SPEED },
+	{ "rpc-port", required_argument, nullptr, OPT_RPC_PORT },
+	{ "load-image", required_argument, nullptr, OPT_LOAD_IMAGE },
+	{ "flash-image", required_argument, nullptr, OPT_FLASH_IMAGE },
+	{ "flash-diff", required_argument, nullptr, OPT_FLASH_DIFF },
+	{ "dump-image", required_argument, nullptr, OPT_DUMP_IMAGE },
+	{ "gdb-proxy", no_argument, nullptr, OPT_GDB_PROXY },
+	{ "fixture-flash", required_argument, nullptr, OPT_FIXTURE_FLASH },
+	{ "fixture-diff", required_argument, nullptr, OPT_FIXTURE_DIFF },
+	{ "capture", required_argument, nullptr, OPT_CAPTURE },
+	{ "capture-rate", required_argument, nullptr, OPT_CAPTURE_RATE },
+	{ "capture-trigger", required_argument, nullptr, OPT_CAPTURE_TRIGGER },
+	{ "capture-window", required_argument, nullptr, OPT_CAPTURE_WINDOW },
+	{ "sequence", required_argument, nullptr, OPT_SEQUENCE },
+	{ "daemon", required_argument, nullptr, OPT_DAEMON },
+	{ "serve", no_argument, nullptr, OPT_SERVE },
+	{ "call", required_argument, nullptr, OPT_CALL },
+	{ "control-socket", required_argument, nullptr, OPT_CONTROL_SOCKET },
+	{ "batch", required_argument, nullptr, OPT_BATCH },
+	{ "gen-eeprom", required_argument, nullptr, OPT_GEN_EEPROM },
+	{ "gen-count", required_argument, nullptr, OPT_GEN_COUNT },
+	{ "gen-serial", required_argument, nullptr, OPT_GEN_SERIAL },
+	{ "gen-mac", required_argument, nullptr, OPT_GEN_MAC },
+	{ "gen-mac-stride", required_argument, nullptr, OPT_GEN_MAC_STRIDE },
+	{ "gen-output", required_argument, nullptr, OPT_GEN_OUTPUT },
+	{ "gen-jobs", required_argument, nullptr, OPT_GEN_JOBS },
+	{ "dtb-set", required_argument, nullptr, OPT_DTB_SET },
+	{ "ledger", required_argument, nullptr, OPT_LEDGER },
+	{ "ledger-find", required_argument, nullptr, OPT_LEDGER_FIND },
+	{ "vendor-schema", required_argument, nullptr, OPT_VENDOR_SCHEMA },
 	{ nullptr, 0, nullptr, 0}
 };
 
@@ -92,7 +173,7 @@ usage(const std::string &argv0)
 	fmt::print("-p:		enable JTAG pass-through mode, cannot be used together with -j option\n");
 	fmt::print("-r:		read raw eeprom contents (binary data) and save it to file\n");
 	fmt::print("		example: -r eeprom.img\n");
-	fmt::print("-s:		absolute path to script\n");
+	fmt::print("-s:		absolute path to script, or 'auto' to pick one by the IDCODEs on the chain\n");
 	fmt::print("-t:		download contents of eeprom, decompile it and write it to dts file\n");
 	fmt::print("		example: -t board.dts\n");
 	fmt::print("-u:		IP address and TCP port number for listening for serial/uart communication\n");
@@ -101,6 +182,75 @@ usage(const std::string &argv0)
 	fmt::print("		example: -w eeprom.img\n");
 	fmt::print("-x:		configuration with serial port and JTAG settings\n");
 	fmt::print("		example: -x profile/profile-kstr-sama5d27.yml\n");
+	fmt::print("--jtag-speed:	JTAG adapter speed in kHz (1 to {}), or 'auto' to find the highest stable one\n",
+	    JTAG_SPEED_MAX);
+	fmt::print("		example: --jtag-speed auto\n");
+	fmt::print("--rpc-port:	OpenOCD TCL RPC port used for image transfers, default {}\n", OPENOCD_RPC_PORT);
+	fmt::print("--load-image:	halt the target and load a binary image to RAM, then exit\n");
+	fmt::print("		example: --load-image u-boot.bin@0x20000000\n");
+	fmt::print("--flash-image:	halt the target, write a binary image to flash and verify it, then exit\n");
+	fmt::print("		example: --flash-image boot.bin@0x10000000\n");
+	fmt::print("--flash-diff:	like --flash-image, but only erase and program sectors that differ\n");
+	fmt::print("--dump-image:	halt the target and save a memory region to file, then exit\n");
+	fmt::print("		example: --dump-image ram.bin@0x20000000:0x100000\n");
+	fmt::print("--gdb-proxy:	serve GDB through a caching proxy that several clients can share\n");
+	fmt::print("		memory is only cached in the gdb_proxy_ram regions of the -x profile\n");
+	fmt::print("--fixture-flash:	flash an image into all connected boards at once, or the ones listed with -d\n");
+	fmt::print("		example: --fixture-flash boot.bin@0x10000000 -d 006/2019,007/2019 -s auto\n");
+	fmt::print("--fixture-diff:	like --fixture-flash, but only erase and program sectors that differ;\n");
+	fmt::print("		the image is read once and compared from memory for all boards\n");
+	fmt::print("--capture:	record GPIO pins to a .vcd or sigrok .sr file, then exit\n");
+	fmt::print("		channels take their names from the gpio node of a -x profile\n");
+	fmt::print("		example: --capture boot.sr --capture-trigger rising:1\n");
+	fmt::print("--capture-rate:	sampling rate in Hz, default {}\n", LOGIC_DEFAULT_RATE);
+	fmt::print("--capture-trigger:	now, rising:PIN, falling:PIN, edge:PIN or pattern:BITS (highest pin first, x for any)\n");
+	fmt::print("		example: --capture-trigger pattern:1x0\n");
+	fmt::print("--capture-window:	samples kept before and after the trigger, default {}:{}\n",
+	    LOGIC_DEFAULT_PRE, LOGIC_DEFAULT_POST);
+	fmt::print("--sequence:	play a GPIO sequence from the gpio_sequences node of the -x profile, then exit\n");
+	fmt::print("		example: -x profile/profile-whle-ls1046a.yml --sequence power-on\n");
+	fmt::print("--daemon:	serve every cable that has a profile, starting it when plugged in\n");
+	fmt::print("		takes a profile file or a directory of them, may be repeated;\n");
+	fmt::print("		edited profiles are reloaded, restarting only what changed;\n");
+	fmt::print("		SIGUSR1 prints the state of all cables; the control socket serves\n");
+	fmt::print("		cable.list, cable.status and the gpio, eeprom and tlv methods,\n");
+	fmt::print("		which then take the cable's serial\n");
+	fmt::print("		example: --daemon /etc/devclient/profiles\n");
+	fmt::print("--serve:	keep the cable selected with -d open and take JSON-RPC requests on the control socket\n");
+	fmt::print("		example: --serve -d 006/2019\n");
+	fmt::print("--call:		send one request to a running --serve or --daemon instance and print the result\n");
+	fmt::print("		methods: gpio.get, gpio.set, gpio.direction, gpio.pulse, eeprom.read, eeprom.write,\n");
+	fmt::print("		tlv.read, tlv.write, reset, bypass, uart.open, uart.send, uart.expect\n");
+	fmt::print("		example: --call gpio.set '{{\"mask\": 3, \"value\": 1}}'\n");
+	fmt::print("		example: --call gpio.get '{{\"serial\": \"FT4XYZ01\"}}'\n");
+	fmt::print("--control-socket:	path of the control socket, default $XDG_RUNTIME_DIR/{}\n", CONTROL_SOCKET_NAME);
+	fmt::print("--batch:	run the steps of a YAML script on one cable, stopping at the first failure\n");
+	fmt::print("		steps: gpio, direction, pulse, sequence, wait, tlv_write, eeprom_read,\n");
+	fmt::print("		eeprom_write, reset, bypass, uart_open, uart_send, expect\n");
+	fmt::print("		example: --batch bringup.yml -d 006/2019\n");
+	fmt::print("--gen-eeprom:	build ONIE TLV images for many boards from a template .yaml, then exit;\n");
+	fmt::print("		a .dtb or .dts template gives device tree images with the serial and\n");
+	fmt::print("		ethaddr-eth0 root properties patched per board\n");
+	fmt::print("		example: --gen-eeprom eeprom/kstr-sama5d27-rev3.0.yaml --gen-count 1000 --gen-output images/\n");
+	fmt::print("--gen-count:	number of boards\n");
+	fmt::print("--gen-serial:	first serial number, default the template's serial-number\n");
+	fmt::print("--gen-mac:	first base MAC address, default the template's mac-address\n");
+	fmt::print("--gen-mac-stride:	MAC addresses per board, default the template's number-mac\n");
+	fmt::print("--gen-output:	directory (existing, or ending with /) for one .bin per board,\n");
+	fmt::print("		otherwise a single indexed archive; a CSV manifest is written alongside\n");
+	fmt::print("--gen-jobs:	worker threads, default one per core\n");
+	fmt::print("--dtb-set:	set a property in every image of a device tree --gen-eeprom run,\n");
+	fmt::print("		value in DTS syntax, may be repeated\n");
+	fmt::print("		example: --dtb-set '/:model=\"WHLE-LS1\"' --dtb-set '/:board-rev=<3>'\n");
+	fmt::print("--ledger:	take serial numbers and MAC blocks from a shared allocation ledger,\n");
+	fmt::print("		used by -m, --gen-eeprom, and tlv_write in --batch and --serve;\n");
+	fmt::print("		the values in the .yaml become the lowest ones handed out\n");
+	fmt::print("		example: -m board.yaml --ledger /srv/provision/ledger.db\n");
+	fmt::print("--ledger-find:	print which board got a serial number or MAC address, then exit\n");
+	fmt::print("		example: --ledger /srv/provision/ledger.db --ledger-find 70:B3:D5:B9:D0:47\n");
+	fmt::print("--vendor-schema:	.yaml with a vendor-schemas section describing vendor extension (0xFD)\n");
+	fmt::print("		payloads by IANA enterprise number, used to decode them with -n\n");
+	fmt::print("		example: -n 0x50 --vendor-schema eeprom/calibration.yaml\n");
 	fmt::print("\nInvocation examples:\n");
 	fmt::print("{:s} -d 006/2019 -u 0.0.0.0:2222 -b 115200 -j 0.0.0.0:3333:4444 -s /tmp/script\n", argv0);
 	fmt::print("{:s} -d 006/2019 -u 0.0.0.0:2222 -b 115200 -p\n", argv0);
@@ -149,7 +299,35 @@ uart_maintenance(std::string serial, std::string uart_listen_addr, uint32_t baud
 }
 
 
-int jtag_maintenance(std::string serial, std::string jtag, std::string script, std::shared_ptr<JtagCmdLine> &jtag_cmd)
+uint32_t
+jtag_adapter_speed(const Device &dev, const std::string &profile, uint32_t speed)
+{
+	if (speed != JTAG_SPEED_AUTO)
+		return speed;
+
+	try {
+		return JtagSpeedCache::resolve(dev, profile);
+	} catch (const std::runtime_error &err) {
+		Logger::warning("JTAG speed tuning failed: {}, using {} kHz",
+		    err.what(), JTAG_SPEED_DEFAULT);
+		return JTAG_SPEED_DEFAULT;
+	}
+}
+
+
+std::string
+jtag_board_script(const Device &dev, const std::string &script)
+{
+	if (!script.empty() && script != "auto")
+		return script;
+
+	return JtagProbe::detect_script(dev,
+	    fmt::format("{}/scripts", executable_dir()));
+}
+
+
+/* config carries the script, speed and options; jtag the address and ports */
+int jtag_maintenance(std::string serial, std::string jtag, const std::string &profile, JtagServerConfig config, const std::vector<OpenOcdRpcJob> &jobs, std::shared_ptr<JtagCmdLine> &jtag_cmd)
 {
 	Device dev;
 	if (!jtag.empty()) {
@@ -167,13 +345,25 @@ int jtag_maintenance(std::string serial, std::string jtag, std::string script, s
 
 		dev = *DeviceEnumerator::find_by_serial(serial);
 		saddr = Gio::InetAddress::create(addr);
+		try {
+			config.board_script = jtag_board_script(dev, config.board_script);
+		} catch (const std::runtime_error &err) {
+			Logger::error("Cannot select a JTAG board script: {}", err.what());
+			exit(-1);
+		}
+
+		/* Without a profile, tuned speeds are remembered per board script */
+		config.adapter_speed = jtag_adapter_speed(dev, profile.empty()
+		    ? filesystem::path(config.board_script).stem().string() : profile,
+		    config.adapter_speed);
 		fmt::print("To use JTAG connect to GDB at port {} and OpenOCD at port {}\n", port_gdb, port_ocd);
-		jtag_cmd = std::unique_ptr<JtagCmdLine>(new JtagCmdLine(
-			dev,
-			saddr,
-			port_gdb,
-			port_ocd,
-			script));
+		config.address = saddr;
+		config.gdb_port = port_gdb;
+		config.ocd_port = port_ocd;
+		jtag_cmd = std::unique_ptr<JtagCmdLine>(new JtagCmdLine(dev, config));
+		for (const auto &job: jobs)
+			jtag_cmd->add_job(job);
+
 		jtag_cmd->m_server->start();
 	}
 
@@ -181,10 +371,24 @@ int jtag_maintenance(std::string serial, std::string jtag, std::string script, s
 }
 
 
+/* Reports every problem in the profile at once before giving up */
+static ProfileConfig
+load_profile(const std::string &path)
+{
+	try {
+		return (ProfileConfig(path));
+	} catch (const ProfileConfigException &err) {
+		Logger::error("{}: invalid profile", path);
+		for (const auto &msg: err.get_errors())
+			Logger::error("{}: {}", path, msg);
+		exit(-1);
+	}
+}
+
 int
-parse_config_file(std::string file_read, std::shared_ptr<SerialCmdLine> &serial_cmd, std::shared_ptr<JtagCmdLine> &jtag_cmd)
+parse_config_file(std::string file_read, JtagServerConfig config, const std::vector<OpenOcdRpcJob> &jobs, std::shared_ptr<SerialCmdLine> &serial_cmd, std::shared_ptr<JtagCmdLine> &jtag_cmd)
 {
-	ProfileConfig pc = ProfileConfig(file_read);
+	ProfileConfig pc = load_profile(file_read);
 
 	try {
 		std::string listen_addr = fmt::format("{}:{}", pc.get_uart_listen_address(), pc.get_uart_port());
@@ -202,7 +406,13 @@ parse_config_file(std::string file_read, std::shared_ptr<SerialCmdLine> &serial_
 		} else {
 			std::string jtag_connector = fmt::format("{}:{}:{}", pc.get_jtag_listen_address(),
 			pc.get_jtag_gdb_port(), pc.get_jtag_telnet_port());
-			jtag_maintenance(pc.get_devcable_serial(), jtag_connector, pc.get_jtag_script_file(), jtag_cmd);
+			config.board_script = pc.get_jtag_script_file();
+			config.adapter_speed = pc.get_jtag_adapter_speed();
+			config.rpc_port = pc.get_jtag_rpc_port();
+			config.gdb_proxy = config.gdb_proxy || pc.get_jtag_gdb_proxy();
+			config.gdb_proxy_ram = pc.get_jtag_gdb_proxy_ram();
+			jtag_maintenance(pc.get_devcable_serial(), jtag_connector,
+			    pc.get_profile_name(), config, jobs, jtag_cmd);
 		}
 	} catch (const ProfileConfigException& error) {
 		Logger::error("Serial port configuration is invalid. {}", error.get_info());
@@ -228,6 +438,22 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 	std::string eeprom_addr;
 	uint8_t gpio_value;
 	uint32_t baudrate_value;
+	JtagServerConfig jtag_config;
+	OpenOcdRpcJob fixture_job;
+	bool fixture = false;
+	std::vector<OpenOcdRpcJob> rpc_jobs;
+	LogicCaptureConfig capture_config;
+	std::string capture_file;
+	std::string sequence;
+	std::vector<std::string> daemon_profiles;
+	std::string control_socket;
+	std::string call_method;
+	std::string batch_file;
+	EepromBatchConfig gen_config;
+	std::shared_ptr<Ledger> ledger;
+	std::string ledger_path;
+	std::string ledger_find;
+	bool serve = false;
 	std::ofstream f_out;
 	std::ifstream f_in;
 	bool cmdline = false;
@@ -312,6 +538,145 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 			file_read = optarg;
 			cmdline = true;
 			break;
+		case OPT_JTAG_SPEED:
+			if (std::string(optarg) == "auto") {
+				jtag_config.adapter_speed = JTAG_SPEED_AUTO;
+				break;
+			}
+
+			/* 0 is JTAG_SPEED_AUTO internally, "auto" asks for it */
+			try {
+				size_t end;
+				long speed = std::stol(optarg, &end, 10);
+
+				if (optarg[end] != '\0' || speed < 1 ||
+				    speed > JTAG_SPEED_MAX)
+					throw std::out_of_range(optarg);
+
+				jtag_config.adapter_speed = speed;
+			} catch (const std::logic_error &) {
+				Logger::error("--jtag-speed takes 1 to {} kHz or 'auto', not '{}'",
+				    JTAG_SPEED_MAX, optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case OPT_RPC_PORT:
+			jtag_config.rpc_port = std::stoi(optarg, 0, 10);
+			break;
+		case OPT_GDB_PROXY:
+			jtag_config.gdb_proxy = true;
+			break;
+		case OPT_FIXTURE_FLASH:
+		case OPT_FIXTURE_DIFF:
+			try {
+				fixture_job = OpenOcdRpcJob::parse(
+				    ch == OPT_FIXTURE_FLASH ? OpenOcdRpcJob::FLASH :
+				    OpenOcdRpcJob::FLASH_DIFF, optarg);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				exit(EX_USAGE);
+			}
+			fixture = true;
+			cmdline = true;
+			break;
+		case OPT_CAPTURE:
+			capture_file = optarg;
+			break;
+		case OPT_CAPTURE_RATE:
+			capture_config.rate = std::stoul(optarg, 0, 10);
+			break;
+		case OPT_CAPTURE_TRIGGER:
+			try {
+				capture_config.trigger = LogicTrigger::parse(optarg);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				exit(EX_USAGE);
+			}
+			break;
+		case OPT_CAPTURE_WINDOW:
+			capture_config.pre = std::stoul(optarg, 0, 10);
+			if (std::string(optarg).find(':') != std::string::npos)
+				capture_config.post = std::stoul(std::string(optarg).substr(
+				    std::string(optarg).find(':') + 1), 0, 10);
+			break;
+		case OPT_SEQUENCE:
+			sequence = optarg;
+			break;
+		case OPT_DAEMON:
+			daemon_profiles.push_back(optarg);
+			cmdline = true;
+			break;
+		case OPT_SERVE:
+			serve = true;
+			cmdline = true;
+			break;
+		case OPT_CALL:
+			call_method = optarg;
+			break;
+		case OPT_CONTROL_SOCKET:
+			control_socket = optarg;
+			break;
+		case OPT_BATCH:
+			batch_file = optarg;
+			break;
+		case OPT_GEN_EEPROM:
+			gen_config.template_file = optarg;
+			break;
+		case OPT_GEN_COUNT:
+			gen_config.count = std::stoul(optarg, 0, 0);
+			break;
+		case OPT_GEN_SERIAL:
+			gen_config.first_serial = std::stoull(optarg, 0, 0);
+			break;
+		case OPT_GEN_MAC:
+			try {
+				gen_config.mac_base = EepromBatch::parse_mac(optarg);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				exit(EX_USAGE);
+			}
+			break;
+		case OPT_GEN_MAC_STRIDE:
+			gen_config.mac_stride = std::stoul(optarg, 0, 0);
+			break;
+		case OPT_GEN_OUTPUT:
+			gen_config.output = optarg;
+			break;
+		case OPT_GEN_JOBS:
+			gen_config.jobs = std::stoul(optarg, 0, 10);
+			break;
+		case OPT_DTB_SET:
+			gen_config.dtb_set.push_back(optarg);
+			break;
+		case OPT_LEDGER:
+			ledger_path = optarg;
+			break;
+		case OPT_LEDGER_FIND:
+			ledger_find = optarg;
+			break;
+		case OPT_VENDOR_SCHEMA:
+			try {
+				OnieTLV::load_vendor_schemas(optarg);
+			} catch (const OnieTLVException &err) {
+				Logger::error("{}", err.get_info());
+				exit(EX_USAGE);
+			}
+			break;
+		case OPT_LOAD_IMAGE:
+		case OPT_FLASH_IMAGE:
+		case OPT_FLASH_DIFF:
+		case OPT_DUMP_IMAGE:
+			try {
+				rpc_jobs.push_back(OpenOcdRpcJob::parse(
+				    ch == OPT_LOAD_IMAGE ? OpenOcdRpcJob::LOAD :
+				    ch == OPT_FLASH_IMAGE ? OpenOcdRpcJob::FLASH :
+				    ch == OPT_FLASH_DIFF ? OpenOcdRpcJob::FLASH_DIFF :
+				    OpenOcdRpcJob::DUMP, optarg));
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				exit(EX_USAGE);
+			}
+			break;
 		default:
 			usage(argv[0]);
 			exit(EX_USAGE);
@@ -320,8 +685,129 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 
 	Gio::init();
 
+	if (control_socket.empty())
+		control_socket = ControlServer::default_path();
+
+	if (!call_method.empty()) {
+		try {
+			ControlClient client(control_socket);
+
+			fmt::print("{}\n", client.call(call_method,
+			    optind < argc ? argv[optind] : "{}"));
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+		exit(0);
+	}
+
+	if (!ledger_path.empty()) {
+		try {
+			ledger = std::make_shared<Ledger>(ledger_path);
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+	}
+
+	if (!ledger_find.empty()) {
+		std::optional<LedgerEntry> entry;
+
+		if (!ledger) {
+			Logger::error("--ledger-find needs --ledger");
+			exit(EX_USAGE);
+		}
+
+		try {
+			if (ledger_find.find(':') != std::string::npos)
+				entry = ledger->find_mac(EepromBatch::parse_mac(ledger_find));
+			else
+				entry = ledger->find_serial(std::stoull(ledger_find, 0, 0));
+		} catch (const std::exception &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+
+		if (!entry) {
+			fmt::print("{} is not in the ledger\n", ledger_find);
+			exit(-1);
+		}
+
+		fmt::print("serial 0x{:08x}, MAC {} (+{}), board {}, cable {}, {}",
+		    entry->serial, EepromBatch::format_mac(entry->mac),
+		    entry->mac_count, entry->board, entry->cable,
+		    std::ctime((time_t *)&entry->timestamp));
+		exit(0);
+	}
+
+	if (!gen_config.template_file.empty()) {
+		gen_config.ledger = ledger_path;
+
+		try {
+			EepromBatch batch(gen_config);
+
+			batch.run();
+			fmt::print("Generated {} images into {}\n",
+			    batch.get_images().size(), gen_config.output);
+		} catch (const std::exception &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+		exit(0);
+	}
+
+	if (!batch_file.empty()) {
+		bool ok;
+
+		try {
+			SessionScript script(batch_file);
+			auto found = DeviceEnumerator::find_by_serial(serial.empty()
+			    ? script.get_serial() : serial);
+
+			if (!found) {
+				Logger::error("Device {} not found", serial.empty()
+				    ? script.get_serial() : serial);
+				exit(-1);
+			}
+
+			Session session(*found);
+			session.set_ledger(ledger);
+			ok = script.run(session);
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+		exit(ok ? 0 : -1);
+	}
+
+	if (!sequence.empty()) {
+		if (!config) {
+			Logger::error("--sequence needs a profile given with -x");
+			exit(EX_USAGE);
+		}
+
+		try {
+			ProfileConfig pc(file_read);
+			GpioSequence seq = pc.get_gpio_sequence(sequence);
+
+			dev = *DeviceEnumerator::find_by_serial(serial.empty()
+			    ? pc.get_devcable_serial() : serial);
+			Gpio gpio(dev);
+			gpio.play(seq);
+			fmt::print("Played {} steps of {} in {} us\n",
+			    seq.get_steps().size(), sequence, seq.get_duration());
+		} catch (const ProfileConfigException &err) {
+			Logger::error("{}", err.get_info());
+			exit(-1);
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+		exit(0);
+	}
+
 	if (config) {
-		parse_config_file(file_read, serial_cmd, jtag_cmd);
+		parse_config_file(file_read, jtag_config, rpc_jobs, serial_cmd, jtag_cmd);
 	}
 
 	if (!jtag.empty() && pass_through) {
@@ -338,6 +824,106 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 		exit(0);
 	}
 
+	if (!daemon_profiles.empty()) {
+		try {
+			cable_manager.reset(new CableManager(daemon_profiles));
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+
+		g_unix_signal_add(SIGUSR1, [](gpointer) -> gboolean {
+			cable_manager->print_status();
+			return (G_SOURCE_CONTINUE);
+		}, nullptr);
+
+		for (int signo: {SIGINT, SIGTERM}) {
+			g_unix_signal_add(signo, [](gpointer) -> gboolean {
+				control_server.reset();
+				cable_manager.reset();
+				exit(0);
+			}, nullptr);
+		}
+
+		cable_manager->start();
+
+		try {
+			control_server.reset(new ControlServer(cable_manager.get(),
+			    control_socket));
+			control_server->start();
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			cable_manager.reset();
+			exit(-1);
+		}
+
+		return cmdline;
+	}
+
+	if (serve) {
+		auto found = DeviceEnumerator::find_by_serial(serial);
+
+		if (!found) {
+			Logger::error("Device {} not found", serial);
+			exit(-1);
+		}
+
+		try {
+			auto session = std::make_shared<Session>(*found);
+
+			session->set_ledger(ledger);
+			control_server.reset(new ControlServer(session,
+			    control_socket));
+			control_server->start();
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+
+		for (int signo: {SIGINT, SIGTERM}) {
+			g_unix_signal_add(signo, [](gpointer) -> gboolean {
+				control_server.reset();
+				exit(0);
+			}, nullptr);
+		}
+
+		return cmdline;
+	}
+
+	if (fixture) {
+		std::vector<Device> devices;
+		std::string item;
+		std::istringstream serials(serial);
+
+		while (std::getline(serials, item, ',')) {
+			auto found = DeviceEnumerator::find_by_serial(item);
+			if (!found) {
+				Logger::error("Device {} not found", item);
+				exit(-1);
+			}
+			devices.push_back(*found);
+		}
+
+		if (serial.empty())
+			devices = DeviceEnumerator::enumerate();
+
+		jtag_config.board_script = script;
+
+		try {
+			jtag_batch.reset(new JtagBatch(devices, jtag_config,
+			    fixture_job));
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}", err.what());
+			exit(-1);
+		}
+
+		jtag_batch->on_finished.connect([](bool ok) {
+			exit(ok ? 0 : -1);
+		});
+		jtag_batch->start();
+		return cmdline;
+	}
+
 	if (gpio) {
 		dev = *DeviceEnumerator::find_by_serial(serial);
 		Gpio gpio(dev);
@@ -345,6 +931,36 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 		exit(0);
 	}
 
+	if (!capture_file.empty()) {
+		std::vector<std::string> names;
+
+		/* Channels are labelled with the -x profile's GPIO names */
+		if (config) {
+			ProfileConfig pc = load_profile(file_read);
+
+			names = pc.get_profile().gpio.names;
+			if (serial.empty())
+				serial = pc.get_devcable_serial();
+		}
+
+		dev = *DeviceEnumerator::find_by_serial(serial);
+
+		try {
+			LogicCapture capture(std::make_shared<Gpio>(dev), capture_config);
+
+			fmt::print("Waiting for trigger {} at {} Hz\n",
+			    capture_config.trigger.describe(), capture_config.rate);
+			LogicTrace trace = capture.run();
+			trace.save(capture_file, names);
+			fmt::print("Saved {} samples ({} runs) to {}\n", trace.size(),
+			    trace.get_runs().size(), capture_file);
+		} catch (const std::runtime_error &err) {
+			Logger::error("Capture failed: {}", err.what());
+			exit(-1);
+		}
+		exit(0);
+	}
+
 	if (eeprom_read) {
 		dev = *DeviceEnumerator::find_by_serial(serial);
 		I2C i2c(dev, 300000);
@@ -381,21 +997,23 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 		I2C i2c(dev, 300000);
 		Eeprom24c eeprom(i2c);
 		std::vector<uint8_t> data;
-		char rdata[4096], fname[256], cmd[256 + 128 + 32];
+		std::string dts;
 
-		eeprom.read(0, 4096, data);
+		try {
+			eeprom.read_fdt(data);
+			dts = DTB::decompile(data);
+		} catch (const std::runtime_error &err) {
+			Logger::error("Failed to read device tree: {}", err.what());
+			exit(-1);
+		}
 
-		// save contents of eeprom to temporary file
-		std::sprintf(fname, "%s_tmp", file_write.c_str());
-		f_out.open(fname, ios::out | ios::binary | ios::trunc);
-		std::copy(data.begin(), data.end(), rdata);
-		f_out.write(rdata, 4096);
+		f_out.open(file_write, ios::out | ios::trunc);
+		f_out << dts;
 		f_out.close();
-
-		// dtb decompilation
-		std::sprintf(cmd, "dtc -I dtb -O dts %s -o %s", fname, file_write.c_str());
-		std::system(cmd);
-		std::remove(fname);
+		if (f_out.fail()) {
+			Logger::error("Failed to write {}", file_write);
+			exit(-1);
+		}
 		exit(0);
 	}
 
@@ -404,19 +1022,29 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 		I2C i2c(dev, 300000);
 		Eeprom24c eeprom(i2c);
 		std::vector<uint8_t> data;
-		char rdata[4096], fname[256], cmd[256 + 128 + 32];
+		std::stringstream dts;
 
-		std::sprintf(fname, "%s_tmp", file_read.c_str());
-		// dts compilation
-		std::sprintf(cmd, "dtc -I dts -O dtb %s -o %s", file_read.c_str(), fname);
-		std::system(cmd);
+		f_in.open(file_read, ios::in);
+		if (!f_in.is_open()) {
+			Logger::error("Failed to open {}", file_read);
+			exit(-1);
+		}
 
-		f_in.open(fname, ios::in | ios::binary);
-		f_in.read(rdata, 4096);
+		dts << f_in.rdbuf();
 		f_in.close();
-		for (unsigned int x = 0; x < sizeof(rdata); x++)
-			data.push_back(rdata[x]);
-		std::remove(fname);
+
+		try {
+			data = DTB::compile(dts.str());
+		} catch (const std::runtime_error &err) {
+			Logger::error("{}: {}", file_read, err.what());
+			exit(-1);
+		}
+
+		if (data.size() > EEPROM_FDT_MAX_SIZE) {
+			Logger::error("Device tree is {} bytes, the EEPROM holds {}",
+			    data.size(), EEPROM_FDT_MAX_SIZE);
+			exit(-1);
+		}
 
 		eeprom.write(0, data);
 		exit(0);
@@ -437,7 +1065,27 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 			exit(-1);
 		}
 
-		otlv.generate_eeprom_file(eeprom_file);
+		if (ledger) {
+			try {
+				LedgerEntry entry = ledger->assign(otlv, dev.serial);
+				if (entry.mac_count > 0)
+					fmt::print("Assigned serial 0x{:08x} and MAC {}\n",
+					    entry.serial, EepromBatch::format_mac(entry.mac));
+				else
+					fmt::print("Assigned serial 0x{:08x}\n",
+					    entry.serial);
+			} catch (const std::runtime_error &err) {
+				Logger::error("{}", err.what());
+				exit(-1);
+			}
+		}
+
+		if (!otlv.generate_eeprom_file(eeprom_file)) {
+			Logger::error("{}: TLV data does not fit in the EEPROM",
+			    file_read);
+			exit(-1);
+		}
+
 		data = std::vector<uint8_t>(eeprom_file, eeprom_file+otlv.get_usage());
 		eeprom.set_address(otlv.get_eeprom_address_from_yaml());
 		eeprom.write(0, data);
@@ -453,14 +1101,21 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 		eeprom.set_address(eeprom_addr);
 
 		try {
-			eeprom.read(0, TLV_EEPROM_MAX_SIZE, data);
-			otlv.load_from_eeprom(data.data());
+			eeprom.read_tlv(data);
+			otlv.load_from_eeprom(data.data(), data.size());
 		} catch (const std::runtime_error &err) {
-			Logger::error("There was an error while reading EEPROM.");
+			Logger::error("There was an error while reading EEPROM: {}",
+			    err.what());
 			exit(-1);
 		}
-		for (const auto tlv_id: otlv.ALL_TLV_ID) {
-			std::cout << fmt::format("Field id: [0x{:x}] Value: [{}]\n", tlv_id, otlv.get_tlv_record(tlv_id).value_or(""));
+		for (const auto &field: onie_tlv_schema) {
+			if (field.code == TLV_CODE_VENDOR_EXT)
+				continue;
+			std::cout << fmt::format("Field id: [0x{:x}] Value: [{}]\n", field.code, otlv.get_tlv_record(field.code).value_or(""));
+		}
+		for (const auto &ext: otlv.get_vendor_extensions()) {
+			std::cout << fmt::format("Field id: [0x{:x}] Value: [{}]\n", TLV_CODE_VENDOR_EXT,
+			    OnieTLV::format_vendor_extension(ext));
 		}
 		exit(0);
 	}
@@ -468,8 +1123,10 @@ parse_cmdline(int argc, char *const argv[], std::shared_ptr<SerialCmdLine> &seri
 	if (!uart_listen_addr.empty())
 		uart_maintenance(serial, uart_listen_addr, baudrate_value, serial_cmd);
 
-	if (!jtag.empty())
-		jtag_maintenance(serial, jtag, script, jtag_cmd);
+	if (!jtag.empty()) {
+		jtag_config.board_script = script;
+		jtag_maintenance(serial, jtag, "", jtag_config, rpc_jobs, jtag_cmd);
+	}
 
 	if (pass_through) {
 		jtag_cmd = std::unique_ptr<JtagCmdLine>(new JtagCmdLine(dev));
@@ -494,7 +1151,11 @@ main(int argc, char *const argv[])
 	cmdline = parse_cmdline(argc, argv, serial_cmd, jtag_cmd);
 
 	if (cmdline == true) {
-		serial_cmd->main_loop->run();
+		/* JTAG alone has no UART main loop to borrow */
+		if (serial_cmd)
+			serial_cmd->main_loop->run();
+		else
+			Glib::MainLoop::create()->run();
 	} else {
 		return Devclient::Application::instance()->run();
 	}
@@ -41,8 +41,10 @@
 #include <log.hh>
 #include <filesystem.hh>
 #include <profile.hh>
+#include <jtag_probe.hh>
 
 MainWindow::MainWindow():
+    m_pc(nullptr),
     m_profile(this, m_device),
     m_uart_tab(this, m_device),
     m_jtag_tab(this, m_device),
@@ -78,6 +80,12 @@ MainWindow::set_gpio_name(int no, std::string name)
 	m_gpio_tab.set_gpio_name(no, name);
 }
 
+void
+MainWindow::set_gpio_sequences(const std::vector<std::string> &names)
+{
+	m_gpio_tab.set_sequences(names);
+}
+
 void
 MainWindow::show_deviceselect_dialog()
 {
@@ -159,8 +167,17 @@ ProfileTab::clicked()
 			if (!gpio_name.empty())
 				m_parent->set_gpio_name(i, gpio_name);
 		}
+		m_parent->set_gpio_sequences(m_parent->m_pc->get_gpio_sequence_names());
+
+		std::string script = m_parent->m_pc->get_jtag_script_file();
+		if (script != "auto")
+			m_parent->set_jtag_script(script);
 
-		m_parent->set_jtag_script(m_parent->m_pc->get_jtag_script_file());
+		uint32_t speed = m_parent->m_pc->get_jtag_adapter_speed();
+		m_parent->set_jtag_speed(speed == JTAG_SPEED_AUTO ? "auto" : std::to_string(speed));
+		m_parent->set_jtag_rpc_port(m_parent->m_pc->get_jtag_rpc_port());
+		m_parent->set_jtag_gdb_proxy(m_parent->m_pc->get_jtag_gdb_proxy(),
+		    m_parent->m_pc->get_jtag_gdb_proxy_ram());
 	} 
 	catch (const ProfileConfigException& error) 
 	{
@@ -368,11 +385,26 @@ JtagTab::JtagTab(MainWindow *parent, const Device &dev):
     m_gdb_port_row("GDB server listen port"),
     m_ocd_port_row("OpenOCD listen port"),
     m_board_row("Board init script"),
+    m_speed_row("Adapter speed (kHz or auto)"),
     m_status_row("Status"),
+    m_standby_row("Keep OpenOCD running when stopped"),
+    m_proxy_row("Cache GDB traffic (shared proxy)"),
+    m_image_row("Image file"),
+    m_image_addr_row("Image address"),
+    m_dump_size_row("Dump size"),
     m_start("Start"),
     m_stop("Stop"),
     m_reset("Reset target"),
     m_bypass("J-Link bypass mode"),
+    m_tune("Tune speed"),
+    m_detect("Detect chain"),
+    m_load("Load to RAM"),
+    m_flash("Write flash"),
+    m_flash_diff("Write changed sectors"),
+    m_dump("Dump memory"),
+    m_rpc_port(OPENOCD_RPC_PORT),
+    m_rpc_done(0),
+    m_rpc_total(0),
     m_parent(parent),
     m_device(dev)
 {
@@ -396,7 +428,10 @@ JtagTab::JtagTab(MainWindow *parent, const Device &dev):
 	    .signal_changed()
 	    .connect(sigc::mem_fun(*this, &JtagTab::on_gdb_port_changed));
 	
+	m_speed_row.get_widget().set_text(std::to_string(JTAG_SPEED_DEFAULT));
 	m_status_row.get_widget().set_text("Stopped");
+	m_status_row.get_widget().set_editable(false);
+	m_standby_row.get_widget().set_active(true);
 
 	m_textbuffer = Gtk::TextBuffer::create();
 	m_textview.set_editable(false);
@@ -411,6 +446,8 @@ JtagTab::JtagTab(MainWindow *parent, const Device &dev):
 	m_buttons.pack_start(m_stop);
 	m_buttons.pack_start(m_reset);
 	m_buttons.pack_start(m_bypass);
+	m_buttons.pack_start(m_tune);
+	m_buttons.pack_start(m_detect);
 
 	m_start.signal_clicked().connect(sigc::mem_fun(*this,
 	    &JtagTab::start_clicked));
@@ -420,91 +457,366 @@ JtagTab::JtagTab(MainWindow *parent, const Device &dev):
 	    &JtagTab::reset_clicked));
 	m_bypass.signal_clicked().connect(sigc::mem_fun(*this,
 	    &JtagTab::bypass_clicked));
+	m_tune.signal_clicked().connect(sigc::mem_fun(*this,
+	    &JtagTab::tune_clicked));
+	m_detect.signal_clicked().connect(sigc::mem_fun(*this,
+	    &JtagTab::detect_clicked));
+
+	m_image_addr_row.get_widget().set_text("0x00000000");
+	m_dump_size_row.get_widget().set_text("0x100000");
+	m_progress.set_show_text(true);
+
+	m_image_buttons.set_border_width(5);
+	m_image_buttons.set_layout(Gtk::ButtonBoxStyle::BUTTONBOX_END);
+	m_image_buttons.pack_start(m_load);
+	m_image_buttons.pack_start(m_flash);
+	m_image_buttons.pack_start(m_flash_diff);
+	m_image_buttons.pack_start(m_dump);
+
+	m_load.signal_clicked().connect(sigc::mem_fun(*this,
+	    &JtagTab::load_clicked));
+	m_flash.signal_clicked().connect(sigc::mem_fun(*this,
+	    &JtagTab::flash_clicked));
+	m_flash_diff.signal_clicked().connect(sigc::mem_fun(*this,
+	    &JtagTab::flash_diff_clicked));
+	m_dump.signal_clicked().connect(sigc::mem_fun(*this,
+	    &JtagTab::dump_clicked));
+	m_rpc_progress.connect(sigc::mem_fun(*this,
+	    &JtagTab::on_rpc_progress));
+	m_rpc_finished.connect(sigc::mem_fun(*this,
+	    &JtagTab::on_rpc_finished));
 
 	set_border_width(5);
 	pack_start(m_address_row, false, true);
 	pack_start(m_gdb_port_row, false, true);
 	pack_start(m_ocd_port_row, false, true);
 	pack_start(m_board_row, false, true);
+	pack_start(m_speed_row, false, true);
 	pack_start(m_status_row, false, true);
+	pack_start(m_standby_row, false, true);
+	pack_start(m_proxy_row, false, true);
 	pack_start(m_scroll, true, true);
 	pack_start(m_buttons, false, true);
+	pack_start(m_image_row, false, true);
+	pack_start(m_image_addr_row, false, true);
+	pack_start(m_dump_size_row, false, true);
+	pack_start(m_progress, false, true);
+	pack_start(m_image_buttons, false, true);
+}
+
+JtagTab::~JtagTab()
+{
+	if (m_rpc_thread.joinable())
+		m_rpc_thread.join();
 }
 
 void
 JtagTab::start_clicked()
 {
-	Glib::RefPtr<Gio::InetAddress> addr;
+	JtagServerConfig config;
 
-	addr = Gio::InetAddress::create(m_address_row.get_widget().get_text());
+	if (m_server)
+		return;
 
+	config.address = Gio::InetAddress::create(
+	    m_address_row.get_widget().get_text());
+	config.gdb_port = std::stoi(m_gdb_port_row.get_widget().get_text());
+	config.ocd_port = std::stoi(m_ocd_port_row.get_widget().get_text());
+	config.gdb_proxy = m_proxy_row.get_widget().get_active();
+	config.gdb_proxy_ram = m_gdb_proxy_ram;
+	config.rpc_port = m_rpc_port;
 	m_textbuffer->set_text("");
-	m_server = std::make_shared<JtagServer>(m_device, addr,
-	    std::stoi(m_gdb_port_row.get_widget().get_text()),
-	    std::stoi(m_ocd_port_row.get_widget().get_text()),
-	    m_board_row.get_widget().get_filename());
-	
-	m_server->on_output_produced.connect(
-	    sigc::mem_fun(*this, &JtagTab::on_output_ready));
-	m_server->on_server_start.connect(
-	    sigc::mem_fun(*this, &JtagTab::on_server_start));
-	m_server->on_server_exit.connect(
-	    sigc::mem_fun(*this, &JtagTab::on_server_exit));
 
 	try {
-		m_server->start();
+		if (m_board_row.get_widget().get_filename().empty())
+			set_script(detect_script());
+
+		config.board_script = m_board_row.get_widget().get_filename();
+		config.adapter_speed = adapter_speed(false);
+		m_server = JtagSupervisor::instance()->acquire(m_device, config);
 	} catch (const std::runtime_error &err) {
 		show_centered_dialog("Failed to start JTAG server.",
 		    err.what());
+		return;
 	}
+
+	m_output_conn = m_server->on_output_produced.connect(
+	    sigc::mem_fun(*this, &JtagTab::on_output_ready));
+	m_state_conn = m_server->on_state_changed.connect(
+	    sigc::mem_fun(*this, &JtagTab::on_server_state));
+	on_server_state(m_server->get_state());
 }
 
 void
 JtagTab::stop_clicked()
 {
-	if (m_server)
-	{
-		m_server->stop();
-		m_server.reset();
-	}
+	if (!m_server)
+		return;
+
+	m_output_conn.disconnect();
+	m_state_conn.disconnect();
+	m_server.reset();
+
+	JtagSupervisor::instance()->release(m_device,
+	    m_standby_row.get_widget().get_active());
+	on_server_state(JtagServer::STOPPED);
 }
 
 void
 JtagTab::reset_clicked()
 {
-	JtagServer::reset(m_device);
+	JtagSupervisor::instance()->discard(m_device);
+
+	try {
+		JtagServer::reset(m_device);
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog("Reset failed", err.what());
+	}
 }
 
 void
 JtagTab::bypass_clicked()
 {
-	JtagServer::bypass(m_device);
+	JtagSupervisor::instance()->discard(m_device);
+
+	try {
+		JtagServer::bypass(m_device);
+		show_centered_dialog("Bypass mode enabled.");
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog("Failed to enable bypass mode", err.what());
+	}
 }
 
 void
-JtagTab::on_output_ready(const std::string &output)
+JtagTab::tune_clicked()
 {
-	Glib::ustring text = m_textbuffer->get_text();
-	
-	text += output;
-	m_textbuffer->set_text(text);
-	m_textview.scroll_to(m_textbuffer->get_insert());
+	uint32_t speed;
+
+	if (m_server)
+		return;
+
+	try {
+		speed = adapter_speed(true);
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog("JTAG speed tuning failed.", err.what());
+		return;
+	}
+
+	m_speed_row.get_widget().set_text(std::to_string(speed));
 }
 
 void
-JtagTab::on_server_start()
+JtagTab::detect_clicked()
 {
-	m_status_row.get_widget().set_text("Running");
-	m_reset.set_sensitive(false);
-	m_bypass.set_sensitive(false);
+	if (m_server)
+		return;
+
+	m_textbuffer->set_text("");
+
+	try {
+		set_script(detect_script());
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog("JTAG chain detection failed.", err.what());
+	}
+}
+
+std::string
+JtagTab::detect_script()
+{
+	/* The probe needs channel B, which a standby OpenOCD may still hold */
+	JtagSupervisor::instance()->discard(m_device);
+
+	return (JtagProbe::detect_script(m_device,
+	    fmt::format("{}/scripts", executable_dir()),
+	    [this](const std::string &line) {
+		m_textbuffer->insert(m_textbuffer->end(), line + "\n");
+	}));
 }
 
 void
-JtagTab::on_server_exit()
+JtagTab::load_clicked()
 {
-	m_status_row.get_widget().set_text("Stopped");
-	m_reset.set_sensitive(true);
-	m_bypass.set_sensitive(true);
+	run_job(OpenOcdRpcJob::LOAD, m_image_row.get_widget().get_filename());
+}
+
+void
+JtagTab::flash_clicked()
+{
+	run_job(OpenOcdRpcJob::FLASH, m_image_row.get_widget().get_filename());
+}
+
+void
+JtagTab::flash_diff_clicked()
+{
+	run_job(OpenOcdRpcJob::FLASH_DIFF,
+	    m_image_row.get_widget().get_filename());
+}
+
+void
+JtagTab::dump_clicked()
+{
+	Gtk::FileChooserDialog file_dialog("Save memory dump",
+	    Gtk::FILE_CHOOSER_ACTION_SAVE);
+
+	file_dialog.add_button("Save", Gtk::RESPONSE_OK);
+	file_dialog.add_button("Cancel", Gtk::RESPONSE_CANCEL);
+	file_dialog.set_do_overwrite_confirmation(true);
+
+	if (file_dialog.run() != Gtk::RESPONSE_OK)
+		return;
+
+	run_job(OpenOcdRpcJob::DUMP, file_dialog.get_filename());
+}
+
+void
+JtagTab::run_job(OpenOcdRpcJob::Kind kind, const std::string &path)
+{
+	OpenOcdRpcJob job;
+	std::string spec;
+
+	if (!m_server || m_server->get_state() != JtagServer::RUNNING) {
+		show_centered_dialog("OpenOCD is not running.",
+		    "Start the JTAG server first.");
+		return;
+	}
+
+	if (m_rpc_thread.joinable() || path.empty())
+		return;
+
+	spec = fmt::format("{}@{}", path, m_image_addr_row.get_widget().get_text());
+	if (kind == OpenOcdRpcJob::DUMP)
+		spec += ":" + m_dump_size_row.get_widget().get_text();
+
+	try {
+		job = OpenOcdRpcJob::parse(kind, spec);
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog("Invalid image transfer.", err.what());
+		return;
+	}
+
+	m_progress.set_fraction(0);
+	m_progress.set_text(job.describe());
+	m_load.set_sensitive(false);
+	m_flash.set_sensitive(false);
+	m_flash_diff.set_sensitive(false);
+	m_dump.set_sensitive(false);
+
+	m_rpc_thread = std::thread(&JtagTab::rpc_worker, this, job,
+	    m_server->get_config());
+}
+
+void
+JtagTab::rpc_worker(OpenOcdRpcJob job, JtagServerConfig config)
+{
+	std::string error;
+	std::string summary;
+
+	try {
+		OpenOcdRpc rpc(config.local_host(), config.rpc_port);
+
+		rpc.halt();
+		summary = job.run(rpc, [this](size_t done, size_t total) {
+			std::lock_guard<std::mutex> guard(m_rpc_lock);
+			m_rpc_done = done;
+			m_rpc_total = total;
+			m_rpc_progress.emit();
+		});
+	} catch (const std::runtime_error &err) {
+		error = err.what();
+	}
+
+	std::lock_guard<std::mutex> guard(m_rpc_lock);
+	m_rpc_error = error;
+	m_rpc_summary = summary;
+	m_rpc_finished.emit();
+}
+
+void
+JtagTab::on_rpc_progress()
+{
+	std::lock_guard<std::mutex> guard(m_rpc_lock);
+
+	if (m_rpc_total)
+		m_progress.set_fraction((double)m_rpc_done / m_rpc_total);
+}
+
+void
+JtagTab::on_rpc_finished()
+{
+	std::string error;
+
+	m_rpc_thread.join();
+	m_load.set_sensitive(true);
+	m_flash.set_sensitive(true);
+	m_flash_diff.set_sensitive(true);
+	m_dump.set_sensitive(true);
+
+	{
+		std::lock_guard<std::mutex> guard(m_rpc_lock);
+		error = m_rpc_error;
+	}
+
+	if (!error.empty()) {
+		m_progress.set_text("Failed");
+		show_centered_dialog("Image transfer failed.", error);
+		return;
+	}
+
+	m_progress.set_fraction(1);
+	m_progress.set_text(fmt::format("Done, {}", m_rpc_summary));
+}
+
+uint32_t
+JtagTab::adapter_speed(bool force)
+{
+	std::string text = m_speed_row.get_widget().get_text();
+	std::string profile;
+
+	if (!force && text != "auto") {
+		size_t end = 0;
+		long speed = 0;
+
+		try {
+			speed = std::stol(text, &end);
+		} catch (const std::logic_error &err) {
+		}
+
+		/* 0 would be taken as auto without tuning */
+		if (end != text.size() || speed < 1 || speed > JTAG_SPEED_MAX)
+			throw std::runtime_error(fmt::format(
+			    "Invalid adapter speed: {}", text));
+
+		return (speed);
+	}
+
+	profile = m_parent->m_pc
+	    ? m_parent->m_pc->get_profile_name()
+	    : filesystem::path(m_board_row.get_widget().get_filename()).stem().string();
+
+	/* Tuning needs channel B, which a standby OpenOCD may still hold */
+	if (force || JtagSpeedCache::lookup(profile, m_device.serial) == JTAG_SPEED_AUTO)
+		JtagSupervisor::instance()->discard(m_device);
+
+	return (JtagSpeedCache::resolve(m_device, profile, force));
+}
+
+void
+JtagTab::on_output_ready(const std::string &output)
+{
+	m_textbuffer->insert(m_textbuffer->end(), output);
+	m_textview.scroll_to(m_textbuffer->get_insert());
+}
+
+void
+JtagTab::on_server_state(JtagServer::State state)
+{
+	bool idle = !m_server;
+
+	m_status_row.get_widget().set_text(JtagServer::state_name(state));
+	m_reset.set_sensitive(idle);
+	m_bypass.set_sensitive(idle);
+	m_tune.set_sensitive(idle);
+	m_detect.set_sensitive(idle);
 }
 
 void JtagTab::on_address_changed()
@@ -568,6 +880,22 @@ void JtagTab::set_script(std::string script)
 	m_board_row.get_widget().set_filename(script);
 }
 
+void JtagTab::set_speed(std::string speed)
+{
+	m_speed_row.get_widget().set_text(speed);
+}
+
+void JtagTab::set_rpc_port(uint16_t port)
+{
+	m_rpc_port = port;
+}
+
+void JtagTab::set_gdb_proxy(bool enable, const GdbProxyRanges &ram)
+{
+	m_proxy_row.get_widget().set_active(enable);
+	m_gdb_proxy_ram = ram;
+}
+
 EepromTab::EepromTab(MainWindow *parent, const Device &dev):
 	Gtk::Box(Gtk::Orientation::ORIENTATION_VERTICAL),
 	m_read("Read"),
@@ -610,12 +938,33 @@ EepromTab::EepromTab(MainWindow *parent, const Device &dev):
 void
 EepromTab::write_clicked()
 {
-	m_textual = std::make_shared<std::string>(m_textbuffer->get_text());
-	m_blob = std::make_shared<std::vector<uint8_t>>();
-	m_dtb = std::make_shared<DTB>(m_textual, m_blob);
+	std::vector<uint8_t> blob;
 
 	try {
-		m_dtb->compile(sigc::mem_fun(*this, &EepromTab::compile_done));
+		blob = DTB::compile(m_textbuffer->get_text());
+	} catch (const std::runtime_error &err) {
+		Gtk::MessageDialog dlg(*m_parent, "Compile errors!");
+
+		dlg.set_secondary_text(fmt::format("<tt>{}</tt>",
+		    Glib::Markup::escape_text(err.what())), true);
+		dlg.run();
+		return;
+	}
+
+	if (blob.size() > EEPROM_FDT_MAX_SIZE) {
+		show_centered_dialog("Write error", fmt::format(
+		    "Device tree is {} bytes, the EEPROM holds {}",
+		    blob.size(), EEPROM_FDT_MAX_SIZE));
+		return;
+	}
+
+	try {
+		Eeprom24c eeprom(*m_parent->m_i2c);
+		Gtk::MessageDialog dlg(*m_parent, fmt::format(
+		    "Compilation and flashing done (size: {} bytes)", blob.size()));
+
+		eeprom.write(0, blob);
+		dlg.run();
 	} catch (const std::runtime_error &err) {
 		Gtk::MessageDialog msg("Write error");
 
@@ -628,60 +977,27 @@ void
 EepromTab::read_clicked()
 {
 	Eeprom24c eeprom(*m_parent->m_i2c);
-
-	m_textual = std::make_shared<std::string>();
-	m_blob = std::make_shared<std::vector<uint8_t>>();
-	m_dtb = std::make_shared<DTB>(m_textual, m_blob);
+	std::vector<uint8_t> blob;
+	std::string text;
 
 	try {
-		eeprom.read(0, 4096, *m_blob);
-		m_dtb->decompile(sigc::mem_fun(*this,
-		    &EepromTab::decompile_done));
+		eeprom.read_fdt(blob);
+		text = DTB::decompile(blob);
 	} catch (const std::runtime_error &err) {
 		Gtk::MessageDialog msg("Read error");
 
 		msg.set_secondary_text(err.what());
 		msg.run();
+		return;
 	}
-}
-
-
-void
-EepromTab::compile_done(bool ok, int size, const std::string &errors)
-{
-	if (ok) {
-		Gtk::MessageDialog dlg(*m_parent, fmt::format(
-		    "Compilation and flashing done (size: {} bytes)", size));
 
-		Eeprom24c eeprom(*m_parent->m_i2c);
-		eeprom.write(0, *m_blob);
-		dlg.run();
-	} else {
-		Gtk::MessageDialog dlg(*m_parent, "Compile errors!");
+	Gtk::MessageDialog dlg(*m_parent, fmt::format(
+	    "Reading done (size: {} bytes)", blob.size()));
 
-		dlg.set_secondary_text(fmt::format("<tt>{}</tt>",
-		    Glib::Markup::escape_text(errors)), true);
-		dlg.run();
-	}
+	dlg.run();
+	m_textbuffer->set_text(text);
 }
 
-void
-EepromTab::decompile_done(bool ok, int size, const std::string &errors)
-{
-	if (ok) {
-		Gtk::MessageDialog dlg(*m_parent, fmt::format(
-		    "Reading done (size: {} bytes)", size));
-
-		dlg.run();
-		m_textbuffer->set_text(*m_textual);
-	} else {
-		Gtk::MessageDialog dlg(*m_parent, "Read errors!");
-
-		dlg.set_secondary_text(fmt::format("<tt>{}</tt>",
-		    Glib::Markup::escape_text(errors)), true);
-		dlg.run();
-	}
-}
 EepromTLVTab::EepromTLVTab(MainWindow *parent):
 		Gtk::Box(Gtk::Orientation::ORIENTATION_VERTICAL),
 		m_load("Load YAML"),
@@ -706,21 +1022,8 @@ EepromTLVTab::EepromTLVTab(MainWindow *parent):
 	m_tlv_records.append_column("Name", m_model_columns.m_name);
 	m_tlv_records.append_column_editable("Value", m_model_columns.m_value);
 
-	add_tlv_row(TLV_CODE_PRODUCT_NAME, "Product name", "set-me-sample-name");
-	add_tlv_row(TLV_CODE_PART_NUMBER, "Part number", "");
-	add_tlv_row(TLV_CODE_SERIAL_NUMBER, "Serial number", "000000");
-	add_tlv_row(TLV_CODE_MAC_BASE, "MAC", "70:B3:D5:B9:D0:00");
-	add_tlv_row(TLV_CODE_MANUF_DATE, "Manufacture date", "01/01/2021 12:00:01");
-	add_tlv_row(TLV_CODE_DEV_VERSION, "Device version", "1");
-	add_tlv_row(TLV_CODE_LABEL_REVISION, "Label revision", "");
-	add_tlv_row(TLV_CODE_PLATFORM_NAME, "Platform name", "");
-	add_tlv_row(TLV_CODE_ONIE_VERSION, "ONIE version", "1");
-	add_tlv_row(TLV_CODE_NUM_MACs, "Number MACs", "1");
-	add_tlv_row(TLV_CODE_MANUF_NAME, "Manufacturer", "Conclusive Engineering");
-	add_tlv_row(TLV_CODE_COUNTRY_CODE, "Country code", "PL");
-	add_tlv_row(TLV_CODE_VENDOR_NAME, "Vendor", "");
-	add_tlv_row(TLV_CODE_DIAG_VERSION, "Diag Version", "");
-	add_tlv_row(TLV_CODE_SERVICE_TAG, "Service tag", "");
+	for (const auto &field: onie_tlv_schema)
+		add_tlv_row(field.code, field.label, field.placeholder);
 
 	m_scroll.add(m_tlv_records);
 
@@ -750,6 +1053,24 @@ void EepromTLVTab::add_tlv_row(tlv_code_t id, std::string name, std::string valu
 	row[m_model_columns.m_value] = value;
 }
 
+/* One row per vendor extension, and an empty one for adding another */
+void EepromTLVTab::update_vendor_rows()
+{
+	auto children = m_list_store_ref->children();
+
+	for (auto it = children.begin(); it != children.end();) {
+		if ((*it).get_value(m_model_columns.m_id) == TLV_CODE_VENDOR_EXT)
+			it = m_list_store_ref->erase(it);
+		else
+			++it;
+	}
+
+	for (const auto &ext: otlv.get_vendor_extensions())
+		add_tlv_row(TLV_CODE_VENDOR_EXT, tlv_field(TLV_CODE_VENDOR_EXT)->label,
+		    OnieTLV::format_vendor_extension(ext));
+	add_tlv_row(TLV_CODE_VENDOR_EXT, tlv_field(TLV_CODE_VENDOR_EXT)->label, "");
+}
+
 void EepromTLVTab::update_tlv_row(tlv_code_t id, std::string value)
 {
 	for (auto row: m_list_store_ref->children()) {
@@ -801,9 +1122,11 @@ EepromTLVTab::load_clicked()
 		}
 	}
 
-	for (const auto tlv_id: otlv.ALL_TLV_ID) {
-		update_tlv_row(tlv_id, otlv.get_tlv_record(tlv_id).value_or(std::string("")));
+	for (const auto &field: onie_tlv_schema) {
+		if (field.code != TLV_CODE_VENDOR_EXT)
+			update_tlv_row(field.code, otlv.get_tlv_record(field.code).value_or(std::string("")));
 	}
+	update_vendor_rows();
 }
 
 void
@@ -811,77 +1134,33 @@ EepromTLVTab::write_clicked()
 {
 	uint8_t eeprom_file[TLV_EEPROM_MAX_SIZE];
 
+	// Every vendor extension row adds one record
+	otlv.clear_vendor_extensions();
+
 	for (auto row: m_list_store_ref->children())
 	{
 		tlv_code_t tlv_id = row.get_value(m_model_columns.m_id);
 		std::string field_value = row.get_value(m_model_columns.m_value);
-		switch (tlv_id) {
-			case TLV_CODE_DEV_VERSION:
-				try {
-					otlv.save_user_tlv(tlv_id, field_value);
-				} catch (OnieTLVException &onieTLVException) {
-					show_centered_dialog("Error EEPROM TLV",
-							fmt::format("ERROR: Wrong value for filed id: 0x{:x} = 'device version'.\n{}",
-									TLV_CODE_DEV_VERSION, onieTLVException.get_info()));
-					return;
-				}
-				break;
-			case TLV_CODE_NUM_MACs:
-				try {
-					otlv.save_user_tlv(tlv_id, field_value);
-				} catch (OnieTLVException &onieTLVException) {
-					show_centered_dialog("Error EEPROM TLV",
-							fmt::format("ERROR: Wrong value for filed id: 0x{:x} = 'mac number'.\n{}",
-									TLV_CODE_NUM_MACs, onieTLVException.get_info()));
-					return;
-				}
-				break;
-			case TLV_CODE_COUNTRY_CODE:
-				try {
-					otlv.save_user_tlv(tlv_id, field_value);
-				} catch (OnieTLVException &onieTLVException) {
-					show_centered_dialog("Error EEPROM TLV",
-							fmt::format("ERROR: Country code (0x{:x}) must 2 characters only."
-				   "Example: PL.\n{}", TLV_CODE_COUNTRY_CODE, onieTLVException.get_info()));
-					return;
-				}
-				break;
-			case TLV_CODE_MANUF_DATE:
-				try {
-					otlv.save_user_tlv(tlv_id, field_value);
-				} catch (OnieTLVException &onieTLVException) {
-					show_centered_dialog("Error EEPROM TLV",
-							fmt::format("ERROR: Invalid date field (0x{:x})."
-				   "Required format is: MM/DD/YYYY hh:mm:ss.\n{}", TLV_CODE_COUNTRY_CODE, onieTLVException.get_info()));
-					return;
-				}
-				break;
-			case TLV_CODE_MAC_BASE:
-				try {
-					otlv.save_user_tlv(tlv_id, field_value);
-				} catch (OnieTLVException &onieTLVException) {
-					show_centered_dialog("Error EEPROM TLV",
-							fmt::format("ERROR: Wrong value for field id: 0x{:x} = 'mac adress'.\n{}",
-									TLV_CODE_MAC_BASE, onieTLVException.get_info()));
-					return;
-				}
-				break;
-			default:
-				if (!field_value.empty()) {
-					try {
-						otlv.save_user_tlv(tlv_id, field_value);
-					} catch (OnieTLVException &onieTLVException) {
-						show_centered_dialog("Error EEPROM TLV", fmt::format("ERROR: Wrong value for field id: 0x{:x}\n{}",
-								tlv_id, onieTLVException.get_info()));
-						return;
-					}
-				} else {
-					Logger::debug("Skipping field id 0x{:x} because it's empty", tlv_id);
-				}
+
+		if (field_value.empty()) {
+			Logger::debug("Skipping field id 0x{:x} because it's empty", tlv_id);
+			continue;
+		}
+
+		try {
+			otlv.save_user_tlv(tlv_id, field_value);
+		} catch (OnieTLVException &onieTLVException) {
+			show_centered_dialog("Error EEPROM TLV",
+					fmt::format("ERROR: Wrong value for field id: 0x{:x} = '{}'.\n{}",
+							tlv_id, tlv_field(tlv_id)->label, onieTLVException.get_info()));
+			return;
 		}
 	}
 
-	otlv.generate_eeprom_file(eeprom_file);
+	if (!otlv.generate_eeprom_file(eeprom_file)) {
+		show_centered_dialog("Error EEPROM TLV", "EEPROM TLV data does not fit in the EEPROM.");
+		return;
+	}
 	m_blob = std::make_shared<std::vector<uint8_t>>(eeprom_file, eeprom_file+otlv.get_usage());
 	Eeprom24c eeprom(*m_parent->m_i2c);
 	eeprom.set_address(m_combo_addr.get_active_text());
@@ -896,16 +1175,18 @@ EepromTLVTab::read_clicked()
 
 	m_blob = std::make_shared<std::vector<uint8_t>>();
 	try {
-		eeprom.read(0, 2048, *m_blob);
-		otlv.load_from_eeprom(m_blob->data());
+		eeprom.read_tlv(*m_blob);
+		otlv.load_from_eeprom(m_blob->data(), m_blob->size());
 	} catch (const std::runtime_error &err) {
-		show_centered_dialog("Error EEPROM TLV ", "Error while trying to read EEPROM.");
+		show_centered_dialog("Error EEPROM TLV ", err.what());
 		return;
 	}
 
-	for (const auto tlv_id: otlv.ALL_TLV_ID) {
-		update_tlv_row(tlv_id, otlv.get_tlv_record(tlv_id).value_or(std::string("")));
+	for (const auto &field: onie_tlv_schema) {
+		if (field.code != TLV_CODE_VENDOR_EXT)
+			update_tlv_row(field.code, otlv.get_tlv_record(field.code).value_or(std::string("")));
 	}
+	update_vendor_rows();
 }
 
 void
@@ -921,14 +1202,23 @@ EepromTLVTab::clear_clicked()
 
 GpioTab::GpioTab(MainWindow *parent, const Device &dev):
     Gtk::Box(Gtk::Orientation::ORIENTATION_VERTICAL),
+    m_parent(parent),
     m_device(dev),
     m_gpio_row {
 	FormRowGpio("GPIO 0"),
 	FormRowGpio("GPIO 1"),
 	FormRowGpio("GPIO 2"),
 	FormRowGpio("GPIO 3")
-    }
+    },
+    m_rate_row("Sampling rate (Hz)"),
+    m_sequence_row("Sequence"),
+    m_play("Play sequence"),
+    m_subscription(0),
+    m_first_event(0),
+    m_updating(false)
 {
+	Pango::FontDescription font("Monospace 9");
+
 	set_border_width(10);
 
 	for (int i = 0; i < 4; i++) {
@@ -939,55 +1229,188 @@ GpioTab::GpioTab(MainWindow *parent, const Device &dev):
 		pack_start(m_gpio_row[i], false, true);
 	}
 
-	m_timer = Glib::signal_timeout().connect(sigc::mem_fun(*this, &GpioTab::timer), 500);
+	m_rate_row.get_widget().set_text(std::to_string(GPIO_MONITOR_RATE));
+	m_rate_row.get_widget().signal_activate().connect(sigc::mem_fun(
+	    *this, &GpioTab::rate_changed));
+
+	m_textbuffer = Gtk::TextBuffer::create();
+	m_textview.set_editable(false);
+	m_textview.set_buffer(m_textbuffer);
+	m_textview.override_font(font);
+	m_scroll.add(m_textview);
+
+	m_events_ready.connect(sigc::mem_fun(*this, &GpioTab::on_events_ready));
+
+	m_play.set_sensitive(false);
+	m_play.signal_clicked().connect(sigc::mem_fun(*this,
+	    &GpioTab::play_clicked));
+	m_buttons.set_border_width(5);
+	m_buttons.set_layout(Gtk::ButtonBoxStyle::BUTTONBOX_END);
+	m_buttons.pack_start(m_play);
+
+	pack_start(m_rate_row, false, true);
+	pack_start(m_scroll, true, true);
+	pack_start(m_sequence_row, false, true);
+	pack_start(m_buttons, false, true);
 }
 
 GpioTab::~GpioTab() noexcept
 {
-	m_timer.disconnect();
+	m_monitor.reset();
 }
 
 void
 GpioTab::state_changed(bool state, uint8_t mask)
 {
-	uint8_t val;
-
-	val = state
-	    ? m_gpio->get() | mask
-	    : m_gpio->get() & ~mask;
+	if (m_updating)
+		return;
 
-	m_gpio->set(val);
+	m_gpio->update(mask, state ? mask : 0);
 }
 
 void
 GpioTab::direction_changed(bool output, uint8_t mask)
 {
-	uint8_t val;
+	m_gpio->set_direction(mask, output ? mask : 0);
+}
+
+void
+GpioTab::rate_changed()
+{
+	unsigned long rate;
 
-	val = output
-	      ? m_gpio->get_direction() | mask
-	      : m_gpio->get_direction() & ~mask;
+	try {
+		rate = std::stoul(m_rate_row.get_widget().get_text());
+	} catch (const std::logic_error &) {
+		show_centered_dialog("Error", "Invalid sampling rate");
+		return;
+	}
 
-	m_gpio->configure(val);
+	if (m_monitor)
+		m_monitor->set_rate(rate);
 }
 
-bool
-GpioTab::timer()
+/*
+ * Pins are only sampled while the tab is on screen; switching to another
+ * tab drops the subscription and the monitor goes idle.
+ */
+void
+GpioTab::on_map()
 {
-	uint8_t val;
-	bool state;
+	Gtk::Box::on_map();
 
-	if (m_gpio == nullptr)
-		return (true);
+	if (m_gpio == nullptr || m_subscription != 0)
+		return;
+
+	if (!m_monitor) {
+		m_monitor = std::make_unique<GpioMonitor>(m_gpio);
+		rate_changed();
+	}
+
+	m_subscription = m_monitor->subscribe(sigc::mem_fun(*this,
+	    &GpioTab::on_gpio_event));
+}
+
+void
+GpioTab::on_unmap()
+{
+	if (m_subscription != 0) {
+		m_monitor->unsubscribe(m_subscription);
+		m_subscription = 0;
+	}
+
+	Gtk::Box::on_unmap();
+}
+
+/* Called on the monitor thread */
+void
+GpioTab::on_gpio_event(const GpioEvent &event)
+{
+	bool notify;
+
+	{
+		std::lock_guard<std::mutex> guard(m_events_lock);
+
+		notify = m_events.empty();
+		m_events.push_back(event);
+	}
+
+	if (notify)
+		m_events_ready.emit();
+}
+
+void
+GpioTab::on_events_ready()
+{
+	std::vector<GpioEvent> events;
+	Gtk::TextBuffer::iterator cut;
+	std::string log;
+
+	{
+		std::lock_guard<std::mutex> guard(m_events_lock);
 
-	val = m_gpio->get();
+		events.swap(m_events);
+	}
+
+	if (events.empty())
+		return;
+
+	if (m_first_event == 0)
+		m_first_event = events.front().timestamp;
+
+	for (const auto &event: events) {
+		log += fmt::format("{:12.6f}  {:04b}  changed {:04b}\n",
+		    (event.timestamp - m_first_event) / 1e6,
+		    event.value & 0xf, event.changed & 0xf);
+	}
+
+	/* The rows only show the latest level */
+	m_updating = true;
 	for (int i = 0; i < 4; i++) {
-		state = val & (1 << i);
+		bool state = events.back().value & (1 << i);
+
 		if (m_gpio_row[i].get_state() != state)
 			m_gpio_row[i].set_state(state);
 	}
+	m_updating = false;
+
+	m_textbuffer->insert(m_textbuffer->end(), log);
+	if (m_textbuffer->get_line_count() > GPIO_LOG_LINES) {
+		cut = m_textbuffer->get_iter_at_line(
+		    m_textbuffer->get_line_count() - GPIO_LOG_LINES);
+		m_textbuffer->erase(m_textbuffer->begin(), cut);
+	}
+	m_textview.scroll_to(m_textbuffer->get_insert());
+}
+
+void
+GpioTab::play_clicked()
+{
+	std::string name = m_sequence_row.get_widget().get_active_text();
+
+	if (m_gpio == nullptr || m_parent->m_pc == nullptr || name.empty())
+		return;
+
+	try {
+		m_gpio->play(m_parent->m_pc->get_gpio_sequence(name));
+	} catch (const ProfileConfigException &err) {
+		show_centered_dialog("Error", err.get_info());
+	} catch (const std::runtime_error &err) {
+		show_centered_dialog("Error", err.what());
+	}
+}
+
+void
+GpioTab::set_sequences(const std::vector<std::string> &names)
+{
+	m_sequence_row.get_widget().remove_all();
+	for (const auto &name: names)
+		m_sequence_row.get_widget().append(name);
+
+	if (!names.empty())
+		m_sequence_row.get_widget().set_active(0);
 
-	return (true);
+	m_play.set_sensitive(!names.empty());
 }
 
 void
@@ -1030,3 +1453,18 @@ void MainWindow::set_jtag_script(std::string script)
 {
 	m_jtag_tab.set_script(script);
 }
+
+void MainWindow::set_jtag_speed(std::string speed)
+{
+	m_jtag_tab.set_speed(speed);
+}
+
+void MainWindow::set_jtag_rpc_port(uint16_t port)
+{
+	m_jtag_tab.set_rpc_port(port);
+}
+
+void MainWindow::set_jtag_gdb_proxy(bool enable, const GdbProxyRanges &ram)
+{
+	m_jtag_tab.set_gdb_proxy(enable, ram);
+}
@@ -0,0 +1,102 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fmt/format.h>
+#include <mapped_file.hh>
+
+MappedFile::MappedFile(const std::string &path):
+    m_path(path),
+    m_data(nullptr),
+    m_size(0)
+{
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(fmt::format("Cannot open {}: {}",
+		    path, strerror(errno)));
+	}
+
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error(fmt::format("Cannot stat {}: {}",
+		    path, strerror(errno)));
+	}
+
+	m_size = st.st_size;
+
+	/* mmap() refuses empty mappings */
+	if (m_size == 0) {
+		close(fd);
+		return;
+	}
+
+	addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED) {
+		throw std::runtime_error(fmt::format("Cannot map {}: {}",
+		    path, strerror(errno)));
+	}
+
+	m_data = (const uint8_t *)addr;
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_data)
+		munmap((void *)m_data, m_size);
+}
+
+void
+MappedFile::write_slice(const std::string &path, size_t offset,
+    size_t length) const
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+	if (offset > m_size || length > m_size - offset) {
+		throw std::runtime_error(fmt::format("Slice {:#x}+{:#x} is "
+		    "outside of {}", offset, length, m_path));
+	}
+
+	out.write((const char *)m_data + offset, length);
+	if (!out) {
+		throw std::runtime_error(fmt::format("Cannot write {}",
+		    path));
+	}
+}
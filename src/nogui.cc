@@ -182,16 +182,25 @@ JtagCmdLine::on_output_ready(const std::string &output)
 }
 
 
-JtagCmdLine::JtagCmdLine(const Device &device, Glib::RefPtr<Gio::InetAddress> address, uint16_t gdb_port,  uint16_t ocd_port, const std::string &board_script) :
+JtagCmdLine::JtagCmdLine(const Device &device, Glib::RefPtr<Gio::InetAddress> address, uint16_t gdb_port,  uint16_t ocd_port, const std::string &board_script, uint32_t adapter_speed) :
+    JtagCmdLine(device, JtagServerConfig { address, gdb_port, ocd_port, board_script, adapter_speed })
+{
+}
+
+
+JtagCmdLine::JtagCmdLine(const Device &device, const JtagServerConfig &config) :
     m_device(device),
-    m_address(address),
-    m_ocd_port(ocd_port),
-    m_gdb_port(gdb_port),
-    m_board_script(board_script),
+    m_address(config.address),
+    m_ocd_port(config.ocd_port),
+    m_gdb_port(config.gdb_port),
+    m_board_script(config.board_script),
     m_running(false)
 {
-	m_server = std::make_shared<JtagServer>(device, address, gdb_port, ocd_port, board_script);
+	m_server = std::make_shared<JtagServer>(device, config);
+	m_server->set_auto_restart(true);
 	m_server->on_output_produced.connect(sigc::mem_fun(*this, &JtagCmdLine::on_output_ready));
+	m_server->on_state_changed.connect(sigc::mem_fun(*this, &JtagCmdLine::on_server_state));
+	m_rpc_finished.connect(sigc::mem_fun(*this, &JtagCmdLine::rpc_done));
 }
 
 
@@ -201,6 +210,70 @@ JtagCmdLine::JtagCmdLine(const Device &device) :
 }
 
 
+JtagCmdLine::~JtagCmdLine()
+{
+	if (m_rpc_thread.joinable())
+		m_rpc_thread.join();
+}
+
+
+void
+JtagCmdLine::add_job(const OpenOcdRpcJob &job)
+{
+	m_jobs.push_back(job);
+}
+
+
+/* Bulk transfers start as soon as OpenOCD reports it is ready */
+void
+JtagCmdLine::on_server_state(JtagServer::State state)
+{
+	if (state == JtagServer::RUNNING && !m_jobs.empty() && !m_rpc_started) {
+		m_rpc_started = true;
+		m_rpc_thread = std::thread(&JtagCmdLine::rpc_worker, this);
+	}
+
+	if (state == JtagServer::STOPPED && m_rpc_started)
+		exit(m_rpc_failed ? -1 : 0);
+}
+
+
+void
+JtagCmdLine::rpc_worker()
+{
+	const JtagServerConfig &config = m_server->get_config();
+
+	try {
+		OpenOcdRpc rpc(config.local_host(), config.rpc_port);
+
+		rpc.halt();
+		for (const auto &job: m_jobs) {
+			fmt::print("{}\n", job.describe());
+			std::string summary = job.run(rpc,
+			    [](size_t done, size_t total) {
+				fmt::print("\r{:3d}% ({} of {} bytes)",
+				    total ? done * 100 / total : 100, done, total);
+				fflush(stdout);
+			});
+			fmt::print("\ndone, {}\n", summary);
+		}
+	} catch (const std::runtime_error &err) {
+		Logger::error("{}", err.what());
+		m_rpc_failed = true;
+	}
+
+	m_rpc_finished.emit();
+}
+
+
+void
+JtagCmdLine::rpc_done()
+{
+	m_rpc_thread.join();
+	m_server->stop();
+}
+
+
 void
 JtagCmdLine::bypass(const Device &device)
 {
@@ -31,6 +31,8 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <mutex>
 #include <cstring>
 #include <netinet/in.h>
 #include <ctime>
@@ -41,34 +43,7 @@
 #define HEADER_SIZE sizeof (struct tlv_header_raw)
 #define RECORD_SIZE sizeof (struct tlv_record_raw)
 
-OnieTLV::OnieTLV()
-{
-	yaml_map["product-name"] = TLV_CODE_PRODUCT_NAME;
-	yaml_map["part-number"] = TLV_CODE_PART_NUMBER;
-	yaml_map["serial-number"] = TLV_CODE_SERIAL_NUMBER;
-	yaml_map["mac-address"] = TLV_CODE_MAC_BASE;
-	yaml_map["manufacture-date"] = TLV_CODE_MANUF_DATE;
-	yaml_map["device-version"] = TLV_CODE_DEV_VERSION;
-	yaml_map["label-revision"] = TLV_CODE_LABEL_REVISION;
-	yaml_map["platform-name"] = TLV_CODE_PLATFORM_NAME;
-	yaml_map["onie-version"] = TLV_CODE_ONIE_VERSION;
-	yaml_map["number-mac"] = TLV_CODE_NUM_MACs;
-	yaml_map["manufacturer"] = TLV_CODE_MANUF_NAME;
-	yaml_map["country-code"] = TLV_CODE_COUNTRY_CODE;
-	yaml_map["vendor-name"] = TLV_CODE_VENDOR_NAME;
-	yaml_map["diag-version"] = TLV_CODE_DIAG_VERSION;
-	yaml_map["service-tag"] = TLV_CODE_SERVICE_TAG;
-
-	board_name = "Not set";
-	revision = "Not set";
-};
-
-OnieTLV::~OnieTLV()
-{
-
-}
-
-void OnieTLV::validate_date(const std::string& date_value)
+static void validate_date(const std::string& date_value)
 {
 	struct tm tm;
 
@@ -79,13 +54,13 @@ void OnieTLV::validate_date(const std::string& date_value)
 		throw OnieTLVException("Bad date. Check if date is valid.");
 }
 
-void OnieTLV::validate_text(const std::string& text, size_t len)
+static void validate_text(const std::string& text, size_t len)
 {
 	if (text.length() > len)
 		throw OnieTLVException(fmt::format("Field value cannot be longer than {}", len));
 }
 
-bool OnieTLV::validate_mac_address(const std::string& mac_address)
+static bool validate_mac_address(const std::string& mac_address)
 {
 	int ret;
 	int mac_bytes[6];
@@ -111,22 +86,7 @@ bool OnieTLV::validate_mac_address(const std::string& mac_address)
 	return true;
 }
 
-void OnieTLV::parse_mac_address(const std::string& mac_text, uint8_t *mac_address)
-{
-	int mac_bytes[6];
-
-	if (!validate_mac_address(mac_text)) {
-		throw OnieTLVException("Invalid MAC address. Required format is: xx:xx:xx:xx:xx.");
-	}
-
-	std::sscanf(mac_text.c_str(), "%02x:%02x:%02x:%02x:%02x:%02x",
-			&mac_bytes[0], &mac_bytes[1], &mac_bytes[2], &mac_bytes[3], &mac_bytes[4], &mac_bytes[5]);
-
-	for (int i=0; i < 6; i++)
-		mac_address[i] = mac_bytes[i];
-}
-
-int OnieTLV::parse_number(const std::string& text_number, int min, int max)
+static int parse_number(const std::string& text_number, int min, int max)
 {
 	int parsed_number = -1;
 	std::string::const_iterator it = text_number.begin();
@@ -151,78 +111,312 @@ int OnieTLV::parse_number(const std::string& text_number, int min, int max)
 	return parsed_number;
 }
 
-bool OnieTLV::is_eeprom_valid(uint32_t crc32)
+/*
+ * Codecs, one encoder and decoder per tlv_codec_t. Encoders validate
+ * and return the number of bytes written; decoders never read past
+ * the given length, whatever the schema says.
+ */
+static size_t encode_text(const TLVField &field, const std::string &value, uint8_t *out)
 {
-	if (crc32 == eeprom_tlv_crc32_generated)
-		return true;
-	Logger::error("CRC mismatch EEPROM value {} != expected value {}", crc32, eeprom_tlv_crc32_generated);
-	return false;
+	validate_text(value, field.length);
+	memcpy(out, value.data(), value.length());
+	return value.length();
 }
 
-bool OnieTLV::load_from_eeprom(const uint8_t *eeprom)
+static std::string decode_text(const TLVField &, const uint8_t *data, size_t length)
 {
-	struct tlv_header_raw *record_header;
-	uint32_t crc_eeprom;
-	uint32_t eeprom_crc32_host;
-	uint16_t total_bytes_eeprom;
-	uint8_t eeprom_generated[TLV_EEPROM_MAX_SIZE];
-	uint32_t read_bytes = 0;
-	uint8_t *eeprom_read_ptr = const_cast<uint8_t *>(eeprom);
+	return std::string(reinterpret_cast<const char *>(data), length);
+}
 
-	if (!eeprom)
-		return false;
+static size_t encode_fixed_text(const TLVField &field, const std::string &value, uint8_t *out)
+{
+	validate_text(value, field.length);
+	memset(out, 0, field.length);
+	memcpy(out, value.data(), value.length());
+	return field.length;
+}
+
+static std::string decode_fixed_text(const TLVField &, const uint8_t *data, size_t length)
+{
+	return std::string(reinterpret_cast<const char *>(data), strnlen(reinterpret_cast<const char *>(data), length));
+}
+
+static size_t encode_date(const TLVField &field, const std::string &value, uint8_t *out)
+{
+	validate_date(value);
+	memcpy(out, value.data(), field.length);
+	return field.length;
+}
 
-#if 0
-	/* Debug print for helping with I2C eeprom read issues */
-	for (int i=0; i < 100; i++) {
-		Logger::info("{}=0x{:x} | {}", i, eeprom[i], (char)eeprom[i]);
+static size_t encode_uint8(const TLVField &, const std::string &value, uint8_t *out)
+{
+	out[0] = parse_number(value, 0, 255);
+	return 1;
+}
+
+static size_t encode_uint16(const TLVField &, const std::string &value, uint8_t *out)
+{
+	int number = parse_number(value, 0, 65535);
+
+	out[0] = number >> 8;
+	out[1] = number & 0xff;
+	return 2;
+}
+
+static std::string decode_uint(const TLVField &, const uint8_t *data, size_t length)
+{
+	unsigned long number = 0;
+
+	for (size_t i = 0; i < length && i < sizeof(uint32_t); i++)
+		number = (number << 8) | data[i];
+	return std::to_string(number);
+}
+
+static size_t encode_mac(const TLVField &, const std::string &value, uint8_t *out)
+{
+	unsigned int mac_bytes[6];
+
+	if (!validate_mac_address(value))
+		throw OnieTLVException("Invalid MAC address. Required format is: xx:xx:xx:xx:xx.");
+
+	std::sscanf(value.c_str(), "%02x:%02x:%02x:%02x:%02x:%02x",
+			&mac_bytes[0], &mac_bytes[1], &mac_bytes[2], &mac_bytes[3], &mac_bytes[4], &mac_bytes[5]);
+	for (int i = 0; i < 6; i++)
+		out[i] = mac_bytes[i];
+	return 6;
+}
+
+static std::string decode_mac(const TLVField &, const uint8_t *data, size_t length)
+{
+	// libfmt formatter cannot be used here, as it skips leading zeros while printing hex
+	char mac_text[20];
+
+	if (length < 6)
+		return "";
+
+	sprintf(mac_text, "%02X:%02X:%02X:%02X:%02X:%02X", data[0], data[1], data[2],
+			data[3], data[4], data[5]);
+	return std::string(mac_text);
+}
+
+static size_t encode_hex(const TLVField &field, const std::string &value, uint8_t *out)
+{
+	size_t length = 0;
+	int high = -1;
+
+	for (char c : value) {
+		int digit;
+
+		if (c == ' ' || c == ':')
+			continue;
+		if (!std::isxdigit((unsigned char)c))
+			throw OnieTLVException(fmt::format("'{}' is not a hex digit", c));
+
+		digit = std::isdigit((unsigned char)c) ? c - '0' : std::tolower(c) - 'a' + 10;
+		if (high < 0) {
+			high = digit;
+			continue;
+		}
+
+		if (length == field.length)
+			throw OnieTLVException(fmt::format("Field value cannot be longer than {} bytes", field.length));
+		out[length++] = (high << 4) | digit;
+		high = -1;
 	}
-#endif
 
-	record_header = reinterpret_cast<tlv_header_raw *> (eeprom_read_ptr);
-	if (strncmp(record_header->signature, TLV_EEPROM_ID_STRING, strlen(TLV_EEPROM_ID_STRING)) != 0) {
-		Logger::error("EEPROM TLV signature is invalid. Skipping loading values.");
-		return false;
+	if (high >= 0)
+		throw OnieTLVException("Hex value has an odd number of digits");
+
+	return length;
+}
+
+static std::string decode_hex(const TLVField &, const uint8_t *data, size_t length)
+{
+	std::string result;
+
+	for (size_t i = 0; i < length; i++)
+		result += fmt::format("{:02x}", data[i]);
+	return result;
+}
+
+struct TLVCodecOps {
+	size_t (*encode)(const TLVField &field, const std::string &value, uint8_t *out);
+	std::string (*decode)(const TLVField &field, const uint8_t *data, size_t length);
+};
+
+// Indexed by tlv_codec_t, keep in the same order
+static constexpr TLVCodecOps codec_ops[] = {
+	{ encode_text, decode_text },               // TLV_CODEC_TEXT
+	{ encode_fixed_text, decode_fixed_text },   // TLV_CODEC_FIXED_TEXT
+	{ encode_date, decode_text },               // TLV_CODEC_DATE
+	{ encode_uint8, decode_uint },              // TLV_CODEC_UINT8
+	{ encode_uint16, decode_uint },             // TLV_CODEC_UINT16
+	{ encode_mac, decode_mac },                 // TLV_CODEC_MAC
+	{ encode_hex, decode_hex },                 // TLV_CODEC_HEX
+};
+
+// Size of the codecs that do not take their length from the field
+static constexpr uint8_t codec_fixed_length[] = { 0, 0, 19, 1, 2, 6, 0 };
+
+static_assert(std::size(codec_fixed_length) == TLV_CODEC_COUNT, "every codec needs a size");
+
+/*
+ * Vendor extension layouts, keyed by IANA enterprise number. Filled by
+ * register_vendor_schema() and by "vendor-schemas" sections in YAML.
+ */
+static std::mutex vendor_schemas_lock;
+static void parse_vendor_schemas(const YAML::Node& node);
+static std::string vendor_extension_from_yaml(const YAML::Node& node);
+static std::map<uint32_t, TLVVendorSchema> vendor_schemas;
+
+static_assert(std::size(codec_ops) == TLV_CODEC_COUNT, "every codec needs its ops");
+
+OnieTLV::OnieTLV()
+{
+	board_name = "Not set";
+	revision = "Not set";
+	usage = 0;
+	clear_records();
+};
+
+OnieTLV::~OnieTLV()
+{
+
+}
+
+OnieTLVView::OnieTLVView(const uint8_t *data, size_t size):
+	data(data), size(0), records_end(0), crc(0), error(nullptr)
+{
+	const struct tlv_header_raw *header = reinterpret_cast<const tlv_header_raw *>(data);
+	uint32_t stored_crc;
+	size_t total;
+	size_t pos;
+
+	memset(offsets, 0, sizeof(offsets));
+
+	if (!data || size < HEADER_SIZE + TLV_EEPROM_LEN_CRC) {
+		error = "EEPROM TLV image is too short.";
+		return;
+	}
+
+	if (memcmp(header->signature, TLV_EEPROM_ID_STRING, strlen(TLV_EEPROM_ID_STRING)) != 0) {
+		error = "EEPROM TLV signature is invalid.";
+		return;
 	}
-	eeprom_read_ptr += HEADER_SIZE;
-	read_bytes += HEADER_SIZE;
 
-	// Convert total length from big endian
-	total_bytes_eeprom = ntohs(record_header->total_length) + HEADER_SIZE;
-	total_bytes_eeprom = (total_bytes_eeprom > TLV_EEPROM_MAX_SIZE)?TLV_EEPROM_MAX_SIZE:total_bytes_eeprom;
-	Logger::info("load_from_eeprom, length : [{}]", total_bytes_eeprom);
+	if (header->version != TLV_EEPROM_VERSION) {
+		error = "EEPROM TLV version is not supported.";
+		return;
+	}
 
-	while (read_bytes < total_bytes_eeprom) {
-		TLVRecord record;
-		struct tlv_record_raw *record_raw = reinterpret_cast<tlv_record_raw *> (eeprom_read_ptr);
+	// Total length is big endian and does not count the header
+	total = HEADER_SIZE + ntohs(header->total_length);
+	if (total > size || total > TLV_EEPROM_MAX_SIZE || total < HEADER_SIZE + TLV_EEPROM_LEN_CRC) {
+		error = "EEPROM TLV total length is out of range.";
+		return;
+	}
 
-		record.type = record_raw->type;
-		record.data_length = record_raw->length;
-		record.data.assign(reinterpret_cast<char *>(record_raw->value), record.data_length);
-		Logger::debug("Type 0x{:x} Len: {}", record.type, record.data_length);
-		update_records(record);
+	// Records are walked up to the CRC record, which must end the image
+	pos = HEADER_SIZE;
+	while (pos + RECORD_SIZE <= total) {
+		const struct tlv_record_raw *record = reinterpret_cast<const tlv_record_raw *>(data + pos);
 
-		eeprom_read_ptr += RECORD_SIZE + record.data_length;
-		read_bytes += RECORD_SIZE + record.data_length;
+		if (pos + RECORD_SIZE + record->length > total) {
+			error = "EEPROM TLV record runs past the total length.";
+			return;
+		}
+
+		if (record->type == TLV_CODE_CRC_32)
+			break;
+
+		offsets[record->type] = pos;
+		pos += RECORD_SIZE + record->length;
 	}
 
-	TLVRecord *crc32_record = find_record_or_nullptr(TLV_CODE_CRC_32);
-	if (!crc32_record) {
-		Logger::error("CRC32 NOT FOUND! Start from scratch!");
-		tlv_records.clear();
-		return false;
+	if (pos + TLV_EEPROM_LEN_CRC != total || data[pos] != TLV_CODE_CRC_32 || data[pos + 1] != 4) {
+		error = "EEPROM TLV does not end with a CRC record.";
+		return;
 	}
 
-	// CRC in EEPROM is saved as big endian
-	memcpy(&crc_eeprom, crc32_record->data.c_str(), crc32_record->data_length);
-	eeprom_crc32_host = ntohl(crc_eeprom);
+	// CRC covers everything up to and including the CRC record's length byte
+	crc = crc32(0, data, pos + RECORD_SIZE);
+	memcpy(&stored_crc, data + pos + RECORD_SIZE, sizeof(stored_crc));
+	if (crc != ntohl(stored_crc)) {
+		error = "EEPROM TLV CRC mismatch.";
+		return;
+	}
 
-	generate_eeprom_file(eeprom_generated);
-	if (!is_eeprom_valid(eeprom_crc32_host)) {
-		Logger::error("EEPROM TLV is not valid! CRC mismatch!");
+	this->size = total;
+	records_end = pos;
+}
+
+std::optional<std::string_view> OnieTLVView::find(uint8_t type) const
+{
+	if (!is_valid() || offsets[type] == 0)
+		return {};
+
+	return (*iterator(data + offsets[type])).value;
+}
+
+OnieTLVView::iterator OnieTLVView::begin() const
+{
+	return iterator(is_valid() ? data + HEADER_SIZE : data);
+}
+
+OnieTLVView::iterator OnieTLVView::end() const
+{
+	return iterator(is_valid() ? data + records_end : data);
+}
+
+TLVRecordView OnieTLVView::iterator::operator*() const
+{
+	const struct tlv_record_raw *record = reinterpret_cast<const tlv_record_raw *>(m_pos);
+
+	return { record->type, std::string_view(reinterpret_cast<const char *>(record->value), record->length) };
+}
+
+OnieTLVView::iterator &OnieTLVView::iterator::operator++()
+{
+	m_pos += RECORD_SIZE + m_pos[1];
+	return *this;
+}
+
+bool OnieTLV::load_from_eeprom(const uint8_t *eeprom, size_t size)
+{
+	return load_from_eeprom(OnieTLVView(eeprom, size));
+}
+
+bool OnieTLV::load_from_eeprom(const OnieTLVView &view)
+{
+	if (!view.is_valid()) {
+		Logger::error("{} Skipping loading values.", view.get_error());
 		return false;
 	}
 
+	Logger::info("load_from_eeprom, length : [{}]", view.get_size());
+
+	clear_records();
+	clear_vendor_extensions();
+	for (const auto record: view) {
+		const uint8_t *value = reinterpret_cast<const uint8_t *>(record.value.data());
+
+		Logger::debug("Type 0x{:x} Len: {}", record.type, record.value.size());
+		if (record.type != TLV_CODE_VENDOR_EXT) {
+			update_records(record.type, value, record.value.size());
+			continue;
+		}
+
+		if (record.value.size() < TLV_VENDOR_IANA_SIZE) {
+			Logger::warning("Skipping vendor extension without an IANA number.");
+			continue;
+		}
+
+		add_vendor_extension((uint32_t)value[0] << 24 | value[1] << 16 | value[2] << 8 | value[3],
+				value + TLV_VENDOR_IANA_SIZE, record.value.size() - TLV_VENDOR_IANA_SIZE);
+	}
+
+	usage = view.get_size();
+	eeprom_tlv_crc32_generated = view.get_crc();
 	Logger::debug("EEPROM TLV is valid.");
 	return true;
 }
@@ -235,21 +429,49 @@ bool OnieTLV::generate_eeprom_file(uint8_t *eeprom)
 	if (!eeprom)
 		return false;
 
-	std::sort(tlv_records.begin(), tlv_records.end(),
-		   [](auto const &a, auto const &b) {return a.type < b.type; });
-
 	// Prepare some space for header that will be written later.
 	usage = HEADER_SIZE;
 	eeprom_write_ptr += HEADER_SIZE;
 
-	for (auto const &record: tlv_records) {
+	// The table is indexed by type, so walking it yields records in type order
+	for (unsigned int type = 0; type < TLV_CODE_COUNT; type++) {
+		const TLVRecord &record = tlv_records[type];
+
+		// Vendor extensions have a slot of their own, in insertion order
+		if (type == TLV_CODE_VENDOR_EXT) {
+			for (const auto &ext : vendor_exts) {
+				uint32_t iana = htonl(ext.iana);
+				size_t length = TLV_VENDOR_IANA_SIZE + ext.data_length;
+
+				if (usage + RECORD_SIZE + length > TLV_EEPROM_MAX_SIZE - TLV_EEPROM_LEN_CRC) {
+					Logger::error("EEPROM TLV data does not fit in {} bytes.", TLV_EEPROM_MAX_SIZE);
+					return false;
+				}
+
+				struct tlv_record_raw *tlv_record = reinterpret_cast<struct tlv_record_raw *>(eeprom_write_ptr);
+				tlv_record->type = type;
+				tlv_record->length = length;
+				memcpy(tlv_record->value, &iana, TLV_VENDOR_IANA_SIZE);
+				memcpy(tlv_record->value + TLV_VENDOR_IANA_SIZE, ext.data, ext.data_length);
+				usage += RECORD_SIZE + length;
+				eeprom_write_ptr += RECORD_SIZE + length;
+			}
+			continue;
+		}
+
 		// CRC record is written separately
-		if (record.type == TLV_CODE_CRC_32)
+		if (!record.present || type == TLV_CODE_CRC_32)
 			continue;
+
+		if (usage + RECORD_SIZE + record.data_length > TLV_EEPROM_MAX_SIZE - TLV_EEPROM_LEN_CRC) {
+			Logger::error("EEPROM TLV data does not fit in {} bytes.", TLV_EEPROM_MAX_SIZE);
+			return false;
+		}
+
 		struct tlv_record_raw *tlv_record = reinterpret_cast<struct tlv_record_raw *>(eeprom_write_ptr);
-		tlv_record->type = record.type;
+		tlv_record->type = type;
 		tlv_record->length = record.data_length;
-		memcpy(tlv_record->value, record.data.c_str(), tlv_record->length);
+		memcpy(tlv_record->value, record.data, tlv_record->length);
 		usage += RECORD_SIZE + tlv_record->length;
 		eeprom_write_ptr += RECORD_SIZE + tlv_record->length;
 	}
@@ -273,142 +495,56 @@ bool OnieTLV::generate_eeprom_file(uint8_t *eeprom)
 	memcpy(crc_record->value, &crc_to_eeprom, crc_record->length);
 	usage += crc_record->length;
 
-	Logger::debug("EEPROM usage [{}] bytes.", usage);
 	return true;
 }
 
 void OnieTLV::save_user_tlv(tlv_code_t tlv_id, const std::string& value)
 {
-	switch (tlv_id) {
-		case TLV_CODE_PRODUCT_NAME:
-		case TLV_CODE_PART_NUMBER:
-		case TLV_CODE_SERIAL_NUMBER:
-		case TLV_CODE_LABEL_REVISION:
-		case TLV_CODE_PLATFORM_NAME:
-		case TLV_CODE_ONIE_VERSION:
-		case TLV_CODE_MANUF_NAME:
-		case TLV_CODE_VENDOR_NAME:
-		case TLV_CODE_DIAG_VERSION:
-		case TLV_CODE_SERVICE_TAG:
-		case TLV_CODE_VENDOR_EXT: {
-			TLVRecord new_record;
-			// For all text based fields just copy the text to EEPROM
-			validate_text(value, TLV_EEPROM_VALUE_MAX_SIZE);
-			new_record.type = tlv_id;
-			new_record.data_length = value.length();
-			new_record.data = value;
-			update_records(new_record);
-			break;
-		}
-		case TLV_CODE_DEV_VERSION: {
-			TLVRecord new_record;
-			// Device version is just single byte
-			int num_version = parse_number(value, 0, 255);
-			new_record.type = tlv_id;
-			new_record.data_length = 1;
-			new_record.data.assign(reinterpret_cast<char *>(&num_version), new_record.data_length);
-			update_records(new_record);
-			break;
-		}
-		case TLV_CODE_NUM_MACs: {
-			TLVRecord new_record;
-			// Number num_mac following MAC addresses (2 bytes)
-			uint32_t num_mac = parse_number(value, 0, 65535);
-			uint16_t num_mac_eeprom = htons(num_mac);
-			new_record.type = tlv_id;
-			new_record.data_length = 2;
-			new_record.data.assign(reinterpret_cast<char *>(&num_mac_eeprom), new_record.data_length);
-			update_records(new_record);
-			break;
-		}
-		case TLV_CODE_COUNTRY_CODE: {
-			TLVRecord new_record;
-			// Country code is just a string limited to 2 bytes
-			validate_text(value, 2);
-			new_record.type = tlv_id;
-			new_record.data_length = 2;
-			new_record.data = value;
-			update_records(new_record);
-			break;
-		}
-		case TLV_CODE_MAC_BASE: {
-			TLVRecord new_record;
-			// MAC address is saved as 6 bytes without any additional characters
-			// MAC address must be checked if it's not all zeros or if it's not broadcast address.
-			uint8_t mac_address[6];
-			parse_mac_address(value, mac_address);
-			new_record.type = tlv_id;
-			new_record.data_length = 6;
-			new_record.data.assign(reinterpret_cast<const char *>(mac_address), new_record.data_length);
-			update_records(new_record);
-			break;
-		}
-		case TLV_CODE_MANUF_DATE: {
-			TLVRecord new_record;
-			// Manufacture date must be in format MM/DD/YYYY hh:mm:ss it's stored in this format in EEPROM
-			validate_date(value);
-			new_record.type = tlv_id;
-			new_record.data_length = 19;
-			new_record.data = value;
-			update_records(new_record);
-			break;
-		}
-		case TLV_CODE_CRC_32:
-			// This field is computed before write to EEPROM cannot be set.
-			throw OnieTLVException("CRC field cannot be set!");
-		default:
-			// Any other type is wrong type
-			throw OnieTLVException(fmt::format("Invalid field set 0x{:x} = {}", tlv_id, value));
+	const TLVField *field = tlv_field(tlv_id);
+	uint8_t data[TLV_EEPROM_VALUE_MAX_SIZE];
+
+	// CRC is computed before write to EEPROM and cannot be set.
+	if (tlv_id == TLV_CODE_CRC_32)
+		throw OnieTLVException("CRC field cannot be set!");
+
+	// Vendor extensions may repeat, each one adds a record
+	if (tlv_id == TLV_CODE_VENDOR_EXT) {
+		add_vendor_extension(value);
+		return;
 	}
+
+	if (!field)
+		throw OnieTLVException(fmt::format("Invalid field set 0x{:x} = {}", tlv_id, value));
+
+	update_records(tlv_id, data, codec_ops[field->codec].encode(*field, value, data));
 }
 
 std::optional<std::string> OnieTLV::get_tlv_record(const tlv_code_t tlv_id) {
+	const TLVField *field = tlv_field(tlv_id);
 	TLVRecord *record = find_record_or_nullptr(tlv_id);
+
+	if (tlv_id == TLV_CODE_VENDOR_EXT && !vendor_exts.empty())
+		return format_vendor_extension(vendor_exts.front());
+
 	if (!record) {
 		Logger::error("Field tlv_id 0x{:x} was not found!", tlv_id);
 		return {};
 	}
 
-	switch (tlv_id) {
-		case TLV_CODE_PRODUCT_NAME:
-		case TLV_CODE_PART_NUMBER:
-		case TLV_CODE_SERIAL_NUMBER:
-		case TLV_CODE_LABEL_REVISION:
-		case TLV_CODE_PLATFORM_NAME:
-		case TLV_CODE_ONIE_VERSION:
-		case TLV_CODE_MANUF_NAME:
-		case TLV_CODE_VENDOR_NAME:
-		case TLV_CODE_DIAG_VERSION:
-		case TLV_CODE_SERVICE_TAG:
-		case TLV_CODE_VENDOR_EXT:
-		case TLV_CODE_COUNTRY_CODE:
-		case TLV_CODE_MANUF_DATE:
-			return record->data;
-		case TLV_CODE_DEV_VERSION:
-			return std::to_string((uint8_t)record->data.c_str()[0]);
-		case TLV_CODE_NUM_MACs: {
-			uint16_t eeprom_num_mac;
-			memcpy(&eeprom_num_mac, record->data.c_str(), record->data_length);
-			return std::to_string(ntohs(eeprom_num_mac));
-		}
-		case TLV_CODE_MAC_BASE: {
-			char mac_text[20];
-			const char *mac = record->data.c_str();
-			// libfmt formatter cannot be used here, as it skips leading zeros while printing hex
-			sprintf(mac_text, "%02X:%02X:%02X:%02X:%02X:%02X", mac[0]&0xFF, mac[1]&0xFF, mac[2]&0xFF,
-					mac[3]&0xFF, mac[4]&0xFF, mac[5]&0xFF);
-			return std::string(mac_text);
-		}
-		case TLV_CODE_RESERVED:
-		case TLV_CODE_RESERVED_1:
-			Logger::warning("Reading reserved field 0x{:x} is not allowed!", tlv_id);
-			return {};
-		case TLV_CODE_CRC_32:
-			Logger::warning("Reading crc field 0x{:x} should not be done.", tlv_id);
-			return {};
+	if (!field) {
+		Logger::warning("Reading field 0x{:x} is not supported.", tlv_id);
+		return {};
 	}
 
-	return {};
+	return codec_ops[field->codec].decode(*field, record->data, record->data_length);
+}
+
+bool OnieTLV::has_tlv_record(const tlv_code_t tlv_id)
+{
+	if (tlv_id == TLV_CODE_VENDOR_EXT)
+		return !vendor_exts.empty();
+
+	return find_record_or_nullptr(tlv_id) != nullptr;
 }
 
 size_t OnieTLV::get_usage()
@@ -421,29 +557,34 @@ std::string OnieTLV::get_eeprom_address_from_yaml()
 	return eeprom_address;
 }
 
+std::string OnieTLV::get_board_name_from_yaml()
+{
+	return board_name;
+}
+
 TLVRecord *OnieTLV::find_record_or_nullptr(tlv_code_t tlv_id)
 {
-	auto is_selected_id = [tlv_id](TLVRecord rec){ return rec.type == tlv_id; };
+	TLVRecord &record = tlv_records[(uint8_t)tlv_id];
 
-	auto found_record = std::find_if(std::begin(tlv_records), std::end(tlv_records), is_selected_id);
-	if (found_record != std::end(tlv_records))
-		return &(*found_record);
-	else
-		return nullptr;
+	return record.present ? &record : nullptr;
 }
 
-void OnieTLV::update_records(TLVRecord& rec)
+void OnieTLV::update_records(uint8_t type, const void *data, size_t length)
 {
-	for (auto &record : tlv_records) {
-		if (record.type == rec.type) {
-			record.data = rec.data;
-			record.data_length = rec.data_length;
-			return;
-		}
-	}
-	tlv_records.push_back(rec);
+	TLVRecord &record = tlv_records[type];
+
+	record.present = true;
+	record.data_length = std::min(length, sizeof(record.data));
+	memcpy(record.data, data, record.data_length);
 };
 
+// Only the flags are reset, stale bytes past data_length are never read
+void OnieTLV::clear_records()
+{
+	for (auto &record : tlv_records)
+		record.present = false;
+}
+
 void OnieTLV::load_from_yaml(const std::string& filename) {
 	YAML::Node config;
 	try {
@@ -478,17 +619,31 @@ void OnieTLV::load_from_yaml(const std::string& filename) {
 	if (!config["eeprom"])
 		throw OnieTLVException("EEPROM configuration file doesn't have eeeprom section.");
 
+	if (config["vendor-schemas"])
+		parse_vendor_schemas(config["vendor-schemas"]);
+
+	clear_vendor_extensions();
+
 	tlv_code_t tlv_id;
 	for (YAML::const_iterator it=config["eeprom"].begin();it!=config["eeprom"].end();++it) {
 		YAML::Node node = *it;
+		if (node["name"] && node["iana"] && node["name"].as<std::string>() == "vendor-extension") {
+			try {
+				add_vendor_extension(vendor_extension_from_yaml(node));
+			} catch (OnieTLVException& exception) {
+				Logger::error("Error while parsing vendor extension {}. Info: {}",
+						node["iana"].as<std::string>(), exception.get_info());
+			}
+			continue;
+		}
+
 		if (!node["name"] || !node["value"])
 			continue;
 
-		try {
-			tlv_id = yaml_map.at(node["name"].as<std::string>());
-		} catch (const std::out_of_range& oor) {
+		const TLVField *field = tlv_field_by_name(node["name"].as<std::string>());
+		if (!field)
 			continue;
-		}
+		tlv_id = field->code;
 
 		try {
 			save_user_tlv(tlv_id, node["value"].as<std::string>());
@@ -498,3 +653,259 @@ void OnieTLV::load_from_yaml(const std::string& filename) {
 		}
 	}
 }
+
+
+/*
+ * A vendor extension entry in YAML names its enterprise number and then
+ * either "fields" (a map, needs a schema) or raw "data" in hex.
+ */
+static std::string vendor_extension_from_yaml(const YAML::Node& node)
+{
+	std::string payload;
+
+	if (node["fields"]) {
+		for (const auto &field : node["fields"]) {
+			payload += payload.empty() ? "" : ";";
+			payload += field.first.as<std::string>() + "=" + field.second.as<std::string>();
+		}
+	} else if (node["data"]) {
+		payload = node["data"].as<std::string>();
+	}
+
+	return node["iana"].as<std::string>() + ":" + payload;
+}
+
+/*
+ * vendor-schemas:
+ *   - iana: 12345
+ *     name: calibration
+ *     fields:
+ *       - { name: adc-gain, type: uint16 }
+ *       - { name: blob, type: hex }
+ */
+static void parse_vendor_schemas(const YAML::Node& node)
+{
+	for (const auto &entry : node) {
+		TLVVendorSchema schema;
+
+		if (!entry["iana"] || !entry["fields"])
+			throw OnieTLVException("Vendor schema needs 'iana' and 'fields'.");
+
+		try {
+			schema.iana = std::stoul(entry["iana"].as<std::string>(), nullptr, 0);
+		} catch (const std::logic_error &) {
+			throw OnieTLVException("Vendor schema IANA number is not a number.");
+		}
+		schema.name = entry["name"] ? entry["name"].as<std::string>() : "";
+
+		for (const auto &field : entry["fields"]) {
+			std::string type = field["type"] ? field["type"].as<std::string>() : "hex";
+			auto codec = std::find_if(std::begin(tlv_codec_names), std::end(tlv_codec_names),
+					[&type](const char *name) { return type == name; });
+
+			if (!field["name"] || codec == std::end(tlv_codec_names))
+				throw OnieTLVException(fmt::format("Vendor schema {:#x}: field needs a name and a known type.",
+						schema.iana));
+
+			schema.fields.push_back({ field["name"].as<std::string>(),
+					(tlv_codec_t)(codec - std::begin(tlv_codec_names)),
+					(uint8_t)(field["length"] ? field["length"].as<unsigned int>() : 0) });
+		}
+
+		OnieTLV::register_vendor_schema(schema);
+	}
+}
+
+void OnieTLV::register_vendor_schema(const TLVVendorSchema& schema)
+{
+	TLVVendorSchema normalized = schema;
+	size_t total = 0;
+
+	for (size_t i = 0; i < normalized.fields.size(); i++) {
+		TLVVendorField &field = normalized.fields[i];
+
+		// Inside a fixed layout text is always padded to its length
+		if (codec_fixed_length[field.codec])
+			field.length = codec_fixed_length[field.codec];
+		else if (field.codec == TLV_CODEC_TEXT && field.length)
+			field.codec = TLV_CODEC_FIXED_TEXT;
+
+		if (field.length == 0 && i + 1 != normalized.fields.size())
+			throw OnieTLVException(fmt::format("Vendor schema {:#x}: only the last field may have no length.",
+					schema.iana));
+		total += field.length;
+	}
+
+	if (total > TLV_VENDOR_DATA_MAX)
+		throw OnieTLVException(fmt::format("Vendor schema {:#x} is longer than {} bytes.",
+				schema.iana, TLV_VENDOR_DATA_MAX));
+
+	std::lock_guard<std::mutex> guard(vendor_schemas_lock);
+	vendor_schemas[schema.iana] = normalized;
+}
+
+std::optional<TLVVendorSchema> OnieTLV::find_vendor_schema(uint32_t iana)
+{
+	std::lock_guard<std::mutex> guard(vendor_schemas_lock);
+	auto it = vendor_schemas.find(iana);
+
+	if (it == vendor_schemas.end())
+		return {};
+	return it->second;
+}
+
+void OnieTLV::load_vendor_schemas(const std::string& filename)
+{
+	YAML::Node config;
+
+	try {
+		config = YAML::LoadFile(filename);
+	} catch (const YAML::Exception& exception) {
+		throw OnieTLVException(fmt::format("Cannot read vendor schemas from {}.", filename));
+	}
+
+	if (config["vendor-schemas"])
+		parse_vendor_schemas(config["vendor-schemas"]);
+}
+
+void OnieTLV::add_vendor_extension(uint32_t iana, const uint8_t *data, size_t length)
+{
+	TLVVendorExt ext;
+
+	if (length > TLV_VENDOR_DATA_MAX)
+		throw OnieTLVException(fmt::format("Vendor extension cannot be longer than {} bytes.",
+				TLV_VENDOR_DATA_MAX));
+
+	ext.iana = iana;
+	ext.data_length = length;
+	memcpy(ext.data, data, length);
+	vendor_exts.push_back(ext);
+}
+
+void OnieTLV::add_vendor_extension(const std::string& text)
+{
+	std::optional<TLVVendorSchema> schema;
+	std::map<std::string, std::string> values;
+	uint8_t data[TLV_VENDOR_DATA_MAX];
+	std::string payload;
+	size_t colon = text.find(':');
+	size_t length = 0;
+	uint32_t iana;
+
+	try {
+		iana = std::stoul(text.substr(0, colon), nullptr, 0);
+	} catch (const std::logic_error &) {
+		throw OnieTLVException("Vendor extension must start with its IANA number, like 12345:payload.");
+	}
+
+	payload = colon == std::string::npos ? "" : text.substr(colon + 1);
+	schema = find_vendor_schema(iana);
+
+	if (!schema || payload.find('=') == std::string::npos) {
+		TLVField raw = { TLV_CODE_VENDOR_EXT, "", "", TLV_CODEC_HEX, TLV_VENDOR_DATA_MAX, "" };
+
+		add_vendor_extension(iana, data, encode_hex(raw, payload, data));
+		return;
+	}
+
+	for (size_t pos = 0; pos < payload.size();) {
+		size_t end = std::min(payload.find(';', pos), payload.size());
+		size_t eq = payload.find('=', pos);
+
+		if (eq == std::string::npos || eq > end)
+			throw OnieTLVException(fmt::format("Expected name=value in '{}'.", payload.substr(pos, end - pos)));
+		// The separators cannot be escaped, so values may not contain them
+		if (payload.find('=', eq + 1) < end)
+			throw OnieTLVException(fmt::format("Value in '{}' cannot contain '=' or ';'.",
+					payload.substr(pos, end - pos)));
+		values[payload.substr(pos, eq - pos)] = payload.substr(eq + 1, end - eq - 1);
+		pos = end + 1;
+	}
+
+	for (const auto &field : schema->fields) {
+		uint8_t room = field.length ? field.length : TLV_VENDOR_DATA_MAX - length;
+		TLVField sub = { TLV_CODE_VENDOR_EXT, field.name.c_str(), field.name.c_str(), field.codec, room, "" };
+		auto value = values.find(field.name);
+		size_t written;
+
+		if (value == values.end())
+			throw OnieTLVException(fmt::format("Vendor extension {} misses field '{}'.", schema->name, field.name));
+
+		written = codec_ops[field.codec].encode(sub, value->second, data + length);
+		memset(data + length + written, 0, field.length ? field.length - written : 0);
+		length += field.length ? field.length : written;
+		values.erase(value);
+	}
+
+	if (!values.empty())
+		throw OnieTLVException(fmt::format("Vendor extension {} has no field '{}'.", schema->name,
+				values.begin()->first));
+
+	add_vendor_extension(iana, data, length);
+}
+
+const std::vector<TLVVendorExt>& OnieTLV::get_vendor_extensions() const
+{
+	return vendor_exts;
+}
+
+void OnieTLV::clear_vendor_extensions()
+{
+	vendor_exts.clear();
+}
+
+std::string OnieTLV::format_vendor_extension(const TLVVendorExt& ext)
+{
+	std::optional<TLVVendorSchema> schema = find_vendor_schema(ext.iana);
+	TLVField raw = { TLV_CODE_VENDOR_EXT, "", "", TLV_CODEC_HEX, TLV_VENDOR_DATA_MAX, "" };
+	std::string result;
+	size_t pos = 0;
+
+	/*
+	 * The text form is parsed back by add_vendor_extension(), so it is
+	 * only used when it encodes back to the same bytes. A payload that
+	 * is not exactly as long as the schema, a value holding a separator
+	 * or one its codec cannot reproduce is shown as raw bytes instead.
+	 */
+	if (schema) {
+		for (const auto &field : schema->fields) {
+			size_t length = field.length ? field.length : ext.data_length - pos;
+			TLVField sub = { TLV_CODE_VENDOR_EXT, field.name.c_str(), field.name.c_str(), field.codec,
+					(uint8_t)length, "" };
+			uint8_t check[TLV_VENDOR_DATA_MAX] = {};
+			std::string value;
+			size_t written;
+
+			if (pos + length > ext.data_length) {
+				result.clear();
+				break;
+			}
+
+			value = codec_ops[field.codec].decode(sub, ext.data + pos, length);
+			try {
+				written = codec_ops[field.codec].encode(sub, value, check);
+			} catch (const OnieTLVException &) {
+				written = length + 1;
+			}
+
+			if (value.find_first_of(";=") != std::string::npos ||
+			    (field.length ? written > length : written != length) ||
+			    memcmp(check, ext.data + pos, length) != 0) {
+				result.clear();
+				break;
+			}
+
+			result += result.empty() ? "" : ";";
+			result += field.name + "=" + value;
+			pos += length;
+		}
+
+		if (pos != ext.data_length)
+			result.clear();
+	}
+
+	if (result.empty())
+		result = decode_hex(raw, ext.data, ext.data_length);
+
+	return fmt::format("{}:{}", ext.iana, result);
+}
@@ -0,0 +1,586 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <deque>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <regex>
+#include <glibmm.h>
+#include <fmt/format.h>
+#include <log.hh>
+#include <openocd_rpc.hh>
+#include <mapped_file.hh>
+#include <filesystem.hh>
+
+#define RPC_TERMINATOR	'\x1a'
+#define RPC_WINDOW	4
+#define LOAD_CHUNK	(16 * 1024)
+#define DUMP_CHUNK	(16 * 1024)
+#define ERROR_CMD_MAX	64
+#define RECV_SIZE	65536
+
+/*
+ * Runs the command under catch, so that the reply always starts with
+ * the TCL return code and errors can be told apart from results.
+ */
+static std::string
+wrap(const std::string &cmd)
+{
+	return (fmt::format("format \"%d %s\" [catch {{{}}} _devclient_rpc] "
+	    "$_devclient_rpc", cmd));
+}
+
+/*
+ * Quotes a file name as a single bare TCL word. Escaped braces do not
+ * count inside the braces wrap() adds, so an unbalanced brace in the
+ * name cannot end the script early.
+ */
+static std::string
+quote(const std::string &path)
+{
+	std::string result;
+
+	if (path.find_first_of("\r\n") != std::string::npos)
+		throw std::runtime_error(fmt::format(
+		    "Line break in file name {}", path));
+
+	for (char c: path) {
+		if (strchr("\\{}[]$\"; \t", c) != nullptr)
+			result += '\\';
+
+		result += c;
+	}
+
+	return (result);
+}
+
+static std::string
+check(const std::string &cmd, const std::string &reply)
+{
+	size_t sep = reply.find(' ');
+	std::string code = reply.substr(0, sep);
+	std::string result = sep == std::string::npos ? "" : reply.substr(sep + 1);
+
+	/* write_memory commands carry their data, keep the error readable */
+	if (code != "0") {
+		throw std::runtime_error(fmt::format("OpenOCD command '{}' "
+		    "failed: {}", cmd.size() > ERROR_CMD_MAX ?
+		    cmd.substr(0, ERROR_CMD_MAX) + "..." : cmd, result));
+	}
+
+	return (result);
+}
+
+OpenOcdRpc::OpenOcdRpc(const std::string &host, uint16_t port):
+    m_throughput(0)
+{
+	Glib::RefPtr<Gio::SocketClient> client = Gio::SocketClient::create();
+
+	try {
+		m_conn = client->connect_to_host(host, port);
+	} catch (const Glib::Error &err) {
+		throw std::runtime_error(fmt::format(
+		    "Cannot connect to OpenOCD at {}:{}: {}", host, port,
+		    err.what()));
+	}
+}
+
+OpenOcdRpc::~OpenOcdRpc()
+{
+	try {
+		m_conn->close();
+	} catch (const Glib::Error &err) {
+	}
+}
+
+void
+OpenOcdRpc::send(const std::string &cmd)
+{
+	std::string msg = cmd + RPC_TERMINATOR;
+	gsize written;
+
+	try {
+		m_conn->get_output_stream()->write_all(msg, written);
+	} catch (const Glib::Error &err) {
+		throw std::runtime_error(fmt::format(
+		    "OpenOCD connection failed: {}", err.what()));
+	}
+}
+
+std::string
+OpenOcdRpc::receive()
+{
+	std::vector<char> buf(RECV_SIZE);
+	std::string reply;
+	gssize len;
+	size_t end;
+
+	while ((end = m_pending.find(RPC_TERMINATOR)) == std::string::npos) {
+		try {
+			len = m_conn->get_input_stream()->read(buf.data(),
+			    buf.size());
+		} catch (const Glib::Error &err) {
+			throw std::runtime_error(fmt::format(
+			    "OpenOCD connection failed: {}", err.what()));
+		}
+
+		if (len <= 0)
+			throw std::runtime_error("OpenOCD closed the connection");
+
+		m_pending.append(buf.data(), len);
+	}
+
+	reply = m_pending.substr(0, end);
+	m_pending.erase(0, end + 1);
+	return (reply);
+}
+
+/*
+ * Keeps up to RPC_WINDOW commands in flight, so the target never waits
+ * for a round trip between two chunks. With raw set, replies are passed
+ * on unchecked, still prefixed with the TCL return code.
+ */
+void
+OpenOcdRpc::pipeline(const std::vector<std::string> &cmds,
+    const std::function<void(size_t, const std::string &)> &reply, bool raw)
+{
+	pipeline(cmds.size(), [&cmds](size_t index) {
+		return (cmds[index]);
+	}, reply, raw);
+}
+
+/* Commands are built as the window moves, only those in flight are kept */
+void
+OpenOcdRpc::pipeline(size_t count,
+    const std::function<std::string(size_t)> &cmd,
+    const std::function<void(size_t, const std::string &)> &reply, bool raw)
+{
+	std::deque<std::string> inflight;
+	size_t sent = 0;
+	size_t done = 0;
+
+	while (done < count) {
+		while (sent < count && sent - done < RPC_WINDOW) {
+			inflight.push_back(cmd(sent++));
+			send(wrap(inflight.back()));
+		}
+
+		try {
+			std::string result = receive();
+
+			reply(done, raw ? result : check(inflight.front(), result));
+			inflight.pop_front();
+			done++;
+		} catch (const std::runtime_error &err) {
+			/* Drain the replies still in flight before bailing out */
+			for (done++; done < sent; done++)
+				receive();
+
+			throw;
+		}
+	}
+}
+
+void
+OpenOcdRpc::finish(size_t bytes, gint64 started)
+{
+	double secs = (g_get_monotonic_time() - started) / 1e6;
+
+	m_throughput = secs > 0 ? bytes / secs : 0;
+}
+
+std::string
+OpenOcdRpc::command(const std::string &cmd)
+{
+	send(wrap(cmd));
+	return (check(cmd, receive()));
+}
+
+void
+OpenOcdRpc::halt()
+{
+	command("halt");
+}
+
+/*
+ * The image is sent over the connection in write_memory slices, so the
+ * next slice is already queued while the target writes the current one
+ * and OpenOCD never touches the file itself.
+ */
+void
+OpenOcdRpc::load_image(const std::string &path, uint32_t address,
+    const Progress &progress)
+{
+	MappedFile image(path);
+	gint64 started = g_get_monotonic_time();
+	size_t size = image.size();
+	size_t count = (size + LOAD_CHUNK - 1) / LOAD_CHUNK;
+	unsigned int width;
+
+	/* Word accesses are much faster over JTAG; assumes a LE target */
+	width = (address % 4 == 0 && size % 4 == 0) ? 32 : 8;
+
+	pipeline(count, [&](size_t index) {
+		size_t offset = index * LOAD_CHUNK;
+		size_t end = std::min<size_t>(offset + LOAD_CHUNK, size);
+		std::string cmd = fmt::format("write_memory {:#x} {} {{",
+		    address + offset, width);
+		uint32_t word;
+		unsigned int i;
+
+		cmd.reserve(cmd.size() + (end - offset) / (width / 8) * 11 + 2);
+		for (; offset < end; offset += width / 8) {
+			word = 0;
+			for (i = 0; i < width / 8; i++)
+				word |= (uint32_t)image.data()[offset + i] << (i * 8);
+
+			cmd += fmt::format(" {:#x}", word);
+		}
+
+		return (cmd + " }");
+	}, [&](size_t index, const std::string &) {
+		if (progress)
+			progress(std::min((index + 1) * LOAD_CHUNK, size), size);
+	});
+
+	finish(size, started);
+}
+
+void
+OpenOcdRpc::flash_image(const std::string &path, uint32_t address,
+    bool verify, const Progress &progress)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	gint64 started = g_get_monotonic_time();
+	size_t size;
+
+	if (!file)
+		throw std::runtime_error(fmt::format("Cannot open {}", path));
+
+	size = file.tellg();
+	if (progress)
+		progress(0, size);
+
+	/*
+	 * Erasing and programming is a single OpenOCD command, so there is
+	 * nothing to pipeline and progress only moves when it completes.
+	 * flash_image_diff() works sector by sector instead.
+	 */
+	command(fmt::format("flash write_image erase {} {:#x} bin",
+	    quote(path), address));
+
+	if (verify)
+		command(fmt::format("verify_image {} {:#x} bin", quote(path),
+		    address));
+
+	finish(size, started);
+	if (progress)
+		progress(size, size);
+}
+
+void
+OpenOcdRpc::dump_image(const std::string &path, uint32_t address,
+    uint32_t size, const Progress &progress)
+{
+	std::vector<std::string> cmds;
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	gint64 started = g_get_monotonic_time();
+	unsigned int width;
+	uint32_t offset;
+	size_t done = 0;
+
+	if (!file)
+		throw std::runtime_error(fmt::format("Cannot create {}", path));
+
+	/* Word accesses are much faster over JTAG; assumes a LE target */
+	width = (address % 4 == 0 && size % 4 == 0) ? 32 : 8;
+
+	for (offset = 0; offset < size; offset += DUMP_CHUNK) {
+		cmds.push_back(fmt::format("read_memory {:#x} {} {}",
+		    address + offset, width,
+		    std::min<uint32_t>(DUMP_CHUNK, size - offset) / (width / 8)));
+	}
+
+	pipeline(cmds, [&](size_t, const std::string &reply) {
+		std::istringstream values(reply);
+		std::string value;
+		uint32_t word;
+		unsigned int i;
+
+		while (values >> value) {
+			word = std::stoul(value, nullptr, 0);
+			for (i = 0; i < width / 8; i++)
+				file.put((char)(word >> (i * 8)));
+
+			done += width / 8;
+		}
+
+		if (progress)
+			progress(done, size);
+	});
+
+	if (done != size) {
+		throw std::runtime_error(fmt::format(
+		    "Short read: got {} of {} bytes", done, size));
+	}
+
+	finish(size, started);
+}
+
+/* Sectors of the flash bank that contains address, from "flash info" */
+std::vector<FlashSector>
+OpenOcdRpc::flash_sectors(uint32_t address)
+{
+	const std::regex bank_re("#(\\d+)\\s*:.*\\s+at\\s+(0x[0-9a-fA-F]+),"
+	    "\\s*size\\s+(0x[0-9a-fA-F]+)");
+	const std::regex sector_re("#\\s*\\d+:\\s*(0x[0-9a-fA-F]+)\\s*"
+	    "\\((0x[0-9a-fA-F]+)");
+	std::vector<FlashSector> sectors;
+	std::string banks = command("flash banks");
+	std::string info;
+	std::smatch match;
+	uint32_t base;
+	uint32_t size;
+
+	for (auto it = std::sregex_iterator(banks.begin(), banks.end(), bank_re);
+	    it != std::sregex_iterator(); it++) {
+		base = std::stoul((*it)[2], nullptr, 16);
+		size = std::stoul((*it)[3], nullptr, 16);
+
+		if (address < base || address - base >= size)
+			continue;
+
+		info = command(fmt::format("flash info {}", (*it)[1].str()));
+		for (auto s = std::sregex_iterator(info.begin(), info.end(),
+		    sector_re); s != std::sregex_iterator(); s++) {
+			sectors.push_back({
+			    base + (uint32_t)std::stoul((*s)[1], nullptr, 16),
+			    (uint32_t)std::stoul((*s)[2], nullptr, 16) });
+		}
+
+		return (sectors);
+	}
+
+	throw std::runtime_error(fmt::format(
+	    "No flash bank contains address {:#010x}", address));
+}
+
+/*
+ * Programs only the sectors whose contents differ from the image. The
+ * target computes a checksum of every sector touched by the image
+ * (verify_image_checksum runs a CRC algorithm on the target itself), so
+ * only a few bytes per sector cross the JTAG link. Differing sectors
+ * are merged into runs and erased and programmed run by run.
+ *
+ * OpenOCD only takes whole files, so sector slices of the mapped image
+ * are handed to it through a temporary directory.
+ */
+FlashDiffResult
+OpenOcdRpc::flash_image_diff(const MappedFile &image, uint32_t address,
+    const Progress &progress)
+{
+	FlashDiffResult result { 0, 0, 0 };
+	std::vector<FlashSector> slices;
+	std::vector<std::string> cmds;
+	std::vector<bool> dirty;
+	std::string tmpl = Glib::build_filename(Glib::get_tmp_dir(),
+	    "devclient-XXXXXX");
+	gint64 started = g_get_monotonic_time();
+	uint64_t end = (uint64_t)address + image.size();
+	uint64_t lo;
+	uint64_t hi;
+	size_t covered = 0;
+	size_t done = 0;
+	size_t first;
+	size_t i;
+
+	for (const auto &sector: flash_sectors(address)) {
+		lo = std::max<uint64_t>(sector.address, address);
+		hi = std::min<uint64_t>((uint64_t)sector.address + sector.size, end);
+		if (lo < hi) {
+			slices.push_back({ (uint32_t)lo, (uint32_t)(hi - lo) });
+			covered += hi - lo;
+		}
+	}
+
+	if (covered != image.size()) {
+		throw std::runtime_error(fmt::format("{} does not fit into the "
+		    "flash bank at {:#010x}", image.path(), address));
+	}
+
+	if (g_mkdtemp(&tmpl[0]) == nullptr)
+		throw std::runtime_error("Cannot create a temporary directory");
+
+	filesystem::path dir(tmpl);
+
+	try {
+		for (i = 0; i < slices.size(); i++) {
+			std::string slice = (dir / fmt::format("sector-{}.bin", i)).string();
+
+			image.write_slice(slice, slices[i].address - address,
+			    slices[i].size);
+			cmds.push_back(fmt::format("verify_image_checksum {} "
+			    "{:#x} bin", quote(slice), slices[i].address));
+		}
+
+		/* A failed checksum comparison is the interesting outcome here */
+		dirty.resize(slices.size());
+		pipeline(cmds, [&](size_t index, const std::string &reply) {
+			dirty[index] = reply.compare(0, 2, "0 ") != 0 &&
+			    reply != "0";
+			done += slices[index].size;
+			if (progress)
+				progress(done, image.size());
+		}, true);
+
+		for (i = 0; i < slices.size();) {
+			if (!dirty[i]) {
+				result.skipped++;
+				i++;
+				continue;
+			}
+
+			for (first = i; i < slices.size() && dirty[i]; i++)
+				result.written++;
+
+			std::string run = (dir / fmt::format("run-{}.bin", first)).string();
+			uint32_t run_address = slices[first].address;
+			uint32_t run_size = slices[i - 1].address +
+			    slices[i - 1].size - run_address;
+
+			Logger::info("Programming {:#x} bytes at {:#010x}",
+			    run_size, run_address);
+			image.write_slice(run, run_address - address, run_size);
+			command(fmt::format("flash write_image erase {} {:#x} bin",
+			    quote(run), run_address));
+			command(fmt::format("verify_image_checksum {} {:#x} bin",
+			    quote(run), run_address));
+			result.bytes += run_size;
+		}
+	} catch (...) {
+		filesystem::remove_all(dir);
+		throw;
+	}
+
+	filesystem::remove_all(dir);
+	finish(image.size(), started);
+	if (progress)
+		progress(image.size(), image.size());
+
+	return (result);
+}
+
+std::string
+OpenOcdRpc::format_rate(double bytes_per_sec)
+{
+	if (bytes_per_sec >= 1024 * 1024)
+		return (fmt::format("{:.2f} MiB/s", bytes_per_sec / (1024 * 1024)));
+
+	return (fmt::format("{:.1f} KiB/s", bytes_per_sec / 1024));
+}
+
+OpenOcdRpcJob
+OpenOcdRpcJob::parse(Kind kind, const std::string &spec)
+{
+	OpenOcdRpcJob job { kind, "", 0, 0 };
+	size_t at = spec.rfind('@');
+	size_t colon;
+
+	if (at == std::string::npos || at == 0) {
+		throw std::runtime_error(fmt::format(
+		    "Invalid image spec '{}', expected FILE@ADDRESS", spec));
+	}
+
+	job.path = spec.substr(0, at);
+	colon = spec.find(':', at);
+
+	try {
+		job.address = std::stoul(spec.substr(at + 1, colon - at - 1),
+		    nullptr, 0);
+		if (colon != std::string::npos)
+			job.size = std::stoul(spec.substr(colon + 1), nullptr, 0);
+	} catch (const std::logic_error &err) {
+		throw std::runtime_error(fmt::format(
+		    "Invalid address or size in '{}'", spec));
+	}
+
+	if (kind == DUMP && job.size == 0) {
+		throw std::runtime_error(fmt::format(
+		    "Invalid dump spec '{}', expected FILE@ADDRESS:SIZE", spec));
+	}
+
+	return (job);
+}
+
+/* Returns a one-line summary of what was done */
+std::string
+OpenOcdRpcJob::run(OpenOcdRpc &rpc, const OpenOcdRpc::Progress &progress) const
+{
+	FlashDiffResult diff;
+
+	switch (kind) {
+	case LOAD:
+		rpc.load_image(path, address, progress);
+		break;
+	case FLASH:
+		rpc.flash_image(path, address, true, progress);
+		break;
+	case FLASH_DIFF:
+		diff = rpc.flash_image_diff(MappedFile(path), address, progress);
+		return (fmt::format("{} sectors unchanged, {} written ({} bytes), {}",
+		    diff.skipped, diff.written, diff.bytes,
+		    OpenOcdRpc::format_rate(rpc.get_throughput())));
+	case DUMP:
+		rpc.dump_image(path, address, size, progress);
+		break;
+	}
+
+	return (OpenOcdRpc::format_rate(rpc.get_throughput()));
+}
+
+std::string
+OpenOcdRpcJob::describe() const
+{
+	switch (kind) {
+	case LOAD:
+		return (fmt::format("Loading {} to {:#010x}", path, address));
+	case FLASH:
+		return (fmt::format("Flashing {} at {:#010x}", path, address));
+	case FLASH_DIFF:
+		return (fmt::format("Flashing changed sectors of {} at {:#010x}",
+		    path, address));
+	case DUMP:
+		return (fmt::format("Dumping {} bytes from {:#010x} to {}",
+		    size, address, path));
+	}
+
+	return ("");
+}
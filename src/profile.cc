@@ -1,12 +1,90 @@
 
 #include <profile.hh>
 #include <string>
+#include <stdexcept>
+#include <tuple>
 #include <yaml-cpp/node/node.h>
 #include <yaml-cpp/yaml.h>
+#include <fmt/format.h>
 #include <log.hh>
+#include <jtag_probe.hh>
+#include <openocd_rpc.hh>
+#include <filesystem.hh>
+
+bool ProfileUart::operator==(const ProfileUart &other) const
+{
+    return std::tie(listen_address, listen_port, baudrate) ==
+        std::tie(other.listen_address, other.listen_port, other.baudrate);
+}
+
+bool ProfileJtag::operator==(const ProfileJtag &other) const
+{
+    return std::tie(pass_trough, listen_address, gdb_port, telnet_port,
+        rpc_port, script_file, adapter_speed, gdb_proxy, gdb_proxy_ram) ==
+        std::tie(other.pass_trough, other.listen_address, other.gdb_port,
+        other.telnet_port, other.rpc_port, other.script_file,
+        other.adapter_speed, other.gdb_proxy, other.gdb_proxy_ram);
+}
+
+bool ProfileGpio::operator==(const ProfileGpio &other) const
+{
+    if (names != other.names || sequences.size() != other.sequences.size())
+        return false;
+
+    for (size_t i = 0; i < sequences.size(); i++) {
+        const auto &a = sequences[i].get_steps();
+        const auto &b = other.sequences[i].get_steps();
+
+        if (sequences[i].get_name() != other.sequences[i].get_name() ||
+            a.size() != b.size())
+            return false;
+
+        for (size_t j = 0; j < a.size(); j++) {
+            if (a[j].mask != b[j].mask || a[j].value != b[j].value ||
+                a[j].hold_us != b[j].hold_us)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Reads node[key] into out. A missing required key or a value that
+ * does not convert is added to errors and leaves out untouched.
+ * Returns whether a value was read.
+ */
+template <typename T>
+static bool read_value(const YAML::Node &node, const char *section,
+    const char *key, bool required, T &out, std::vector<std::string> &errors)
+{
+    if (!node[key]) {
+        if (required)
+            errors.push_back(fmt::format("No '{}' in {} node", key, section));
+        return false;
+    }
+
+    try {
+        out = node[key].as<T>();
+    } catch (const YAML::BadConversion &err) {
+        errors.push_back(fmt::format("'{}' in {} node has an invalid value (line {})",
+            key, section, node[key].Mark().line + 1));
+        return false;
+    }
+
+    return true;
+}
+
+static void check_port(uint32_t port, const char *section, const char *key,
+    std::vector<std::string> &errors)
+{
+    if (port == 0 || port > 65535)
+        errors.push_back(fmt::format("'{}' in {} node must be a TCP port number", key, section));
+}
 
 ProfileConfig::ProfileConfig(const std::string &file_name) 
 {
+    std::vector<std::string> errors;
     YAML::Node profile_file;
 
     Logger::debug("File name: {}", file_name);
@@ -17,144 +95,371 @@ ProfileConfig::ProfileConfig(const std::string &file_name)
 		throw ProfileConfigException("Cannot read profile file.");
 	}
 	catch (const YAML::ParserException& parserException) {
-		throw ProfileConfigException("Profile file has bad format.");
+		throw ProfileConfigException(fmt::format("Profile file has bad format: {}",
+		    parserException.what()));
 	}
 
-    if ((uart = profile_file["devcable-serial"]) == nullptr) {
-        throw ProfileConfigException("devcable-serial node is not found in profile file");
-    } else {
-        devcable_serial = profile_file["devcable-serial"].as<std::string>();
+    if (!profile_file.IsMap())
+        throw ProfileConfigException("Profile file has bad format.");
+
+    profile.name = filesystem::path(file_name).stem().string();
+    read_value(profile_file, "profile", "profile-name", false, profile.name, errors);
+
+    if (!profile_file["devcable-serial"])
+        errors.push_back("devcable-serial node is not found in profile file");
+    else
+        read_value(profile_file, "profile", "devcable-serial", true, profile.devcable_serial, errors);
+
+    if (!profile_file["uart"])
+        errors.push_back("UART node in profile file is not found.");
+    else
+        parse_uart(profile_file["uart"], errors);
+
+    if (!profile_file["jtag"])
+        errors.push_back("JTAG node in profile file is not found.");
+    else
+        parse_jtag(profile_file["jtag"], errors);
+
+    /* GPIO and EEPROM nodes in profile file are optional */
+    if (!profile_file["gpio"])
+        Logger::warning("GPIO node in profile file is not found.");
+
+    parse_gpio(profile_file["gpio"], profile_file["gpio_sequences"], errors);
+
+    if (!profile_file["eeprom"]) {
+        Logger::warning("EEPROM node in profile file is not found.");
+    } else if (!profile_file["eeprom"].IsMap()) {
+        errors.push_back("EEPROM node must be a map");
+    } else if (profile_file["eeprom"]["eeprom_file"]) {
+        std::string eeprom_file;
+
+        read_value(profile_file["eeprom"], "EEPROM", "eeprom_file", true, eeprom_file, errors);
+        profile.eeprom_file = eeprom_file;
     }
 
-    if ((uart = profile_file["uart"]) == nullptr) {
-        throw ProfileConfigException("UART node in profile file is not found.");
+    if (!errors.empty())
+        throw ProfileConfigException(errors);
+}
+
+void ProfileConfig::parse_uart(const YAML::Node &node, std::vector<std::string> &errors)
+{
+    if (!node.IsMap()) {
+        errors.push_back("UART node must be a map");
+        return;
     }
 
-    if ((jtag = profile_file["jtag"]) == nullptr) {
-        throw ProfileConfigException("JTAG node in profile file is not found.");
+    if (read_value(node, "Uart", "baudrate", true, profile.uart.baudrate, errors) &&
+        profile.uart.baudrate == 0)
+        errors.push_back("'baudrate' in Uart node must not be 0");
+
+    read_value(node, "Uart", "listen_address", true, profile.uart.listen_address, errors);
+
+    if (read_value(node, "Uart", "listen_port", true, profile.uart.listen_port, errors))
+        check_port(profile.uart.listen_port, "Uart", "listen_port", errors);
+}
+
+void ProfileConfig::parse_jtag(const YAML::Node &node, std::vector<std::string> &errors)
+{
+    ProfileJtag &jtag = profile.jtag;
+    std::string speed;
+
+    if (!node.IsMap()) {
+        errors.push_back("JTAG node must be a map");
+        return;
     }
 
-    /* GPIO and EEPROM nodes in profile file are optional */
-    if ((gpio = profile_file["gpio"]) == nullptr) {
-         Logger::warning("GPIO node in profile file is not found.");
-    } else {
-        for(YAML::const_iterator it=gpio.begin(); it!=gpio.end(); ++it)
-            gpio_names.push_back(it->as<std::string>());
+    read_value(node, "JTAG", "pass_trough", true, jtag.pass_trough, errors);
+
+    /* The OpenOCD settings only matter when OpenOCD is started */
+    read_value(node, "JTAG", "listen_address", !jtag.pass_trough, jtag.listen_address, errors);
+    if (read_value(node, "JTAG", "gdb_listen_port", !jtag.pass_trough, jtag.gdb_port, errors) &&
+        !jtag.pass_trough)
+        check_port(jtag.gdb_port, "JTAG", "gdb_listen_port", errors);
+
+    if (read_value(node, "JTAG", "telnet_listen_port", !jtag.pass_trough, jtag.telnet_port, errors) &&
+        !jtag.pass_trough)
+        check_port(jtag.telnet_port, "JTAG", "telnet_listen_port", errors);
+
+    /* Optional, only needed when several servers share a host */
+    jtag.rpc_port = OPENOCD_RPC_PORT;
+    read_value(node, "JTAG", "rpc_listen_port", false, jtag.rpc_port, errors);
+
+    /* Optional, "auto" picks a script by the IDCODEs found on the chain */
+    jtag.script_file = "auto";
+    read_value(node, "JTAG", "script_file", false, jtag.script_file, errors);
+
+    /* Optional, "auto" picks the speed with JtagSpeedCache::resolve() */
+    jtag.adapter_speed = JTAG_SPEED_DEFAULT;
+    if (node["adapter_speed"]) {
+        speed = node["adapter_speed"].as<std::string>("");
+        if (speed == "auto") {
+            jtag.adapter_speed = JTAG_SPEED_AUTO;
+        } else {
+            /* 0 would silently mean auto, so it is refused like garbage */
+            try {
+                jtag.adapter_speed = node["adapter_speed"].as<uint32_t>();
+            } catch (const YAML::BadConversion &err) {
+                jtag.adapter_speed = 0;
+            }
+
+            if (jtag.adapter_speed == 0 || jtag.adapter_speed > JTAG_SPEED_MAX) {
+                jtag.adapter_speed = JTAG_SPEED_DEFAULT;
+                errors.push_back(fmt::format("'adapter_speed' in JTAG node must be 1 to {} kHz or 'auto'",
+                    JTAG_SPEED_MAX));
+            }
+        }
     }
 
-    if ((eeprom = profile_file["eeprom"]) == nullptr) {
-        Logger::warning("EEPROM node in profile file is not found.");
+    /* Optional, puts the caching GdbProxy in front of OpenOCD */
+    read_value(node, "JTAG", "gdb_proxy", false, jtag.gdb_proxy, errors);
+
+    /*
+     * Optional, the RAM regions the proxy may read ahead in and cache:
+     *   gdb_proxy_ram:
+     *     - { start: 0x20000000, size: 0x10000000 }
+     */
+    if (node["gdb_proxy_ram"]) {
+        if (!node["gdb_proxy_ram"].IsSequence()) {
+            errors.push_back("'gdb_proxy_ram' in JTAG node must be a list of ranges");
+        } else {
+            for (const auto &it: node["gdb_proxy_ram"]) {
+                try {
+                    if (!it.IsMap() || !it["start"] || !it["size"])
+                        throw std::invalid_argument("range");
+
+                    jtag.gdb_proxy_ram.emplace_back(
+                        std::stoull(it["start"].as<std::string>(), nullptr, 0),
+                        std::stoull(it["size"].as<std::string>(), nullptr, 0));
+                } catch (const std::exception &err) {
+                    errors.push_back(fmt::format("Range on line {} of 'gdb_proxy_ram' in JTAG node "
+                        "needs a numeric start and size", it.Mark().line + 1));
+                }
+            }
+        }
     }
+
+    if (jtag.pass_trough)
+        return;
+
+    if (jtag.gdb_port != 0 && jtag.gdb_port == jtag.telnet_port)
+        errors.push_back("'gdb_listen_port' and 'telnet_listen_port' in JTAG node are the same");
+
+    if (jtag.gdb_port != 0 && jtag.gdb_port == profile.uart.listen_port)
+        errors.push_back("'gdb_listen_port' in JTAG node is the UART listen_port");
+
+    if (jtag.telnet_port != 0 && jtag.telnet_port == profile.uart.listen_port)
+        errors.push_back("'telnet_listen_port' in JTAG node is the UART listen_port");
+}
+
+void ProfileConfig::parse_gpio(const YAML::Node &names, const YAML::Node &sequences,
+    std::vector<std::string> &errors)
+{
+    if (names) {
+        if (!names.IsSequence()) {
+            errors.push_back("GPIO node must be a list of pin names");
+        } else {
+            for (const auto &it: names) {
+                try {
+                    profile.gpio.names.push_back(it.as<std::string>());
+                } catch (const YAML::BadConversion &err) {
+                    errors.push_back(fmt::format("GPIO name on line {} is not a string",
+                        it.Mark().line + 1));
+                }
+            }
+        }
+    }
+
+    if (!sequences)
+        return;
+
+    if (!sequences.IsMap()) {
+        errors.push_back("gpio_sequences node must map names to lists of steps");
+        return;
+    }
+
+    for (const auto &it: sequences)
+        parse_gpio_sequence(it.first.as<std::string>(), it.second, errors);
+}
+
+/*
+ * Each step sets some pins, named as in the gpio node or GPIOn, and
+ * holds them for hold_us microseconds:
+ *
+ * gpio_sequences:
+ *   power-on:
+ *     - { pins: { JTAG_BSR_VSEL: 1, JTAG_HRESET_B: 0 }, hold_us: 1000 }
+ *     - { pins: { JTAG_HRESET_B: 1 } }
+ */
+void ProfileConfig::parse_gpio_sequence(const std::string &name, const YAML::Node &steps,
+    std::vector<std::string> &errors)
+{
+    const std::vector<std::string> &gpio_names = profile.gpio.names;
+    GpioSequence sequence(name);
+    size_t nerrors = errors.size();
+
+    if (!steps.IsSequence()) {
+        errors.push_back(fmt::format("GPIO sequence '{}' must be a list of steps", name));
+        return;
+    }
+
+    for (const auto &step: steps) {
+        uint8_t mask = 0;
+        uint8_t value = 0;
+        uint32_t hold_us = 0;
+
+        if (!step.IsMap() || !step["pins"] || !step["pins"].IsMap()) {
+            errors.push_back(fmt::format("Step without 'pins' in GPIO sequence '{}'", name));
+            continue;
+        }
+
+        for (const auto &pin: step["pins"]) {
+            std::string pin_name = pin.first.as<std::string>();
+            int no = -1;
+
+            for (size_t i = 0; i < gpio_names.size(); i++) {
+                if (gpio_names[i] == pin_name)
+                    no = i;
+            }
+
+            if (no < 0 && pin_name.compare(0, 4, "GPIO") == 0 && pin_name.size() == 5 &&
+                pin_name[4] >= '0' && pin_name[4] <= '7')
+                no = pin_name[4] - '0';
+
+            if (no < 0) {
+                errors.push_back(fmt::format("Unknown pin '{}' in GPIO sequence '{}'", pin_name, name));
+                continue;
+            }
+
+            std::string level = pin.second.as<std::string>("");
+
+            mask |= 1 << no;
+            if (level == "1" || level == "high")
+                value |= 1 << no;
+            else if (level != "0" && level != "low")
+                errors.push_back(fmt::format("Pin '{}' in GPIO sequence '{}' must be 0 or 1", pin_name, name));
+        }
+
+        try {
+            if (step["hold_us"])
+                hold_us = step["hold_us"].as<uint32_t>();
+        } catch (const YAML::BadConversion &err) {
+            errors.push_back(fmt::format("'hold_us' in GPIO sequence '{}' must be a number", name));
+        }
+
+        sequence.add_step(mask, value, hold_us);
+    }
+
+    if (errors.size() == nerrors)
+        profile.gpio.sequences.push_back(sequence);
+}
+
+const Profile &ProfileConfig::get_profile() const
+{
+    return profile;
+}
+
+std::string ProfileConfig::get_profile_name()
+{
+    return profile.name;
 }
 
 std::string ProfileConfig::get_devcable_serial() 
 {
-    return devcable_serial;
+    return profile.devcable_serial;
 }
 
 std::uint32_t ProfileConfig::get_uart_baudrate() 
 {
-    uint32_t baudrate = 0;
-    if (uart["baudrate"])
-        baudrate = uart["baudrate"].as<uint32_t>();
-    else
-        throw ProfileConfigException("No 'baudrate' in Uart node");
-
-    return baudrate;
+    return profile.uart.baudrate;
 }
 
 std::string ProfileConfig::get_uart_listen_address() 
 {
-    std::string listen_address;
-    if (uart["listen_address"])
-        listen_address = uart["listen_address"].as<std::string>();
-    else
-        throw ProfileConfigException("No 'listen_address' in Uart node");
-
-    return listen_address;
+    return profile.uart.listen_address;
 }
 
 std::uint32_t ProfileConfig::get_uart_port() 
 {
-    uint32_t uart_port = 0;
-    if (uart["listen_port"])
-        uart_port = uart["listen_port"].as<uint32_t>();
-    else
-        throw ProfileConfigException("No 'listen_port' in Uart node");
-
-    return uart_port;
+    return profile.uart.listen_port;
 }
 
 std::uint32_t ProfileConfig::get_jtag_gdb_port() 
 {
-    uint32_t gdb_listen_port = 0;
-    if (jtag["gdb_listen_port"])
-        gdb_listen_port = jtag["gdb_listen_port"].as<uint32_t>();
-    else
-        throw ProfileConfigException("No 'gdb_listen_port' in JTAG node");
-
-    return gdb_listen_port;
+    return profile.jtag.gdb_port;
 }
 
 std::uint32_t ProfileConfig::get_jtag_telnet_port() 
 {
-    uint32_t telnet_listen_port = 0;
-    if (jtag["telnet_listen_port"])
-        telnet_listen_port = jtag["telnet_listen_port"].as<uint32_t>();
-    else
-        throw ProfileConfigException("No 'telnet_listen_port' in JTAG node");
-
-    return telnet_listen_port;
+    return profile.jtag.telnet_port;
 }
 
 std::string ProfileConfig::get_jtag_listen_address()
 {
-    std::string listen_address;
-    if (jtag["listen_address"])
-        listen_address = jtag["listen_address"].as<std::string>();
-    else
-        throw ProfileConfigException("No 'listen_address' in JTAG node");
+    return profile.jtag.listen_address;
+}
 
-    return listen_address;
+std::uint16_t ProfileConfig::get_jtag_rpc_port()
+{
+    return profile.jtag.rpc_port;
 }
 
 std::string ProfileConfig::get_jtag_script_file() 
 {
-    std::string script_file;
-    if (jtag["script_file"])
-        script_file = jtag["script_file"].as<std::string>();
-    else
-        throw ProfileConfigException("No 'script_file' in JTAG node");
+    return profile.jtag.script_file;
+}
 
-    return script_file;
+std::uint32_t ProfileConfig::get_jtag_adapter_speed()
+{
+    return profile.jtag.adapter_speed;
 }
 
 bool ProfileConfig::get_jtag_passtrough() 
 {
-    bool pass_trough = 0;
-    if (jtag["pass_trough"])
-        pass_trough = jtag["pass_trough"].as<bool>();
-    else
-        throw ProfileConfigException("No 'pass_trough' in JTAG node");
+    return profile.jtag.pass_trough;
+}
 
-    return pass_trough;
+bool ProfileConfig::get_jtag_gdb_proxy()
+{
+    return profile.jtag.gdb_proxy;
+}
+
+std::vector<std::pair<std::uint64_t, std::uint64_t>> ProfileConfig::get_jtag_gdb_proxy_ram()
+{
+    return profile.jtag.gdb_proxy_ram;
 }
 
 std::string ProfileConfig::get_gpio_name(int gpio) 
 {
-    int gpio_labels = gpio_names.size();
+    int gpio_labels = profile.gpio.names.size();
     if (gpio >= 0 && gpio < gpio_labels)
-        return gpio_names[gpio];
+        return profile.gpio.names[gpio];
     return "";
 }
 
+std::vector<std::string> ProfileConfig::get_gpio_sequence_names()
+{
+    std::vector<std::string> names;
+
+    for (const auto &sequence: profile.gpio.sequences)
+        names.push_back(sequence.get_name());
+
+    return names;
+}
+
+GpioSequence ProfileConfig::get_gpio_sequence(const std::string &name)
+{
+    for (const auto &sequence: profile.gpio.sequences) {
+        if (sequence.get_name() == name)
+            return sequence;
+    }
+
+    throw ProfileConfigException(fmt::format("No GPIO sequence named '{}'", name));
+}
+
 std::string ProfileConfig::get_eeprom_file() 
 {
-    std::string eeprom_file;
-    if (eeprom && eeprom["eeprom_file"])
-        eeprom_file = eeprom["eeprom_file"].as<std::string>();
-    else
-        throw ProfileConfigException("No 'eeprom_file' in JTAG node");
+    if (!profile.eeprom_file.has_value())
+        throw ProfileConfigException("No 'eeprom_file' in EEPROM node");
 
-    return eeprom_file;
-}
\ No newline at end of file
+    return profile.eeprom_file.value();
+}
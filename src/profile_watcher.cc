@@ -0,0 +1,127 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <fmt/format.h>
+#include <filesystem.hh>
+#include <profile_watcher.hh>
+#include <log.hh>
+
+ProfileWatcher::ProfileWatcher(const SlotChanged &changed):
+    m_changed(changed)
+{
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd < 0)
+		throw std::runtime_error(fmt::format("inotify_init1: {}",
+		    strerror(errno)));
+
+	m_io = Glib::signal_io().connect(sigc::mem_fun(*this,
+	    &ProfileWatcher::readable), m_fd, Glib::IO_IN);
+}
+
+ProfileWatcher::~ProfileWatcher()
+{
+	m_timer.disconnect();
+	m_io.disconnect();
+	close(m_fd);
+}
+
+void
+ProfileWatcher::add(const std::string &path)
+{
+	filesystem::path file = filesystem::absolute(path).lexically_normal();
+	std::string dir = file.parent_path().string();
+	int wd;
+
+	wd = inotify_add_watch(m_fd, dir.c_str(),
+	    IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0) {
+		throw std::runtime_error(fmt::format("Cannot watch {}: {}",
+		    dir, strerror(errno)));
+	}
+
+	/* Watching a directory twice hands back the same descriptor */
+	m_dirs[wd] = dir;
+	m_files.insert(file.string());
+	Logger::debug("Watching {} for changes", file.string());
+}
+
+bool
+ProfileWatcher::readable(Glib::IOCondition condition)
+{
+	alignas(struct inotify_event) char buf[4096];
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+
+	for (;;) {
+		len = read(m_fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (ptr = buf; ptr < buf + len;
+		    ptr += sizeof(struct inotify_event) + event->len) {
+			event = reinterpret_cast<const struct inotify_event *>(ptr);
+
+			auto dir = m_dirs.find(event->wd);
+			if (dir == m_dirs.end() || event->len == 0)
+				continue;
+
+			std::string file = (filesystem::path(dir->second) /
+			    event->name).string();
+			if (m_files.count(file))
+				m_pending.insert(file);
+		}
+	}
+
+	if (!m_pending.empty()) {
+		m_timer.disconnect();
+		m_timer = Glib::signal_timeout().connect(sigc::mem_fun(*this,
+		    &ProfileWatcher::settled), PROFILE_WATCHER_SETTLE_MS);
+	}
+
+	return (true);
+}
+
+bool
+ProfileWatcher::settled()
+{
+	std::set<std::string> files;
+
+	files.swap(m_pending);
+	for (const auto &file: files) {
+		Logger::info("{} changed", file);
+		m_changed(file);
+	}
+
+	return (false);
+}
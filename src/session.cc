@@ -0,0 +1,332 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <chrono>
+#include <thread>
+#include <regex>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <session.hh>
+#include <eeprom/24c.hh>
+#include <jtag.hh>
+#include <log.hh>
+
+Session::Session(const Device &device):
+    m_device(device)
+{
+}
+
+/* Uses a GPIO channel someone else already holds open */
+Session::Session(const Device &device, std::shared_ptr<Gpio> gpio):
+    m_device(device),
+    m_gpio(gpio)
+{
+}
+
+Session::~Session()
+{
+	if (m_uart)
+		m_uart->close();
+}
+
+Gpio &
+Session::gpio()
+{
+	if (!m_gpio)
+		m_gpio = std::make_shared<Gpio>(m_device);
+
+	return (*m_gpio);
+}
+
+I2C &
+Session::i2c()
+{
+	if (!m_i2c)
+		m_i2c.reset(new I2C(m_device, SESSION_I2C_CLOCK));
+
+	return (*m_i2c);
+}
+
+Ftdi::Context &
+Session::uart()
+{
+	if (!m_uart)
+		uart_open(SESSION_UART_BAUDRATE);
+
+	return (*m_uart);
+}
+
+uint8_t
+Session::gpio_get()
+{
+	return (gpio().get());
+}
+
+uint8_t
+Session::gpio_get_output()
+{
+	return (gpio().get_output());
+}
+
+uint8_t
+Session::gpio_get_direction()
+{
+	return (gpio().get_direction());
+}
+
+void
+Session::gpio_set(uint8_t mask, uint8_t value)
+{
+	gpio().update(mask, value);
+}
+
+void
+Session::gpio_direction(uint8_t mask, uint8_t outputs)
+{
+	gpio().set_direction(mask, outputs);
+}
+
+/* Timed by the chip, see GpioSequence */
+void
+Session::gpio_pulse(uint8_t mask, uint8_t value, uint32_t width_us)
+{
+	GpioSequence pulse("pulse");
+	uint8_t idle = gpio().get_output();
+
+	pulse.add_step(mask, value, width_us);
+	pulse.add_step(mask, idle, 0);
+	gpio().play(pulse);
+}
+
+void
+Session::gpio_play(const GpioSequence &sequence)
+{
+	gpio().play(sequence);
+}
+
+void
+Session::check_eeprom_address(const std::string &address)
+{
+	if (Eeprom::eeprom_addrs.count(address) == 0)
+		throw std::runtime_error(fmt::format(
+		    "Unsupported EEPROM address {}", address));
+}
+
+std::vector<uint8_t>
+Session::eeprom_read(const std::string &address, uint16_t offset,
+    size_t length)
+{
+	Eeprom24c eeprom(i2c());
+	std::vector<uint8_t> data;
+
+	check_eeprom_address(address);
+	eeprom.set_address(address);
+	eeprom.read(offset, length, data);
+	return (data);
+}
+
+void
+Session::eeprom_write(const std::string &address, uint16_t offset,
+    const std::vector<uint8_t> &data)
+{
+	Eeprom24c eeprom(i2c());
+
+	check_eeprom_address(address);
+	eeprom.set_address(address);
+	eeprom.write(offset, data);
+}
+
+/* Vendor extensions may repeat, every other code has a single value */
+std::map<tlv_code_t, std::vector<std::string>>
+Session::tlv_read(const std::string &address)
+{
+	std::map<tlv_code_t, std::vector<std::string>> result;
+	Eeprom24c eeprom(i2c());
+	std::vector<uint8_t> data;
+	OnieTLV otlv;
+
+	check_eeprom_address(address);
+	eeprom.set_address(address);
+	eeprom.read_tlv(data);
+	if (!otlv.load_from_eeprom(data.data(), data.size()))
+		throw std::runtime_error("EEPROM does not hold valid ONIE TLV data");
+
+	for (const auto &field: onie_tlv_schema) {
+		if (field.code == TLV_CODE_VENDOR_EXT || !otlv.has_tlv_record(field.code))
+			continue;
+
+		result[field.code].push_back(
+		    otlv.get_tlv_record(field.code).value());
+	}
+
+	for (const auto &ext: otlv.get_vendor_extensions())
+		result[TLV_CODE_VENDOR_EXT].push_back(
+		    OnieTLV::format_vendor_extension(ext));
+
+	return (result);
+}
+
+/* With verify set the image is read back and compared byte by byte */
+void
+Session::tlv_write(const std::string &yaml_file, bool verify)
+{
+	uint8_t eeprom_file[TLV_EEPROM_MAX_SIZE];
+	std::vector<uint8_t> image;
+	std::string address;
+	OnieTLV otlv;
+
+	try {
+		otlv.load_from_yaml(yaml_file);
+	} catch (const OnieTLVException &err) {
+		throw std::runtime_error(err.get_info());
+	}
+
+	if (m_ledger)
+		m_ledger->assign(otlv, m_device.serial);
+
+	if (!otlv.generate_eeprom_file(eeprom_file))
+		throw std::runtime_error(fmt::format(
+		    "{}: TLV data does not fit in the EEPROM", yaml_file));
+
+	image.assign(eeprom_file, eeprom_file + otlv.get_usage());
+	address = otlv.get_eeprom_address_from_yaml();
+	eeprom_write(address, 0, image);
+
+	if (verify && eeprom_read(address, 0, image.size()) != image)
+		throw std::runtime_error(fmt::format(
+		    "EEPROM at {} does not match {} after writing", address,
+		    yaml_file));
+}
+
+void
+Session::tlv_write(const std::string &address,
+    const std::map<tlv_code_t, std::vector<std::string>> &fields)
+{
+	uint8_t eeprom_file[TLV_EEPROM_MAX_SIZE];
+	OnieTLV otlv;
+
+	try {
+		for (const auto &field: fields) {
+			for (const auto &value: field.second)
+				otlv.save_user_tlv(field.first, value);
+		}
+	} catch (const OnieTLVException &err) {
+		throw std::runtime_error(err.get_info());
+	}
+
+	if (!otlv.generate_eeprom_file(eeprom_file))
+		throw std::runtime_error("TLV data does not fit in the EEPROM");
+
+	eeprom_write(address, 0, std::vector<uint8_t>(eeprom_file,
+	    eeprom_file + otlv.get_usage()));
+}
+
+void
+Session::reset()
+{
+	JtagServer::reset(m_device);
+}
+
+void
+Session::bypass()
+{
+	JtagServer::bypass(m_device);
+}
+
+void
+Session::uart_open(unsigned int baudrate)
+{
+	std::unique_ptr<Ftdi::Context> context(new Ftdi::Context);
+
+	context->set_interface(INTERFACE_C);
+	if (context->open(m_device.vid, m_device.pid, m_device.description,
+	    m_device.serial) != 0) {
+		throw std::runtime_error(fmt::format(
+		    "Failed to open UART channel: {}", context->error_string()));
+	}
+
+	if (context->set_bitmode(0xff, BITMODE_RESET) != 0 ||
+	    context->bitbang_disable() != 0)
+		throw std::runtime_error("Failed to reset UART channel");
+
+	if (context->set_baud_rate(baudrate) != 0)
+		throw std::runtime_error("Failed to set the baud rate");
+
+	context->set_latency(1);
+	m_uart = std::move(context);
+	m_uart_pending.clear();
+}
+
+void
+Session::uart_send(const std::string &data)
+{
+	if (uart().write((const uint8_t *)data.data(), data.size()) !=
+	    (int)data.size())
+		throw std::runtime_error("Failed to write to UART");
+}
+
+/*
+ * Returns everything received up to and including the first match.
+ * Output after the match stays buffered for the next call.
+ */
+std::string
+Session::uart_expect(const std::string &pattern, unsigned int timeout_ms)
+{
+	auto deadline = std::chrono::steady_clock::now() +
+	    std::chrono::milliseconds(timeout_ms);
+	std::regex re(pattern);
+	std::smatch match;
+	uint8_t buffer[512];
+	std::string result;
+	int ret;
+
+	for (;;) {
+		if (std::regex_search(m_uart_pending, match, re)) {
+			size_t end = match.position(0) + match.length(0);
+
+			result = m_uart_pending.substr(0, end);
+			m_uart_pending.erase(0, end);
+			return (result);
+		}
+
+		if (std::chrono::steady_clock::now() > deadline)
+			break;
+
+		ret = uart().read(buffer, sizeof(buffer));
+		if (ret < 0)
+			throw std::runtime_error("Failed to read from UART");
+
+		if (ret == 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		else
+			m_uart_pending.append((const char *)buffer, ret);
+	}
+
+	throw std::runtime_error(fmt::format(
+	    "UART output did not match '{}' within {} ms", pattern, timeout_ms));
+}
@@ -0,0 +1,372 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2019 Conclusive Engineering
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <fmt/format.h>
+#include <session_script.hh>
+#include <filesystem.hh>
+#include <profile.hh>
+#include <log.hh>
+
+static unsigned long
+get_uint(const YAML::Node &node, const std::string &key)
+{
+	if (!node[key])
+		throw std::runtime_error(fmt::format("Missing '{}'", key));
+
+	try {
+		return (std::stoul(node[key].as<std::string>(), nullptr, 0));
+	} catch (const std::logic_error &) {
+		throw std::runtime_error(fmt::format("'{}' must be a number", key));
+	}
+}
+
+static unsigned long
+get_uint(const YAML::Node &node, const std::string &key, unsigned long def)
+{
+	return (node[key] ? get_uint(node, key) : def);
+}
+
+/* Pin masks and levels, which would silently lose bits as uint8_t */
+static uint8_t
+get_byte(const YAML::Node &node, const std::string &key)
+{
+	unsigned long value = get_uint(node, key);
+
+	if (value > 0xff)
+		throw std::runtime_error(fmt::format("'{}' must be at most 0xff",
+		    key));
+
+	return (value);
+}
+
+static uint8_t
+get_byte(const YAML::Node &node, const std::string &key, uint8_t def)
+{
+	return (node[key] ? get_byte(node, key) : def);
+}
+
+static std::string
+get_string(const YAML::Node &node, const std::string &key)
+{
+	if (!node[key] || node[key].as<std::string>().empty())
+		throw std::runtime_error(fmt::format("Missing '{}'", key));
+
+	return (node[key].as<std::string>());
+}
+
+static std::string
+get_string(const YAML::Node &node, const std::string &key,
+    const std::string &def)
+{
+	return (node[key] ? node[key].as<std::string>() : def);
+}
+
+SessionScript::SessionScript(const std::string &file):
+    m_file(file)
+{
+	YAML::Node root;
+	size_t index = 0;
+
+	try {
+		root = YAML::LoadFile(file);
+	} catch (const YAML::Exception &err) {
+		throw std::runtime_error(fmt::format("Cannot load {}: {}", file,
+		    err.what()));
+	}
+
+	if (root["device"])
+		m_serial = root["device"].as<std::string>();
+
+	if (root["profile"])
+		m_profile = resolve(root["profile"].as<std::string>());
+
+	if (!root["steps"] || !root["steps"].IsSequence())
+		throw std::runtime_error(fmt::format("{}: 'steps' must be a list",
+		    file));
+
+	for (const auto &node: root["steps"]) {
+		index++;
+
+		try {
+			m_steps.push_back(parse_step(node));
+		} catch (const ProfileConfigException &err) {
+			throw std::runtime_error(fmt::format("{}: step {}: {}",
+			    file, index, err.get_info()));
+		} catch (const std::exception &err) {
+			throw std::runtime_error(fmt::format("{}: step {}: {}",
+			    file, index, err.what()));
+		}
+	}
+}
+
+const std::string &
+SessionScript::get_serial() const
+{
+	return (m_serial);
+}
+
+const std::vector<SessionScriptStep> &
+SessionScript::get_steps() const
+{
+	return (m_steps);
+}
+
+/* Paths in the script are relative to the script itself */
+std::string
+SessionScript::resolve(const std::string &path) const
+{
+	filesystem::path result(path);
+
+	if (result.is_absolute())
+		return (path);
+
+	return ((filesystem::path(m_file).parent_path() / result).string());
+}
+
+/*
+ * A step is either a bare action name ("reset") or a map with one
+ * action key and the optional "name" and "continue" keys.
+ */
+SessionScriptStep
+SessionScript::parse_step(const YAML::Node &node)
+{
+	SessionScriptStep step;
+	std::string action;
+	YAML::Node args;
+
+	step.keep_going = false;
+
+	if (node.IsScalar()) {
+		action = node.as<std::string>();
+	} else if (node.IsMap()) {
+		for (const auto &i: node) {
+			std::string key = i.first.as<std::string>();
+
+			if (key == "name")
+				continue;
+			else if (key == "continue")
+				step.keep_going = i.second.as<bool>();
+			else if (action.empty()) {
+				action = key;
+				args = i.second;
+			} else
+				throw std::runtime_error(fmt::format(
+				    "More than one action: {} and {}", action, key));
+		}
+	}
+
+	if (action.empty())
+		throw std::runtime_error("Step has no action");
+
+	if (action == "gpio") {
+		uint8_t mask = get_byte(args, "mask", 0xff);
+		uint8_t value = get_byte(args, "value");
+
+		step.action = [=](Session &session) {
+			session.gpio_set(mask, value);
+		};
+		step.description = fmt::format("gpio {:#04x}/{:#04x}", value, mask);
+	} else if (action == "direction") {
+		uint8_t mask = get_byte(args, "mask", 0xff);
+		uint8_t outputs = get_byte(args, "outputs");
+
+		step.action = [=](Session &session) {
+			session.gpio_direction(mask, outputs);
+		};
+		step.description = fmt::format("direction {:#04x}/{:#04x}",
+		    outputs, mask);
+	} else if (action == "pulse") {
+		uint8_t mask = get_byte(args, "mask");
+		uint8_t value = get_byte(args, "value", 0);
+		uint32_t width = get_uint(args, "width_us");
+
+		step.action = [=](Session &session) {
+			session.gpio_pulse(mask, value, width);
+		};
+		step.description = fmt::format("pulse {:#04x}/{:#04x} for {} us",
+		    value, mask, width);
+	} else if (action == "sequence") {
+		std::string name = args.as<std::string>();
+
+		if (m_profile.empty())
+			throw std::runtime_error("'sequence' needs a 'profile'");
+
+		GpioSequence seq = ProfileConfig(m_profile).get_gpio_sequence(name);
+		step.action = [=](Session &session) {
+			session.gpio_play(seq);
+		};
+		step.description = fmt::format("sequence {}", name);
+	} else if (action == "wait") {
+		unsigned long ms = std::stoul(args.as<std::string>(), nullptr, 0);
+
+		step.action = [=](Session &) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+		};
+		step.description = fmt::format("wait {} ms", ms);
+	} else if (action == "tlv_write") {
+		std::string file = args.IsScalar() ? args.as<std::string>() :
+		    get_string(args, "file");
+		bool verify = args.IsMap() && args["verify"] &&
+		    args["verify"].as<bool>();
+
+		if (file.empty())
+			throw std::runtime_error("Missing 'file'");
+
+		file = resolve(file);
+
+		step.action = [=](Session &session) {
+			session.tlv_write(file, verify);
+		};
+		step.description = fmt::format("tlv_write {}{}", file,
+		    verify ? " and verify" : "");
+	} else if (action == "eeprom_write" || action == "eeprom_read") {
+		std::string file = resolve(get_string(args, "file"));
+		std::string address = get_string(args, "address",
+		    SESSION_EEPROM_ADDRESS);
+		uint16_t offset = get_uint(args, "offset", 0);
+		size_t length = get_uint(args, "length", TLV_EEPROM_MAX_SIZE);
+
+		if (action == "eeprom_write") {
+			step.action = [=](Session &session) {
+				std::ifstream in(file, std::ios::binary);
+
+				if (!in)
+					throw std::runtime_error(fmt::format(
+					    "Cannot open {}", file));
+
+				session.eeprom_write(address, offset,
+				    std::vector<uint8_t>(
+				    std::istreambuf_iterator<char>(in), {}));
+			};
+		} else {
+			step.action = [=](Session &session) {
+				std::vector<uint8_t> data = session.eeprom_read(
+				    address, offset, length);
+				std::ofstream out(file, std::ios::binary |
+				    std::ios::trunc);
+
+				out.write((const char *)data.data(), data.size());
+				if (!out)
+					throw std::runtime_error(fmt::format(
+					    "Cannot write {}", file));
+			};
+		}
+		step.description = fmt::format("{} {} at {}", action, file, address);
+	} else if (action == "reset") {
+		step.action = [](Session &session) { session.reset(); };
+		step.description = "reset";
+	} else if (action == "bypass") {
+		step.action = [](Session &session) { session.bypass(); };
+		step.description = "bypass";
+	} else if (action == "uart_open") {
+		unsigned int baudrate = std::stoul(args.as<std::string>(), nullptr, 0);
+
+		step.action = [=](Session &session) {
+			session.uart_open(baudrate);
+		};
+		step.description = fmt::format("uart_open {}", baudrate);
+	} else if (action == "uart_send") {
+		std::string data = args.as<std::string>();
+
+		step.action = [=](Session &session) {
+			session.uart_send(data);
+		};
+		step.description = "uart_send";
+	} else if (action == "expect") {
+		std::string pattern = args.IsScalar() ? args.as<std::string>() :
+		    get_string(args, "pattern", "");
+		unsigned int timeout = args.IsMap() ?
+		    get_uint(args, "timeout_ms", SESSION_EXPECT_TIMEOUT) :
+		    SESSION_EXPECT_TIMEOUT;
+
+		if (pattern.empty())
+			throw std::runtime_error("'expect' needs a pattern");
+
+		step.action = [=](Session &session) {
+			session.uart_expect(pattern, timeout);
+		};
+		step.description = fmt::format("expect '{}'", pattern);
+	} else
+		throw std::runtime_error(fmt::format("Unknown action {}", action));
+
+	if (node.IsMap() && node["name"])
+		step.description = node["name"].as<std::string>();
+
+	return (step);
+}
+
+/* Stops at the first failed step unless it was marked "continue" */
+bool
+SessionScript::run(Session &session) const
+{
+	auto start = std::chrono::steady_clock::now();
+	unsigned int failed = 0;
+	size_t index = 0;
+
+	for (const auto &step: m_steps) {
+		auto step_start = std::chrono::steady_clock::now();
+		std::string error;
+
+		index++;
+
+		try {
+			step.action(session);
+		} catch (const std::exception &err) {
+			error = err.what();
+		}
+
+		double ms = std::chrono::duration<double, std::milli>(
+		    std::chrono::steady_clock::now() - step_start).count();
+
+		if (error.empty()) {
+			fmt::print("[{}/{}] {}: ok ({:.1f} ms)\n", index,
+			    m_steps.size(), step.description, ms);
+			continue;
+		}
+
+		fmt::print("[{}/{}] {}: FAILED ({:.1f} ms): {}\n", index,
+		    m_steps.size(), step.description, ms, error);
+		failed++;
+
+		if (!step.keep_going) {
+			fmt::print("Aborted after step {} of {}\n", index,
+			    m_steps.size());
+			return (false);
+		}
+	}
+
+	fmt::print("{} steps, {} failed, {:.1f} ms total\n", m_steps.size(),
+	    failed, std::chrono::duration<double, std::milli>(
+	    std::chrono::steady_clock::now() - start).count());
+	return (failed == 0);
+}
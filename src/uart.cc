@@ -45,28 +45,28 @@ Uart::Uart(const Device &device, const Glib::RefPtr<Gio::SocketAddress> &addr,
 
 	if (m_context.open(device.vid, device.pid, device.description,
 	    device.serial) != 0) {
-		show_centered_dialog("Failed to open device.");
-		return;
+		throw std::runtime_error(fmt::format("Failed to open device: {}",
+		    m_context.error_string()));
 	}
 
 	if (m_context.reset() != 0) {
-		show_centered_dialog("Failed to reset UART channel");
-		return;
+		throw std::runtime_error(fmt::format("Failed to reset UART channel: {}",
+		    m_context.error_string()));
 	}
 	
 	if (m_context.set_bitmode(0xff, BITMODE_RESET) != 0) {
-		show_centered_dialog("Failed to reset bitmode.");
-		return;
+		throw std::runtime_error(fmt::format("Failed to reset bitmode: {}",
+		    m_context.error_string()));
 	}
 
 	if (m_context.bitbang_disable() != 0) {
-		show_centered_dialog("Failed to set bitbang_disable.");
-		return;
+		throw std::runtime_error(fmt::format("Failed to set bitbang_disable: {}",
+		    m_context.error_string()));
 	}
 
 	if (m_context.set_baud_rate(baudrate) != 0) {
-		show_centered_dialog("Failed to set the baud rate.");
-		return;
+		throw std::runtime_error(fmt::format("Failed to set the baud rate: {}",
+		    m_context.error_string()));
 	}
 
 	m_context.set_latency(1);
@@ -75,4 +75,21 @@ std::string executable_dir()
 #else
 	return unimpl_executable_dir();
 #endif
-}
\ No newline at end of file
+}
+
+/* Port numbers are only reserved until the probe socket is closed */
+uint16_t free_tcp_port(const std::string &host)
+{
+	Glib::RefPtr<Gio::InetAddress> address = Gio::InetAddress::create(host);
+	Glib::RefPtr<Gio::Socket> socket = Gio::Socket::create(
+	    address->get_family(), Gio::SocketType::SOCKET_TYPE_STREAM,
+	    Gio::SocketProtocol::SOCKET_PROTOCOL_TCP);
+	Glib::RefPtr<Gio::InetSocketAddress> bound;
+
+	socket->bind(Gio::InetSocketAddress::create(address, 0), true);
+	bound = Glib::RefPtr<Gio::InetSocketAddress>::cast_dynamic(
+	    socket->get_local_address());
+	socket->close();
+
+	return (bound->get_port());
+}